@@ -56,6 +56,8 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 139400 $")
 #include <sys/signal.h>
 #endif
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sched.h>
 #include <math.h>
 #include <ctype.h>
 
@@ -256,8 +258,138 @@ static int gendigittimeout = 8000;
 /*! \brief How long to wait for an extra digit, if there is an ambiguous match */
 static int matchdigittimeout = 3000;
 
-/*! \brief Protect the interface list (of dahdi_pvt's) */
-AST_MUTEX_DEFINE_STATIC(iflock);
+/*! \brief Contention seen at one place a profiled lock is taken, see lockprofile */
+struct lock_prof {
+	const char *lock;			/*!< Which lock */
+	const char *func;			/*!< Where it is taken */
+	int line;
+	unsigned int acquired;
+	unsigned int failed;			/*!< Attempts given up on, the caller backed off */
+	unsigned int retries;			/*!< Failed trylocks over all attempts */
+	unsigned long long wait;		/*!< Microseconds spent getting the lock */
+	unsigned int maxwait;
+	unsigned int holds;			/*!< Releases timed, only for linkset and pri locks */
+	unsigned long long hold;
+	unsigned int maxhold;
+	struct lock_prof *next;
+};
+
+/*! \brief Profile linkset, PRI, interface list and pvt lock contention, costs two clock reads per lock */
+static int lock_profiling = 0;
+static struct lock_prof *lock_profs = NULL;
+AST_MUTEX_DEFINE_STATIC(lock_prof_lock);
+
+static unsigned int lock_prof_since(struct timeval start)
+{
+	struct timeval now = ast_tvnow();
+	long long us = (now.tv_sec - start.tv_sec) * 1000000LL + (now.tv_usec - start.tv_usec);
+
+	return (us < 0) ? 0 : (us > 0xffffffffLL) ? 0xffffffffU : (unsigned int) us;
+}
+
+/*!
+ * \brief Account for one attempt at \a lock from \a func, \a line started at \a start
+ *
+ * \a start is zero when profiling was off as the attempt began, nothing is
+ * recorded then.  Sites are created the first time they are seen and live
+ * until unload.
+ *
+ * \return The site, to time the hold with lock_prof_hold(), or NULL
+ */
+static struct lock_prof *lock_prof_wait(const char *lock, const char *func, int line, struct timeval start, unsigned int retries, int acquired)
+{
+	struct lock_prof *site;
+	unsigned int us;
+
+	if (ast_tvzero(start))
+		return NULL;
+	us = lock_prof_since(start);
+	ast_mutex_lock(&lock_prof_lock);
+	for (site = lock_profs; site; site = site->next) {
+		if ((site->line == line) && (site->func == func) && (site->lock == lock))
+			break;
+	}
+	if (!site) {
+		if (!(site = ast_calloc(1, sizeof(*site)))) {
+			ast_mutex_unlock(&lock_prof_lock);
+			return NULL;
+		}
+		site->lock = lock;
+		site->func = func;
+		site->line = line;
+		site->next = lock_profs;
+		lock_profs = site;
+	}
+	if (acquired)
+		site->acquired++;
+	else
+		site->failed++;
+	site->retries += retries;
+	site->wait += us;
+	if (us > site->maxwait)
+		site->maxwait = us;
+	ast_mutex_unlock(&lock_prof_lock);
+
+	return site;
+}
+
+/*! \brief Account for the release of a lock \a site got at \a since */
+static void lock_prof_hold(struct lock_prof *site, struct timeval since)
+{
+	unsigned int us;
+
+	if (ast_tvzero(since))
+		return;
+	us = lock_prof_since(since);
+	ast_mutex_lock(&lock_prof_lock);
+	site->holds++;
+	site->hold += us;
+	if (us > site->maxhold)
+		site->maxhold = us;
+	ast_mutex_unlock(&lock_prof_lock);
+}
+
+static inline struct timeval lock_prof_start(void)
+{
+	return lock_profiling ? ast_tvnow() : ast_tv(0, 0);
+}
+
+/*! \brief Protect the interface list (of dahdi_pvt's).  Walking it takes the
+ * read side; linking, unlinking or seizing an interface takes the write side. */
+AST_RWLOCK_DEFINE_STATIC(iflock);
+
+#define iflock_rdlock() __iflock_lock(0, __FUNCTION__, __LINE__)
+#define iflock_wrlock() __iflock_lock(1, __FUNCTION__, __LINE__)
+
+static inline void __iflock_lock(int exclusive, const char *func, int line)
+{
+	struct timeval start = lock_prof_start();
+
+	if (exclusive)
+		ast_rwlock_wrlock(&iflock);
+	else
+		ast_rwlock_rdlock(&iflock);
+	lock_prof_wait(exclusive ? "iflock (write)" : "iflock", func, line, start, 0, 1);
+}
+
+/*! \brief Lock the interface list, or the CRV list protected by \a lock if not NULL */
+static inline void iflist_lock(ast_mutex_t *lock, int exclusive)
+{
+	if (lock)
+		ast_mutex_lock(lock);
+	else if (exclusive)
+		iflock_wrlock();
+	else
+		iflock_rdlock();
+}
+
+static inline void iflist_unlock(ast_mutex_t *lock)
+{
+	if (lock)
+		ast_mutex_unlock(lock);
+	else
+		ast_rwlock_unlock(&iflock);
+}
 
 
 static int ifcount = 0;
@@ -277,7 +409,54 @@ static ast_cond_t ss_thread_complete;
 AST_MUTEX_DEFINE_STATIC(ss_thread_lock);
 AST_MUTEX_DEFINE_STATIC(restart_lock);
 static int ss_thread_count = 0;
+
+/*! \brief Hard upper bound on the number of call setups queued for the ss_thread pool */
+#define SS_POOL_MAX_QUEUE 1024
+
+/*! \brief Reusable threads running ss_thread() for analog/CAS call setup.
+ * A worker stays with its channel until the digits are collected and the PBX
+ * is started on a thread of its own, and then parks waiting for the next
+ * seizure instead of exiting. */
+static struct {
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	struct ast_channel *jobs[SS_POOL_MAX_QUEUE];	/*!< Ring of channels waiting for a worker */
+	struct timeval queued_at[SS_POOL_MAX_QUEUE];	/*!< When each of jobs[] was queued */
+	int head;			/*!< Oldest queued channel */
+	int queued;			/*!< Number of channels in jobs[] */
+	int workers;			/*!< Worker threads alive */
+	int idle;			/*!< Workers parked waiting for a job */
+	int stop;			/*!< Set on unload, tells the workers to exit */
+	int size;			/*!< Configured maximum number of workers, 0 disables the pool */
+	int depth;			/*!< Configured maximum number of queued call setups */
+	int timeout;			/*!< Configured ms a call setup may wait in the queue, 0 for ever */
+	unsigned int dispatched;	/*!< Call setups handed to the pool */
+	unsigned int spawned;		/*!< Worker threads created */
+	unsigned int rejected;		/*!< Call setups refused because the queue was full */
+	unsigned int expired;		/*!< Call setups hung up after waiting longer than timeout */
+	int peak_queued;		/*!< High water mark of queued */
+} ss_pool = {
+	.lock = AST_MUTEX_INIT_VALUE,
+	.size = 0,
+	.depth = 32,
+	.timeout = 10000,
+};
+
+/*! \brief Set on the ss_thread pool workers, see ss_thread_pbx() */
+AST_THREADSTORAGE(ss_pool_thread);
 static int num_restart_pending = 0;
+static volatile int monitor_generation = 0;	/*!< Bumped whenever a dahdi_pvt is freed, to invalidate pending monitor events */
+static volatile int monitor_radios = 0;		/*!< Radio channels, which do_monitor() has to poll for events */
+
+/*! \brief Channels whose epoll registration do_monitor() has to bring up to date, see monitor_touch() */
+static struct {
+	ast_mutex_t lock;
+	struct dahdi_pvt *head;
+	int pipe[2];		/*!< Wakes the monitor out of epoll_wait() once head gets its first entry */
+} monitor_queue = {
+	.lock = AST_MUTEX_INIT_VALUE,
+	.pipe = { -1, -1 },
+};
 
 static int restart_monitor(void);
 
@@ -316,20 +495,156 @@ static inline int dahdi_wait_event(int fd)
 
 /*! Chunk size to read -- we use 20ms chunks to make things happy. */
 #define READ_SIZE 160
+/*! Largest chunk an SS7 bearer may be configured to read with ss7framesize, 40ms */
+#define MAX_READ_SIZE (READ_SIZE * 2)
 
 #define MASK_AVAIL		(1 << 0)	/*!< Channel available for PRI use */
 #define MASK_INUSE		(1 << 1)	/*!< Channel currently in use */
 
-#define CALLWAITING_SILENT_SAMPLES	( (300 * 8) / READ_SIZE) /*!< 300 ms */
-#define CALLWAITING_REPEAT_SAMPLES	( (10000 * 8) / READ_SIZE) /*!< 10,000 ms */
-#define CIDCW_EXPIRE_SAMPLES		( (500 * 8) / READ_SIZE) /*!< 500 ms */
+#define CALLWAITING_SILENT_SAMPLES(p)	( (300 * 8) / (p)->readsize) /*!< 300 ms */
+#define CALLWAITING_REPEAT_SAMPLES(p)	( (10000 * 8) / (p)->readsize) /*!< 10,000 ms */
+#define CIDCW_EXPIRE_SAMPLES(p)		( (500 * 8) / (p)->readsize) /*!< 500 ms */
 #define MIN_MS_SINCE_FLASH			( (2000) )	/*!< 2000 ms */
-#define DEFAULT_RINGT 				( (8000 * 8) / READ_SIZE) /*!< 8,000 ms */
+#define DEFAULT_RINGT 				( (8000 * 8) / READ_SIZE) /*!< 8,000 ms, in READ_SIZE frames */
 
 struct dahdi_pvt;
 
 static int ringt_base = DEFAULT_RINGT;
 
+#define DAHDI_CPUS_LEN		128	/*!< Longest CPU list, as in chan_dahdi.conf or a sysfs cpulist */
+
+/*! \brief Where a signalling thread runs, see dahdi_thread_place() */
+struct dahdi_placement {
+	char cpus[DAHDI_CPUS_LEN];	/*!< CPUs it may run on, e.g. "2,3" or "0-7", empty for any */
+	int rtprio;			/*!< SCHED_FIFO priority, 0 keeps the scheduling of Asterisk */
+};
+
+#ifdef __linux__
+/*! \brief Turn a CPU list such as "0-3,8" into a CPU set, -1 if it is not one */
+static int dahdi_parse_cpus(const char *list, cpu_set_t *set)
+{
+	char buf[DAHDI_CPUS_LEN], *c = buf, *cpu;
+	int lo, hi;
+
+	CPU_ZERO(set);
+	ast_copy_string(buf, list, sizeof(buf));
+	while ((cpu = strsep(&c, ","))) {
+		switch (sscanf(cpu, "%d-%d", &lo, &hi)) {
+		case 1:
+			hi = lo;
+			break;
+		case 2:
+			break;
+		default:
+			return -1;
+		}
+		if ((lo < 0) || (hi < lo) || (hi >= CPU_SETSIZE))
+			return -1;
+		for (; lo <= hi; lo++)
+			CPU_SET(lo, set);
+	}
+	return 0;
+}
+#endif
+
+/*! \brief Whether \a list can be used as CPU list on this host */
+static int dahdi_valid_cpus(const char *list)
+{
+#ifdef __linux__
+	cpu_set_t set;
+
+	return !dahdi_parse_cpus(list, &set);
+#else
+	return 0;
+#endif
+}
+
+/*! \brief Read the CPUs of NUMA node \a node into \a buf, -1 if the host has no such node */
+static int dahdi_numa_cpus(int node, char *buf, size_t len)
+{
+	char path[80];
+	FILE *f;
+	int res = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	if (!(f = fopen(path, "r")))
+		return -1;
+	if (fgets(buf, len, f)) {
+		ast_trim_blanks(buf);
+		res = ast_strlen_zero(buf) ? -1 : 0;
+	}
+	fclose(f);
+	return res;
+}
+
+/*!
+ * \brief Bind the calling thread to the CPUs of \a place and give it its real-time priority
+ *
+ * Settings left empty are not touched, so the thread keeps what it inherited
+ * from Asterisk (asterisk -p, taskset).
+ */
+static void dahdi_thread_place(const char *what, const struct dahdi_placement *place)
+{
+	struct sched_param param;
+	int res;
+#ifdef __linux__
+	cpu_set_t set;
+
+	if (!ast_strlen_zero(place->cpus)) {
+		if (dahdi_parse_cpus(place->cpus, &set))
+			ast_log(LOG_WARNING, "Invalid CPU list '%s' for %s\n", place->cpus, what);
+		else if ((res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)))
+			ast_log(LOG_WARNING, "Unable to bind %s to CPUs %s: %s\n", what, place->cpus, strerror(res));
+		else
+			ast_verb(3, "%s runs on CPUs %s\n", what, place->cpus);
+	}
+#else
+	if (!ast_strlen_zero(place->cpus))
+		ast_log(LOG_WARNING, "CPU affinity is not supported on this platform, %s runs on any CPU\n", what);
+#endif
+	if (place->rtprio) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = place->rtprio;
+		if ((res = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)))
+			ast_log(LOG_WARNING, "Unable to give %s real-time priority %d: %s\n", what, place->rtprio, strerror(res));
+		else
+			ast_verb(3, "%s runs with real-time priority %d\n", what, place->rtprio);
+	}
+}
+
+/*! \brief Take a CPU list option of chan_dahdi.conf into \a cpus, which is left alone if it is invalid */
+static void dahdi_parse_cpus_option(const struct ast_variable *v, char *cpus, size_t len)
+{
+	if (ast_strlen_zero(v->value) || dahdi_valid_cpus(v->value))
+		ast_copy_string(cpus, v->value, len);
+	else
+		ast_log(LOG_WARNING, "Invalid %s '%s' at line %d, must be a CPU list such as 0-3,8.\n", v->name, v->value, v->lineno);
+}
+
+/*! \brief Take a real-time priority option of chan_dahdi.conf into \a rtprio, 0 for none */
+static void dahdi_parse_rtprio_option(const struct ast_variable *v, int *rtprio)
+{
+	int prio = atoi(v->value);
+
+	if ((prio < 0) || (prio > sched_get_priority_max(SCHED_FIFO)))
+		ast_log(LOG_WARNING, "Invalid %s '%s' at line %d, must be 0-%d.\n", v->name, v->value, v->lineno, sched_get_priority_max(SCHED_FIFO));
+	else
+		*rtprio = prio;
+}
+
+/*! \brief Placement of the monitor thread, see monitorcpus in chan_dahdi.conf */
+static struct dahdi_placement monitor_placement;
+
+/*! \brief How dahdi_io_place() bound the calling channel thread, for dahdi_io_unplace() to undo */
+struct dahdi_io_placed {
+	int channel;			/*!< DAHDI channel the thread is bound for, 0 if it is not */
+#ifdef __linux__
+	cpu_set_t saved;		/*!< CPUs it could run on before */
+#endif
+};
+AST_THREADSTORAGE(dahdi_io_placed);
+
+
 #ifdef HAVE_SS7
 
 #define LINKSTATE_INALARM	(1 << 0)
@@ -348,9 +663,94 @@ static int ringt_base = DEFAULT_RINGT;
 #define SS7_BLOCKED_HARDWARE 1 << 1
 #define SS7_BLOCKED_MAINTENANCE 1 << 0
 
+#define SS7_CIC_HASH_MIN 64		/*!< Smallest per-linkset (dpc, cic) index, must be a power of two */
+#define SS7_BEARER_PREPARE (1 << 0)	/*!< Put an idle bearer in audio mode with the linkset law */
+#define SS7_BEARER_EC (1 << 1)		/*!< Enable and train the echo canceller of an answered call */
+#define SS7_EVENT_QUEUE 256		/*!< ISUP events a linkset queue starts with between link I/O and dispatch */
+#define SS7_MAX_SETUP_THREADS 16	/*!< Call setup threads a linkset can have, see ss7setupthreads */
+#define SS7_PENDING_CONTROLS 8		/*!< Control frames a pvt can hold for its owner, must be a power of two */
+#define SS7_STATS_EVENTS 64		/*!< libss7 event codes counted one by one, higher ones are counted together */
+#define SS7_HIST_BUCKETS 13		/*!< Buckets of an ss7_hist, see ss7_hist_bounds */
+
+/*! \brief Fixed-bucket latency histogram, in microseconds */
+struct ss7_hist {
+	unsigned int count;
+	unsigned int buckets[SS7_HIST_BUCKETS];
+	unsigned long long total;
+	unsigned int max;
+};
+
+#define SS7_TRACE_SIZE	1024		/*!< Records in the trace ring of a linkset, a power of 2 */
+#define SS7_TRACE_DAHDI	-1		/*!< Trace record type of a DAHDI event on a signalling channel */
+
+/*! \brief One record of the trace ring of a linkset, see ss7_trace() */
+struct ss7_trace_rec {
+	unsigned int seq;		/*!< Ring position + 1 the record was written at, 0 while it is being written */
+	struct timeval tv;
+	int type;			/*!< libss7 event, or SS7_TRACE_DAHDI */
+	int link;			/*!< Signalling channel, -1 for ISUP events */
+	int cic;
+	unsigned int pc;		/*!< OPC of ISUP events */
+	int data;			/*!< End of a CIC range, cause, SLC or DAHDI event */
+};
+
+/*! \brief Intervals timed on every linkset, for "ss7 show stats" and SS7ShowStats */
+enum ss7_latency {
+	SS7_LAT_IAM_ACM = 0,		/*!< IAM, sent or received, to the matching ACM */
+	SS7_LAT_ACM_ANM,		/*!< ACM to ANM */
+	SS7_LAT_REL_RLC,		/*!< REL to RLC */
+	SS7_LAT_GRS_GRA,		/*!< GRS to GRA */
+	SS7_LAT_EVENT,			/*!< Linkset lock held to handle one ISUP event */
+	SS7_LAT_NUM
+};
+
+/*! \brief Where a CIC is in the message exchanges timed by ss7_stat_phase() */
+enum ss7_phase {
+	SS7_PHASE_NONE = 0,
+	SS7_PHASE_IAM,
+	SS7_PHASE_ACM,
+	SS7_PHASE_ANM,
+	SS7_PHASE_REL,
+	SS7_PHASE_RLC,
+	SS7_PHASE_GRS,
+	SS7_PHASE_GRA
+};
+
+struct ss7_worker;
+
+#define SS7_PREFIX_CONF		40	/*!< Room for the comma separated list of one ss7_*prefix option */
+#define SS7_PREFIXES		16	/*!< Prefixes a linkset can tell NAIs apart by, over all NAIs */
+#define SS7_LENGTHS		16	/*!< Rules of ss7_called_lengths a linkset can hold */
+
+/*! \brief NAIs a linkset has prefixes for, in the order numbers are matched against them */
+enum ss7_prefix_nai {
+	SS7_PREFIX_INTERNATIONAL = 0,
+	SS7_PREFIX_NATIONAL,
+	SS7_PREFIX_NETWORKROUTED,
+	SS7_PREFIX_UNKNOWN,
+	SS7_PREFIX_SUBSCRIBER,
+	SS7_PREFIX_NAIS
+};
+
+/*! \brief One number prefix of a linkset, compiled from its ss7_*prefix options */
+struct ss7_prefix {
+	char digits[SS7_PREFIX_CONF];
+	int len;
+	char nai;							/*!< SS7_NAI_* */
+};
+
+/*! \brief A called number starting with prefix is complete once it has len digits, see ss7_number_complete() */
+struct ss7_length {
+	char prefix[SS7_PREFIX_CONF];
+	int plen;
+	int len;
+};
+
 struct dahdi_ss7 {
 	pthread_t master;						/*!< Thread of master */
 	ast_mutex_t lock;
+	struct lock_prof *prof_site;					/*!< Where ss7_grab() got lock, its hold is timed by ss7_rel() */
+	struct timeval prof_since;
 	int fds[NUM_DCHANS];
 	int numsigchans;
 	int linkstate[NUM_DCHANS];
@@ -362,18 +762,162 @@ struct dahdi_ss7 {
 	} state;
 	char called_nai;						/*!< Called Nature of Address Indicator */
 	char calling_nai;						/*!< Calling Nature of Address Indicator */
-	char internationalprefix[10];					/*!< country access code ('00' for european dialplans) */
-	char nationalprefix[10];					/*!< area access code ('0' for european dialplans) */
-	char subscriberprefix[20];					/*!< area access code + area code ('0'+area code for european dialplans) */
-	char unknownprefix[20];						/*!< for unknown dialplans */
-	char networkroutedprefix[20];
+	/* Each of these may list several prefixes, separated by commas, see ss7_compile_prefixes() */
+	char internationalprefix[SS7_PREFIX_CONF];			/*!< country access code ('00' for european dialplans) */
+	char nationalprefix[SS7_PREFIX_CONF];				/*!< area access code ('0' for european dialplans) */
+	char subscriberprefix[SS7_PREFIX_CONF];				/*!< area access code + area code ('0'+area code for european dialplans) */
+	char unknownprefix[SS7_PREFIX_CONF];				/*!< for unknown dialplans */
+	char networkroutedprefix[SS7_PREFIX_CONF];
+	struct ss7_prefix prefixes[SS7_PREFIXES];			/*!< Prefixes in the order ss7_parse_prefix() tries them */
+	int numprefixes;
+	struct ss7_prefix plan[SS7_PREFIX_NAIS];			/*!< Prefix ss7_apply_plan_to_number() puts in front of each NAI */
+	char called_lengths[SS7_PREFIX_CONF * 2];			/*!< prefix:length list of complete called numbers */
+	struct ss7_length lengths[SS7_LENGTHS];				/*!< called_lengths, longest prefix first */
+	int numlengths;
+	char stdigit;							/*!< Ends a called number received in overlap */
+	struct dahdi_placement placement;				/*!< Where the threads of the linkset run */
+	int place_gen;							/*!< Bumped when placement changes, see ss7_thread_place() */
 	struct ss7 *ss7;
-	struct dahdi_pvt *pvts[MAX_CHANNELS];				/*!< Member channel pvt structs */
+	struct dahdi_pvt **pvts;					/*!< Member channel pvt structs, sorted by (dpc, cic) */
+	int pvts_size;							/*!< Slots allocated in pvts */
+	struct dahdi_pvt **cic_hash;					/*!< Member pvts indexed by (dpc, cic) */
+	unsigned int cic_hash_mask;					/*!< Buckets in cic_hash minus one */
 	int flags;							/*!< Linkset flags */
+	int reload_flags;						/*!< Flags the reload in progress has seen for us, applied by ss7_reload_end() */
+	int reload_seen;						/*!< The reload in progress has configured this linkset */
+	int grs_active;							/*!< Startup group reset in progress, see ss7_grs_pump() */
+	int grs_next;							/*!< pvts[] position the next startup GRS starts at */
+	int grs_outstanding;						/*!< Startup GRS waiting for their GRA */
+	int grs_ranges;							/*!< Startup GRS to send in all */
+	int grs_acked;							/*!< Startup GRS acknowledged so far */
+	struct timeval grs_start;					/*!< When the linkset came up */
+	struct timeval grs_due;						/*!< Earliest time for the next paced GRS */
+	struct timeval grs_progress;					/*!< Last startup GRS sent or GRA received */
+	struct timeval grs_finish;					/*!< When the last startup GRA came in */
+	struct ss7_worker *worker;					/*!< Pool worker servicing us, NULL with a thread of our own */
+	struct timeval deadline;					/*!< Next libss7 timer, valid while heap_pos >= 0 */
+	int heap_pos;							/*!< Slot in the worker's timer heap, -1 if no timer is pending */
+	unsigned int epmask[NUM_DCHANS];				/*!< Events registered in the worker's epoll set */
+	int dirty;							/*!< Timer and events must be looked at again by the worker */
+	pthread_t dispatcher;						/*!< ISUP dispatch thread */
+	ast_mutex_t evlock;						/*!< Protects the ISUP event queue, taken after lock */
+	ast_cond_t evcond;
+	ss7_event *evq;							/*!< Events waiting for the dispatcher, evsize slots */
+	int evsize;
+	int evhead;
+	int evcount;
+	int evpeak;							/*!< High water mark of evcount */
+	unsigned int evoverflow;					/*!< Times the queue was full and had to grow */
+	int evstop;
+	struct dahdi_pvt *setup_head;					/*!< Call setups ss7_start_call() left for outside the linkset lock, under evlock */
+	struct dahdi_pvt *setup_tail;
+	struct dahdi_pvt *setup_running;				/*!< Call setups being run, under evlock */
+	ast_cond_t setupcond;						/*!< Signalled when a call setup is queued or done */
+	pthread_t setup_threads[SS7_MAX_SETUP_THREADS];
+	int numsetup_threads;
+	unsigned int calls_allocated;					/*!< libss7 calls allocated for our CICs */
+	unsigned int calls_failed;					/*!< libss7 call allocations that failed */
+	int bearers_prepared;						/*!< Idle bearers the bearer thread configured ahead of an IAM, atomic */
+	int bearers_inline;						/*!< IAMs that still had to configure the bearer themselves, atomic */
+	struct {
+		unsigned int wakeups;					/*!< Times the channel was found ready */
+		unsigned int frames;					/*!< Frames moved over all those wakeups */
+		unsigned int maxbatch;					/*!< Most frames moved in one wakeup */
+	} rxstats[NUM_DCHANS], txstats[NUM_DCHANS];
+	/* Updated only with lock held, by whichever thread owns the linkset at the time */
+	unsigned int msgcount[SS7_STATS_EVENTS + 1];			/*!< ISUP/MTP events handled, by libss7 event code */
+	unsigned int passes;						/*!< ss7_linkset_dispatch() calls */
+	unsigned int passevents;					/*!< Events taken from libss7 over all passes */
+	unsigned int passmax;						/*!< Most events taken from libss7 in one pass */
+	struct ss7_hist latency[SS7_LAT_NUM];
+	int ev_avg;							/*!< Running average of the time one event takes to handle, in us */
+	int overload;							/*!< New IAMs are being rejected, see ss7_overloaded() */
+	unsigned int overloads;						/*!< Times the linkset went into overload */
+	unsigned int shed;						/*!< IAMs rejected with cause 42 while overloaded */
+	struct ss7_trace_rec *trace;					/*!< Lossy ring of the last SS7_TRACE_SIZE events, NULL if not allocated */
+	volatile int trace_pos;						/*!< Records ever written to trace */
 };
 
 static struct dahdi_ss7 linksets[NUM_SPANS];
 
+/*! \brief Upper bounds of the first SS7_HIST_BUCKETS - 1 buckets, the last one takes the rest */
+static const unsigned int ss7_hist_bounds[SS7_HIST_BUCKETS - 1] = {
+	10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000
+};
+static const char * const ss7_hist_labels[SS7_HIST_BUCKETS] = {
+	"10us", "50us", "100us", "500us", "1ms", "5ms", "10ms", "50ms", "100ms", "500ms", "1s", "5s", ">5s"
+};
+static const char * const ss7_latency_names[SS7_LAT_NUM] = {
+	"IAM->ACM", "ACM->ANM", "REL->RLC", "GRS->GRA", "Event"
+};
+
+#define SS7_MAX_WORKERS 32
+
+/*! \brief Signalling thread servicing several linksets from one epoll set */
+struct ss7_worker {
+	pthread_t thread;
+	int epfd;
+	int numlinksets;
+	struct dahdi_ss7 *linksets[NUM_SPANS];				/*!< Linksets owned by this worker */
+	struct dahdi_ss7 *heap[NUM_SPANS];				/*!< Min-heap of owned linksets by next libss7 timer */
+	int heapsize;
+	volatile int kicked;						/*!< Someone else touched one of our linksets */
+};
+
+/*! \brief Number of linkset workers, 0 gives every linkset a thread of its own */
+static int ss7_numworkers = 0;
+
+/*! \brief Threads per linkset creating the channels of incoming calls, 0 leaves that to the dispatcher */
+static int ss7_setup_threads = 0;
+
+/*! \brief Call setup state of a pvt, see ss7_start_call() */
+enum {
+	SS7_SETUP_NONE = 0,
+	SS7_SETUP_QUEUED,
+	SS7_SETUP_RUNNING,
+};
+
+/*! \brief The CICs an ISUP event is about, see ss7_event_range() */
+struct ss7_cic_range {
+	unsigned int pc;
+	int lo;
+	int hi;
+	int all;	/*!< The event is about the whole linkset */
+};
+
+/*! \brief Most HDLC frames read from, or written to, one signalling channel per wakeup */
+static int ss7_batch = 1;
+
+/*! \brief Keep the audio of answered SS7-to-SS7 native bridges in the kernel, see ss7_tandem_bridge() */
+static int ss7_tandem = 0;
+
+/*! \brief Seconds without in-band DTMF after which an answered SS7 call stops DSP processing, 0 sheds on answer, -1 never */
+static int ss7_dsp_shed = -1;
+
+/*! \brief Most startup GRS a linkset has unacknowledged at a time, 0 sends them all at once */
+static int ss7_grs_window = 0;
+
+/*! \brief Startup GRS a linkset sends per second, 0 does not pace them */
+static int ss7_grs_rate = 0;
+
+#define SS7_GRS_STALL	30000	/*!< ms without a GRA after which a full startup GRS window is opened again */
+
+/*! \brief ISUP events queued for the dispatcher at which new IAMs are rejected, 0 never */
+static int ss7_overload_queue = 0;
+
+/*! \brief Estimated ms a new event waits in the dispatch queue at which new IAMs are rejected, 0 never */
+static int ss7_overload_delay = 0;
+static struct ss7_worker ss7_workers[SS7_MAX_WORKERS];
+static int ss7_workers_running = 0;
+
+#define SS7_LINKSET_MAP_SIZE	(NUM_SPANS * 2)	/*!< Slots in the struct ss7 -> linkset map, kept at most half full */
+
+/*! \brief Back-pointers from libss7 instances to the linkset that owns them */
+static struct {
+	struct ss7 *ss7;
+	struct dahdi_ss7 *linkset;
+} linkset_map[SS7_LINKSET_MAP_SIZE];
+
 static int cur_ss7type = -1;
 static int cur_linkset = -1;
 static int cur_pointcode = -1;
@@ -393,6 +937,8 @@ static int cur_defaultdpc = -1;
 struct dahdi_pri {
 	pthread_t master;						/*!< Thread of master */
 	ast_mutex_t lock;						/*!< Mutex */
+	struct lock_prof *prof_site;					/*!< Where pri_grab() got lock, its hold is timed by pri_rel() */
+	struct timeval prof_since;
 	char idleext[AST_MAX_EXTENSION];				/*!< Where to idle extra calls */
 	char idlecontext[AST_MAX_CONTEXT];				/*!< What context to use for idle */
 	char idledial[AST_MAX_EXTENSION];				/*!< What to dial before dumping */
@@ -429,6 +975,7 @@ struct dahdi_pri {
 #endif
 	time_t lastreset;						/*!< time when unused channels were last reset */
 	long resetinterval;						/*!< Interval (in seconds) for resetting unused channels */
+	struct dahdi_placement placement;				/*!< Where the D-channel thread runs */
 	int sig;
 	struct dahdi_pvt *pvts[MAX_CHANNELS];				/*!< Member channel pvt structs */
 	struct dahdi_pvt *crvs;						/*!< Member CRV structs */
@@ -446,7 +993,13 @@ static struct dahdi_pri pris[NUM_SPANS];
 
 static inline void pri_rel(struct dahdi_pri *pri)
 {
+	struct lock_prof *site = pri->prof_site;
+	struct timeval since = pri->prof_since;
+
+	pri->prof_site = NULL;
 	ast_mutex_unlock(&pri->lock);
+	if (site)
+		lock_prof_hold(site, since);
 }
 
 #else
@@ -485,7 +1038,7 @@ struct dahdi_subchannel {
 	int dfd;
 	struct ast_channel *owner;
 	int chan;
-	short buffer[AST_FRIENDLY_OFFSET/2 + READ_SIZE];
+	short buffer[AST_FRIENDLY_OFFSET/2 + MAX_READ_SIZE];
 	struct ast_frame f;		/*!< One frame for each channel.  How did this ever work before? */
 	unsigned int needringing:1;
 	unsigned int needbusy:1;
@@ -520,6 +1073,7 @@ static struct dahdi_pvt {
 
 	int buf_no;					/*!< Number of buffers */
 	int buf_policy;				/*!< Buffer policy */
+	int readsize;				/*!< Samples per frame read from the channel, READ_SIZE unless ss7framesize says otherwise */
 	int sig;					/*!< Signalling style */
 	int radio;					/*!< radio type */
 	int outsigmod;					/*!< Outbound Signalling style (modifier) */
@@ -582,10 +1136,12 @@ static struct dahdi_pvt {
 	unsigned int mwimonitor_neon:1;			/*!< monitor this FXO port for neon type MWI indication from other end */
 	unsigned int mwimonitor_fsk:1;			/*!< monitor this FXO port for fsk MWI indication from other end */
 	unsigned int mwimonitoractive:1;		/*!< an MWI monitor thread is currently active */
+	int monitor_events;				/*!< Events do_monitor() has this channel registered for, 0 if none */
+	int monitor_radio;				/*!< do_monitor() counts this channel in monitor_radios */
+	int monitor_queued;				/*!< On the monitor queue, see monitor_touch() */
+	struct dahdi_pvt *monitor_next;			/*!< Next on the monitor queue */
 	/* Channel state or unavilability flags */
-	unsigned int inservice:1;
-	unsigned int locallyblocked:2;
-	unsigned int remotelyblocked:2;
+	volatile int cicstate;				/*!< Blocking and in service state, see circuit_update() */
 #if defined(HAVE_PRI) || defined(HAVE_SS7)
 	unsigned int rlt:1;
 	unsigned int alerting:1;
@@ -600,6 +1156,9 @@ static struct dahdi_pvt {
 	unsigned int do_hangup; /* what have to do in chan_dahdi */
 	unsigned int called_complete;
 	unsigned int echocontrol_ind;
+	int overlap_checked;						/*!< Leading digits of exten already looked at for the ST digit */
+	int setup_state;						/*!< SS7_SETUP_*, under the linkset evlock */
+	struct dahdi_pvt *setup_next;					/*!< Next on the setup queue or running list of the linkset */
 #endif
 	unsigned int use_smdi:1;		/* Whether to use SMDI on this channel */
 	struct ast_smdi_interface *smdi_iface;	/* The serial port to listen for SMDI data on */
@@ -610,6 +1169,9 @@ static struct dahdi_pvt {
 	char defcontext[AST_MAX_CONTEXT];
 	char exten[AST_MAX_EXTENSION];
 	char language[MAX_LANGUAGE];
+	char iocpus[DAHDI_CPUS_LEN];			/*!< CPUs the thread reading the channel is bound to, empty for any */
+	pthread_t io_thread;				/*!< Thread dahdi_io_place() bound to iocpus, if io_placed */
+	int io_placed;
 	char mohinterpret[MAX_MUSICCLASS];
 	char mohsuggest[MAX_MUSICCLASS];
 #if defined(PRI_ANI) || defined(HAVE_SS7)
@@ -693,11 +1255,15 @@ static struct dahdi_pvt {
 #endif
 	int polarity;
 	int dsp_features;
+	int dsp_idle;					/*!< Voice frames since answer or the last in-band DTMF while DSP shedding is armed, -1 keeps the DSP for the whole call */
+	unsigned int dsp_shed:1;			/*!< The DSP is not being run on this answered call, see ss7_dsp_shed_check() */
 #ifdef HAVE_SS7
 	struct dahdi_ss7 *ss7;
 	struct isup_call *ss7call;
 	char charge_number[50];
 	char gen_add_number[50];
+	enum ss7_phase ss7_phase;			/*!< Message exchange being timed on this CIC */
+	struct timeval ss7_stamp;			/*!< When ss7_phase was entered */
 	char gen_dig_number[50];
 	char orig_called_num[50];
 	char redirecting_num[50];
@@ -725,7 +1291,20 @@ static struct dahdi_pvt {
 	int transcap;
 	int cic;							/*!< CIC associated with channel */
 	unsigned int dpc;						/*!< CIC's DPC */
+	struct dahdi_pvt *cic_next;					/*!< Next pvt in the linkset (dpc, cic) index bucket */
+	int bearerlaw;							/*!< Law the bearer is set to with audio mode on, DAHDI_LAW_DEFAULT if not prepared */
+	int bearer_jobs;						/*!< SS7_BEARER_* work queued for the bearer thread */
+	struct dahdi_pvt *bearer_next;					/*!< Next pvt in the bearer thread queue */
+	int pending_ctrl[SS7_PENDING_CONTROLS];				/*!< Control frames queued by the linkset thread for dahdi_read() */
+	unsigned int pending_head;					/*!< Next pending_ctrl slot to hand to the owner */
+	unsigned int pending_tail;					/*!< Next free pending_ctrl slot */
+	unsigned int pending_overflow:1;				/*!< pending_ctrl was full, the rest of the call goes to the read queue */
 	unsigned int loopedback:1;
+	unsigned int grs_startup:1;					/*!< First CIC of a startup GRS still waiting for its GRA */
+	unsigned int ss7_stale:1;					/*!< Not configured by the reload in progress, see ss7_reload_end() */
+	unsigned int ss7_pending:1;					/*!< Takes reload_cic/reload_dpc at the end of the reload in progress */
+	int reload_cic;
+	unsigned int reload_dpc;
 	char cug_interlock_ni[5];
 	unsigned short cug_interlock_code;
 	unsigned char cug_indicator;
@@ -733,6 +1312,51 @@ static struct dahdi_pvt {
 	char begindigit;
 } *iflist = NULL, *ifend = NULL;
 
+/*!
+ * \brief Circuit state word of a dahdi_pvt
+ *
+ * Blocking (SS7_BLOCKED_* per side) and in service state live in one int so
+ * that hunting and the CLI can read them without taking the pvt lock.  The
+ * signalling thread changes them through circuit_update(), with the pvt lock
+ * held as before; readers get a consistent snapshot from circuit_state().
+ */
+#define CIRCUIT_LOCAL(type)	((type) << 0)		/*!< Locally blocked for the given SS7_BLOCKED_* reasons */
+#define CIRCUIT_REMOTE(type)	((type) << 2)		/*!< Remotely blocked for the given SS7_BLOCKED_* reasons */
+#define CIRCUIT_LOCAL_MASK	CIRCUIT_LOCAL(0x3)
+#define CIRCUIT_REMOTE_MASK	CIRCUIT_REMOTE(0x3)
+#define CIRCUIT_INSERVICE	(1 << 4)		/*!< Circuit has been reset or otherwise brought into service */
+
+#ifndef HAVE_GCC_ATOMICS
+AST_MUTEX_DEFINE_STATIC(circuit_lock);
+#endif
+
+static inline int circuit_state(struct dahdi_pvt *p)
+{
+	return ast_atomic_fetchadd_int(&p->cicstate, 0);
+}
+
+/*! \brief Atomically clear, then set, bits of the circuit state word */
+static inline void circuit_update(struct dahdi_pvt *p, int clear, int set)
+{
+#ifdef HAVE_GCC_ATOMICS
+	int old;
+
+	do {
+		old = p->cicstate;
+	} while (!__sync_bool_compare_and_swap(&p->cicstate, old, (old & ~clear) | set));
+#else
+	ast_mutex_lock(&circuit_lock);
+	p->cicstate = (p->cicstate & ~clear) | set;
+	ast_mutex_unlock(&circuit_lock);
+#endif
+}
+
+#define circuit_set(p, bits)		circuit_update((p), 0, (bits))
+#define circuit_clear(p, bits)		circuit_update((p), (bits), 0)
+#define circuit_locally_blocked(p)	(circuit_state(p) & CIRCUIT_LOCAL_MASK)
+#define circuit_remotely_blocked(p)	((circuit_state(p) & CIRCUIT_REMOTE_MASK) >> 2)
+#define circuit_inservice(p)		(circuit_state(p) & CIRCUIT_INSERVICE)
+
 /*! \brief Channel configuration from chan_dahdi.conf .
  * This struct is used for parsing the [channels] section of chan_dahdi.conf.
  * Generally there is a field here for every possible configuration item.
@@ -792,6 +1416,8 @@ static struct dahdi_chan_conf dahdi_chan_conf_default(void) {
 			.subscriberprefix = "",
 			.unknownprefix = "",
 			.networkroutedprefix = "",
+			.called_lengths = "",
+			.stdigit = '#',
 		},
 #endif
 		.chan = {
@@ -827,7 +1453,8 @@ static struct dahdi_chan_conf dahdi_chan_conf_default(void) {
 			.sendcalleridafter = DEFAULT_CIDRINGS,
 
 			.buf_policy = DAHDI_POLICY_IMMEDIATE,
-			.buf_no = numbufs
+			.buf_no = numbufs,
+			.readsize = READ_SIZE
 		},
 		.timing = {
 			.prewinktime = -1,
@@ -889,19 +1516,240 @@ static const struct ast_channel_tech dahdi_tech = {
 #define GET_CHANNEL(p) ((p)->channel)
 #endif
 
-struct dahdi_pvt *round_robin[32];
+#define NUM_GROUPS	(sizeof(ast_group_t) * 8)
+
+struct dahdi_pvt *round_robin[NUM_GROUPS];
+
+#define HUNT_BITS	(sizeof(unsigned int) * 8)
+
+/*!
+ * \brief Members of one dial group, for G/g/R/r hunting in dahdi_request()
+ *
+ * A set bit in idle[] means the member has no owner, or is an FXS port that
+ * can still take a call waiting.  It is cleared when the channel is seized and
+ * set again on hangup, so only members with their bit set are considered at
+ * all.  Those are still checked with available(), for alarms, blocking and the
+ * like, and if none of them is, the group is busy.
+ */
+struct dahdi_hunt_group {
+	int numchans;
+	struct dahdi_pvt **pvts;		/*!< Members in iflist (channel) order */
+	unsigned int *idle;			/*!< One bit per member, see above */
+	int cursor;				/*!< Member handed out last, for round robin */
+};
+
+static struct dahdi_hunt_group hunt_groups[NUM_GROUPS];
+static int hunt_groups_dirty = 1;		/*!< iflist or a group changed, rebuild before the next hunt */
+
+/*! \brief Protect hunt_groups.  Taken after iflock and the pvt lock, nothing is locked under it */
+AST_MUTEX_DEFINE_STATIC(huntlock);
+
+static void hunt_groups_invalidate(void)
+{
+	ast_mutex_lock(&huntlock);
+	hunt_groups_dirty = 1;
+	ast_mutex_unlock(&huntlock);
+}
+
+static void hunt_groups_free(void)
+{
+	int g;
+
+	for (g = 0; g < NUM_GROUPS; g++) {
+		if (hunt_groups[g].pvts)
+			ast_free(hunt_groups[g].pvts);
+		if (hunt_groups[g].idle)
+			ast_free(hunt_groups[g].idle);
+	}
+	memset(hunt_groups, 0, sizeof(hunt_groups));
+}
+
+/*! \brief Whether a seized \a p can still take a call, as call waiting on an FXS port */
+static inline int hunt_group_callwait(const struct dahdi_pvt *p)
+{
+	return (p->sig == SIG_FXOKS) || (p->sig == SIG_FXOLS) || (p->sig == SIG_FXOGS);
+}
+
+/*! \brief Rebuild the member tables from iflist.  Call with iflock and huntlock held */
+static void hunt_groups_build(void)
+{
+	int count[NUM_GROUPS] = { 0, };
+	struct dahdi_hunt_group *hg;
+	struct dahdi_pvt *p;
+	int g, i;
+
+	hunt_groups_free();
+	for (p = iflist; p; p = p->next) {
+		if (p->destroy)
+			continue;
+		for (g = 0; g < NUM_GROUPS; g++) {
+			if (p->group & ((ast_group_t) 1 << g))
+				count[g]++;
+		}
+	}
+	for (g = 0; g < NUM_GROUPS; g++) {
+		if (!count[g])
+			continue;
+		hg = &hunt_groups[g];
+		hg->pvts = ast_calloc(count[g], sizeof(hg->pvts[0]));
+		hg->idle = ast_calloc((count[g] + HUNT_BITS - 1) / HUNT_BITS, sizeof(hg->idle[0]));
+		if (!hg->pvts || !hg->idle) {
+			if (hg->pvts)
+				ast_free(hg->pvts);
+			if (hg->idle)
+				ast_free(hg->idle);
+			hg->pvts = NULL;
+			hg->idle = NULL;
+		}
+	}
+	for (p = iflist; p; p = p->next) {
+		if (p->destroy)
+			continue;
+		for (g = 0; g < NUM_GROUPS; g++) {
+			hg = &hunt_groups[g];
+			if (hg->pvts && (p->group & ((ast_group_t) 1 << g)))
+				hg->pvts[hg->numchans++] = p;
+		}
+	}
+	for (g = 0; g < NUM_GROUPS; g++) {
+		hg = &hunt_groups[g];
+		for (i = 0; i < hg->numchans; i++) {
+			if (!hg->pvts[i]->owner || hunt_group_callwait(hg->pvts[i]))
+				hg->idle[i / HUNT_BITS] |= 1U << (i % HUNT_BITS);
+		}
+	}
+	hunt_groups_dirty = 0;
+}
+
+static int hunt_group_index(struct dahdi_hunt_group *hg, struct dahdi_pvt *p)
+{
+	int lo = 0, hi = hg->numchans - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (hg->pvts[mid]->channel < p->channel)
+			lo = mid + 1;
+		else if (hg->pvts[mid]->channel > p->channel)
+			hi = mid - 1;
+		else
+			return (hg->pvts[mid] == p) ? mid : -1;
+	}
+	return -1;
+}
+
+/*! \brief Note that a channel was seized (idle = 0) or released (idle = 1) */
+static void hunt_groups_mark(struct dahdi_pvt *p, int idle)
+{
+	struct dahdi_hunt_group *hg;
+	int g, i;
+
+	if (!p->group || p->destroy || (!idle && hunt_group_callwait(p)))
+		return;
+	ast_mutex_lock(&huntlock);
+	if (!hunt_groups_dirty) {
+		for (g = 0; g < NUM_GROUPS; g++) {
+			if (!(p->group & ((ast_group_t) 1 << g)))
+				continue;
+			hg = &hunt_groups[g];
+			if ((i = hunt_group_index(hg, p)) < 0)
+				continue;
+			if (idle)
+				hg->idle[i / HUNT_BITS] |= 1U << (i % HUNT_BITS);
+			else
+				hg->idle[i / HUNT_BITS] &= ~(1U << (i % HUNT_BITS));
+		}
+	}
+	ast_mutex_unlock(&huntlock);
+}
+
+static inline int available(struct dahdi_pvt *p, int channelmatch, ast_group_t groupmatch, int *busy, int *channelmatched, int *groupmatched);
+
+/*!
+ * \brief Pick an available member of a dial group using the idle bitmap
+ * \note Call with iflock held
+ * \retval 0 \a found is the channel to use, or NULL if no member is available
+ * \retval -1 there is no member table for \a group, dahdi_request() has to scan iflist
+ */
+static int hunt_group_find(int group, int backwards, int roundrobin, struct dahdi_pvt **found, int *busy, int *groupmatched)
+{
+	struct dahdi_hunt_group *hg;
+	struct dahdi_pvt *p;
+	unsigned int word;
+	int i, n, skip, channelmatched = 0;
+
+	*found = NULL;
+	if (group < 0 || group >= NUM_GROUPS)
+		return -1;
+
+	ast_mutex_lock(&huntlock);
+	if (hunt_groups_dirty)
+		hunt_groups_build();
+	hg = &hunt_groups[group];
+	if (!hg->numchans) {
+		ast_mutex_unlock(&huntlock);
+		return -1;
+	}
+	*groupmatched = 1;
+
+	if (roundrobin)
+		i = hg->cursor + (backwards ? -1 : 1);
+	else
+		i = backwards ? hg->numchans - 1 : 0;
+	for (n = 0; n < hg->numchans; n++, i += backwards ? -1 : 1) {
+		if (i < 0)
+			i = hg->numchans - 1;
+		else if (i >= hg->numchans)
+			i = 0;
+		word = hg->idle[i / HUNT_BITS];
+		if (!word && !backwards && !(i % HUNT_BITS)) {
+			/* Whole word busy, skip ahead to the next one */
+			skip = hg->numchans - i;
+			if (skip > HUNT_BITS)
+				skip = HUNT_BITS;
+			n += skip - 1;
+			i += skip - 1;
+			continue;
+		}
+		if (!(word & (1U << (i % HUNT_BITS))))
+			continue;
+		p = hg->pvts[i];
+		if (p->owner && !hunt_group_callwait(p)) {
+			/* Seized without us noticing, no call waiting possible either */
+			hg->idle[i / HUNT_BITS] &= ~(1U << (i % HUNT_BITS));
+			continue;
+		}
+		if (!p->inalarm && available(p, -1, (ast_group_t) 1 << group, busy, &channelmatched, groupmatched)) {
+			*found = p;
+			break;
+		}
+	}
+
+	if (*found)
+		hg->cursor = i;
+	ast_mutex_unlock(&huntlock);
+
+	return 0;
+}
 
 #ifdef HAVE_PRI
-static inline int pri_grab(struct dahdi_pvt *pvt, struct dahdi_pri *pri)
+#define pri_grab(pvt, pri) __pri_grab(pvt, pri, __FUNCTION__, __LINE__)
+
+static inline int __pri_grab(struct dahdi_pvt *pvt, struct dahdi_pri *pri, const char *func, int line)
 {
 	int res;
+	unsigned int retries = 0;
+	struct timeval start = lock_prof_start();
+
 	/* Grab the lock first */
 	do {
 		res = ast_mutex_trylock(&pri->lock);
 		if (res) {
+			retries++;
 			DEADLOCK_AVOIDANCE(&pvt->lock);
 		}
 	} while (res);
+	pri->prof_site = lock_prof_wait("pri", func, line, start, retries, 1);
+	pri->prof_since = lock_prof_start();
 	/* Then break the poll */
 	if (pri->master != AST_PTHREADT_NULL)
 		pthread_kill(pri->master, SIGURG);
@@ -911,31 +1759,330 @@ static inline int pri_grab(struct dahdi_pvt *pvt, struct dahdi_pri *pri)
 
 #ifdef HAVE_SS7
 static int ss7_find_alloc_call(struct dahdi_pvt *p);
+static void ss7_queue_bearer(struct dahdi_pvt *p, int jobs);
+static void ss7_bearer_forget(struct dahdi_pvt *p);
 static int ss7_do_rsc(struct dahdi_pvt *p);
+static void ss7_setup_forget(struct dahdi_ss7 *linkset, struct dahdi_pvt *p);
+static void ss7_dsp_shed_check(struct ast_channel *ast, struct dahdi_pvt *p);
+static void ss7_event_range(const ss7_event *e, struct ss7_cic_range *range);
+
+/*! \brief Allocate a libss7 call for \a p and account for it, with the linkset lock held */
+static struct isup_call *ss7_new_call(struct dahdi_pvt *p)
+{
+	if (!(p->ss7call = isup_new_call(p->ss7->ss7))) {
+		p->ss7->calls_failed++;
+		return NULL;
+	}
+	p->ss7->calls_allocated++;
+	return p->ss7call;
+}
 
 static inline void ss7_rel(struct dahdi_ss7 *ss7)
 {
+	struct lock_prof *site = ss7->prof_site;
+	struct timeval since = ss7->prof_since;
+
+	ss7->prof_site = NULL;
 	ast_mutex_unlock(&ss7->lock);
+	if (site)
+		lock_prof_hold(site, since);
+}
+
+/*!
+ * \brief Add a record to the trace ring of \a linkset
+ *
+ * Nothing is formatted and no lock is taken, so this stays on all the time.
+ * A writer that gets lapped by SS7_TRACE_SIZE others loses its record, the
+ * reader sees that from seq, see ss7_trace_copy().
+ */
+static inline void ss7_trace(struct dahdi_ss7 *linkset, int type, int link, int cic, unsigned int pc, int data)
+{
+	struct ss7_trace_rec *r;
+	unsigned int pos;
+
+	if (!linkset->trace)
+		return;
+	pos = ast_atomic_fetchadd_int(&linkset->trace_pos, 1);
+	r = &linkset->trace[pos & (SS7_TRACE_SIZE - 1)];
+	r->seq = 0;
+	/* seq has to be seen cleared before the fields change, and set after */
+	__sync_synchronize();
+	r->tv = ast_tvnow();
+	r->type = type;
+	r->link = link;
+	r->cic = cic;
+	r->pc = pc;
+	r->data = data;
+	__sync_synchronize();
+	r->seq = pos + 1;
+}
+
+/*! \brief Break the poll of whichever thread services \a linkset, so it picks up what we queued */
+static inline void ss7_linkset_kick(struct dahdi_ss7 *linkset)
+{
+	linkset->dirty = 1;
+	if (linkset->worker) {
+		linkset->worker->kicked = 1;
+		pthread_kill(linkset->worker->thread, SIGURG);
+	} else if (linkset->master != AST_PTHREADT_NULL)
+		pthread_kill(linkset->master, SIGURG);
 }
 
-static inline int ss7_grab(struct dahdi_pvt *pvt, struct dahdi_ss7 *pri)
+#define ss7_grab(pvt, ss7) __ss7_grab(pvt, ss7, __FUNCTION__, __LINE__)
+
+static inline int __ss7_grab(struct dahdi_pvt *pvt, struct dahdi_ss7 *pri, const char *func, int line)
 {
 	int res;
+	unsigned int retries = 0;
+	struct timeval start = lock_prof_start();
+
 	/* Grab the lock first */
 	do {
 		res = ast_mutex_trylock(&pri->lock);
 		if (res) {
+			retries++;
 			ast_mutex_unlock(&pvt->lock);
 			/* Release the lock and try again */
 			usleep(1);
 			ast_mutex_lock(&pvt->lock);
 		}
 	} while (res);
+	pri->prof_site = lock_prof_wait("linkset", func, line, start, retries, 1);
+	pri->prof_since = lock_prof_start();
 	/* Then break the poll */
-	if (pri->master != AST_PTHREADT_NULL)
-		pthread_kill(pri->master, SIGURG);
+	ss7_linkset_kick(pri);
+	return 0;
+}
+
+static void ss7_hist_add(struct ss7_hist *h, struct timeval start, struct timeval end)
+{
+	long long us = (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_usec - start.tv_usec);
+	unsigned int v = (us < 0) ? 0 : (us > 0xffffffffLL) ? 0xffffffffU : (unsigned int) us;
+	int i;
+
+	for (i = 0; (i < SS7_HIST_BUCKETS - 1) && (v >= ss7_hist_bounds[i]); i++);
+	h->buckets[i]++;
+	h->count++;
+	h->total += v;
+	if (v > h->max)
+		h->max = v;
+}
+
+/*!
+ * \brief Note that CIC \a p sent or got the message starting or ending \a phase
+ *
+ * Called with the linkset lock held.  An ending message that matches the
+ * exchange in progress adds its latency to the linkset histograms.
+ */
+static void ss7_stat_phase(struct dahdi_pvt *p, enum ss7_phase phase)
+{
+	struct timeval now = ast_tvnow();
+	int lat = -1;
+
+	switch (phase) {
+	case SS7_PHASE_ACM:
+		if (p->ss7_phase == SS7_PHASE_IAM)
+			lat = SS7_LAT_IAM_ACM;
+		break;
+	case SS7_PHASE_ANM:
+		if (p->ss7_phase == SS7_PHASE_ACM)
+			lat = SS7_LAT_ACM_ANM;
+		phase = SS7_PHASE_NONE;
+		break;
+	case SS7_PHASE_REL:
+		/* On a release collision the first REL is the one being answered */
+		if (p->ss7_phase == SS7_PHASE_REL)
+			return;
+		break;
+	case SS7_PHASE_RLC:
+		if (p->ss7_phase == SS7_PHASE_REL)
+			lat = SS7_LAT_REL_RLC;
+		phase = SS7_PHASE_NONE;
+		break;
+	case SS7_PHASE_GRA:
+		if (p->ss7_phase == SS7_PHASE_GRS)
+			lat = SS7_LAT_GRS_GRA;
+		phase = SS7_PHASE_NONE;
+		break;
+	default:
+		break;
+	}
+
+	if ((lat >= 0) && p->ss7)
+		ss7_hist_add(&p->ss7->latency[lat], p->ss7_stamp, now);
+	p->ss7_phase = phase;
+	p->ss7_stamp = now;
+}
+
+static inline unsigned int ss7_cic_hash(struct dahdi_ss7 *linkset, int cic, unsigned int dpc)
+{
+	return ((unsigned int) cic ^ (dpc * 2654435761U)) & linkset->cic_hash_mask;
+}
+
+/*! \brief Add a member pvt to the linkset (dpc, cic) index */
+static void ss7_cic_index_add(struct dahdi_ss7 *linkset, struct dahdi_pvt *p)
+{
+	struct dahdi_pvt **cur = &linkset->cic_hash[ss7_cic_hash(linkset, p->cic, p->dpc)];
+
+	while (*cur)
+		cur = &(*cur)->cic_next;
+	p->cic_next = NULL;
+	*cur = p;
+}
+
+/*! \brief Remove a member pvt from the linkset (dpc, cic) index */
+static void ss7_cic_index_del(struct dahdi_ss7 *linkset, struct dahdi_pvt *p)
+{
+	struct dahdi_pvt **cur = &linkset->cic_hash[ss7_cic_hash(linkset, p->cic, p->dpc)];
+
+	for (; *cur; cur = &(*cur)->cic_next) {
+		if (*cur == p) {
+			*cur = p->cic_next;
+			break;
+		}
+	}
+	p->cic_next = NULL;
+}
+
+static struct dahdi_pvt *ss7_find_cic(struct dahdi_ss7 *linkset, int cic, unsigned int dpc)
+{
+	struct dahdi_pvt *p;
+
+	if (!linkset->cic_hash)
+		return NULL;
+	for (p = linkset->cic_hash[ss7_cic_hash(linkset, cic, dpc)]; p; p = p->cic_next) {
+		if (p->cic == cic && p->dpc == dpc)
+			return p;
+	}
+	return NULL;
+}
+
+/*! \brief Index of the first member pvt at or after (dpc, cic) in the sorted pvts[] */
+static int ss7_cic_lower_bound(struct dahdi_ss7 *linkset, int cic, unsigned int dpc)
+{
+	int lo = 0, hi = linkset->numchans, mid;
+	struct dahdi_pvt *p;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		p = linkset->pvts[mid];
+		if (p->dpc < dpc || (p->dpc == dpc && p->cic < cic))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*!
+ * \brief Locate the member pvts of a CIC range
+ * \return the number of equipped CICs in startcic..endcic on dpc, which are
+ * pvts[*first] onwards in CIC order
+ */
+static int ss7_cic_range(struct dahdi_ss7 *linkset, int startcic, int endcic, unsigned int dpc, int *first)
+{
+	int x;
+
+	*first = ss7_cic_lower_bound(linkset, startcic, dpc);
+	for (x = *first; x < linkset->numchans; x++) {
+		if (linkset->pvts[x]->dpc != dpc || linkset->pvts[x]->cic > endcic)
+			break;
+	}
+	return x - *first;
+}
+
+/*!
+ * \brief Make room in the linkset tables for one more member pvt
+ *
+ * pvts[] and the (dpc, cic) index are sized by the CICs actually configured on
+ * the linkset, both double as needed.  The index is rebuilt when it grows so
+ * that it never holds more pvts than buckets.
+ */
+static int ss7_grow_pvts(struct dahdi_ss7 *linkset)
+{
+	struct dahdi_pvt **tmp;
+	unsigned int buckets;
+	int i, size;
+
+	if (linkset->numchans >= linkset->pvts_size) {
+		size = linkset->pvts_size ? linkset->pvts_size * 2 : 32;
+		/* One spare slot, ss7_remove_pvt() clears the one past the end */
+		if (!(tmp = ast_realloc(linkset->pvts, (size + 1) * sizeof(*tmp))))
+			return -1;
+		linkset->pvts = tmp;
+		linkset->pvts_size = size;
+	}
+	if (linkset->cic_hash && linkset->numchans < linkset->cic_hash_mask + 1)
+		return 0;
+
+	buckets = linkset->cic_hash ? (linkset->cic_hash_mask + 1) * 2 : SS7_CIC_HASH_MIN;
+	if (!(tmp = ast_calloc(buckets, sizeof(*tmp))))
+		return -1;
+	ast_free(linkset->cic_hash);
+	linkset->cic_hash = tmp;
+	linkset->cic_hash_mask = buckets - 1;
+	for (i = 0; i < linkset->numchans; i++)
+		ss7_cic_index_add(linkset, linkset->pvts[i]);
+	return 0;
+}
+
+/*! \brief Release the tables of a linkset whose pvts are all gone */
+static void ss7_free_pvts(struct dahdi_ss7 *linkset)
+{
+	ast_free(linkset->trace);
+	linkset->trace = NULL;
+	ast_free(linkset->pvts);
+	linkset->pvts = NULL;
+	linkset->pvts_size = 0;
+	ast_free(linkset->cic_hash);
+	linkset->cic_hash = NULL;
+	linkset->cic_hash_mask = 0;
+}
+
+/*! \brief Add a member pvt to the linkset, keeping pvts[] sorted, a (dpc, cic) can only be had once */
+static int ss7_add_pvt(struct dahdi_ss7 *linkset, struct dahdi_pvt *p)
+{
+	struct dahdi_pvt *cur;
+	int pos;
+
+	if ((cur = ss7_find_cic(linkset, p->cic, p->dpc))) {
+		ast_log(LOG_ERROR, "CIC %d DPC %d of channel %d is already used by channel %d\n",
+			p->cic, p->dpc, p->channel, cur->channel);
+		return -1;
+	}
+	if (ss7_grow_pvts(linkset)) {
+		ast_log(LOG_ERROR, "Unable to grow linkset for CIC %d DPC %d\n", p->cic, p->dpc);
+		return -1;
+	}
+	pos = ss7_cic_lower_bound(linkset, p->cic, p->dpc);
+	memmove(&linkset->pvts[pos + 1], &linkset->pvts[pos], (linkset->numchans - pos) * sizeof(linkset->pvts[0]));
+	linkset->pvts[pos] = p;
+	linkset->numchans++;
+	ss7_cic_index_add(linkset, p);
 	return 0;
 }
+
+/*! \brief Remove a member pvt from the linkset */
+static void ss7_remove_pvt(struct dahdi_ss7 *linkset, struct dahdi_pvt *p)
+{
+	int pos;
+
+	if (!linkset->pvts)
+		return;
+	ss7_cic_index_del(linkset, p);
+	/* ss7_add_pvt() keeps (dpc, cic) unique, still never leave p behind if it is not */
+	for (pos = ss7_cic_lower_bound(linkset, p->cic, p->dpc); pos < linkset->numchans; pos++) {
+		if (linkset->pvts[pos] == p)
+			break;
+		if (linkset->pvts[pos]->dpc != p->dpc || linkset->pvts[pos]->cic != p->cic)
+			return;
+	}
+	if (pos >= linkset->numchans)
+		return;
+	linkset->numchans--;
+	memmove(&linkset->pvts[pos], &linkset->pvts[pos + 1], (linkset->numchans - pos) * sizeof(linkset->pvts[0]));
+	linkset->pvts[linkset->numchans] = NULL;
+}
 #endif
 #define NUM_CADENCE_MAX 25
 static int num_cadence = 4;
@@ -988,6 +2135,9 @@ static void wakeup_sub(struct dahdi_pvt *p, int a, struct dahdi_pri *pri)
 static void wakeup_sub(struct dahdi_pvt *p, int a, void *pri)
 #endif
 {
+	struct timeval start = lock_prof_start();
+	unsigned int retries = 0;
+
 #ifdef HAVE_PRI
 	if (pri)
 		ast_mutex_unlock(&pri->lock);
@@ -995,8 +2145,10 @@ static void wakeup_sub(struct dahdi_pvt *p, int a, void *pri)
 	for (;;) {
 		if (p->subs[a].owner) {
 			if (ast_channel_trylock(p->subs[a].owner)) {
+				retries++;
 				DEADLOCK_AVOIDANCE(&p->lock);
 			} else {
+				lock_prof_wait("owner", __FUNCTION__, __LINE__, start, retries, 1);
 				ast_queue_frame(p->subs[a].owner, &ast_null_frame);
 				ast_channel_unlock(p->subs[a].owner);
 				break;
@@ -1018,6 +2170,9 @@ static void dahdi_queue_frame(struct dahdi_pvt *p, struct ast_frame *f, void *da
 #ifdef HAVE_SS7
 	struct dahdi_ss7 *ss7 = (struct dahdi_ss7*) data;
 #endif
+	struct timeval start = lock_prof_start();
+	unsigned int retries = 0;
+
 	/* We must unlock the PRI to avoid the possibility of a deadlock */
 #if defined(HAVE_PRI) || defined(HAVE_SS7)
 	if (data) {
@@ -1042,8 +2197,10 @@ static void dahdi_queue_frame(struct dahdi_pvt *p, struct ast_frame *f, void *da
 	for (;;) {
 		if (p->owner) {
 			if (ast_channel_trylock(p->owner)) {
+				retries++;
 				DEADLOCK_AVOIDANCE(&p->lock);
 			} else {
+				lock_prof_wait("owner", __FUNCTION__, __LINE__, start, retries, 1);
 				ast_queue_frame(p->owner, f);
 				ast_channel_unlock(p->owner);
 				break;
@@ -1074,8 +2231,102 @@ static void dahdi_queue_frame(struct dahdi_pvt *p, struct ast_frame *f, void *da
 #endif
 }
 
+#ifdef HAVE_SS7
+/*!
+ * \brief Queue a control frame for the owner of an SS7 circuit
+ *
+ * Called by the linkset thread with p->lock held.  The frame is handed over by
+ * dahdi_read() (or dahdi_exception()) on the channel thread, which also holds
+ * p->lock, so the linkset thread never needs the owner's channel lock.  Only if
+ * the ring is full do we fall back to dahdi_queue_frame().  ast_read() hands
+ * out the read queue before calling dahdi_read(), so the ring is moved there
+ * first and stays bypassed for the rest of the call, keeping the frames in order.
+ *
+ * The channel thread may be waiting on a bearer that carries no audio yet, so
+ * when the ring gets its first entry the owner is woken through its alertpipe,
+ * which ast_read() answers by calling dahdi_read().
+ */
+static void ss7_queue_control(struct dahdi_pvt *p, int subclass, struct dahdi_ss7 *linkset)
+{
+	int blah = 1;
+
+	if (p->pending_overflow || (p->pending_tail - p->pending_head >= SS7_PENDING_CONTROLS)) {
+		struct ast_frame f = { AST_FRAME_CONTROL, };
+		int ctrl[SS7_PENDING_CONTROLS + 1];
+		int i, n = 0;
+
+		/* Empty the ring before dahdi_queue_frame() drops p->lock, dahdi_read() must not get any of it */
+		p->pending_overflow = 1;
+		while (p->pending_head != p->pending_tail)
+			ctrl[n++] = p->pending_ctrl[p->pending_head++ & (SS7_PENDING_CONTROLS - 1)];
+		ctrl[n++] = subclass;
+		for (i = 0; i < n; i++) {
+			f.subclass = ctrl[i];
+			dahdi_queue_frame(p, &f, linkset);
+		}
+		return;
+	}
+	if ((p->pending_head == p->pending_tail) && p->owner && (p->owner->alertpipe[1] > -1)) {
+		if ((write(p->owner->alertpipe[1], &blah, sizeof(blah)) != sizeof(blah)) && (errno != EAGAIN))
+			ast_log(LOG_WARNING, "Unable to wake %s: %s\n", p->owner->name, strerror(errno));
+	}
+	p->pending_ctrl[p->pending_tail++ & (SS7_PENDING_CONTROLS - 1)] = subclass;
+}
+
+/*! \brief Hand the next control frame queued by ss7_queue_control() to the owner, with p->lock held */
+static struct ast_frame *ss7_pending_control(struct dahdi_pvt *p, int index)
+{
+	if (p->sig != SIG_SS7 || index != SUB_REAL || p->pending_head == p->pending_tail)
+		return NULL;
+	p->subs[index].f.frametype = AST_FRAME_CONTROL;
+	p->subs[index].f.subclass = p->pending_ctrl[p->pending_head++ & (SS7_PENDING_CONTROLS - 1)];
+	return &p->subs[index].f;
+}
+#endif
+
 static int restore_gains(struct dahdi_pvt *p);
 
+/*!
+ * \brief Have do_monitor() look again at what \a p has to be watched for
+ *
+ * Called whenever a channel gains or loses an owner, or starts or stops a
+ * spill or MWI monitor, so the monitor never has to rescan iflist.
+ */
+static void monitor_touch(struct dahdi_pvt *p)
+{
+	ast_mutex_lock(&monitor_queue.lock);
+	if (!p->monitor_queued) {
+		p->monitor_queued = 1;
+		p->monitor_next = monitor_queue.head;
+		if (!monitor_queue.head && (monitor_queue.pipe[1] > -1) && (write(monitor_queue.pipe[1], "", 1) < 0) && (errno != EAGAIN))
+			ast_log(LOG_WARNING, "Unable to wake the monitor: %s\n", strerror(errno));
+		monitor_queue.head = p;
+	}
+	ast_mutex_unlock(&monitor_queue.lock);
+}
+
+/*! \brief Take \a p off the monitor queue, before it is freed */
+static void monitor_forget(struct dahdi_pvt *p)
+{
+	struct dahdi_pvt **q;
+
+	ast_mutex_lock(&monitor_queue.lock);
+	if (p->monitor_queued) {
+		for (q = &monitor_queue.head; *q; q = &(*q)->monitor_next) {
+			if (*q == p) {
+				*q = p->monitor_next;
+				break;
+			}
+		}
+		p->monitor_queued = 0;
+	}
+	ast_mutex_unlock(&monitor_queue.lock);
+	if (p->monitor_radio) {
+		p->monitor_radio = 0;
+		ast_atomic_fetchadd_int(&monitor_radios, -1);
+	}
+}
+
 static void swap_subs(struct dahdi_pvt *p, int a, int b)
 {
 	int tchan;
@@ -1095,6 +2346,7 @@ static void swap_subs(struct dahdi_pvt *p, int a, int b)
 	p->subs[b].chan = tchan;
 	p->subs[b].owner = towner;
 	p->subs[b].inthreeway = tinthreeway;
+	monitor_touch(p);
 
 	if (p->subs[a].owner)
 		ast_channel_set_fd(p->subs[a].owner, 0, p->subs[a].dfd);
@@ -1182,6 +2434,17 @@ static int alloc_sub(struct dahdi_pvt *p, int x)
 		return -1;
 	}
 
+	if (p->readsize != READ_SIZE) {
+		/* Subchannels are read with the frame size of the real one */
+		res = p->readsize;
+		if (ioctl(p->subs[x].dfd, DAHDI_SET_BLOCKSIZE, &res) == -1) {
+			ast_log(LOG_WARNING, "Unable to set blocksize %d on subchannel %d: %s\n", p->readsize, x, strerror(errno));
+			dahdi_close(p->subs[x].dfd);
+			p->subs[x].dfd = -1;
+			return -1;
+		}
+	}
+
 	res = ioctl(p->subs[x].dfd, DAHDI_GET_BUFINFO, &bi);
 	if (!res) {
 		bi.txbufpolicy = p->buf_policy;
@@ -1725,72 +2988,82 @@ static void dahdi_disable_ec(struct dahdi_pvt *p)
 	p->echocanon = 0;
 }
 
-static void fill_txgain(struct dahdi_gains *g, float gain, int law)
+#define GAIN_CACHE_SIZE 16	/*!< Distinct (gain, law) tables kept by gain_table_get() */
+
+/*! \brief A gain table computed once and shared by every channel using that gain and law */
+struct gain_table {
+	float gain;
+	int law;
+	unsigned char table[sizeof(((struct dahdi_gains *) NULL)->txgain)];
+};
+
+static struct gain_table gain_cache[GAIN_CACHE_SIZE];
+static int gain_cache_used = 0;
+static int gain_cache_next = 0;		/*!< Slot replaced next once the cache is full */
+AST_MUTEX_DEFINE_STATIC(gain_cache_lock);
+
+static void compute_gain(unsigned char *table, int len, float gain, int law)
 {
 	int j;
 	int k;
 	float linear_gain = pow(10.0, gain / 20.0);
 
-	switch (law) {
-	case DAHDI_LAW_ALAW:
-		for (j = 0; j < ARRAY_LEN(g->txgain); j++) {
-			if (gain) {
-				k = (int) (((float) AST_ALAW(j)) * linear_gain);
-				if (k > 32767) k = 32767;
-				if (k < -32767) k = -32767;
-				g->txgain[j] = AST_LIN2A(k);
-			} else {
-				g->txgain[j] = j;
-			}
-		}
-		break;
-	case DAHDI_LAW_MULAW:
-		for (j = 0; j < ARRAY_LEN(g->txgain); j++) {
-			if (gain) {
-				k = (int) (((float) AST_MULAW(j)) * linear_gain);
-				if (k > 32767) k = 32767;
-				if (k < -32767) k = -32767;
-				g->txgain[j] = AST_LIN2MU(k);
-			} else {
-				g->txgain[j] = j;
-			}
-		}
-		break;
+	for (j = 0; j < len; j++) {
+		k = (int) (((float) (law == DAHDI_LAW_ALAW ? AST_ALAW(j) : AST_MULAW(j))) * linear_gain);
+		if (k > 32767) k = 32767;
+		if (k < -32767) k = -32767;
+		table[j] = (law == DAHDI_LAW_ALAW) ? AST_LIN2A(k) : AST_LIN2MU(k);
 	}
 }
 
-static void fill_rxgain(struct dahdi_gains *g, float gain, int law)
+/*! \brief Copy the table for gain and law into dst, computing it only the first time it is asked for */
+static void gain_table_get(unsigned char *dst, int len, float gain, int law)
 {
+	struct gain_table *t = NULL;
 	int j;
-	int k;
-	float linear_gain = pow(10.0, gain / 20.0);
 
-	switch (law) {
-	case DAHDI_LAW_ALAW:
-		for (j = 0; j < ARRAY_LEN(g->rxgain); j++) {
-			if (gain) {
-				k = (int) (((float) AST_ALAW(j)) * linear_gain);
-				if (k > 32767) k = 32767;
-				if (k < -32767) k = -32767;
-				g->rxgain[j] = AST_LIN2A(k);
-			} else {
-				g->rxgain[j] = j;
-			}
+	if ((law != DAHDI_LAW_ALAW) && (law != DAHDI_LAW_MULAW))
+		return;
+	if (!gain) {
+		for (j = 0; j < len; j++)
+			dst[j] = j;
+		return;
+	}
+	if (len > (int) sizeof(t->table)) {
+		compute_gain(dst, len, gain, law);
+		return;
+	}
+
+	ast_mutex_lock(&gain_cache_lock);
+	for (j = 0; j < gain_cache_used; j++) {
+		if ((gain_cache[j].gain == gain) && (gain_cache[j].law == law)) {
+			t = &gain_cache[j];
+			break;
 		}
-		break;
-	case DAHDI_LAW_MULAW:
-		for (j = 0; j < ARRAY_LEN(g->rxgain); j++) {
-			if (gain) {
-				k = (int) (((float) AST_MULAW(j)) * linear_gain);
-				if (k > 32767) k = 32767;
-				if (k < -32767) k = -32767;
-				g->rxgain[j] = AST_LIN2MU(k);
-			} else {
-				g->rxgain[j] = j;
-			}
+	}
+	if (!t) {
+		if (gain_cache_used < GAIN_CACHE_SIZE) {
+			t = &gain_cache[gain_cache_used++];
+		} else {
+			t = &gain_cache[gain_cache_next];
+			gain_cache_next = (gain_cache_next + 1) % GAIN_CACHE_SIZE;
 		}
-		break;
+		t->gain = gain;
+		t->law = law;
+		compute_gain(t->table, sizeof(t->table), gain, law);
 	}
+	memcpy(dst, t->table, len);
+	ast_mutex_unlock(&gain_cache_lock);
+}
+
+static void fill_txgain(struct dahdi_gains *g, float gain, int law)
+{
+	gain_table_get(g->txgain, ARRAY_LEN(g->txgain), gain, law);
+}
+
+static void fill_rxgain(struct dahdi_gains *g, float gain, int law)
+{
+	gain_table_get(g->rxgain, ARRAY_LEN(g->rxgain), gain, law);
 }
 
 static int set_actual_txgain(int fd, int chan, float gain, int law)
@@ -1831,7 +3104,22 @@ static int set_actual_rxgain(int fd, int chan, float gain, int law)
 
 static int set_actual_gain(int fd, int chan, float rxgain, float txgain, int law)
 {
-	return set_actual_txgain(fd, chan, txgain, law) | set_actual_rxgain(fd, chan, rxgain, law);
+	struct dahdi_gains g;
+	int res;
+
+	/* Both directions in one read-modify-write of the channel gains */
+	memset(&g, 0, sizeof(g));
+	g.chan = chan;
+	res = ioctl(fd, DAHDI_GETGAINS, &g);
+	if (res) {
+		ast_debug(1, "Failed to read gains: %s\n", strerror(errno));
+		return res;
+	}
+
+	fill_txgain(&g, txgain, law);
+	fill_rxgain(&g, rxgain, law);
+
+	return ioctl(fd, DAHDI_SETGAINS, &g);
 }
 
 static int bump_gains(struct dahdi_pvt *p)
@@ -2055,7 +3343,7 @@ static int send_callerid(struct dahdi_pvt *p)
 	p->cidspill = NULL;
 	if (p->callwaitcas) {
 		/* Wait for CID/CW to expire */
-		p->cidcwexpire = CIDCW_EXPIRE_SAMPLES;
+		p->cidcwexpire = CIDCW_EXPIRE_SAMPLES(p);
 	} else
 		restore_conference(p);
 	return 0;
@@ -2064,7 +3352,7 @@ static int send_callerid(struct dahdi_pvt *p)
 static int dahdi_callwait(struct ast_channel *ast)
 {
 	struct dahdi_pvt *p = ast->tech_pvt;
-	p->callwaitingrepeat = CALLWAITING_REPEAT_SAMPLES;
+	p->callwaitingrepeat = CALLWAITING_REPEAT_SAMPLES(p);
 	if (p->cidspill) {
 		ast_log(LOG_WARNING, "Spill already exists?!?\n");
 		ast_free(p->cidspill);
@@ -2102,27 +3390,18 @@ static unsigned char cid_pres2ss7screen(int cid_pres)
 
 static int ss7_parse_prefix(struct dahdi_pvt *p, const char *number, char *nai)
 {
-	int strip = 0;
-
-	if (strncmp(number, p->ss7->internationalprefix, strlen(p->ss7->internationalprefix)) == 0) {
-		strip = strlen(p->ss7->internationalprefix);
-		*nai = SS7_NAI_INTERNATIONAL;
-	} else if (strncmp(number, p->ss7->nationalprefix, strlen(p->ss7->nationalprefix)) == 0) {
-		strip = strlen(p->ss7->nationalprefix);
-		*nai = SS7_NAI_NATIONAL;
-	} else if (strncmp(number, p->ss7->networkroutedprefix, strlen(p->ss7->networkroutedprefix)) == 0) {
-		strip = strlen(p->ss7->networkroutedprefix);
-		*nai = SS7_NAI_NETWORKROUTED;
-	} else if (strncmp(number, p->ss7->unknownprefix, strlen(p->ss7->unknownprefix)) == 0) {
-		strip = strlen(p->ss7->unknownprefix);
-		*nai = SS7_NAI_UNKNOWN;
-	} else if (strncmp(number, p->ss7->subscriberprefix, strlen(p->ss7->subscriberprefix)) == 0) {
-		strip = strlen(p->ss7->subscriberprefix);
-		*nai = SS7_NAI_SUBSCRIBER;
-	} else
-		*nai = SS7_NAI_SUBSCRIBER;
+	const struct ss7_prefix *pre;
+	int i;
 
-	return strip;
+	for (i = 0; i < p->ss7->numprefixes; i++) {
+		pre = &p->ss7->prefixes[i];
+		if (!strncmp(number, pre->digits, pre->len)) {
+			*nai = pre->nai;
+			return pre->len;
+		}
+	}
+	*nai = SS7_NAI_SUBSCRIBER;
+	return 0;
 }
 #endif
 
@@ -2141,6 +3420,16 @@ static void disable_dtmf_detect(struct dahdi_pvt *p)
 	}
 }
 
+/*! \brief Something asked for in-band detection again, run the DSP for the rest of the call */
+static void dsp_unshed(struct dahdi_pvt *p)
+{
+	if (!p->dsp_shed)
+		return;
+	ast_debug(1, "Resuming DSP processing on channel %d\n", p->channel);
+	p->dsp_shed = 0;
+	p->dsp_idle = -1;
+}
+
 static void enable_dtmf_detect(struct dahdi_pvt *p)
 {
 	int val;
@@ -2149,6 +3438,7 @@ static void enable_dtmf_detect(struct dahdi_pvt *p)
 		return;
 
 	p->ignoredtmf = 0;
+	dsp_unshed(p);
 
 	val = DAHDI_TONEDETECT_ON | DAHDI_TONEDETECT_MUTE;
 	ioctl(p->subs[SUB_REAL].dfd, DAHDI_TONEDETECT, &val);
@@ -2507,7 +3797,7 @@ static int dahdi_call(struct ast_channel *ast, char *rdest, int timeout)
 			return -1;
 		}
 		p->digital = IS_DIGITAL(ast->transfercapability);
-		p->ss7call = isup_new_call(p->ss7->ss7);
+		ss7_new_call(p);
 
 		if (!p->ss7call) {
 			ss7_rel(p->ss7);
@@ -2707,6 +3997,7 @@ static int dahdi_call(struct ast_channel *ast, char *rdest, int timeout)
 
 
 		isup_iam(p->ss7->ss7, p->ss7call);
+		ss7_stat_phase(p, SS7_PHASE_IAM);
 		ast_setstate(ast, AST_STATE_DIALING);
 		ss7_rel(p->ss7);
 	}
@@ -2992,12 +4283,23 @@ static void destroy_dahdi_pvt(struct dahdi_pvt **pvt)
 		p->prev->next = p->next;
 	if (p->next)
 		p->next->prev = p->prev;
+	if (!p->destroy)
+		hunt_groups_invalidate();
+	monitor_forget(p);
+	ast_atomic_fetchadd_int(&monitor_generation, 1);
 	if (p->use_smdi)
 		ast_smdi_interface_unref(p->smdi_iface);
 	if (p->mwi_event_sub)
 		ast_event_unsubscribe(p->mwi_event_sub);
 	if (p->vars)
 		ast_variables_destroy(p->vars);
+#ifdef HAVE_SS7
+	if (p->ss7) {
+		ss7_remove_pvt(p->ss7, p);
+		ss7_bearer_forget(p);
+		ss7_setup_forget(p->ss7, p);
+	}
+#endif
 	ast_mutex_destroy(&p->lock);
 	if (p->owner)
 		p->owner->tech_pvt = NULL;
@@ -3070,7 +4372,7 @@ static void destroy_all_channels(void)
 		usleep(1);
 	}
 
-	ast_mutex_lock(&iflock);
+	iflock_wrlock();
 	/* Destroy all the interfaces and free their memory */
 	p = iflist;
 	while (p) {
@@ -3091,7 +4393,11 @@ static void destroy_all_channels(void)
 	}
 	iflist = NULL;
 	ifcount = 0;
-	ast_mutex_unlock(&iflock);
+	ast_mutex_lock(&huntlock);
+	hunt_groups_free();
+	hunt_groups_dirty = 1;
+	ast_mutex_unlock(&huntlock);
+	ast_rwlock_unlock(&iflock);
 }
 
 #ifdef HAVE_PRI
@@ -3156,6 +4462,8 @@ static int pri_is_up(struct dahdi_pri *pri)
 static int pri_assign_bearer(struct dahdi_pvt *crv, struct dahdi_pri *pri, struct dahdi_pvt *bearer)
 {
 	bearer->owner = &inuse;
+	hunt_groups_mark(bearer, 0);
+	monitor_touch(bearer);
 	bearer->realcall = crv;
 	crv->subs[SUB_REAL].dfd = bearer->subs[SUB_REAL].dfd;
 	if (crv->subs[SUB_REAL].owner)
@@ -3222,6 +4530,8 @@ static int pri_find_dchan(struct dahdi_pri *pri)
 }
 #endif
 
+static void dahdi_io_unplace(struct dahdi_pvt *p);
+
 static int dahdi_hangup(struct ast_channel *ast)
 {
 	int res;
@@ -3240,6 +4550,7 @@ static int dahdi_hangup(struct ast_channel *ast)
 
 	ast_mutex_lock(&p->lock);
 
+	dahdi_io_unplace(p);
 	p->ignore_dtmf_regenerate = 0;
 	enable_dtmf_detect(p);
 	index = dahdi_get_index(ast, p, 1);
@@ -3270,6 +4581,8 @@ static int dahdi_hangup(struct ast_channel *ast)
 	ast_debug(1, "Hangup: channel: %d index = %d, normal = %d, callwait = %d, thirdcall = %d\n",
 		p->channel, index, p->subs[SUB_REAL].dfd, p->subs[SUB_CALLWAIT].dfd, p->subs[SUB_THREEWAY].dfd);
 	p->ignoredtmf = 0;
+	p->dsp_idle = 0;
+	p->dsp_shed = 0;
 
 	if (index > -1) {
 		/* Real channel, do some fixup */
@@ -3282,6 +4595,12 @@ static int dahdi_hangup(struct ast_channel *ast)
 		p->subs[index].linear = 0;
 		p->subs[index].needcallerid = 0;
 		p->polarity = POLARITY_IDLE;
+#ifdef HAVE_SS7
+		if (index == SUB_REAL) {
+			p->pending_head = p->pending_tail = 0;
+			p->pending_overflow = 0;
+		}
+#endif
 		dahdi_setlinear(p->subs[index].dfd, 0);
 		if (index == SUB_REAL) {
 			if ((p->subs[SUB_CALLWAIT].dfd > -1) && (p->subs[SUB_THREEWAY].dfd > -1)) {
@@ -3373,6 +4692,8 @@ static int dahdi_hangup(struct ast_channel *ast)
 
 	if (!p->subs[SUB_REAL].owner && !p->subs[SUB_CALLWAIT].owner && !p->subs[SUB_THREEWAY].owner) {
 		p->owner = NULL;
+		hunt_groups_mark(p, 1);
+		monitor_touch(p);
 		p->ringt = 0;
 		p->distinctivering = 0;
 		p->confirmanswer = 0;
@@ -3402,6 +4723,8 @@ static int dahdi_hangup(struct ast_channel *ast)
 		/* Perform low level hangup if no owner left */
 #ifdef HAVE_SS7
 		if (p->ss7) {
+			p->bearerlaw = DAHDI_LAW_DEFAULT;
+			ss7_queue_bearer(p, SS7_BEARER_PREPARE);
 			if (p->ss7call) {
 				if (!ss7_grab(p, p->ss7)) {
 					if (p->do_hangup == SS7_HANGUP_SEND_REL) {
@@ -3416,12 +4739,14 @@ static int dahdi_hangup(struct ast_channel *ast)
 							icause = 16;
 
 						isup_rel(p->ss7->ss7, p->ss7call, icause);
+						ss7_stat_phase(p, SS7_PHASE_REL);
 						p->do_hangup = SS7_HANGUP_DO_NOTHING;
 					} else if (p->do_hangup == SS7_HANGUP_SEND_RSC) {
 						ss7_do_rsc(p);
 						p->do_hangup = SS7_HANGUP_DO_NOTHING;
 					} else if (p->do_hangup == SS7_HANGUP_SEND_RLC) {
 						isup_rlc(p->ss7->ss7, p->ss7call);
+						ss7_stat_phase(p, SS7_PHASE_RLC);
 						isup_free_call(p->ss7->ss7, p->ss7call);
 						p->ss7call = NULL;
 						p->do_hangup = SS7_HANGUP_DO_NOTHING;
@@ -3560,6 +4885,8 @@ static int dahdi_hangup(struct ast_channel *ast)
 			update_conf(p->bearer);
 			reset_conf(p->bearer);
 			p->bearer->owner = NULL;
+			hunt_groups_mark(p->bearer, 1);
+			monitor_touch(p->bearer);
 			p->bearer->realcall = NULL;
 			p->bearer = NULL;
 			p->subs[SUB_REAL].dfd = -1;
@@ -3578,7 +4905,7 @@ static int dahdi_hangup(struct ast_channel *ast)
 	ast_module_unref(ast_module_info->self);
 	ast_verb(3, "Hungup '%s'\n", ast->name);
 
-	ast_mutex_lock(&iflock);
+	iflock_wrlock();
 
 	if (p->restartpending) {
 		num_restart_pending--;
@@ -3597,7 +4924,7 @@ static int dahdi_hangup(struct ast_channel *ast)
 			}
 		}
 	}
-	ast_mutex_unlock(&iflock);
+	ast_rwlock_unlock(&iflock);
 	return 0;
 }
 
@@ -3722,12 +5049,15 @@ static int dahdi_answer(struct ast_channel *ast)
 				isup_set_connected(p->ss7call, connected_num + connected_strip, connected_nai, connected_pres, SS7_SCREENING_NETWORK_PROVIDED);
 			}
 
-			if (!p->proceeding && (p->ss7->flags & LINKSET_FLAG_AUTOACM))
+			if (!p->proceeding && (p->ss7->flags & LINKSET_FLAG_AUTOACM)) {
 			    isup_acm(p->ss7->ss7, p->ss7call);
+			    ss7_stat_phase(p, SS7_PHASE_ACM);
+			}
 
 			p->proceeding = 1;
 			p->dialing = 0;
 			res = isup_anm(p->ss7->ss7, p->ss7call);
+			ss7_stat_phase(p, SS7_PHASE_ANM);
 			ss7_rel(p->ss7);
 			if (!p->echocontrol_ind || !(p->ss7->flags & LINKSET_FLAG_USEECHOCONTROL)) {
 				dahdi_enable_ec(p);
@@ -3788,6 +5118,7 @@ static int dahdi_setoption(struct ast_channel *chan, int option, void *data, int
 	case AST_OPTION_TONE_VERIFY:
 		if (!p->dsp)
 			break;
+		dsp_unshed(p);
 		cp = (char *) data;
 		switch (*cp) {
 		case 1:
@@ -3880,6 +5211,7 @@ static int dahdi_setoption(struct ast_channel *chan, int option, void *data, int
 	case AST_OPTION_RELAXDTMF:  /* Relax DTMF decoding (or not) */
 		if (!p->dsp)
 			break;
+		dsp_unshed(p);
 		cp = (char *) data;
 		ast_debug(1, "Set option RELAX DTMF, value: %s(%d) on %s\n",
 			*cp ? "ON" : "OFF", (int) *cp, chan->name);
@@ -3897,6 +5229,10 @@ static int dahdi_setoption(struct ast_channel *chan, int option, void *data, int
 		}
 		if (ioctl(p->subs[SUB_REAL].dfd, DAHDI_AUDIOMODE, &x) == -1)
 			ast_log(LOG_WARNING, "Unable to set audio mode on channel %d to %d: %s\n", p->channel, x, strerror(errno));
+#ifdef HAVE_SS7
+		if (!x)
+			p->bearerlaw = DAHDI_LAW_DEFAULT;
+#endif
 		break;
 	case AST_OPTION_OPRMODE:  /* Operator services mode */
 		oprmode = (struct oprmode *) data;
@@ -3959,9 +5295,14 @@ static void dahdi_unlink(struct dahdi_pvt *slave, struct dahdi_pvt *master, int
 	if (needlock) {
 		ast_mutex_lock(&master->lock);
 		if (slave) {
+			struct timeval start = lock_prof_start();
+			unsigned int retries = 0;
+
 			while (ast_mutex_trylock(&slave->lock)) {
+				retries++;
 				DEADLOCK_AVOIDANCE(&master->lock);
 			}
+			lock_prof_wait("pvt", __FUNCTION__, __LINE__, start, retries, 1);
 		}
 	}
 	hasslaves = 0;
@@ -4028,30 +5369,127 @@ static void dahdi_link(struct dahdi_pvt *slave, struct dahdi_pvt *master) {
 	ast_debug(1, "Making %d slave to master %d at %d\n", slave->channel, master->channel, x);
 }
 
-static enum ast_bridge_result dahdi_bridge(struct ast_channel *c0, struct ast_channel *c1, int flags, struct ast_frame **fo, struct ast_channel **rc, int timeoutms)
+#ifdef HAVE_SS7
+#define SS7_TANDEM_POLL 50	/*!< ms between looks at hangup state and pending controls in the tandem bridge */
+
+/*!
+ * \brief Bridge loop for two answered SS7 bearers that dahdi_bridge() joined in the kernel
+ *
+ * The audio never leaves DAHDI, so instead of reading and dropping every voice
+ * frame of both legs we only wait on the channels' alert pipes for queued
+ * frames and on the bearers for DAHDI events, and look at the hangup state and
+ * the pending SS7 controls of both pvts every SS7_TANDEM_POLL ms.  A DAHDI
+ * event is handed to dahdi_exception() through ast_read(), and the bridge is
+ * left so that dahdi_bridge() looks at both legs again.  Whatever the bearers
+ * received meanwhile is flushed on the way out.
+ */
+static enum ast_bridge_result ss7_tandem_bridge(struct ast_channel *c0, struct ast_channel *c1,
+	struct dahdi_pvt *p0, struct dahdi_pvt *p1, struct ast_frame **fo, struct ast_channel **rc, int *timeoutms)
 {
+	enum ast_bridge_result res = AST_BRIDGE_RETRY;
 	struct ast_channel *who;
-	struct dahdi_pvt *p0, *p1, *op0, *op1;
-	struct dahdi_pvt *master = NULL, *slave = NULL;
 	struct ast_frame *f;
-	int inconf = 0;
-	int nothingok = 1;
-	int ofd0, ofd1;
-	int oi0, oi1, i0 = -1, i1 = -1, t0, t1;
-	int os0 = -1, os1 = -1;
-	int priority = 0;
-	struct ast_channel *oc0, *oc1;
-	enum ast_bridge_result res;
-
-#ifdef PRI_2BCT
-	int triedtopribridge = 0;
-	q931_call *q931c0 = NULL, *q931c1 = NULL;
-#endif
+	struct pollfd fds[4];
+	struct timeval start;
+	int ofd0 = c0->fds[0], ofd1 = c1->fds[0];
+	int ms, x, exception;
 
-	/* For now, don't attempt to native bridge if either channel needs DTMF detection.
-	   There is code below to handle it properly until DTMF is actually seen,
-	   but due to currently unresolved issues it's ignored...
-	*/
+	ast_verb(3, "Tandem bridging %s and %s in the kernel\n", c0->name, c1->name);
+
+	for (;;) {
+		if ((c0->tech_pvt != p0) || (c1->tech_pvt != p1) ||
+		    (c0->fds[0] != ofd0) || (c1->fds[0] != ofd1) ||
+		    (p0->owner != c0) || (p1->owner != c1) ||
+		    !*timeoutms) {
+			ast_debug(1, "Something changed out on tandem %d to %d, returning -3 to restart\n", p0->channel, p1->channel);
+			break;
+		}
+
+		who = NULL;
+		exception = 0;
+		if (ast_check_hangup(c0) || (p0->pending_head != p0->pending_tail))
+			who = c0;
+		else if (ast_check_hangup(c1) || (p1->pending_head != p1->pending_tail))
+			who = c1;
+
+		if (!who) {
+			ms = SS7_TANDEM_POLL;
+			if ((*timeoutms > 0) && (*timeoutms < ms))
+				ms = *timeoutms;
+			fds[0].fd = c0->alertpipe[0];
+			fds[1].fd = c1->alertpipe[0];
+			fds[2].fd = c0->fds[0];
+			fds[3].fd = c1->fds[0];
+			fds[0].events = fds[1].events = POLLIN;
+			fds[2].events = fds[3].events = POLLPRI;
+			fds[0].revents = fds[1].revents = fds[2].revents = fds[3].revents = 0;
+			start = ast_tvnow();
+			x = poll(fds, 4, ms);
+			if (*timeoutms > 0) {
+				*timeoutms -= ast_tvdiff_ms(ast_tvnow(), start);
+				if (*timeoutms < 0)
+					*timeoutms = 0;
+			}
+			if (x <= 0)
+				continue;
+			if ((fds[2].revents | fds[3].revents) & POLLPRI) {
+				/* As ast_waitfor_nandfds() would flag it, so ast_read() calls dahdi_exception() */
+				who = (fds[2].revents & POLLPRI) ? c0 : c1;
+				ast_set_flag(who, AST_FLAG_EXCEPTION);
+				who->fdno = 0;
+				exception = 1;
+			} else
+				who = (fds[0].revents & POLLIN) ? c0 : c1;
+		}
+
+		f = ast_read(who);
+		if (!f || (f->frametype == AST_FRAME_CONTROL) || (f->frametype == AST_FRAME_DTMF)) {
+			*fo = f;
+			*rc = who;
+			res = AST_BRIDGE_COMPLETE;
+			break;
+		}
+		ast_frfree(f);
+		if (exception) {
+			ast_debug(1, "DAHDI event on tandem %d to %d, returning -3 to restart\n", p0->channel, p1->channel);
+			break;
+		}
+	}
+
+	x = DAHDI_FLUSH_READ;
+	ioctl(p0->subs[SUB_REAL].dfd, DAHDI_FLUSH, &x);
+	x = DAHDI_FLUSH_READ;
+	ioctl(p1->subs[SUB_REAL].dfd, DAHDI_FLUSH, &x);
+
+	return res;
+}
+#endif
+
+static enum ast_bridge_result dahdi_bridge(struct ast_channel *c0, struct ast_channel *c1, int flags, struct ast_frame **fo, struct ast_channel **rc, int timeoutms)
+{
+	struct ast_channel *who;
+	struct dahdi_pvt *p0, *p1, *op0, *op1;
+	struct dahdi_pvt *master = NULL, *slave = NULL;
+	struct ast_frame *f;
+	int inconf = 0;
+	int nothingok = 1;
+	int ofd0, ofd1;
+	int oi0, oi1, i0 = -1, i1 = -1, t0, t1;
+	int os0 = -1, os1 = -1;
+	int priority = 0;
+	struct ast_channel *oc0, *oc1;
+	enum ast_bridge_result res;
+	struct timeval start;
+
+#ifdef PRI_2BCT
+	int triedtopribridge = 0;
+	q931_call *q931c0 = NULL, *q931c1 = NULL;
+#endif
+
+	/* For now, don't attempt to native bridge if either channel needs DTMF detection.
+	   There is code below to handle it properly until DTMF is actually seen,
+	   but due to currently unresolved issues it's ignored...
+	*/
 
 	if (flags & (AST_BRIDGE_DTMF_CHANNEL_0 | AST_BRIDGE_DTMF_CHANNEL_1))
 		return AST_BRIDGE_FAILED_NOWARN;
@@ -4087,7 +5525,9 @@ static enum ast_bridge_result dahdi_bridge(struct ast_channel *c0, struct ast_ch
 	oc0 = p0->owner;
 	oc1 = p1->owner;
 
+	start = lock_prof_start();
 	if (ast_mutex_trylock(&p0->lock)) {
+		lock_prof_wait("pvt", __FUNCTION__, __LINE__, start, 1, 0);
 		/* Don't block, due to potential for deadlock */
 		ast_channel_unlock(c0);
 		ast_channel_unlock(c1);
@@ -4095,6 +5535,7 @@ static enum ast_bridge_result dahdi_bridge(struct ast_channel *c0, struct ast_ch
 		return AST_BRIDGE_RETRY;
 	}
 	if (ast_mutex_trylock(&p1->lock)) {
+		lock_prof_wait("pvt", __FUNCTION__, __LINE__, start, 1, 0);
 		/* Don't block, due to potential for deadlock */
 		ast_mutex_unlock(&p0->lock);
 		ast_channel_unlock(c0);
@@ -4221,6 +5662,16 @@ static enum ast_bridge_result dahdi_bridge(struct ast_channel *c0, struct ast_ch
 	if (!(flags & AST_BRIDGE_DTMF_CHANNEL_1) && (oi1 == SUB_REAL))
 		disable_dtmf_detect(op1);
 
+#ifdef HAVE_SS7
+	if (ss7_tandem && master && slave && (oi0 == SUB_REAL) && (oi1 == SUB_REAL) &&
+	    (op0->sig == SIG_SS7) && (op1->sig == SIG_SS7) &&
+	    (c0->_state == AST_STATE_UP) && (c1->_state == AST_STATE_UP) &&
+	    (c0->alertpipe[0] > -1) && (c1->alertpipe[0] > -1)) {
+		res = ss7_tandem_bridge(c0, c1, op0, op1, fo, rc, &timeoutms);
+		goto return_from_bridge;
+	}
+#endif
+
 	for (;;) {
 		struct ast_channel *c0_priority[2] = {c0, c1};
 		struct ast_channel *c1_priority[2] = {c1, c0};
@@ -4377,6 +5828,7 @@ static int dahdi_ring_phone(struct dahdi_pvt *p)
 }
 
 static void *ss_thread(void *data);
+static int dahdi_ss_thread_start(struct ast_channel *chan);
 
 static struct ast_channel *dahdi_new(struct dahdi_pvt *, int, int, int, int, int);
 
@@ -4584,7 +6036,6 @@ static struct ast_frame *dahdi_handle_event(struct ast_channel *ast)
 	int index, mysig;
 	char *c;
 	struct dahdi_pvt *p = ast->tech_pvt;
-	pthread_t threadid;
 	struct ast_channel *chan;
 	struct ast_frame *f;
 
@@ -5182,7 +6633,7 @@ static struct ast_frame *dahdi_handle_event(struct ast_channel *ast)
 						p->owner = chan;
 						if (!chan) {
 							ast_log(LOG_WARNING, "Cannot allocate new structure on channel %d\n", p->channel);
-						} else if (ast_pthread_create_detached(&threadid, NULL, ss_thread, chan)) {
+						} else if (dahdi_ss_thread_start(chan)) {
 							ast_log(LOG_WARNING, "Unable to start simple switch on channel %d\n", p->channel);
 							res = tone_zone_play_tone(p->subs[SUB_REAL].dfd, DAHDI_TONE_CONGESTION);
 							dahdi_enable_ec(p);
@@ -5440,6 +6891,10 @@ static struct ast_frame *__dahdi_exception(struct ast_channel *ast)
 	p->subs[index].f.src = "dahdi_exception";
 	p->subs[index].f.data = NULL;
 
+#ifdef HAVE_SS7
+	if (p->owner && (f = ss7_pending_control(p, index)))
+		return f;
+#endif
 
 	if ((!p->owner) && (!(p->radio || (p->oprmode < 0)))) {
 		/* If nobody owns us, absorb the event appropriately, otherwise
@@ -5535,6 +6990,64 @@ static struct ast_frame *dahdi_exception(struct ast_channel *ast)
 	return f;
 }
 
+/*!
+ * \brief Bind the channel thread reading \a p to the iocpus of \a p
+ *
+ * Only the first thread reading the channel during a call is bound, which
+ * is the thread running its call, and only for the first channel with iocpus
+ * it reads, so bridging channels of cards on different NUMA nodes does not
+ * bounce it between them.  Threads shared between calls, like the autoservice
+ * thread reading it later on or the simple switch pool, are left alone.  The
+ * binding is undone at hangup, see dahdi_io_unplace().
+ */
+static void dahdi_io_place(struct dahdi_pvt *p)
+{
+	struct dahdi_placement place;
+	struct dahdi_io_placed *placed;
+	char name[40];
+	int *pooled;
+
+	if (ast_strlen_zero(p->iocpus) || p->io_placed)
+		return;
+	if ((pooled = ast_threadstorage_get(&ss_pool_thread, sizeof(*pooled))) && *pooled)
+		return;
+	if (!(placed = ast_threadstorage_get(&dahdi_io_placed, sizeof(*placed))) || placed->channel)
+		return;
+#ifdef __linux__
+	if (pthread_getaffinity_np(pthread_self(), sizeof(placed->saved), &placed->saved))
+		return;
+#endif
+	placed->channel = p->channel;
+	p->io_thread = pthread_self();
+	p->io_placed = 1;
+	memset(&place, 0, sizeof(place));
+	ast_copy_string(place.cpus, p->iocpus, sizeof(place.cpus));
+	snprintf(name, sizeof(name), "Channel thread of DAHDI/%d", p->channel);
+	dahdi_thread_place(name, &place);
+}
+
+/*! \brief Give the thread dahdi_io_place() bound for \a p back the CPUs it had, if it is the calling one */
+static void dahdi_io_unplace(struct dahdi_pvt *p)
+{
+	struct dahdi_io_placed *placed;
+#ifdef __linux__
+	int res;
+#endif
+
+	if (!p->io_placed)
+		return;
+	p->io_placed = 0;
+	if (!pthread_equal(p->io_thread, pthread_self()))
+		return;
+	if (!(placed = ast_threadstorage_get(&dahdi_io_placed, sizeof(*placed))) || placed->channel != p->channel)
+		return;
+	placed->channel = 0;
+#ifdef __linux__
+	if ((res = pthread_setaffinity_np(pthread_self(), sizeof(placed->saved), &placed->saved)))
+		ast_log(LOG_WARNING, "Unable to unbind the channel thread of DAHDI/%d: %s\n", p->channel, strerror(res));
+#endif
+}
+
 static struct ast_frame  *dahdi_read(struct ast_channel *ast)
 {
 	struct dahdi_pvt *p = ast->tech_pvt;
@@ -5542,10 +7055,17 @@ static struct ast_frame  *dahdi_read(struct ast_channel *ast)
 	int index;
 	void *readbuf;
 	struct ast_frame *f;
+	struct timeval start;
+	unsigned int retries = 0;
 
+	start = lock_prof_start();
 	while (ast_mutex_trylock(&p->lock)) {
+		retries++;
 		CHANNEL_DEADLOCK_AVOIDANCE(ast);
 	}
+	lock_prof_wait("pvt", __FUNCTION__, __LINE__, start, retries, 1);
+
+	dahdi_io_place(p);
 
 	index = dahdi_get_index(ast, p, 0);
 
@@ -5599,6 +7119,14 @@ static struct ast_frame  *dahdi_read(struct ast_channel *ast)
 	else if (p->ringt > 0)
 		p->ringt--;
 
+	/* Controls from the linkset thread go first, they predate any needringing */
+#ifdef HAVE_SS7
+	if ((f = ss7_pending_control(p, index))) {
+		ast_mutex_unlock(&p->lock);
+		return f;
+	}
+#endif
+
 	if (p->subs[index].needringing) {
 		/* Send ringing frame if requested */
 		p->subs[index].needringing = 0;
@@ -5695,7 +7223,7 @@ static struct ast_frame  *dahdi_read(struct ast_channel *ast)
 	}
 	readbuf = ((unsigned char *)p->subs[index].buffer) + AST_FRIENDLY_OFFSET;
 	CHECK_BLOCKING(ast);
-	res = read(p->subs[index].dfd, readbuf, p->subs[index].linear ? READ_SIZE * 2 : READ_SIZE);
+	res = read(p->subs[index].dfd, readbuf, p->subs[index].linear ? p->readsize * 2 : p->readsize);
 	ast_clear_flag(ast, AST_FLAG_BLOCKING);
 	/* Check for hangup */
 	if (res < 0) {
@@ -5713,8 +7241,8 @@ static struct ast_frame  *dahdi_read(struct ast_channel *ast)
 		ast_mutex_unlock(&p->lock);
 		return f;
 	}
-	if (res != (p->subs[index].linear ? READ_SIZE * 2 : READ_SIZE)) {
-		ast_debug(1, "Short read (%d/%d), must be an event...\n", res, p->subs[index].linear ? READ_SIZE * 2 : READ_SIZE);
+	if (res != (p->subs[index].linear ? p->readsize * 2 : p->readsize)) {
+		ast_debug(1, "Short read (%d/%d), must be an event...\n", res, p->subs[index].linear ? p->readsize * 2 : p->readsize);
 		f = __dahdi_exception(ast);
 		ast_mutex_unlock(&p->lock);
 		return f;
@@ -5722,7 +7250,7 @@ static struct ast_frame  *dahdi_read(struct ast_channel *ast)
 	if (p->tdd) { /* if in TDD mode, see if we receive that */
 		int c;
 
-		c = tdd_feed(p->tdd,readbuf,READ_SIZE);
+		c = tdd_feed(p->tdd,readbuf,p->readsize);
 		if (c < 0) {
 			ast_debug(1,"tdd_feed failed\n");
 			ast_mutex_unlock(&p->lock);
@@ -5757,9 +7285,9 @@ static struct ast_frame  *dahdi_read(struct ast_channel *ast)
 		restore_conference(p);
 	}
 	if (p->subs[index].linear) {
-		p->subs[index].f.datalen = READ_SIZE * 2;
+		p->subs[index].f.datalen = p->readsize * 2;
 	} else
-		p->subs[index].f.datalen = READ_SIZE;
+		p->subs[index].f.datalen = p->readsize;
 
 	/* Handle CallerID Transmission */
 	if ((p->owner == ast) && p->cidspill &&((ast->_state == AST_STATE_UP) || (ast->rings == p->cidrings))) {
@@ -5768,7 +7296,7 @@ static struct ast_frame  *dahdi_read(struct ast_channel *ast)
 
 	p->subs[index].f.frametype = AST_FRAME_VOICE;
 	p->subs[index].f.subclass = ast->rawreadformat;
-	p->subs[index].f.samples = READ_SIZE;
+	p->subs[index].f.samples = p->readsize;
 	p->subs[index].f.mallocd = 0;
 	p->subs[index].f.offset = AST_FRIENDLY_OFFSET;
 	p->subs[index].f.data = p->subs[index].buffer + AST_FRIENDLY_OFFSET / sizeof(p->subs[index].buffer[0]);
@@ -5789,7 +7317,11 @@ static struct ast_frame  *dahdi_read(struct ast_channel *ast)
 		p->subs[index].f.data = NULL;
 		p->subs[index].f.datalen= 0;
 	}
-	if (p->dsp && (!p->ignoredtmf || p->callwaitcas || p->busydetect  || p->callprogress) && !index) {
+#ifdef HAVE_SS7
+	if ((p->sig == SIG_SS7) && p->dsp && !p->dsp_shed && !index && (ast->_state == AST_STATE_UP))
+		ss7_dsp_shed_check(ast, p);
+#endif
+	if (p->dsp && !p->dsp_shed && (!p->ignoredtmf || p->callwaitcas || p->busydetect  || p->callprogress) && !index) {
 		/* Perform busy detection. etc on the dahdi line */
 		f = ast_dsp_process(ast, p->dsp, &p->subs[index].f);
 		if (f) {
@@ -5811,6 +7343,8 @@ static struct ast_frame  *dahdi_read(struct ast_channel *ast)
 #endif
 				/* DSP clears us of being pulse */
 				p->pulsedial = 0;
+				if (p->dsp_idle > 0)
+					p->dsp_idle = 1;
 			}
 		}
 	} else
@@ -5827,6 +7361,49 @@ static struct ast_frame  *dahdi_read(struct ast_channel *ast)
 	return f;
 }
 
+#ifdef HAVE_SS7
+/*! \brief Stop running the DSP on an answered SS7 call once ss7dspshed says it has nothing left to find
+ *
+ * Called with the pvt locked for every frame read from the bearer while the
+ * call is up and the DSP still runs.  On the first frame the dialplan may
+ * override the policy for this call with SS7_DSP_SHED=yes|no.  Busy and call
+ * progress detection are explicitly configured, so lines using them keep the
+ * DSP.  Anything wanting in-band digits again goes through dsp_unshed().
+ */
+static void ss7_dsp_shed_check(struct ast_channel *ast, struct dahdi_pvt *p)
+{
+	const char *var;
+
+	if ((p->dsp_idle < 0) || p->busydetect || p->callprogress)
+		return;
+
+	if (!p->dsp_idle++) {
+		if ((var = pbx_builtin_getvar_helper(ast, "SS7_DSP_SHED")) && !ast_strlen_zero(var)) {
+			if (ast_false(var)) {
+				p->dsp_idle = -1;
+				return;
+			}
+			if (ast_true(var)) {
+				/* Shed now, but never again once something asks for the DSP back */
+				p->dsp_idle = -1;
+				ast_debug(1, "Dialplan dropped DSP processing on answered channel %d\n", p->channel);
+				p->dsp_shed = 1;
+				return;
+			}
+		}
+		if (ss7_dsp_shed < 0) {
+			p->dsp_idle = -1;
+			return;
+		}
+	}
+
+	if (p->dsp_idle > ss7_dsp_shed * (8000 / p->readsize)) {
+		ast_debug(1, "Dropping DSP processing on answered channel %d\n", p->channel);
+		p->dsp_shed = 1;
+	}
+}
+#endif
+
 static int my_dahdi_write(struct dahdi_pvt *p, unsigned char *buf, int len, int index, int linear)
 {
 	int sent=0;
@@ -5836,8 +7413,8 @@ static int my_dahdi_write(struct dahdi_pvt *p, unsigned char *buf, int len, int
 	fd = p->subs[index].dfd;
 	while (len) {
 		size = len;
-		if (size > (linear ? READ_SIZE * 2 : READ_SIZE))
-			size = (linear ? READ_SIZE * 2 : READ_SIZE);
+		if (size > (linear ? p->readsize * 2 : p->readsize))
+			size = (linear ? p->readsize * 2 : p->readsize);
 		res = write(fd, buf, size);
 		if (res != size) {
 			ast_debug(1, "Write returned %d (%s) on channel %d\n", res, strerror(errno), p->channel);
@@ -5971,6 +7548,7 @@ static int dahdi_indicate(struct ast_channel *chan, int condition, const void *d
 				if (p->ss7->ss7) {
 					ss7_grab(p, p->ss7);
 					isup_rel(p->ss7->ss7, p->ss7call, AST_CAUSE_BUSY);
+					ss7_stat_phase(p, SS7_PHASE_REL);
 					ss7_rel(p->ss7);
 				}
 				res = 0;
@@ -6001,6 +7579,7 @@ static int dahdi_indicate(struct ast_channel *chan, int condition, const void *d
 
 					if (!p->proceeding && (p->ss7->flags & LINKSET_FLAG_AUTOACM)) {
 						isup_acm(p->ss7->ss7, p->ss7call);
+						ss7_stat_phase(p, SS7_PHASE_ACM);
 						p->proceeding = 1;
 					}
 
@@ -6052,6 +7631,7 @@ static int dahdi_indicate(struct ast_channel *chan, int condition, const void *d
 				if (p->ss7->ss7) {
 					ss7_grab(p, p->ss7);
 					isup_acm(p->ss7->ss7, p->ss7call);
+					ss7_stat_phase(p, SS7_PHASE_ACM);
 					p->proceeding = 1;
 					ss7_rel(p->ss7);
 
@@ -6085,6 +7665,7 @@ static int dahdi_indicate(struct ast_channel *chan, int condition, const void *d
 
 					if (!p->proceeding && (p->ss7->flags & LINKSET_FLAG_AUTOACM)) {
 						isup_acm(p->ss7->ss7, p->ss7call);
+						ss7_stat_phase(p, SS7_PHASE_ACM);
 						p->proceeding = 1;
 					}
 
@@ -6132,6 +7713,7 @@ static int dahdi_indicate(struct ast_channel *chan, int condition, const void *d
 				if (p->ss7->ss7) {
 					ss7_grab(p, p->ss7);
 					isup_rel(p->ss7->ss7, p->ss7call, AST_CAUSE_SWITCH_CONGESTION);
+					ss7_stat_phase(p, SS7_PHASE_REL);
 					ss7_rel(p->ss7);
 				}
 				res = 0;
@@ -6342,13 +7924,16 @@ static struct ast_channel *dahdi_new(struct dahdi_pvt *i, int state, int startpb
 	}
 	if (!ast_strlen_zero(i->language))
 		ast_string_field_set(tmp, language, i->language);
-	if (!i->owner)
+	if (!i->owner) {
 		i->owner = tmp;
+		hunt_groups_mark(i, 0);
+	}
 	if (!ast_strlen_zero(i->accountcode))
 		ast_string_field_set(tmp, accountcode, i->accountcode);
 	if (i->amaflags)
 		tmp->amaflags = i->amaflags;
 	i->subs[index].owner = tmp;
+	monitor_touch(i);
 	ast_copy_string(tmp->context, i->context, sizeof(tmp->context));
 	ast_string_field_set(tmp, call_forward, i->call_forward);
 	/* If we've been told "no ADSI" then enforce it */
@@ -6403,6 +7988,7 @@ static struct ast_channel *dahdi_new(struct dahdi_pvt *i, int state, int startpb
 			ast_log(LOG_WARNING, "Unable to start PBX on %s\n", tmp->name);
 			ast_hangup(tmp);
 			i->owner = NULL;
+			monitor_touch(i);
 			return NULL;
 		}
 	}
@@ -6471,6 +8057,21 @@ static void dahdi_dnd(struct dahdi_pvt *dahdichan, int on)
 			on? "enabled" : "disabled");
 }
 
+/*!
+ * \brief Have the PBX take over \a chan once ss_thread() collected the digits
+ *
+ * A pool worker starts it on a thread of its own, so that the worker is free
+ * for the next call setup again rather than tied up for the whole call.
+ */
+static enum ast_pbx_result ss_thread_pbx(struct ast_channel *chan)
+{
+	int *pooled = ast_threadstorage_get(&ss_pool_thread, sizeof(*pooled));
+
+	if (pooled && *pooled)
+		return ast_pbx_start(chan);
+	return ast_pbx_run(chan);
+}
+
 static void *ss_thread(void *data)
 {
 	struct ast_channel *chan = data;
@@ -6498,9 +8099,7 @@ static void *ss_thread(void *data)
 	int res;
 	int index;
 
-	ast_mutex_lock(&ss_thread_lock);
-	ss_thread_count++;
-	ast_mutex_unlock(&ss_thread_lock);
+	/* ss_thread_count was already bumped by dahdi_ss_thread_start() */
 	/* in the bizarre case where the channel has become a zombie before we
 	   even get started here, abort safely
 	*/
@@ -6560,7 +8159,7 @@ static void *ss_thread(void *data)
 			if (p->dsp) ast_dsp_digitreset(p->dsp);
 			dahdi_enable_ec(p);
 			ast_setstate(chan, AST_STATE_RING);
-			res = ast_pbx_run(chan);
+			res = ss_thread_pbx(chan);
 			if (res) {
 				ast_log(LOG_WARNING, "PBX exited non-zero!\n");
 			}
@@ -6818,7 +8417,7 @@ static void *ss_thread(void *data)
 		if (ast_exists_extension(chan, chan->context, exten, 1, chan->cid.cid_num)) {
 			ast_copy_string(chan->exten, exten, sizeof(chan->exten));
 			if (p->dsp) ast_dsp_digitreset(p->dsp);
-			res = ast_pbx_run(chan);
+			res = ss_thread_pbx(chan);
 			if (res) {
 				ast_log(LOG_WARNING, "PBX exited non-zero\n");
 				res = tone_zone_play_tone(p->subs[index].dfd, DAHDI_TONE_CONGESTION);
@@ -6902,7 +8501,7 @@ static void *ss_thread(void *data)
 						}
 						ast_setstate(chan, AST_STATE_RING);
 						dahdi_enable_ec(p);
-						res = ast_pbx_run(chan);
+						res = ss_thread_pbx(chan);
 						if (res) {
 							ast_log(LOG_WARNING, "PBX exited non-zero\n");
 							res = tone_zone_play_tone(p->subs[index].dfd, DAHDI_TONE_CONGESTION);
@@ -7637,7 +9236,7 @@ static void *ss_thread(void *data)
 		ast_setstate(chan, AST_STATE_RING);
 		chan->rings = 1;
 		p->ringt = p->ringt_base;
-		res = ast_pbx_run(chan);
+		res = ss_thread_pbx(chan);
 		if (res) {
 			ast_hangup(chan);
 			ast_log(LOG_WARNING, "PBX exited non-zero\n");
@@ -7661,31 +9260,184 @@ quit:
 	return NULL;
 }
 
+static void ss_thread_done(void)
+{
+	ast_mutex_lock(&ss_thread_lock);
+	ss_thread_count--;
+	ast_cond_signal(&ss_thread_complete);
+	ast_mutex_unlock(&ss_thread_lock);
+}
+
+static void *ss_pool_worker(void *data)
+{
+	struct ast_channel *chan;
+	struct timeval queued_at;
+	int *pooled;
+
+	if ((pooled = ast_threadstorage_get(&ss_pool_thread, sizeof(*pooled))))
+		*pooled = 1;
+
+	ast_mutex_lock(&ss_pool.lock);
+	for (;;) {
+		/* Idle workers beyond a size made smaller on reload exit right away */
+		while (!ss_pool.queued && !ss_pool.stop && ss_pool.workers <= ss_pool.size) {
+			ss_pool.idle++;
+			ast_cond_wait(&ss_pool.cond, &ss_pool.lock);
+			ss_pool.idle--;
+		}
+		if (!ss_pool.queued)
+			break;
+		chan = ss_pool.jobs[ss_pool.head];
+		queued_at = ss_pool.queued_at[ss_pool.head];
+		ss_pool.head = (ss_pool.head + 1) % SS_POOL_MAX_QUEUE;
+		ss_pool.queued--;
+		if (ss_pool.timeout && ast_tvdiff_ms(ast_tvnow(), queued_at) > ss_pool.timeout) {
+			ss_pool.expired++;
+			ast_mutex_unlock(&ss_pool.lock);
+			ast_log(LOG_WARNING, "Simple switch not started on %s within %d ms, hanging up\n", chan->name, ss_pool.timeout);
+			chan->hangupcause = AST_CAUSE_SWITCH_CONGESTION;
+			ast_hangup(chan);
+			ss_thread_done();
+			ast_mutex_lock(&ss_pool.lock);
+			continue;
+		}
+		ast_mutex_unlock(&ss_pool.lock);
+
+		ss_thread(chan);
+
+		ast_mutex_lock(&ss_pool.lock);
+	}
+	ss_pool.workers--;
+	ast_cond_broadcast(&ss_pool.cond);
+	ast_mutex_unlock(&ss_pool.lock);
+	return NULL;
+}
+
+/*! \brief Start the simple switch on a freshly created channel.
+ *
+ * Hands the channel to a parked pool worker, spawns a new worker while the pool
+ * is below its configured size, or queues the call setup until a worker frees up.
+ * With the pool disabled a detached thread is created per call, as before.
+ *
+ * \retval 0 on success.
+ * \retval -1 if the simple switch could not be started; the caller still owns \a chan.
+ */
+static int dahdi_ss_thread_start(struct ast_channel *chan)
+{
+	pthread_t threadid;
+	int res = 0;
+
+	ast_mutex_lock(&ss_thread_lock);
+	ss_thread_count++;
+	ast_mutex_unlock(&ss_thread_lock);
+
+	ast_mutex_lock(&ss_pool.lock);
+	if (!ss_pool.size || ss_pool.stop) {
+		ast_mutex_unlock(&ss_pool.lock);
+		if (ast_pthread_create_detached(&threadid, NULL, ss_thread, chan)) {
+			ss_thread_done();
+			return -1;
+		}
+		return 0;
+	}
+	if (ss_pool.queued >= ss_pool.depth || ss_pool.queued >= SS_POOL_MAX_QUEUE) {
+		ss_pool.rejected++;
+		ast_mutex_unlock(&ss_pool.lock);
+		ast_log(LOG_WARNING, "Simple switch queue full (%d waiting), rejecting %s\n", ss_pool.depth, chan->name);
+		ss_thread_done();
+		return -1;
+	}
+	ss_pool.jobs[(ss_pool.head + ss_pool.queued) % SS_POOL_MAX_QUEUE] = chan;
+	ss_pool.queued_at[(ss_pool.head + ss_pool.queued) % SS_POOL_MAX_QUEUE] = ast_tvnow();
+	ss_pool.queued++;
+	if (ss_pool.queued > ss_pool.peak_queued)
+		ss_pool.peak_queued = ss_pool.queued;
+	ss_pool.dispatched++;
+	if (ss_pool.idle < ss_pool.queued && ss_pool.workers < ss_pool.size) {
+		if (ast_pthread_create_detached(&threadid, NULL, ss_pool_worker, NULL)) {
+			ast_log(LOG_WARNING, "Unable to grow simple switch pool: %s\n", strerror(errno));
+			if (!ss_pool.workers) {
+				/* Nobody would ever pick it up */
+				ss_pool.queued--;
+				ss_pool.dispatched--;
+				res = -1;
+			}
+		} else {
+			ss_pool.workers++;
+			ss_pool.spawned++;
+		}
+	}
+	if (!res)
+		ast_cond_signal(&ss_pool.cond);
+	ast_mutex_unlock(&ss_pool.lock);
+	if (res)
+		ss_thread_done();
+	return res;
+}
+
+/*! \brief Tell the parked pool workers to exit and wait for them */
+static void ss_pool_shutdown(void)
+{
+	ast_mutex_lock(&ss_pool.lock);
+	ss_pool.stop = 1;
+	ast_cond_broadcast(&ss_pool.cond);
+	while (ss_pool.workers)
+		ast_cond_wait(&ss_pool.cond, &ss_pool.lock);
+	ast_mutex_unlock(&ss_pool.lock);
+}
+
 struct mwi_thread_data {
 	struct dahdi_pvt *pvt;
 	unsigned char buf[READ_SIZE];
 	size_t len;
 };
 
+/*! \brief Magnitude of every ulaw and alaw code, filled once by energy_tables_init() */
+static unsigned short ulaw_energy[256];
+static unsigned short alaw_energy[256];
+
+static void energy_tables_init(void)
+{
+	int x;
+
+	for (x = 0; x < 256; x++) {
+		ulaw_energy[x] = abs(AST_MULAW(x));
+		alaw_energy[x] = abs(AST_ALAW(x));
+	}
+}
+
+/*! \brief Average magnitude of a buffer of ulaw or alaw samples
+ *
+ * The monitor runs this on every buffer read from every idle FXO line
+ * watching for FSK MWI.  The law is resolved once per buffer, each sample
+ * is a single lookup, and four independent sums keep the loop from
+ * waiting on one accumulator.
+ */
 static int calc_energy(const unsigned char *buf, int len, int law)
 {
+	const unsigned short *energy = (law == AST_FORMAT_ULAW) ? ulaw_energy : alaw_energy;
+	unsigned int s0 = 0, s1 = 0, s2 = 0, s3 = 0;
 	int x;
-	int sum = 0;
 
 	if (!len)
 		return 0;
 
-	for (x = 0; x < len; x++)
-		sum += abs(law == AST_FORMAT_ULAW ? AST_MULAW(buf[x]) : AST_ALAW(buf[x]));
+	for (x = 0; x + 4 <= len; x += 4) {
+		s0 += energy[buf[x]];
+		s1 += energy[buf[x + 1]];
+		s2 += energy[buf[x + 2]];
+		s3 += energy[buf[x + 3]];
+	}
+	for (; x < len; x++)
+		s0 += energy[buf[x]];
 
-	return sum / len;
+	return (s0 + s1 + s2 + s3) / len;
 }
 
 static void *mwi_thread(void *data)
 {
 	struct mwi_thread_data *mtd = data;
 	struct callerid_state *cs;
-	pthread_t threadid;
 	int samples = 0;
 	char *name, *number;
 	int flags;
@@ -7695,6 +9447,7 @@ static void *mwi_thread(void *data)
 
 	if (!(cs = callerid_new(mtd->pvt->cid_signalling))) {
 		mtd->pvt->mwimonitoractive = 0;
+		monitor_touch(mtd->pvt);
 
 		return NULL;
 	}
@@ -7743,7 +9496,7 @@ static void *mwi_thread(void *data)
 				mtd->pvt->ringt = mtd->pvt->ringt_base;
 
 				if ((chan = dahdi_new(mtd->pvt, AST_STATE_RING, 0, SUB_REAL, 0, 0))) {
-					if (ast_pthread_create_detached(&threadid, NULL, ss_thread, chan)) {
+					if (dahdi_ss_thread_start(chan)) {
 						ast_log(LOG_WARNING, "Unable to start simple switch thread on channel %d\n", mtd->pvt->channel);
 						res = tone_zone_play_tone(mtd->pvt->subs[SUB_REAL].dfd, DAHDI_TONE_CONGESTION);
 						if (res < 0)
@@ -7806,6 +9559,7 @@ quit:
 
 quit_no_clean:
 	mtd->pvt->mwimonitoractive = 0;
+	monitor_touch(mtd->pvt);
 
 	ast_free(mtd);
 
@@ -7836,7 +9590,6 @@ static int dahdi_destroy_channel_bynum(int channel)
 static int handle_init_event(struct dahdi_pvt *i, int event)
 {
 	int res;
-	pthread_t threadid;
 	struct ast_channel *chan;
 
 	/* Handle an event on a given channel for the monitor thread. */
@@ -7883,7 +9636,7 @@ static int handle_init_event(struct dahdi_pvt *i, int event)
 						res = tone_zone_play_tone(i->subs[SUB_REAL].dfd, DAHDI_TONE_DIALTONE);
 					if (res < 0)
 						ast_log(LOG_WARNING, "Unable to play dialtone on channel %d, do you have defaultzone and loadzone defined?\n", i->channel);
-					if (ast_pthread_create_detached(&threadid, NULL, ss_thread, chan)) {
+					if (dahdi_ss_thread_start(chan)) {
 						ast_log(LOG_WARNING, "Unable to start simple switch thread on channel %d\n", i->channel);
 						res = tone_zone_play_tone(i->subs[SUB_REAL].dfd, DAHDI_TONE_CONGESTION);
 						if (res < 0)
@@ -7920,7 +9673,7 @@ static int handle_init_event(struct dahdi_pvt *i, int event)
 				} else {
 					chan = dahdi_new(i, AST_STATE_RING, 0, SUB_REAL, 0, 0);
 				}
-				if (chan && ast_pthread_create_detached(&threadid, NULL, ss_thread, chan)) {
+				if (chan && dahdi_ss_thread_start(chan)) {
 					ast_log(LOG_WARNING, "Unable to start simple switch thread on channel %d\n", i->channel);
 					res = tone_zone_play_tone(i->subs[SUB_REAL].dfd, DAHDI_TONE_CONGESTION);
 					if (res < 0)
@@ -8020,7 +9773,7 @@ static int handle_init_event(struct dahdi_pvt *i, int event)
 					    "CID detection on channel %d\n",
 					    i->channel);
 				chan = dahdi_new(i, AST_STATE_PRERING, 0, SUB_REAL, 0, 0);
-				if (chan && ast_pthread_create_detached(&threadid, NULL, ss_thread, chan)) {
+				if (chan && dahdi_ss_thread_start(chan)) {
 					ast_log(LOG_WARNING, "Unable to start simple switch thread on channel %d\n", i->channel);
 				}
 			}
@@ -8053,221 +9806,376 @@ static int handle_init_event(struct dahdi_pvt *i, int event)
 	return 0;
 }
 
-static void *do_monitor(void *data)
+#define MONITOR_MAX_EVENTS	64	/*!< Ready channels do_monitor() takes from epoll per wakeup */
+
+/*!
+ * \brief Bring the epoll registration of one channel in line with its state
+ *
+ * Every dahdi_pvt that has no owner is watched for events, and for input too
+ * while sending or listening for VMWI.  Radio channels are counted instead,
+ * they have to be polled for events.  Called with iflock read locked, only
+ * from the monitor thread.
+ */
+static void monitor_sync_pvt(int epfd, struct dahdi_pvt *i)
 {
-	int count, res, res2, spoint, pollres=0;
-	struct dahdi_pvt *i;
-	struct dahdi_pvt *last = NULL;
-	time_t thispass = 0, lastpass = 0;
-	int found;
-	char buf[1024];
-	struct pollfd *pfds=NULL;
-	int lastalloc = -1;
-	/* This thread monitors all the frame relay interfaces which are not yet in use
-	   (and thus do not have a separate thread) indefinitely */
-	/* From here on out, we die whenever asked */
-#if 0
-	if (pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL)) {
-		ast_log(LOG_WARNING, "Unable to set cancel type to asynchronous\n");
-		return NULL;
+	struct epoll_event ev;
+	int want = 0, radio = 0, op;
+
+	if ((i->subs[SUB_REAL].dfd > -1) && i->sig) {
+		if (i->radio) {
+			radio = 1;
+		} else if (!i->owner && !i->subs[SUB_REAL].owner && !i->mwimonitoractive) {
+			/* This needs to be watched, as it lacks an owner */
+			want = EPOLLPRI;
+			/* If we are monitoring for VMWI or sending CID, we need to
+			   read from the channel as well */
+			if (i->cidspill || i->mwimonitor_fsk)
+				want |= EPOLLIN;
+		}
+	}
+	if (radio != i->monitor_radio) {
+		i->monitor_radio = radio;
+		ast_atomic_fetchadd_int(&monitor_radios, radio ? 1 : -1);
+	}
+	if (want == i->monitor_events)
+		return;
+	if (i->subs[SUB_REAL].dfd < 0) {
+		/* Closing the fd already took it out of the set */
+		i->monitor_events = 0;
+		return;
 	}
-	ast_debug(1, "Monitor starting...\n");
-#endif
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = want;
+	ev.data.ptr = i;
+	if (!want)
+		op = EPOLL_CTL_DEL;
+	else if (!i->monitor_events)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+	if (epoll_ctl(epfd, op, i->subs[SUB_REAL].dfd, &ev)) {
+		/* The fd may have been closed and reopened behind our back */
+		if (op == EPOLL_CTL_ADD && errno == EEXIST)
+			op = EPOLL_CTL_MOD;
+		else if (op == EPOLL_CTL_MOD && errno == ENOENT)
+			op = EPOLL_CTL_ADD;
+		else if (op == EPOLL_CTL_DEL && errno == ENOENT)
+			want = 0;
+		else
+			op = -1;
+		if (op == -1 || (want && epoll_ctl(epfd, op, i->subs[SUB_REAL].dfd, &ev))) {
+			ast_log(LOG_WARNING, "Unable to watch channel %d for events: %s\n", i->channel, strerror(errno));
+			want = 0;
+		}
+	}
+	i->monitor_events = want;
+}
+
+/*!
+ * \brief Update the registration of every channel monitor_touch() queued
+ * \note Called with iflock read locked, only from the monitor thread
+ */
+static void monitor_sync(int epfd)
+{
+	struct dahdi_pvt *i;
+	char buf[16];
 
 	for (;;) {
-		/* Lock the interface list */
-		ast_mutex_lock(&iflock);
-		if (!pfds || (lastalloc != ifcount)) {
-			if (pfds) {
-				ast_free(pfds);
-				pfds = NULL;
-			}
-			if (ifcount) {
-				if (!(pfds = ast_calloc(1, ifcount * sizeof(*pfds)))) {
-					ast_mutex_unlock(&iflock);
-					return NULL;
-				}
-			}
-			lastalloc = ifcount;
+		ast_mutex_lock(&monitor_queue.lock);
+		if ((i = monitor_queue.head)) {
+			monitor_queue.head = i->monitor_next;
+			i->monitor_queued = 0;
+		} else {
+			/* Empty again, so the next monitor_touch() has to wake us */
+			while (read(monitor_queue.pipe[0], buf, sizeof(buf)) > 0);
 		}
-		/* Build the stuff we're going to poll on, that is the socket of every
-		   dahdi_pvt that does not have an associated owner channel */
-		count = 0;
-		i = iflist;
-		while (i) {
-			if ((i->subs[SUB_REAL].dfd > -1) && i->sig && (!i->radio)) {
-				if (!i->owner && !i->subs[SUB_REAL].owner && !i->mwimonitoractive) {
-					/* This needs to be watched, as it lacks an owner */
-					pfds[count].fd = i->subs[SUB_REAL].dfd;
-					pfds[count].events = POLLPRI;
-					pfds[count].revents = 0;
-					/* If we are monitoring for VMWI or sending CID, we need to
-					   read from the channel as well */
-					if (i->cidspill || i->mwimonitor_fsk)
-						pfds[count].events |= POLLIN;
-					count++;
-				}
+		ast_mutex_unlock(&monitor_queue.lock);
+		if (!i)
+			break;
+		monitor_sync_pvt(epfd, i);
+	}
+}
+
+/*! \brief Create the pipe monitor_touch() wakes the monitor with and add it to \a epfd */
+static int monitor_wake_open(int epfd)
+{
+	struct epoll_event ev;
+	int x, res = 0;
+
+	ast_mutex_lock(&monitor_queue.lock);
+	if (pipe(monitor_queue.pipe)) {
+		ast_log(LOG_ERROR, "Unable to create the monitor's wakeup pipe: %s\n", strerror(errno));
+		monitor_queue.pipe[0] = monitor_queue.pipe[1] = -1;
+		ast_mutex_unlock(&monitor_queue.lock);
+		return -1;
+	}
+	for (x = 0; x < 2; x++)
+		fcntl(monitor_queue.pipe[x], F_SETFL, fcntl(monitor_queue.pipe[x], F_GETFL) | O_NONBLOCK);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, monitor_queue.pipe[0], &ev)) {
+		ast_log(LOG_ERROR, "Unable to watch the monitor's wakeup pipe: %s\n", strerror(errno));
+		res = -1;
+	}
+	ast_mutex_unlock(&monitor_queue.lock);
+	return res;
+}
+
+/*! \brief Start a VMWI spill on an idle FXO channel if its message state changed */
+static int monitor_vmwi(struct dahdi_pvt *last, time_t thispass)
+{
+	int res, res2, x;
+
+	if (!last->cidspill && !last->owner && !ast_strlen_zero(last->mailbox) && (thispass - last->onhooktime > 3) &&
+		(last->sig & __DAHDI_SIG_FXO)) {
+		res = has_voicemail(last);
+		if (last->msgstate != res) {
+			ast_debug(1, "Message status for %s changed from %d to %d on %d\n", last->mailbox, last->msgstate, res, last->channel);
+			res2 = ioctl(last->subs[SUB_REAL].dfd, DAHDI_VMWI, &res);
+			if (res2)
+				ast_log(LOG_DEBUG, "Unable to control message waiting led on channel %d: %s\n", last->channel, strerror(errno));
+			x = DAHDI_FLUSH_BOTH;
+			res2 = ioctl(last->subs[SUB_REAL].dfd, DAHDI_FLUSH, &x);
+			if (res2)
+				ast_log(LOG_WARNING, "Unable to flush input on channel %d\n", last->channel);
+			if ((last->cidspill = ast_calloc(1, MAX_CALLERID_SIZE))) {
+				/* Turn on on hook transfer for 4 seconds */
+				x = 4000;
+				ioctl(last->subs[SUB_REAL].dfd, DAHDI_ONHOOKTRANSFER, &x);
+				last->cidlen = vmwi_generate(last->cidspill, res, 1, AST_LAW(last));
+				last->cidpos = 0;
+				last->msgstate = res;
+				last->onhooktime = thispass;
 			}
-			i = i->next;
+			return 1;
 		}
-		/* Okay, now that we know what to do, release the interface lock */
-		ast_mutex_unlock(&iflock);
+	}
+	return 0;
+}
 
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-		pthread_testcancel();
-		/* Wait at least a second for something to happen */
-		res = poll(pfds, count, 1000);
-		pthread_testcancel();
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+/*!
+ * \brief Handle poll events on an idle channel
+ * \note Called with iflock read locked, it is dropped around handle_init_event()
+ * \retval 1 the events this channel has to be watched for may have changed
+ */
+static int monitor_handle_channel(struct dahdi_pvt *i, int revents)
+{
+	char buf[1024];
+	int res, res2;
+	int changed = 0;
 
-		/* Okay, poll has finished.  Let's see what happened.  */
-		if (res < 0) {
-			if ((errno != EAGAIN) && (errno != EINTR))
-				ast_log(LOG_WARNING, "poll return %d: %s\n", res, strerror(errno));
-			continue;
+	if (revents & POLLIN) {
+		if (i->owner || i->subs[SUB_REAL].owner) {
+#ifdef HAVE_PRI
+			if (!i->pri)
+#endif
+				ast_log(LOG_WARNING, "Whoa....  I'm owned but found (%d) in read...\n", i->subs[SUB_REAL].dfd);
+			return 1;
 		}
-		/* Alright, lock the interface list again, and let's look and see what has
-		   happened */
-		ast_mutex_lock(&iflock);
-		found = 0;
-		spoint = 0;
-		lastpass = thispass;
-		thispass = time(NULL);
-		i = iflist;
-		while (i) {
-			if (thispass != lastpass) {
-				if (!found && ((i == last) || ((i == iflist) && !last))) {
-					last = i;
-					if (last) {
-						if (!last->cidspill && !last->owner && !ast_strlen_zero(last->mailbox) && (thispass - last->onhooktime > 3) &&
-							(last->sig & __DAHDI_SIG_FXO)) {
-							res = has_voicemail(last);
-							if (last->msgstate != res) {
-								int x;
-								ast_debug(1, "Message status for %s changed from %d to %d on %d\n", last->mailbox, last->msgstate, res, last->channel);
-								res2 = ioctl(last->subs[SUB_REAL].dfd, DAHDI_VMWI, &res);
-								if (res2)
-									ast_log(LOG_DEBUG, "Unable to control message waiting led on channel %d: %s\n", last->channel, strerror(errno));
-								x = DAHDI_FLUSH_BOTH;
-								res2 = ioctl(last->subs[SUB_REAL].dfd, DAHDI_FLUSH, &x);
-								if (res2)
-									ast_log(LOG_WARNING, "Unable to flush input on channel %d\n", last->channel);
-								if ((last->cidspill = ast_calloc(1, MAX_CALLERID_SIZE))) {
-									/* Turn on on hook transfer for 4 seconds */
-									x = 4000;
-									ioctl(last->subs[SUB_REAL].dfd, DAHDI_ONHOOKTRANSFER, &x);
-									last->cidlen = vmwi_generate(last->cidspill, res, 1, AST_LAW(last));
-									last->cidpos = 0;
-									last->msgstate = res;
-									last->onhooktime = thispass;
-								}
-								found ++;
-							}
+		if (!i->cidspill && !i->mwimonitor_fsk) {
+			ast_log(LOG_WARNING, "Whoa....  I'm reading but have no cidspill (%d)...\n", i->subs[SUB_REAL].dfd);
+			return 1;
+		}
+		res = read(i->subs[SUB_REAL].dfd, buf, sizeof(buf));
+		if (res > 0) {
+			if (i->mwimonitor_fsk) {
+				if (calc_energy((unsigned char *) buf, res, AST_LAW(i)) > mwilevel) {
+					pthread_attr_t attr;
+					pthread_t threadid;
+					struct mwi_thread_data *mtd;
+
+					pthread_attr_init(&attr);
+					pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+					ast_log(LOG_DEBUG, "Maybe some MWI on port %d!\n", i->channel);
+					if ((mtd = ast_calloc(1, sizeof(*mtd)))) {
+						mtd->pvt = i;
+						memcpy(mtd->buf, buf, res);
+						mtd->len = res;
+						if (ast_pthread_create_background(&threadid, &attr, mwi_thread, mtd)) {
+							ast_log(LOG_WARNING, "Unable to start mwi thread on channel %d\n", i->channel);
+							ast_free(mtd);
 						}
-						last = last->next;
+						i->mwimonitoractive = 1;
+						changed = 1;
 					}
 				}
-			}
-			if ((i->subs[SUB_REAL].dfd > -1) && i->sig) {
-				if (i->radio && !i->owner)
-				{
-					res = dahdi_get_event(i->subs[SUB_REAL].dfd);
-					if (res)
-					{
-						ast_debug(1, "Monitor doohicky got event %s on radio channel %d\n", event2str(res), i->channel);
-						/* Don't hold iflock while handling init events */
-						ast_mutex_unlock(&iflock);
-						handle_init_event(i, res);
-						ast_mutex_lock(&iflock);
+			} else if (i->cidspill) {
+				/* We read some number of bytes.  Write an equal amount of data */
+				if (res > i->cidlen - i->cidpos)
+					res = i->cidlen - i->cidpos;
+				res2 = write(i->subs[SUB_REAL].dfd, i->cidspill + i->cidpos, res);
+				if (res2 > 0) {
+					i->cidpos += res2;
+					if (i->cidpos >= i->cidlen) {
+						free(i->cidspill);
+						i->cidspill = 0;
+						i->cidpos = 0;
+						i->cidlen = 0;
+						changed = 1;
 					}
-					i = i->next;
-					continue;
+				} else {
+					ast_log(LOG_WARNING, "Write failed: %s\n", strerror(errno));
+					i->msgstate = -1;
 				}
-				pollres = ast_fdisset(pfds, i->subs[SUB_REAL].dfd, count, &spoint);
-				if (pollres & POLLIN) {
-					if (i->owner || i->subs[SUB_REAL].owner) {
+			}
+		} else {
+			ast_log(LOG_WARNING, "Read failed with %d: %s\n", res, strerror(errno));
+		}
+	}
+	if (revents & POLLPRI) {
+		if (i->owner || i->subs[SUB_REAL].owner) {
 #ifdef HAVE_PRI
-						if (!i->pri)
+			if (!i->pri)
 #endif
-							ast_log(LOG_WARNING, "Whoa....  I'm owned but found (%d) in read...\n", i->subs[SUB_REAL].dfd);
-						i = i->next;
-						continue;
-					}
-					if (!i->cidspill && !i->mwimonitor_fsk) {
-						ast_log(LOG_WARNING, "Whoa....  I'm reading but have no cidspill (%d)...\n", i->subs[SUB_REAL].dfd);
-						i = i->next;
-						continue;
-					}
-					res = read(i->subs[SUB_REAL].dfd, buf, sizeof(buf));
-					if (res > 0) {
-						if (i->mwimonitor_fsk) {
-							if (calc_energy((unsigned char *) buf, res, AST_LAW(i)) > mwilevel) {
-								pthread_attr_t attr;
-								pthread_t threadid;
-								struct mwi_thread_data *mtd;
-
-								pthread_attr_init(&attr);
-								pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
-								ast_log(LOG_DEBUG, "Maybe some MWI on port %d!\n", i->channel);
-								if ((mtd = ast_calloc(1, sizeof(*mtd)))) {
-									mtd->pvt = i;
-									memcpy(mtd->buf, buf, res);
-									mtd->len = res;
-									if (ast_pthread_create_background(&threadid, &attr, mwi_thread, mtd)) {
-										ast_log(LOG_WARNING, "Unable to start mwi thread on channel %d\n", i->channel);
-										ast_free(mtd);
-									}
-									i->mwimonitoractive = 1;
-								}
-							}
-						} else if (i->cidspill) {
-							/* We read some number of bytes.  Write an equal amount of data */
-							if (res > i->cidlen - i->cidpos)
-								res = i->cidlen - i->cidpos;
-							res2 = write(i->subs[SUB_REAL].dfd, i->cidspill + i->cidpos, res);
-							if (res2 > 0) {
-								i->cidpos += res2;
-								if (i->cidpos >= i->cidlen) {
-									free(i->cidspill);
-									i->cidspill = 0;
-									i->cidpos = 0;
-									i->cidlen = 0;
-								}
-							} else {
-								ast_log(LOG_WARNING, "Write failed: %s\n", strerror(errno));
-								i->msgstate = -1;
-							}
-						}
-					} else {
-						ast_log(LOG_WARNING, "Read failed with %d: %s\n", res, strerror(errno));
-					}
-				}
-				if (pollres & POLLPRI) {
-					if (i->owner || i->subs[SUB_REAL].owner) {
-#ifdef HAVE_PRI
-						if (!i->pri)
+				ast_log(LOG_WARNING, "Whoa....  I'm owned but found (%d)...\n", i->subs[SUB_REAL].dfd);
+			return 1;
+		}
+		res = dahdi_get_event(i->subs[SUB_REAL].dfd);
+		ast_debug(1, "Monitor doohicky got event %s on channel %d\n", event2str(res), i->channel);
+		/* Don't hold iflock while handling init events */
+		ast_rwlock_unlock(&iflock);
+		handle_init_event(i, res);
+		iflock_rdlock();
+		changed = 1;
+	}
+	return changed;
+}
+
+static void monitor_cleanup(void *data)
+{
+	close(*(int *) data);
+	ast_mutex_lock(&monitor_queue.lock);
+	if (monitor_queue.pipe[0] > -1) {
+		close(monitor_queue.pipe[0]);
+		close(monitor_queue.pipe[1]);
+		monitor_queue.pipe[0] = monitor_queue.pipe[1] = -1;
+	}
+	ast_mutex_unlock(&monitor_queue.lock);
+}
+
+static void *do_monitor(void *data)
+{
+	int res, n, revents, gen, changed;
+	int epfd;
+	struct dahdi_pvt *i;
+	struct dahdi_pvt *last = NULL;
+	time_t thispass = 0, lastpass = 0;
+	struct epoll_event events[MONITOR_MAX_EVENTS];
+	/* This thread monitors all the frame relay interfaces which are not yet in use
+	   (and thus do not have a separate thread) indefinitely */
+	/* From here on out, we die whenever asked */
+#if 0
+	if (pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL)) {
+		ast_log(LOG_WARNING, "Unable to set cancel type to asynchronous\n");
+		return NULL;
+	}
+	ast_debug(1, "Monitor starting...\n");
 #endif
-							ast_log(LOG_WARNING, "Whoa....  I'm owned but found (%d)...\n", i->subs[SUB_REAL].dfd);
-						i = i->next;
-						continue;
-					}
-					res = dahdi_get_event(i->subs[SUB_REAL].dfd);
-					ast_debug(1, "Monitor doohicky got event %s on channel %d\n", event2str(res), i->channel);
-					/* Don't hold iflock while handling init events */
-					ast_mutex_unlock(&iflock);
-					handle_init_event(i, res);
-					ast_mutex_lock(&iflock);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	dahdi_thread_place("DAHDI monitor thread", &monitor_placement);
+
+	if ((epfd = epoll_create(MONITOR_MAX_EVENTS)) < 0) {
+		ast_log(LOG_ERROR, "Unable to create the monitor's epoll set: %s\n", strerror(errno));
+		return NULL;
+	}
+	pthread_cleanup_push(monitor_cleanup, &epfd);
+	if (monitor_wake_open(epfd)) {
+		pthread_exit(NULL);
+	}
+
+	/* A previous monitor registered these with an epoll set that is gone */
+	iflock_rdlock();
+	for (i = iflist; i; i = i->next) {
+		i->monitor_events = 0;
+		if (i->monitor_radio) {
+			i->monitor_radio = 0;
+			ast_atomic_fetchadd_int(&monitor_radios, -1);
+		}
+		monitor_touch(i);
+	}
+	gen = monitor_generation;
+	ast_rwlock_unlock(&iflock);
+
+	for (;;) {
+		/* Lock the interface list */
+		iflock_rdlock();
+		/* A dahdi_pvt was freed while we were not looking, it may have been last */
+		if (gen != monitor_generation)
+			last = NULL;
+		lastpass = thispass;
+		thispass = time(NULL);
+		if (thispass != lastpass) {
+			/* Once a second, look for a mailbox whose state changed */
+			for (i = last ? last : iflist; i; i = i->next) {
+				if (monitor_vmwi(i, thispass)) {
+					/* It has a spill to send now */
+					monitor_touch(i);
+					i = i->next;
+					break;
 				}
 			}
-			i=i->next;
+			last = i;
+		}
+		monitor_sync(epfd);
+		gen = monitor_generation;
+		/* Okay, now that we know what to do, release the interface lock */
+		ast_rwlock_unlock(&iflock);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		pthread_testcancel();
+		/* Wait at least a second for something to happen */
+		res = epoll_wait(epfd, events, ARRAY_LEN(events), 1000);
+		pthread_testcancel();
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		/* Okay, epoll has finished.  Let's see what happened.  */
+		if (res < 0) {
+			if ((errno != EAGAIN) && (errno != EINTR))
+				ast_log(LOG_WARNING, "epoll_wait return %d: %s\n", res, strerror(errno));
+			continue;
+		}
+		/* Alright, lock the interface list again, and let's look and see what has
+		   happened */
+		iflock_rdlock();
+		/* Once a dahdi_pvt went away, the remaining events may point to it */
+		for (n = 0; (n < res) && (gen == monitor_generation); n++) {
+			/* The wakeup pipe, the queue is synced at the top */
+			if (!(i = events[n].data.ptr))
+				continue;
+			revents = 0;
+			if (events[n].events & EPOLLIN)
+				revents |= POLLIN;
+			if (events[n].events & EPOLLPRI)
+				revents |= POLLPRI;
+			changed = monitor_handle_channel(i, revents);
+			/* iflock may have been dropped, so i may be gone */
+			if (changed && (gen == monitor_generation))
+				monitor_touch(i);
+		}
+		for (i = iflist; monitor_radios && i && (gen == monitor_generation); i = i->next) {
+			if (!i->radio || i->owner || !i->sig || (i->subs[SUB_REAL].dfd < 0))
+				continue;
+			res = dahdi_get_event(i->subs[SUB_REAL].dfd);
+			if (res) {
+				ast_debug(1, "Monitor doohicky got event %s on radio channel %d\n", event2str(res), i->channel);
+				/* Don't hold iflock while handling init events */
+				ast_rwlock_unlock(&iflock);
+				handle_init_event(i, res);
+				iflock_rdlock();
+				/* Do not step on to i->next if i was freed meanwhile */
+				if (gen != monitor_generation)
+					break;
+				monitor_touch(i);
+			}
 		}
-		ast_mutex_unlock(&iflock);
+		ast_rwlock_unlock(&iflock);
 	}
 	/* Never reached */
+	pthread_cleanup_pop(1);
 	return NULL;
-
 }
 
 static int restart_monitor(void)
@@ -8442,6 +10350,169 @@ static struct dahdi_ss7 * ss7_resolve_linkset(int linkset)
 	else
 		return &linksets[linkset - 1];
 }
+
+/*!
+ * \brief Build the prefix tables of a linkset from its ss7_*prefix strings
+ *
+ * Every option may list several prefixes, "00,+" say, tried in that order.
+ * The first one of each NAI is what received numbers are given.  An empty
+ * prefix matches any number, as it always has, so nothing after it is kept.
+ */
+static void ss7_compile_prefixes(struct dahdi_ss7 *ss7)
+{
+	const char *conf[SS7_PREFIX_NAIS] = {
+		[SS7_PREFIX_INTERNATIONAL] = ss7->internationalprefix,
+		[SS7_PREFIX_NATIONAL] = ss7->nationalprefix,
+		[SS7_PREFIX_NETWORKROUTED] = ss7->networkroutedprefix,
+		[SS7_PREFIX_UNKNOWN] = ss7->unknownprefix,
+		[SS7_PREFIX_SUBSCRIBER] = ss7->subscriberprefix,
+	};
+	static const char nais[SS7_PREFIX_NAIS] = {
+		[SS7_PREFIX_INTERNATIONAL] = SS7_NAI_INTERNATIONAL,
+		[SS7_PREFIX_NATIONAL] = SS7_NAI_NATIONAL,
+		[SS7_PREFIX_NETWORKROUTED] = SS7_NAI_NETWORKROUTED,
+		[SS7_PREFIX_UNKNOWN] = SS7_NAI_UNKNOWN,
+		[SS7_PREFIX_SUBSCRIBER] = SS7_NAI_SUBSCRIBER,
+	};
+	char list[SS7_PREFIX_CONF], *c, *digits;
+	struct ss7_prefix *pre;
+	int i, first, done = 0;
+
+	ss7->numprefixes = 0;
+	for (i = 0; i < SS7_PREFIX_NAIS; i++) {
+		ast_copy_string(list, conf[i], sizeof(list));
+		c = list;
+		first = 1;
+		while ((digits = strsep(&c, ","))) {
+			digits = ast_strip(digits);
+			/* "0," is the prefix 0, but "" still is the empty prefix */
+			if (ast_strlen_zero(digits) && !first)
+				continue;
+			if (first) {
+				pre = &ss7->plan[i];
+				ast_copy_string(pre->digits, digits, sizeof(pre->digits));
+				pre->len = strlen(pre->digits);
+				pre->nai = nais[i];
+				first = 0;
+			}
+			if (done)
+				continue;
+			if (ss7->numprefixes == SS7_PREFIXES) {
+				ast_log(LOG_WARNING, "Too many SS7 prefixes, ignoring '%s'\n", digits);
+				continue;
+			}
+			pre = &ss7->prefixes[ss7->numprefixes++];
+			ast_copy_string(pre->digits, digits, sizeof(pre->digits));
+			pre->len = strlen(pre->digits);
+			pre->nai = nais[i];
+			if (!pre->len)
+				done = 1;
+		}
+	}
+}
+
+/*! \brief Build the length rules of a linkset from its called_lengths string, longest prefix first */
+static void ss7_compile_lengths(struct dahdi_ss7 *ss7)
+{
+	char list[sizeof(ss7->called_lengths)], *c, *rule, *len;
+	struct ss7_length tmp;
+	int i;
+
+	ss7->numlengths = 0;
+	ast_copy_string(list, ss7->called_lengths, sizeof(list));
+	c = list;
+	while ((rule = strsep(&c, ","))) {
+		rule = ast_strip(rule);
+		if (ast_strlen_zero(rule))
+			continue;
+		if (!(len = strchr(rule, ':')) || (atoi(len + 1) < 1)) {
+			ast_log(LOG_WARNING, "Invalid ss7_called_lengths rule '%s', must be prefix:length\n", rule);
+			continue;
+		}
+		if (ss7->numlengths == SS7_LENGTHS) {
+			ast_log(LOG_WARNING, "Too many ss7_called_lengths rules, ignoring '%s'\n", rule);
+			continue;
+		}
+		*len++ = '\0';
+		ast_copy_string(tmp.prefix, ast_strip(rule), sizeof(tmp.prefix));
+		tmp.plen = strlen(tmp.prefix);
+		tmp.len = atoi(len);
+		/* Keep them sorted so the first one that matches is the most specific */
+		for (i = ss7->numlengths++; (i > 0) && (ss7->lengths[i - 1].plen < tmp.plen); i--)
+			ss7->lengths[i] = ss7->lengths[i - 1];
+		ss7->lengths[i] = tmp;
+	}
+}
+
+/*! \brief Copy the number prefixes and NAIs of a channel configuration to its linkset */
+static void ss7_linkset_conf(struct dahdi_ss7 *ss7, const struct dahdi_chan_conf *conf)
+{
+	ast_copy_string(ss7->internationalprefix, conf->ss7.internationalprefix, sizeof(ss7->internationalprefix));
+	ast_copy_string(ss7->nationalprefix, conf->ss7.nationalprefix, sizeof(ss7->nationalprefix));
+	ast_copy_string(ss7->subscriberprefix, conf->ss7.subscriberprefix, sizeof(ss7->subscriberprefix));
+	ast_copy_string(ss7->unknownprefix, conf->ss7.unknownprefix, sizeof(ss7->unknownprefix));
+	ast_copy_string(ss7->networkroutedprefix, conf->ss7.networkroutedprefix, sizeof(ss7->networkroutedprefix));
+
+	ss7->called_nai = conf->ss7.called_nai;
+	ss7->calling_nai = conf->ss7.calling_nai;
+	ss7_compile_prefixes(ss7);
+
+	ast_copy_string(ss7->called_lengths, conf->ss7.called_lengths, sizeof(ss7->called_lengths));
+	ss7_compile_lengths(ss7);
+	ss7->stdigit = conf->ss7.stdigit;
+
+	if (strcmp(ss7->placement.cpus, conf->ss7.placement.cpus) || (ss7->placement.rtprio != conf->ss7.placement.rtprio)) {
+		ss7->placement = conf->ss7.placement;
+		ss7->place_gen++;
+	}
+}
+
+/*! \brief LINKSET_FLAG_ bit set by a linkset option, 0 if the option is not one */
+static int ss7_linkset_flag(const char *name)
+{
+	if (!strcasecmp(name, "ss7_explicitacm"))
+		return LINKSET_FLAG_EXPLICITACM;
+	if (!strcasecmp(name, "ss7_autoacm"))
+		return LINKSET_FLAG_AUTOACM;
+	if (!strcasecmp(name, "ss7_initialhwblo"))
+		return LINKSET_FLAG_INITIALHWBLO;
+	if (!strcasecmp(name, "ss7_use_echocontrol"))
+		return LINKSET_FLAG_USEECHOCONTROL;
+	if (!strcasecmp(name, "ss7_default_echocontrol"))
+		return LINKSET_FLAG_DEFAULTECHOCONTROL;
+	return 0;
+}
+
+/*! \brief Diff a running SS7 channel against its reloaded configuration
+ *
+ * A changed CIC or DPC is only recorded here, ss7_reload_end() moves the
+ * channel once every channel of the new configuration has been seen.
+ */
+static void ss7_reload_pvt(struct dahdi_pvt *p, const struct dahdi_chan_conf *conf)
+{
+	struct dahdi_ss7 *ss7 = ss7_resolve_linkset(cur_linkset);
+	int cic;
+
+	p->ss7_stale = 0;
+	if (!ss7 || (cur_cicbeginswith < 0)) {
+		ast_log(LOG_WARNING, "No linkset or cicbeginswith for channel %d, keeping CIC %d\n", p->channel, p->cic);
+		return;
+	}
+	cic = cur_cicbeginswith++;
+	if (ss7 != p->ss7) {
+		ast_log(LOG_WARNING, "Moving channel %d to linkset %d needs a dahdi restart, keeping CIC %d\n", p->channel, cur_linkset, p->cic);
+		return;
+	}
+
+	ast_mutex_lock(&ss7->lock);
+	ss7_linkset_conf(ss7, conf);
+	ast_mutex_unlock(&ss7->lock);
+	if ((cic != p->cic) || (cur_defaultdpc != p->dpc)) {
+		p->reload_cic = cic;
+		p->reload_dpc = cur_defaultdpc;
+		p->ss7_pending = 1;
+	}
+}
 #endif /* HAVE_SS7 */
 
 /* converts a DAHDI sigtype to signalling as can be configured from
@@ -8496,7 +10567,8 @@ static struct dahdi_pvt *mkintf(int channel, const struct dahdi_chan_conf *conf,
 		tmp2 = tmp2->next;
 	}
 
-	if (!here && reloading != 1) {
+	/* A reload only adds SS7 channels, to linksets that are already running */
+	if (!here && ((reloading != 1) || (conf->chan.sig == SIG_SS7))) {
 		if (!(tmp = ast_calloc(1, sizeof(*tmp)))) {
 			if (tmp)
 				free(tmp);
@@ -8507,10 +10579,14 @@ static struct dahdi_pvt *mkintf(int channel, const struct dahdi_chan_conf *conf,
 		for (x = 0; x < 3; x++)
 			tmp->subs[x].dfd = -1;
 		tmp->channel = channel;
+		tmp->readsize = READ_SIZE;
 	}
 
 	if (tmp) {
 		int chan_sig = conf->chan.sig;
+		/* Signalling is not reloaded, a channel keeps what it was started with */
+		if (here && (reloading == 1))
+			chan_sig = tmp->sig;
 		if (!here) {
 			if ((channel != CHAN_PSEUDO) && !pri) {
 				int count = 0;
@@ -8562,6 +10638,7 @@ static struct dahdi_pvt *mkintf(int channel, const struct dahdi_chan_conf *conf,
 					destroy_dahdi_pvt(&tmp);
 					return NULL;
 				}
+				tmp->bearerlaw = DAHDI_LAW_DEFAULT;
 
 				ss7 = ss7_resolve_linkset(cur_linkset);
 				if (!ss7) {
@@ -8569,6 +10646,11 @@ static struct dahdi_pvt *mkintf(int channel, const struct dahdi_chan_conf *conf,
 					destroy_dahdi_pvt(&tmp);
 					return NULL;
 				}
+				if ((reloading == 1) && !ss7->ss7) {
+					ast_log(LOG_ERROR, "Linkset %d is not running, new linksets need a dahdi restart\n", cur_linkset);
+					destroy_dahdi_pvt(&tmp);
+					return NULL;
+				}
 				if (cur_cicbeginswith < 0) {
 					ast_log(LOG_ERROR, "Need to set cicbeginswith for the channels!\n");
 					destroy_dahdi_pvt(&tmp);
@@ -8582,16 +10664,20 @@ static struct dahdi_pvt *mkintf(int channel, const struct dahdi_chan_conf *conf,
 
 				tmp->ss7 = ss7;
 				tmp->ss7call = NULL;
-				ss7->pvts[ss7->numchans++] = tmp;
-
-				ast_copy_string(ss7->internationalprefix, conf->ss7.internationalprefix, sizeof(linksets[span-1].internationalprefix));
-				ast_copy_string(ss7->nationalprefix, conf->ss7.nationalprefix, sizeof(linksets[span-1].nationalprefix));
-				ast_copy_string(ss7->subscriberprefix, conf->ss7.subscriberprefix, sizeof(linksets[span-1].subscriberprefix));
-				ast_copy_string(ss7->unknownprefix, conf->ss7.unknownprefix, sizeof(linksets[span-1].unknownprefix));
-				ast_copy_string(ss7->networkroutedprefix, conf->ss7.networkroutedprefix, sizeof(linksets[span-1].networkroutedprefix));
+				if (reloading == 1) {
+					/* Joins the running linkset once the old CICs are out of the way */
+					tmp->reload_cic = tmp->cic;
+					tmp->reload_dpc = tmp->dpc;
+					tmp->ss7_pending = 1;
+				} else if (ss7_add_pvt(ss7, tmp)) {
+					tmp->ss7 = NULL;
+					destroy_dahdi_pvt(&tmp);
+					return NULL;
+				}
 
-				ss7->called_nai = conf->ss7.called_nai;
-				ss7->calling_nai = conf->ss7.calling_nai;
+				ast_mutex_lock(&ss7->lock);
+				ss7_linkset_conf(ss7, conf);
+				ast_mutex_unlock(&ss7->lock);
 			}
 #endif
 #ifdef HAVE_PRI
@@ -8709,6 +10795,7 @@ static struct dahdi_pvt *mkintf(int channel, const struct dahdi_chan_conf *conf,
 						ast_copy_string(pris[span].privateprefix, conf->pri.privateprefix, sizeof(pris[span].privateprefix));
 						ast_copy_string(pris[span].unknownprefix, conf->pri.unknownprefix, sizeof(pris[span].unknownprefix));
 						pris[span].resetinterval = conf->pri.resetinterval;
+						pris[span].placement = conf->pri.placement;
 
 						tmp->pri = &pris[span];
 						tmp->prioffset = offset;
@@ -8794,12 +10881,25 @@ static struct dahdi_pvt *mkintf(int channel, const struct dahdi_chan_conf *conf,
 		}
 #if 1
 		if (!here && (tmp->subs[SUB_REAL].dfd > -1)) {
+#ifdef HAVE_SS7
+			/* The frame size is only changed while the channel is idle, on its first mkintf */
+			if ((chan_sig == SIG_SS7) && (conf->chan.readsize != READ_SIZE)) {
+				x = conf->chan.readsize;
+				if (ioctl(tmp->subs[SUB_REAL].dfd, DAHDI_SET_BLOCKSIZE, &x) == -1)
+					ast_log(LOG_WARNING, "Unable to set blocksize %d on channel %d, keeping %d: %s\n", x, channel, READ_SIZE, strerror(errno));
+				else
+					tmp->readsize = x;
+			}
+#endif
 			memset(&bi, 0, sizeof(bi));
 			res = ioctl(tmp->subs[SUB_REAL].dfd, DAHDI_GET_BUFINFO, &bi);
 			if (!res) {
 				bi.txbufpolicy = conf->chan.buf_policy;
 				bi.rxbufpolicy = conf->chan.buf_policy;
-				bi.numbufs = conf->chan.buf_no;
+				/* Keep the configured buffering in milliseconds when the frames are bigger */
+				bi.numbufs = (conf->chan.buf_no * READ_SIZE) / tmp->readsize;
+				if (bi.numbufs < 1)
+					bi.numbufs = 1;
 				res = ioctl(tmp->subs[SUB_REAL].dfd, DAHDI_SET_BUFINFO, &bi);
 				if (res < 0) {
 					ast_log(LOG_WARNING, "Unable to set buffer policy on channel %d: %s\n", channel, strerror(errno));
@@ -8809,6 +10909,7 @@ static struct dahdi_pvt *mkintf(int channel, const struct dahdi_chan_conf *conf,
 		}
 #endif
 		tmp->immediate = conf->chan.immediate;
+		ast_copy_string(tmp->iocpus, conf->chan.iocpus, sizeof(tmp->iocpus));
 		tmp->transfertobusy = conf->chan.transfertobusy;
 		if (chan_sig & __DAHDI_SIG_FXS) {
 			tmp->mwimonitor_fsk = conf->chan.mwimonitor_fsk;
@@ -8816,7 +10917,7 @@ static struct dahdi_pvt *mkintf(int channel, const struct dahdi_chan_conf *conf,
 		}
 		tmp->sig = chan_sig;
 		tmp->outsigmod = conf->chan.outsigmod;
-		tmp->ringt_base = ringt_base;
+		tmp->ringt_base = (ringt_base * READ_SIZE) / tmp->readsize;
 		tmp->firstradio = 0;
 		if ((chan_sig == SIG_FXOKS) || (chan_sig == SIG_FXOLS) || (chan_sig == SIG_FXOGS))
 			tmp->permcallwaiting = conf->chan.callwaiting;
@@ -8958,16 +11059,21 @@ static struct dahdi_pvt *mkintf(int channel, const struct dahdi_chan_conf *conf,
 		tmp->answeronpolarityswitch = conf->chan.answeronpolarityswitch;
 		tmp->hanguponpolarityswitch = conf->chan.hanguponpolarityswitch;
 		tmp->sendcalleridafter = conf->chan.sendcalleridafter;
+#ifdef HAVE_SS7
+		if (here && (reloading == 1) && (chan_sig == SIG_SS7) && tmp->ss7)
+			ss7_reload_pvt(tmp, conf);
+#endif
 		if (!here) {
-			tmp->locallyblocked = tmp->remotelyblocked = 0;
+			tmp->cicstate = 0;
 			if ((chan_sig == SIG_PRI) || (chan_sig == SIG_BRI) || (chan_sig == SIG_BRI_PTMP) || (chan_sig == SIG_SS7)) {
-				tmp->inservice = 0;
 				if (chan_sig == SIG_SS7 && tmp->ss7->flags & LINKSET_FLAG_INITIALHWBLO)
-					tmp->remotelyblocked |= SS7_BLOCKED_HARDWARE;
+					circuit_set(tmp, CIRCUIT_REMOTE(SS7_BLOCKED_HARDWARE));
 			} else /* We default to in service on protocols that don't have a reset */
-				tmp->inservice = 1;
+				circuit_set(tmp, CIRCUIT_INSERVICE);
 		}
 	}
+	if (tmp)
+		hunt_groups_invalidate();
 	if (tmp && !here) {
 		/* nothing on the iflist */
 		if (!*wlist) {
@@ -9012,6 +11118,8 @@ static struct dahdi_pvt *mkintf(int channel, const struct dahdi_chan_conf *conf,
 			}
 		}
 	}
+	if (tmp)
+		monitor_touch(tmp);
 	return tmp;
 }
 
@@ -9044,7 +11152,7 @@ static inline int available(struct dahdi_pvt *p, int channelmatch, ast_group_t g
 	if (p->guardtime && (time(NULL) < p->guardtime))
 		return 0;
 
-	if (p->locallyblocked || p->remotelyblocked)
+	if (circuit_locally_blocked(p) || circuit_remotely_blocked(p))
 		return 0;
 
 	/* If no owner definitely available */
@@ -9061,7 +11169,7 @@ static inline int available(struct dahdi_pvt *p, int channelmatch, ast_group_t g
 #ifdef HAVE_SS7
 		/* Trust SS7 */
 		if (p->ss7) {
-			if (p->ss7call || !p->inservice)
+			if (p->ss7call || !circuit_inservice(p))
 				return 0;
 			else
 				return 1;
@@ -9137,6 +11245,11 @@ static struct dahdi_pvt *chandup(struct dahdi_pvt *src)
 	if ((p = ast_malloc(sizeof(*p)))) {
 		memcpy(p, src, sizeof(struct dahdi_pvt));
 		ast_mutex_init(&p->lock);
+		p->monitor_events = 0;
+		p->monitor_radio = 0;
+		p->monitor_queued = 0;
+		p->monitor_next = NULL;
+		p->io_placed = 0;
 		p->subs[SUB_REAL].dfd = dahdi_open("/dev/dahdi/pseudo");
 		/* Allocate a dahdi structure */
 		if (p->subs[SUB_REAL].dfd < 0) {
@@ -9214,13 +11327,13 @@ static struct ast_channel *dahdi_request(const char *type, int format, void *dat
 	int trunkgroup;
 	struct dahdi_pri *pri=NULL;
 #endif
-	struct dahdi_pvt *exit, *start, *end;
+	struct dahdi_pvt *exit, *start, *end, *hunted, *seized = NULL;
 	ast_mutex_t *lock;
 	int channelmatched = 0;
 	int groupmatched = 0;
 
 	/* Assume we're locking the iflock */
-	lock = &iflock;
+	lock = NULL;
 	start = iflist;
 	end = ifend;
 	if (data) {
@@ -9299,20 +11412,37 @@ static struct ast_channel *dahdi_request(const char *type, int format, void *dat
 			channelmatch = x;
 		}
 	}
-	/* Search for an unowned channel */
-	ast_mutex_lock(lock);
+	/* Search for an unowned channel.  Requests hunt side by side, only chandup()
+	 * changes the list and needs it to ourselves */
+	iflist_lock(lock, channelmatch == CHAN_PSEUDO);
+	/* The idle bitmap of the group has the final say, even when nobody is idle */
+	if (groupmatch && !hunt_group_find(x, backwards, roundrobin, &hunted, &busy, &groupmatched))
+		p = hunted;
 	exit = p;
 	while (p && !tmp) {
-		if (roundrobin)
+		if (roundrobin) {
+			ast_mutex_lock(&huntlock);
 			round_robin[x] = p;
+			ast_mutex_unlock(&huntlock);
+		}
 #if 0
 		ast_verbose("name = %s, %d, %d, %d\n",p->owner ? p->owner->name : "<none>", p->channel, channelmatch, groupmatch);
 #endif
 
 		if (p && available(p, channelmatch, groupmatch, &busy, &channelmatched, &groupmatched)) {
+			/* Another request may have got there first, it is only ours once
+			 * it is still free under its own lock */
+			ast_mutex_lock(&p->lock);
+			if (!available(p, channelmatch, groupmatch, &busy, &channelmatched, &groupmatched)) {
+				ast_mutex_unlock(&p->lock);
+				goto next;
+			}
 			ast_debug(1, "Using channel %d\n", p->channel);
-			if (p->inalarm)
+			if (p->inalarm) {
+				ast_mutex_unlock(&p->lock);
 				goto next;
+			}
+			seized = p;
 
 			callwait = (p->owner != NULL);
 #ifdef HAVE_PRI
@@ -9357,6 +11487,7 @@ static struct ast_channel *dahdi_request(const char *type, int format, void *dat
 			if (p->bearer) {
 				/* Log owner to bearer channel, too */
 				p->bearer->owner = tmp;
+				monitor_touch(p->bearer);
 			}
 #endif
 			/* Make special notes */
@@ -9398,7 +11529,9 @@ next:
 		if (p == exit)
 			break;
 	}
-	ast_mutex_unlock(lock);
+	if (seized)
+		ast_mutex_unlock(&seized->lock);
+	iflist_unlock(lock);
 	restart_monitor();
 	if (callwait)
 		*cause = AST_CAUSE_BUSY;
@@ -9423,36 +11556,219 @@ static int dahdi_setlaw(int dfd, int law)
 
 #ifdef HAVE_SS7
 
-static int ss7_find_cic(struct dahdi_ss7 *linkset, int cic, unsigned int dpc)
+/*! \brief Asynchronous bearer preparation for SS7 circuits, so the linkset never waits on bearer ioctls */
+static struct {
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	struct dahdi_pvt *head;
+	struct dahdi_pvt *tail;
+	struct dahdi_pvt *current;	/*!< Pvt being worked on outside the lock */
+	pthread_t thread;
+	int running;
+	int stop;
+	int queued;			/*!< Number of pvts from head to tail */
+} ss7_bearer = {
+	.lock = AST_MUTEX_INIT_VALUE,
+	.thread = AST_PTHREADT_NULL,
+};
+
+static inline int ss7_linkset_law(struct dahdi_ss7 *linkset)
 {
-	int i;
-	int winner = -1;
-	for (i = 0; i < linkset->numchans; i++) {
-		if (linkset->pvts[i] && (linkset->pvts[i]->dpc == dpc && linkset->pvts[i]->cic == cic)) {
-			winner = i;
+	return (linkset->type == SS7_ITU) ? DAHDI_LAW_ALAW : DAHDI_LAW_MULAW;
+}
+
+/*! \brief Put the bearer in audio mode with the law of its linkset, with p->lock held */
+static int ss7_bearer_prepare(struct dahdi_pvt *p)
+{
+	int law = 1;
+
+	if (ioctl(p->subs[SUB_REAL].dfd, DAHDI_AUDIOMODE, &law) == -1) {
+		ast_log(LOG_WARNING, "Unable to set audio mode on channel %d to %d: %s\n", p->channel, law, strerror(errno));
+		p->bearerlaw = DAHDI_LAW_DEFAULT;
+		return -1;
+	}
+	law = ss7_linkset_law(p->ss7);
+	if (dahdi_setlaw(p->subs[SUB_REAL].dfd, law) < 0) {
+		ast_log(LOG_WARNING, "Unable to set law on channel %d\n", p->channel);
+		p->bearerlaw = DAHDI_LAW_DEFAULT;
+		return -1;
+	}
+	p->bearerlaw = law;
+	return 0;
+}
+
+/*! \brief Carry out \a jobs on \a p, with p->lock held */
+static void ss7_bearer_run(struct dahdi_pvt *p, int jobs)
+{
+	if ((jobs & SS7_BEARER_PREPARE) && !p->owner && p->bearerlaw != ss7_linkset_law(p->ss7)) {
+		if (!ss7_bearer_prepare(p))
+			ast_atomic_fetchadd_int(&p->ss7->bearers_prepared, 1);
+	}
+	if ((jobs & SS7_BEARER_EC) && p->owner) {
+		dahdi_enable_ec(p);
+		dahdi_train_ec(p);
+	}
+}
+
+static void *ss7_bearer_thread(void *data)
+{
+	struct dahdi_pvt *p;
+	struct timespec ts;
+	struct timeval tv;
+	int jobs, busy = 0;
+
+	ast_mutex_lock(&ss7_bearer.lock);
+	while (!ss7_bearer.stop) {
+		if (!(p = ss7_bearer.head)) {
+			busy = 0;
+			ast_cond_wait(&ss7_bearer.cond, &ss7_bearer.lock);
+			continue;
+		}
+		if (busy >= ss7_bearer.queued) {
+			/* All of them were busy in a row, give their holders a while
+			 * unless more work comes in */
+			busy = 0;
+			tv = ast_tvadd(ast_tvnow(), ast_samp2tv(10, 1000));
+			ts.tv_sec = tv.tv_sec;
+			ts.tv_nsec = tv.tv_usec * 1000;
+			ast_cond_timedwait(&ss7_bearer.cond, &ss7_bearer.lock, &ts);
+			continue;
+		}
+		if (ast_mutex_trylock(&p->lock)) {
+			/* Somebody is busy with it, move on to the others and come back */
+			busy++;
+			if (p != ss7_bearer.tail) {
+				ss7_bearer.head = p->bearer_next;
+				p->bearer_next = NULL;
+				ss7_bearer.tail->bearer_next = p;
+				ss7_bearer.tail = p;
+			}
+			continue;
+		}
+		busy = 0;
+		if (!(ss7_bearer.head = p->bearer_next))
+			ss7_bearer.tail = NULL;
+		ss7_bearer.queued--;
+		p->bearer_next = NULL;
+		jobs = p->bearer_jobs;
+		p->bearer_jobs = 0;
+		ss7_bearer.current = p;
+		ast_mutex_unlock(&ss7_bearer.lock);
+
+		ss7_bearer_run(p, jobs);
+		ast_mutex_unlock(&p->lock);
+
+		ast_mutex_lock(&ss7_bearer.lock);
+		ss7_bearer.current = NULL;
+		ast_cond_broadcast(&ss7_bearer.cond);
+	}
+	ast_mutex_unlock(&ss7_bearer.lock);
+	return NULL;
+}
+
+/*! \brief Hand bearer work for \a p to the bearer thread, with p->lock held.
+ * Without a running bearer thread the work is done right away. */
+static void ss7_queue_bearer(struct dahdi_pvt *p, int jobs)
+{
+	ast_mutex_lock(&ss7_bearer.lock);
+	if (!ss7_bearer.running) {
+		ast_mutex_unlock(&ss7_bearer.lock);
+		ss7_bearer_run(p, jobs);
+		return;
+	}
+	if (!p->bearer_jobs) {
+		if (ss7_bearer.tail)
+			ss7_bearer.tail->bearer_next = p;
+		else
+			ss7_bearer.head = p;
+		ss7_bearer.tail = p;
+		ss7_bearer.queued++;
+		ast_cond_signal(&ss7_bearer.cond);
+	}
+	p->bearer_jobs |= jobs;
+	ast_mutex_unlock(&ss7_bearer.lock);
+}
+
+/*! \brief Make sure the bearer thread holds no reference to \a p before it is freed */
+static void ss7_bearer_forget(struct dahdi_pvt *p)
+{
+	struct dahdi_pvt **cur, *prev = NULL;
+
+	ast_mutex_lock(&ss7_bearer.lock);
+	for (cur = &ss7_bearer.head; *cur; prev = *cur, cur = &(*cur)->bearer_next) {
+		if (*cur == p) {
+			*cur = p->bearer_next;
+			if (ss7_bearer.tail == p)
+				ss7_bearer.tail = prev;
+			ss7_bearer.queued--;
 			break;
 		}
 	}
-	return winner;
+	p->bearer_next = NULL;
+	p->bearer_jobs = 0;
+	while (ss7_bearer.current == p)
+		ast_cond_wait(&ss7_bearer.cond, &ss7_bearer.lock);
+	ast_mutex_unlock(&ss7_bearer.lock);
+}
+
+static int ss7_bearer_start(void)
+{
+	ast_mutex_lock(&ss7_bearer.lock);
+	ss7_bearer.stop = 0;
+	if (ast_pthread_create_background(&ss7_bearer.thread, NULL, ss7_bearer_thread, NULL)) {
+		ast_mutex_unlock(&ss7_bearer.lock);
+		ast_log(LOG_WARNING, "Unable to start SS7 bearer thread, bearers will be set up by the linkset threads\n");
+		return -1;
+	}
+	ss7_bearer.running = 1;
+	ast_mutex_unlock(&ss7_bearer.lock);
+	return 0;
+}
+
+static void ss7_bearer_stop(void)
+{
+	ast_mutex_lock(&ss7_bearer.lock);
+	if (!ss7_bearer.running) {
+		ast_mutex_unlock(&ss7_bearer.lock);
+		return;
+	}
+	ss7_bearer.stop = 1;
+	ss7_bearer.running = 0;
+	ast_cond_broadcast(&ss7_bearer.cond);
+	ast_mutex_unlock(&ss7_bearer.lock);
+	pthread_join(ss7_bearer.thread, NULL);
+	ss7_bearer.thread = AST_PTHREADT_NULL;
+	/* Nobody will run the leftovers */
+	ast_mutex_lock(&ss7_bearer.lock);
+	while (ss7_bearer.head) {
+		struct dahdi_pvt *p = ss7_bearer.head;
+		ss7_bearer.head = p->bearer_next;
+		p->bearer_next = NULL;
+		p->bearer_jobs = 0;
+	}
+	ss7_bearer.tail = NULL;
+	ss7_bearer.queued = 0;
+	ast_mutex_unlock(&ss7_bearer.lock);
 }
 
 static void ss7_check_range(struct dahdi_ss7 *linkset, int startcic, int endcic, unsigned int dpc, unsigned char *state)
 {
-	int cic;
+	int cic, x, last;
 
-	for(cic = startcic; cic <= endcic; cic++)
-		if(state[cic - startcic] && ss7_find_cic(linkset, cic, dpc) == -1)
+	last = ss7_cic_range(linkset, startcic, endcic, dpc, &x) + x;
+	for(cic = startcic; cic <= endcic; cic++) {
+		if (x < last && linkset->pvts[x]->cic == cic)
+			x++;
+		else
 			state[cic - startcic] = 0;
+	}
 }
 
 static int ss7_find_cic_range(struct dahdi_ss7 *linkset, int startcic, int endcic, unsigned int dpc)
 {
-	int x, found = 0;
+	int first;
 
-	for(x = 0; x < linkset->numchans; x++)
-		if (linkset->pvts[x] && (linkset->pvts[x]->dpc == dpc && linkset->pvts[x]->cic >= startcic && linkset->pvts[x]->cic <= endcic))
-			found++;
-	if(found == endcic - startcic + 1)
+	if(ss7_cic_range(linkset, startcic, endcic, dpc, &first) == endcic - startcic + 1)
 		return  1;
 	else
 		return 0;
@@ -9462,25 +11778,24 @@ static void ss7_handle_cqm(struct dahdi_ss7 *linkset, int startcic, int endcic,
 {
 	unsigned char status[32];
 	struct dahdi_pvt *p = NULL;
-	int i, offset;
-
-	for (i = 0; i < linkset->numchans; i++) {
-		if (linkset->pvts[i] && (linkset->pvts[i]->dpc == dpc && ((linkset->pvts[i]->cic >= startcic) && (linkset->pvts[i]->cic <= endcic)))) {
-			p = linkset->pvts[i];
-			offset = p->cic - startcic;
-			status[offset] = 0;
-			if (p->locallyblocked)
-				status[offset] |= (1 << 0) | (1 << 4);
-			if (p->remotelyblocked)
-				status[offset] |= (1 << 1) | (1 << 5);
-			if (p->ss7call) {
-				if (p->outgoing)
-					status[offset] |= (1 << 3);
-				else
-					status[offset] |= (1 << 2);
-			} else
-				status[offset] |= 0x3 << 2;
-		}
+	int i, offset, first, last;
+
+	last = ss7_cic_range(linkset, startcic, endcic, dpc, &first) + first;
+	for (i = first; i < last; i++) {
+		p = linkset->pvts[i];
+		offset = p->cic - startcic;
+		status[offset] = 0;
+		if (circuit_locally_blocked(p))
+			status[offset] |= (1 << 0) | (1 << 4);
+		if (circuit_remotely_blocked(p))
+			status[offset] |= (1 << 1) | (1 << 5);
+		if (p->ss7call) {
+			if (p->outgoing)
+				status[offset] |= (1 << 3);
+			else
+				status[offset] |= (1 << 2);
+		} else
+			status[offset] |= 0x3 << 2;
 	}
 
 	if (p)
@@ -9492,94 +11807,172 @@ static void ss7_handle_cqm(struct dahdi_ss7 *linkset, int startcic, int endcic,
 
 static inline void ss7_block_cics(struct dahdi_ss7 *linkset, int startcic, int endcic, unsigned int dpc, unsigned char state[], int block, int remotely, int type)
 {
-	int i, offset = 0;
-	for (i = 0; i < linkset->numchans; i++) {
-		if (linkset->pvts[i] && (linkset->pvts[i]->dpc == dpc && ((linkset->pvts[i]->cic >= startcic) && (linkset->pvts[i]->cic <= endcic)))) {
-			if (state) {
-				if (state[offset]) {
-					if(linkset->pvts[i]->cic != startcic)
-						ast_mutex_lock(&linkset->pvts[i]->lock);
-
-					if (block) {
-						if (remotely)
-							linkset->pvts[i]->remotelyblocked |= type;
-						else
-							linkset->pvts[i]->locallyblocked |= type;
-					} else {
-						if (remotely)
-							linkset->pvts[i]->remotelyblocked &= ~type;
-						else
-							linkset->pvts[i]->locallyblocked &= ~type;
-					}
+	int i, first, last;
+	struct dahdi_pvt *p;
 
-					if(linkset->pvts[i]->owner && linkset->pvts[i]->owner->_state == AST_STATE_DIALING && !linkset->pvts[i]->proceeding) {
-						linkset->pvts[i]->owner->hangupcause = SS7_CAUSE_TRY_AGAIN;
-						linkset->pvts[i]->owner->_softhangup |= AST_SOFTHANGUP_DEV;
-					}
+	last = ss7_cic_range(linkset, startcic, endcic, dpc, &first) + first;
+	for (i = first; i < last; i++) {
+		p = linkset->pvts[i];
+		if (state) {
+			if (state[p->cic - startcic]) {
+				if(p->cic != startcic)
+					ast_mutex_lock(&p->lock);
 
-					if(linkset->pvts[i]->cic != startcic)
-						ast_mutex_unlock(&linkset->pvts[i]->lock);
-				}
-				offset++;
-			} else {
 				if (block) {
 					if (remotely)
-						linkset->pvts[i]->remotelyblocked |= type;
+						circuit_set(p, CIRCUIT_REMOTE(type));
 					else
-						linkset->pvts[i]->locallyblocked |= type;
+						circuit_set(p, CIRCUIT_LOCAL(type));
 				} else {
 					if (remotely)
-						linkset->pvts[i]->remotelyblocked &= ~type;
+						circuit_clear(p, CIRCUIT_REMOTE(type));
 					else
-						linkset->pvts[i]->locallyblocked &= ~type;
+						circuit_clear(p, CIRCUIT_LOCAL(type));
 				}
-			}
-		}
-	} /* for */
-}
 
-static void ss7_inservice(struct dahdi_ss7 *linkset, int startcic, int endcic, unsigned int dpc)
-{
-	int i;
+				if(p->owner && p->owner->_state == AST_STATE_DIALING && !p->proceeding) {
+					p->owner->hangupcause = SS7_CAUSE_TRY_AGAIN;
+					p->owner->_softhangup |= AST_SOFTHANGUP_DEV;
+				}
 
-	for (i = 0; i < linkset->numchans; i++) {
-		if (linkset->pvts[i] && (linkset->pvts[i]->dpc == dpc && ((linkset->pvts[i]->cic >= startcic) && (linkset->pvts[i]->cic <= endcic))))
-			linkset->pvts[i]->inservice = 1;
+				if(p->cic != startcic)
+					ast_mutex_unlock(&p->lock);
+			}
+		} else {
+			if (block) {
+				if (remotely)
+					circuit_set(p, CIRCUIT_REMOTE(type));
+				else
+					circuit_set(p, CIRCUIT_LOCAL(type));
+			} else {
+				if (remotely)
+					circuit_clear(p, CIRCUIT_REMOTE(type));
+				else
+					circuit_clear(p, CIRCUIT_LOCAL(type));
+			}
+		}
+	} /* for */
+}
+
+static void ss7_inservice(struct dahdi_ss7 *linkset, int startcic, int endcic, unsigned int dpc)
+{
+	int i, first, last;
+
+	last = ss7_cic_range(linkset, startcic, endcic, dpc, &first) + first;
+	for (i = first; i < last; i++) {
+		circuit_set(linkset->pvts[i], CIRCUIT_INSERVICE);
+		ast_mutex_lock(&linkset->pvts[i]->lock);
+		ss7_queue_bearer(linkset->pvts[i], SS7_BEARER_PREPARE);
+		ast_mutex_unlock(&linkset->pvts[i]->lock);
 	}
 }
 
-static void ss7_reset_linkset(struct dahdi_ss7 *linkset)
+/*! \brief Last pvts[] position of the GRS range starting at \a pos, at most 32 contiguous CICs of one DPC */
+static int ss7_grs_range_end(struct dahdi_ss7 *linkset, int pos)
 {
-	int i, startcic = -1, endcic, dpc;
-	struct dahdi_pvt *p;
+	int i = pos;
 
-	if (linkset->numchans <= 0)
+	while ((i + 1 < linkset->numchans) && (linkset->pvts[i + 1]->dpc == linkset->pvts[pos]->dpc) &&
+			(linkset->pvts[i + 1]->cic - linkset->pvts[i]->cic == 1) && (linkset->pvts[i]->cic - linkset->pvts[pos]->cic < 31))
+		i++;
+	return i;
+}
+
+/*! \brief Close the startup reset of \a linkset once every range has been acknowledged */
+static void ss7_grs_check_done(struct dahdi_ss7 *linkset)
+{
+	if (!linkset->grs_active || (linkset->grs_next < linkset->numchans) || (linkset->grs_acked < linkset->grs_ranges))
 		return;
+	linkset->grs_active = 0;
+	linkset->grs_finish = ast_tvnow();
+	ast_verb(2, "Linkset %d reset done: %d GRS in %d ms\n", (int) (linkset - linksets) + 1,
+		linkset->grs_acked, (int) ast_tvdiff_ms(linkset->grs_finish, linkset->grs_start));
+}
 
-	startcic = linkset->pvts[0]->cic;
-	p = linkset->pvts[0];
-	/* DB: CIC's DPC fix */
-	dpc = linkset->pvts[0]->dpc;
+/*!
+ * \brief Send the startup GRS that the window and pacing allow, with the linkset lock held
+ *
+ * Without ss7grswindow and ss7grsrate everything goes out in one pass, as it
+ * always did.  Returns the number of GRS sent.
+ */
+static int ss7_grs_pump(struct dahdi_ss7 *linkset)
+{
+	struct dahdi_pvt *p;
+	struct timeval now;
+	int end, sent = 0;
 
-	for (i = 0; i < linkset->numchans; i++) {
-		if (linkset->pvts[i+1] && linkset->pvts[i+1]->dpc == dpc && ((linkset->pvts[i+1]->cic - linkset->pvts[i]->cic) == 1) && (linkset->pvts[i]->cic - startcic < 31)) {
-			continue;
-		} else {
-			endcic = linkset->pvts[i]->cic;
-			ast_verbose("Resetting CICs %d to %d\n", startcic, endcic);
-			if(!ss7_find_alloc_call(p))
-				ast_log(LOG_ERROR, "Unable allocate new ss7call\n");
-			else
-				isup_grs(linkset->ss7, p->ss7call, endcic);
+	if (!linkset->grs_active)
+		return 0;
 
-			/* DB: CIC's DPC fix */
-			if (linkset->pvts[i+1]) {
-				startcic = linkset->pvts[i+1]->cic;
-				dpc = linkset->pvts[i+1]->dpc;
-				p = linkset->pvts[i+1];
-			}
+	now = ast_tvnow();
+	if (ss7_grs_window && (linkset->grs_outstanding >= ss7_grs_window) && (ast_tvdiff_ms(now, linkset->grs_progress) > SS7_GRS_STALL)) {
+		ast_log(LOG_WARNING, "No GRA on linkset %d for %d s, opening the startup reset window again\n",
+			(int) (linkset - linksets) + 1, SS7_GRS_STALL / 1000);
+		linkset->grs_outstanding = 0;
+	}
+
+	while (linkset->grs_next < linkset->numchans) {
+		if (ss7_grs_window && (linkset->grs_outstanding >= ss7_grs_window))
+			break;
+		if (ss7_grs_rate && (ast_tvdiff_ms(linkset->grs_due, now) > 0))
+			break;
+		p = linkset->pvts[linkset->grs_next];
+		end = ss7_grs_range_end(linkset, linkset->grs_next);
+		linkset->grs_next = end + 1;
+		linkset->grs_progress = now;
+		if (ss7_grs_rate)
+			linkset->grs_due = ast_tvadd(now, ast_samp2tv(1, ss7_grs_rate));
+
+		ast_verbose("Resetting CICs %d to %d\n", p->cic, linkset->pvts[end]->cic);
+		if (!ss7_find_alloc_call(p)) {
+			ast_log(LOG_ERROR, "Unable allocate new ss7call\n");
+			linkset->grs_ranges--;
+			continue;
 		}
+		isup_grs(linkset->ss7, p->ss7call, linkset->pvts[end]->cic);
+		ss7_stat_phase(p, SS7_PHASE_GRS);
+		p->grs_startup = 1;
+		linkset->grs_outstanding++;
+		sent++;
 	}
+	ss7_grs_check_done(linkset);
+	return sent;
+}
+
+/*! \brief A GRA came in for the range starting at \a p, with the linkset lock held */
+static void ss7_grs_ack(struct dahdi_ss7 *linkset, struct dahdi_pvt *p)
+{
+	if (!p->grs_startup)
+		return;
+	p->grs_startup = 0;
+	if (linkset->grs_outstanding > 0)
+		linkset->grs_outstanding--;
+	linkset->grs_acked++;
+	linkset->grs_progress = ast_tvnow();
+	if (ss7_grs_pump(linkset))
+		ss7_linkset_kick(linkset);
+	ss7_grs_check_done(linkset);
+}
+
+static void ss7_reset_linkset(struct dahdi_ss7 *linkset)
+{
+	int i;
+
+	if (linkset->numchans <= 0)
+		return;
+
+	linkset->grs_ranges = 0;
+	for (i = 0; i < linkset->numchans; i = ss7_grs_range_end(linkset, i) + 1) {
+		linkset->pvts[i]->grs_startup = 0;
+		linkset->grs_ranges++;
+	}
+	linkset->grs_active = 1;
+	linkset->grs_next = 0;
+	linkset->grs_outstanding = 0;
+	linkset->grs_acked = 0;
+	linkset->grs_start = linkset->grs_due = linkset->grs_progress = ast_tvnow();
+	linkset->grs_finish = ast_tv(0, 0);
+	ss7_grs_pump(linkset);
 }
 
 static void dahdi_loopback(struct dahdi_pvt *p, int enable)
@@ -9600,10 +11993,10 @@ static int ss7_do_rsc(struct dahdi_pvt *p) {
 
 	isup_rsc(p->ss7->ss7, p->ss7call);
 
-	if(p->locallyblocked == SS7_BLOCKED_MAINTENANCE)
+	if(circuit_locally_blocked(p) == SS7_BLOCKED_MAINTENANCE)
 		isup_blo(p->ss7->ss7, p->ss7call);
 	else
-		p->locallyblocked = 0;
+		circuit_clear(p, CIRCUIT_LOCAL_MASK);
 
 	return 1;
 }
@@ -9616,8 +12009,7 @@ static int ss7_start_rsc(struct dahdi_pvt *p) {
 	if(!ss7_find_alloc_call(p))
 		return 0;
 
-	p->remotelyblocked = 0;
-	p->inservice = 0;
+	circuit_clear(p, CIRCUIT_REMOTE_MASK | CIRCUIT_INSERVICE);
 	dahdi_loopback(p, 0);
 
 	if(p->owner) {
@@ -9632,20 +12024,20 @@ static int ss7_start_rsc(struct dahdi_pvt *p) {
 }
 
 static int ss7_clear_channels(struct dahdi_pvt *p, int endcic, int do_hangup) {
-	int i, chanpos, clean = 1;
+	int i, first, last, clean = 1;
 	struct dahdi_pvt *p_cur;
 
 	if (!p || !p->ss7call)
 		return 0;
 
-	for (i = p->cic; i <= endcic; i++)	{
-		chanpos = ss7_find_cic(p->ss7, i, p->dpc);
-		p_cur = p->ss7->pvts[chanpos];
+	last = ss7_cic_range(p->ss7, p->cic, endcic, p->dpc, &first) + first;
+	for (i = first; i < last; i++)	{
+		p_cur = p->ss7->pvts[i];
 
 		if (p_cur != p)
 			ast_mutex_lock(&p_cur->lock);
 
-		p_cur->inservice = 0;
+		circuit_clear(p_cur, CIRCUIT_INSERVICE);
 
 		if (p_cur->owner) {
 			p_cur->owner->hangupcause = AST_CAUSE_NORMAL_CLEARING;
@@ -9666,44 +12058,26 @@ static int ss7_clear_channels(struct dahdi_pvt *p, int endcic, int do_hangup) {
 	return clean;
 }
 
-/* XXX: This function is assumed to be called with the private channel lock and linkset lock held */
-static void ss7_start_call(struct dahdi_pvt *p, struct dahdi_ss7 *linkset)
+/*!
+ * \brief Second half of ss7_start_call(): create the channel and start the PBX on it
+ *
+ * Called with p->lock held, and normally without the linkset lock, which is
+ * only taken again for libss7 should the channel not come up.
+ */
+static void ss7_setup_call(struct dahdi_pvt *p, struct dahdi_ss7 *linkset)
 {
-	struct ss7 *ss7 = linkset->ss7;
-	int res;
-	int law = 1;
 	struct ast_channel *c;
 	char tmp[256];
 	char *strp;
 
-	if (ioctl(p->subs[SUB_REAL].dfd, DAHDI_AUDIOMODE, &law) == -1)
-		ast_log(LOG_WARNING, "Unable to set audio mode on channel %d to %d: %s\n", p->channel, law, strerror(errno));
-
-	if (linkset->type == SS7_ITU)
-		law = DAHDI_LAW_ALAW;
-	else
-		law = DAHDI_LAW_MULAW;
-
-	res = dahdi_setlaw(p->subs[SUB_REAL].dfd, law);
-	if (res < 0)
-		ast_log(LOG_WARNING, "Unable to set law on channel %d\n", p->channel);
-
-	isup_set_echocontrol(p->ss7call, (linkset->flags & LINKSET_FLAG_DEFAULTECHOCONTROL) ? 1 : 0);
-
-	if (!(linkset->flags & LINKSET_FLAG_EXPLICITACM)) {
-		p->proceeding = 1;
-		isup_acm(ss7, p->ss7call);
-	}
-
-	/* I had a deadlock cause of it !!! */
-	/*ast_mutex_unlock(&linkset->lock);  */
-	c = dahdi_new(p, AST_STATE_RING, 0, SUB_REAL, law, 0); /* The startpbx is sometimes faster than we set up the variables!!! */
+	c = dahdi_new(p, AST_STATE_RING, 0, SUB_REAL, ss7_linkset_law(linkset), 0); /* The startpbx is sometimes faster than we set up the variables!!! */
 
 	if (!c) {
 		ast_log(LOG_WARNING, "Unable to start PBX on CIC %d\n", p->cic);
-		/* Holding this lock is assumed entering the function */
-		/* ast_mutex_lock(&linkset->lock); */
-		isup_rel(p->ss7->ss7, p->ss7call, AST_CAUSE_SWITCH_CONGESTION);
+		ss7_grab(p, linkset);
+		isup_rel(linkset->ss7, p->ss7call, AST_CAUSE_SWITCH_CONGESTION);
+		ss7_stat_phase(p, SS7_PHASE_REL);
+		ss7_rel(linkset);
 		return;
 	} else
 		ast_verb(3, "Accepting call to '%s' on CIC %d\n", p->exten, p->cic);
@@ -9907,32 +12281,230 @@ static void ss7_start_call(struct dahdi_pvt *p, struct dahdi_ss7 *linkset)
 		c->hangupcause = AST_CAUSE_SWITCH_CONGESTION; /* The ast_hangup() is dangerous here!!! */
 		c->_softhangup |= AST_SOFTHANGUP_DEV;
 	}
+}
+
+/*!
+ * \brief Answer an incoming call towards the network and have its channel set up
+ *
+ * Called with the private channel lock and linkset lock held.  Only the
+ * libss7 part is done here.  Creating the channel and starting the PBX on it
+ * is queued for the dispatcher or a setup thread, which do it without the
+ * linkset lock, so the link keeps being serviced meanwhile.  Without a
+ * dispatcher the call is set up right away.
+ */
+static void ss7_start_call(struct dahdi_pvt *p, struct dahdi_ss7 *linkset)
+{
+	struct ss7 *ss7 = linkset->ss7;
+	int law;
+
+	if (p->setup_state != SS7_SETUP_NONE)
+		return;
+
+	/* Normally the bearer thread got the idle CIC ready already */
+	law = ss7_linkset_law(linkset);
+	if (p->bearerlaw != law) {
+		ast_atomic_fetchadd_int(&linkset->bearers_inline, 1);
+		ss7_bearer_prepare(p);
+	}
+
+	isup_set_echocontrol(p->ss7call, (linkset->flags & LINKSET_FLAG_DEFAULTECHOCONTROL) ? 1 : 0);
+
+	if (!(linkset->flags & LINKSET_FLAG_EXPLICITACM)) {
+		p->proceeding = 1;
+		isup_acm(ss7, p->ss7call);
+		ss7_stat_phase(p, SS7_PHASE_ACM);
+	}
+
+	if (!linkset->evq) {
+		ss7_setup_call(p, linkset);
+		return;
+	}
+	ast_mutex_lock(&linkset->evlock);
+	p->setup_state = SS7_SETUP_QUEUED;
+	p->setup_next = NULL;
+	if (linkset->setup_tail)
+		linkset->setup_tail->setup_next = p;
+	else
+		linkset->setup_head = p;
+	linkset->setup_tail = p;
+	ast_cond_broadcast(&linkset->setupcond);
+	ast_mutex_unlock(&linkset->evlock);
+}
+
+/*! \brief Whether \a p is one of the CICs of \a range */
+static inline int ss7_range_has(const struct ss7_cic_range *range, const struct dahdi_pvt *p)
+{
+	return range->all || ((p->dpc == range->pc) && (p->cic >= range->lo) && (p->cic <= range->hi));
+}
+
+/*!
+ * \brief Take the first queued call setup, of a CIC in \a range unless that is NULL
+ *
+ * Called with the linkset lock held, which keeps the pvt from going away until
+ * it is returned locked.  It is on the running list then, see ss7_setup_run().
+ */
+static struct dahdi_pvt *ss7_setup_take(struct dahdi_ss7 *linkset, const struct ss7_cic_range *range)
+{
+	struct dahdi_pvt *p, *prev = NULL;
+
+	ast_mutex_lock(&linkset->evlock);
+	for (p = linkset->setup_head; p; prev = p, p = p->setup_next) {
+		if (range && !ss7_range_has(range, p))
+			continue;
+		if (prev)
+			prev->setup_next = p->setup_next;
+		else
+			linkset->setup_head = p->setup_next;
+		if (linkset->setup_tail == p)
+			linkset->setup_tail = prev;
+		p->setup_next = linkset->setup_running;
+		linkset->setup_running = p;
+		p->setup_state = SS7_SETUP_RUNNING;
+		break;
+	}
+	ast_mutex_unlock(&linkset->evlock);
+	if (p)
+		ast_mutex_lock(&p->lock);
+	return p;
+}
+
+/*! \brief Take \a p off the setup queue or running list of its linkset, with the linkset lock held */
+static void ss7_setup_forget(struct dahdi_ss7 *linkset, struct dahdi_pvt *p)
+{
+	struct dahdi_pvt **q, *prev = NULL;
+
+	ast_mutex_lock(&linkset->evlock);
+	if (p->setup_state != SS7_SETUP_NONE) {
+		q = (p->setup_state == SS7_SETUP_QUEUED) ? &linkset->setup_head : &linkset->setup_running;
+		for (; *q; prev = *q, q = &(*q)->setup_next) {
+			if (*q == p) {
+				*q = p->setup_next;
+				break;
+			}
+		}
+		if (linkset->setup_tail == p)
+			linkset->setup_tail = prev;
+		p->setup_next = NULL;
+		p->setup_state = SS7_SETUP_NONE;
+		ast_cond_broadcast(&linkset->setupcond);
+	}
+	ast_mutex_unlock(&linkset->evlock);
+}
+
+/*!
+ * \brief Run a call setup ss7_setup_take() returned, with the linkset lock dropped meanwhile
+ *
+ * The circuit may have been reset or released from the CLI in between, then
+ * there is nothing to set up any more.
+ */
+static void ss7_setup_run(struct dahdi_ss7 *linkset, struct dahdi_pvt *p)
+{
+	ast_mutex_unlock(&linkset->lock);
+	if (p->ss7call && !p->owner)
+		ss7_setup_call(p, linkset);
+	ss7_setup_forget(linkset, p);
+	ast_mutex_unlock(&p->lock);
+	ast_mutex_lock(&linkset->lock);
+}
+
+/*!
+ * \brief Finish the call setups of the CICs \a e is about, before it is handled
+ *
+ * Keeps the order of events per CIC now that setups run outside the linkset
+ * lock.  Queued setups are run right here, those a setup thread is running are
+ * waited for.  Called with the linkset lock held, it is dropped meanwhile.
+ */
+static void ss7_setup_barrier(struct dahdi_ss7 *linkset, const ss7_event *e)
+{
+	struct ss7_cic_range range;
+	struct dahdi_pvt *p;
+	int busy;
+
+	if (!linkset->setup_head && !linkset->setup_running)
+		return;
+	ss7_event_range(e, &range);
+	for (;;) {
+		if ((p = ss7_setup_take(linkset, &range))) {
+			ss7_setup_run(linkset, p);
+			continue;
+		}
+		ast_mutex_lock(&linkset->evlock);
+		for (busy = 0, p = linkset->setup_running; p && !busy; p = p->setup_next)
+			busy = ss7_range_has(&range, p);
+		if (!busy) {
+			ast_mutex_unlock(&linkset->evlock);
+			break;
+		}
+		ast_mutex_unlock(&linkset->lock);
+		ast_cond_wait(&linkset->setupcond, &linkset->evlock);
+		ast_mutex_unlock(&linkset->evlock);
+		ast_mutex_lock(&linkset->lock);
+	}
+}
+
+/*! \brief Call setup thread of a linkset, see ss7setupthreads in chan_dahdi.conf */
+static void *ss7_setup_thread(void *data)
+{
+	struct dahdi_ss7 *linkset = data;
+	struct dahdi_pvt *p;
+
+	for (;;) {
+		ast_mutex_lock(&linkset->evlock);
+		while (!linkset->setup_head && !linkset->evstop)
+			ast_cond_wait(&linkset->setupcond, &linkset->evlock);
+		if (linkset->evstop) {
+			ast_mutex_unlock(&linkset->evlock);
+			break;
+		}
+		ast_mutex_unlock(&linkset->evlock);
+		ast_mutex_lock(&linkset->lock);
+		if ((p = ss7_setup_take(linkset, NULL)))
+			ss7_setup_run(linkset, p);
+		ast_mutex_unlock(&linkset->lock);
+	}
 
-	 /* ast_mutex_lock(&linkset->lock); */
+	return NULL;
 }
 
 static void ss7_apply_plan_to_number(char *buf, size_t size, const struct dahdi_ss7 *ss7, const char *number, const unsigned nai)
 {
+	const struct ss7_prefix *pre;
+	size_t len, n;
+
 	switch (nai) {
 	case SS7_NAI_INTERNATIONAL:
-		snprintf(buf, size, "%s%s", ss7->internationalprefix, number);
+		pre = &ss7->plan[SS7_PREFIX_INTERNATIONAL];
 		break;
 	case SS7_NAI_NATIONAL:
-		snprintf(buf, size, "%s%s", ss7->nationalprefix, number);
+		pre = &ss7->plan[SS7_PREFIX_NATIONAL];
 		break;
 	case SS7_NAI_SUBSCRIBER:
-		snprintf(buf, size, "%s%s", ss7->subscriberprefix, number);
+		pre = &ss7->plan[SS7_PREFIX_SUBSCRIBER];
 		break;
 	case SS7_NAI_UNKNOWN:
-		snprintf(buf, size, "%s%s", ss7->unknownprefix, number);
+		pre = &ss7->plan[SS7_PREFIX_UNKNOWN];
 		break;
 	case SS7_NAI_NETWORKROUTED:
-		snprintf(buf, size, "%s%s", ss7->networkroutedprefix, number);
+		pre = &ss7->plan[SS7_PREFIX_NETWORKROUTED];
 		break;
 	default:
-		snprintf(buf, size, "%s", number);
+		pre = NULL;
 		break;
 	}
+
+	if (!size)
+		return;
+	/* Straight into buf, this runs for every number of every IAM */
+	len = pre ? pre->len : 0;
+	if (len > size - 1)
+		len = size - 1;
+	if (len)
+		memcpy(buf, pre->digits, len);
+	n = strlen(number);
+	if (n > size - 1 - len)
+		n = size - 1 - len;
+	memcpy(buf + len, number, n);
+	buf[len + n] = '\0';
 }
 
 static int ss7_pres_scr2cid_pres(char presentation_ind, char screening_ind)
@@ -9961,888 +12533,1588 @@ static void ss7_process_connected(struct dahdi_pvt *p, char *connected_num, unsi
 }
 */
 
-static void *ss7_linkset(void *data)
+/*! \brief Time out to the next libss7 timer of \a linkset in \a when, returns -1 if none is scheduled */
+static int ss7_linkset_deadline(struct dahdi_ss7 *linkset, struct timeval *when)
 {
-	int res, i;
-	struct timeval *next = NULL, tv;
-	struct dahdi_ss7 *linkset = (struct dahdi_ss7 *) data;
-	struct ss7 *ss7 = linkset->ss7;
-	ss7_event *e = NULL;
-	struct dahdi_pvt *p_cur, *p = NULL; /* just shut up gcc 4.1 */
-	int chanpos;
-	struct pollfd pollers[NUM_DCHANS];
-	int cic;
-	unsigned int dpc;
-	unsigned char mb_state[255];
-	int nextms = 0;
+	struct timeval *next;
+	int res = -1;
 
-	ss7_start(ss7);
+	ast_mutex_lock(&linkset->lock);
+	if ((next = ss7_schedule_next(linkset->ss7))) {
+		*when = *next;
+		res = 0;
+	}
+	/* A paced startup reset wakes us for its next GRS too */
+	if (linkset->grs_active && ss7_grs_rate && (linkset->grs_next < linkset->numchans) &&
+			(!ss7_grs_window || (linkset->grs_outstanding < ss7_grs_window)) &&
+			(res || (ast_tvdiff_ms(*when, linkset->grs_due) > 0))) {
+		*when = linkset->grs_due;
+		res = 0;
+	}
+	ast_mutex_unlock(&linkset->lock);
+	return res;
+}
 
-	while(1) {
-		ast_mutex_lock(&linkset->lock);
-		if ((next = ss7_schedule_next(ss7))) {
-			tv = ast_tvnow();
-			tv.tv_sec = next->tv_sec - tv.tv_sec;
-			tv.tv_usec = next->tv_usec - tv.tv_usec;
-			if (tv.tv_usec < 0) {
-				tv.tv_usec += 1000000;
-				tv.tv_sec -= 1;
-			}
-			if (tv.tv_sec < 0) {
-				tv.tv_sec = 0;
-				tv.tv_usec = 0;
-			}
-			nextms = tv.tv_sec * 1000;
-			nextms += tv.tv_usec / 1000;
-		} else
-			nextms = -1;
+/*! \brief Milliseconds until \a when, never negative */
+static int ss7_ms_until(struct timeval when)
+{
+	int64_t ms = ast_tvdiff_ms(when, ast_tvnow());
 
-		ast_mutex_unlock(&linkset->lock);
+	return ms < 0 ? 0 : (int) ms;
+}
 
-		for (i = 0; i < linkset->numsigchans; i++) {
-			pollers[i].fd = linkset->fds[i];
-			pollers[i].events = ss7_pollflags(ss7, linkset->fds[i]);
-			pollers[i].revents = 0;
-		}
+static void ss7_linkset_dispatch(struct dahdi_ss7 *linkset);
 
-		res = poll(pollers, linkset->numsigchans, nextms);
-		if ((res < 0) && (errno != EINTR)) {
-			ast_log(LOG_ERROR, "poll(%s)\n", strerror(errno));
-		} else if (!res) {
-			ast_mutex_lock(&linkset->lock);
-			ss7_schedule_run(ss7);
-			ast_mutex_unlock(&linkset->lock);
-			/* continue; */
-		}
+/*! \brief Service one signalling channel of \a linkset that poll or epoll reported ready, with the linkset lock held */
+static void ss7_linkset_fd_event(struct dahdi_ss7 *linkset, int i, short revents)
+{
+	struct ss7 *ss7 = linkset->ss7;
+	int res, n;
 
-		ast_mutex_lock(&linkset->lock);
-		for (i = 0; i < linkset->numsigchans; i++) {
-			if (pollers[i].revents & POLLPRI) {
-				int x;
-				if (ioctl(pollers[i].fd, DAHDI_GETEVENT, &x)) {
-					ast_log(LOG_ERROR, "Error in exception retrieval!\n");
-				}
-				switch (x) {
-				case DAHDI_EVENT_OVERRUN:
-					ast_debug(1, "Overrun detected!\n");
-					break;
-				case DAHDI_EVENT_BADFCS:
-					ast_debug(1, "Bad FCS\n");
-					break;
-				case DAHDI_EVENT_ABORT:
-					ast_debug(1, "HDLC Abort\n");
-					break;
-				case DAHDI_EVENT_ALARM:
-					ast_log(LOG_ERROR, "Alarm on link!\n");
-					linkset->linkstate[i] |= (LINKSTATE_DOWN | LINKSTATE_INALARM);
-					linkset->linkstate[i] &= ~LINKSTATE_UP;
-					ss7_link_alarm(ss7, pollers[i].fd);
-					break;
-				case DAHDI_EVENT_NOALARM:
-					ast_log(LOG_ERROR, "Alarm cleared on link\n");
-					linkset->linkstate[i] &= ~(LINKSTATE_INALARM | LINKSTATE_DOWN);
-					linkset->linkstate[i] |= LINKSTATE_STARTING;
-					ss7_link_noalarm(ss7, pollers[i].fd);
-					break;
-				default:
-					ast_log(LOG_ERROR, "Got exception %d!\n", x);
-					break;
-				}
-			}
+	if (revents & POLLPRI) {
+		int x;
+		if (ioctl(linkset->fds[i], DAHDI_GETEVENT, &x)) {
+			ast_log(LOG_ERROR, "Error in exception retrieval!\n");
+		}
+		ss7_trace(linkset, SS7_TRACE_DAHDI, i, 0, 0, x);
+		switch (x) {
+		case DAHDI_EVENT_OVERRUN:
+			ast_debug(1, "Overrun detected!\n");
+			break;
+		case DAHDI_EVENT_BADFCS:
+			ast_debug(1, "Bad FCS\n");
+			break;
+		case DAHDI_EVENT_ABORT:
+			ast_debug(1, "HDLC Abort\n");
+			break;
+		case DAHDI_EVENT_ALARM:
+			ast_log(LOG_ERROR, "Alarm on link!\n");
+			linkset->linkstate[i] |= (LINKSTATE_DOWN | LINKSTATE_INALARM);
+			linkset->linkstate[i] &= ~LINKSTATE_UP;
+			ss7_link_alarm(ss7, linkset->fds[i]);
+			break;
+		case DAHDI_EVENT_NOALARM:
+			ast_log(LOG_ERROR, "Alarm cleared on link\n");
+			linkset->linkstate[i] &= ~(LINKSTATE_INALARM | LINKSTATE_DOWN);
+			linkset->linkstate[i] |= LINKSTATE_STARTING;
+			ss7_link_noalarm(ss7, linkset->fds[i]);
+			break;
+		default:
+			ast_log(LOG_ERROR, "Got exception %d!\n", x);
+			break;
+		}
+	}
 
-			if (pollers[i].revents & POLLIN) {
-				ast_mutex_lock(&linkset->lock);
-				res = ss7_read(ss7, pollers[i].fd);
-				ast_mutex_unlock(&linkset->lock);
-			}
+	if (revents & POLLIN) {
+		/* The fds are non-blocking, read until DAHDI runs dry or the budget is spent.
+		 * libss7 only has room for a few events, so hand them on after every frame. */
+		for (n = 0; n < ss7_batch; n++) {
+			if ((res = ss7_read(ss7, linkset->fds[i])) < 0)
+				break;
+			ss7_linkset_dispatch(linkset);
+		}
+		linkset->rxstats[i].wakeups++;
+		linkset->rxstats[i].frames += n;
+		if (n > linkset->rxstats[i].maxbatch)
+			linkset->rxstats[i].maxbatch = n;
+	}
 
-			if (pollers[i].revents & POLLOUT) {
-				ast_mutex_lock(&linkset->lock);
-				res = ss7_write(ss7, pollers[i].fd);
-				ast_mutex_unlock(&linkset->lock);
-				if (res < 0) {
+	if (revents & POLLOUT) {
+		for (n = 0; n < ss7_batch; n++) {
+			if ((res = ss7_write(ss7, linkset->fds[i])) < 0) {
+				if (errno != EAGAIN)
 					ast_debug(1, "Error in write %s\n", strerror(errno));
-				}
+				break;
+			}
+			if (!(ss7_pollflags(ss7, linkset->fds[i]) & POLLOUT)) {
+				n++;
+				break;
 			}
 		}
+		linkset->txstats[i].wakeups++;
+		linkset->txstats[i].frames += n;
+		if (n > linkset->txstats[i].maxbatch)
+			linkset->txstats[i].maxbatch = n;
+	}
+}
 
-		while ((e = ss7_check_event(ss7))) {
-			switch (e->e) {
-			case SS7_EVENT_UP:
-				if (linkset->state != LINKSET_STATE_UP) {
-					ast_verbose("--- SS7 Up ---\n");
-					ss7_reset_linkset(linkset);
-				}
-				linkset->state = LINKSET_STATE_UP;
-				break;
-			case SS7_EVENT_DOWN:
-				ast_verbose("--- SS7 Down ---\n");
-				linkset->state = LINKSET_STATE_DOWN;
-				for (i = 0; i < linkset->numchans; i++) {
-					struct dahdi_pvt *p = linkset->pvts[i];
-					if (p) {
-						p->inservice = 0;
-						if (linkset->flags & LINKSET_FLAG_INITIALHWBLO)
-							p->remotelyblocked |= SS7_BLOCKED_HARDWARE;
-					}
-				}
-				break;
-			case MTP2_LINK_UP:
-				ast_verbose("MTP2 link up (SLC %d)\n", e->gen.data);
-				break;
-			case MTP2_LINK_DOWN:
-				ast_log(LOG_WARNING, "MTP2 link down (SLC %d)\n", e->gen.data);
-				break;
-			case ISUP_EVENT_CPG:
-				chanpos = ss7_find_cic(linkset, e->cpg.cic, e->cpg.opc);
-				if (chanpos < 0) { /* Never will be true */
-					ast_log(LOG_WARNING, "CPG on unconfigured CIC %d PC %d\n", e->cpg.cic, e->cpg.opc);
-					isup_free_call(ss7, e->cpg.call);
-					break;
-				}
-				p = linkset->pvts[chanpos];
-				ast_mutex_lock(&p->lock);
+/*! \brief Whether \a number is as long as the ss7_called_lengths rule for its prefix asks for */
+static int ss7_number_complete(const struct dahdi_ss7 *linkset, const char *number)
+{
+	int i;
 
-				switch (e->cpg.event) {
-				case CPG_EVENT_ALERTING:
-					p->alerting = 1;
-					p->subs[SUB_REAL].needringing = 1;
-					break;
-				case CPG_EVENT_PROGRESS:
-				case CPG_EVENT_INBANDINFO:
-					{
-						struct ast_frame f = { AST_FRAME_CONTROL, AST_CONTROL_PROGRESS, };
-						ast_debug(1, "Queuing frame PROGRESS on CIC %d\n", p->cic);
-						dahdi_queue_frame(p, &f, linkset);
-						p->progress = 1;
-						p->dialing = 0;
-						if (p->dsp && p->dsp_features) {
-							ast_dsp_set_features(p->dsp, p->dsp_features);
-							p->dsp_features = 0;
-						}
-					}
-					break;
-				default:
-					ast_debug(1, "Do not handle CPG with event type 0x%x\n", e->cpg.event);
-				}
-				p->echocontrol_ind = e->cpg.echocontrol_ind;
-				ast_mutex_unlock(&p->lock);
-				break;
-			case ISUP_EVENT_RSC:
-				ast_verbose("Resetting CIC %d\n", e->rsc.cic);
-				chanpos = ss7_find_cic(linkset, e->rsc.cic, e->rsc.opc);
-				if (chanpos < 0) {
-					ast_log(LOG_WARNING, "RSC on unconfigured CIC %d PC %d\n", e->rsc.cic, e->rsc.opc);
-					isup_free_call(ss7, e->rsc.call);
-					break;
-				}
-				p = linkset->pvts[chanpos];
-				ast_mutex_lock(&p->lock);
-				p->ss7call = e->rsc.call;
-				p->inservice = 1;
-				p->remotelyblocked = 0;
-				dpc = p->dpc;
-				if (p->locallyblocked == SS7_BLOCKED_MAINTENANCE)
-					isup_blo(ss7, e->rsc.call);
-				else if (p->locallyblocked == SS7_BLOCKED_HARDWARE)
-					p->locallyblocked = 0;
-
-				isup_set_call_dpc(e->rsc.call, dpc);
-
-				if (p->owner) {
-					p->owner->_softhangup |= AST_SOFTHANGUP_DEV;
-					p->do_hangup = SS7_HANGUP_SEND_RLC;
-					if (e->rsc.got_sent_msg != ISUP_SENT_IAM) {
-						/* Q.784 6.2.3 */
-						p->owner->hangupcause = AST_CAUSE_NORMAL_CLEARING;
-					} else {
-						p->owner->hangupcause = SS7_CAUSE_TRY_AGAIN;
-					}
-				} else {
-					isup_rlc(ss7, e->rsc.call);
-					p->ss7call = isup_free_call_if_clear(ss7, e->rsc.call);
-				}
-				/* End the loopback if we have one */
-				dahdi_loopback(p, 0);
-				ast_mutex_unlock(&p->lock);
-				break;
-			case ISUP_EVENT_GRS:
-				if(!ss7_find_cic_range(linkset, e->grs.startcic, e->grs.endcic, e->grs.opc)) {
-					ast_log(LOG_WARNING, "GRS on unconfigured range CIC %d - %d PC %d\n", e->grs.startcic, e->grs.endcic, e->grs.opc);
-					chanpos = ss7_find_cic(linkset, e->gra.startcic, e->gra.opc);
-					if(chanpos > -1) {
-						p = linkset->pvts[chanpos];
-						ast_mutex_lock(&p->lock);
-						p->ss7call = isup_free_call_if_clear(ss7, e->grs.call);
-						ast_mutex_unlock(&p->lock);
-					} else
-						isup_free_call(ss7, e->grs.call);
-					break;
-				}
+	for (i = 0; i < linkset->numlengths; i++) {
+		if (!strncmp(number, linkset->lengths[i].prefix, linkset->lengths[i].plen))
+			return strlen(number) >= linkset->lengths[i].len;
+	}
+	return 0;
+}
 
-				chanpos = ss7_find_cic(linkset, e->gra.startcic, e->gra.opc);
-				p = linkset->pvts[chanpos];
-				ast_mutex_lock(&p->lock);
-				p->ss7call = e->gra.call;
+/*!
+ * \brief Look at the called digits of \a p that came in since the last IAM or SAM
+ *
+ * Only the new digits are searched for the ST digit, what came before has
+ * been searched already.  The number is also complete once it is as long as
+ * its prefix says, so the call starts without waiting for the digit timeout.
+ */
+static void ss7_overlap_digits(struct dahdi_ss7 *linkset, struct dahdi_pvt *p)
+{
+	char *st;
 
-				ss7_block_cics(linkset, e->grs.startcic, e->grs.endcic, e->grs.opc, NULL, 0, 1,  SS7_BLOCKED_HARDWARE);
+	if (linkset->stdigit && (st = strchr(p->exten + p->overlap_checked, linkset->stdigit))) {
+		*st = '\0';
+		p->called_complete = 1;
+	}
+	p->overlap_checked = strlen(p->exten);
+	if (!p->called_complete && ss7_number_complete(linkset, p->exten))
+		p->called_complete = 1;
+}
 
-				for (i = 0; i <= e->grs.endcic - p->cic; i++)	{
-					chanpos = ss7_find_cic(p->ss7, i + p->cic, p->dpc);
-					p_cur = p->ss7->pvts[chanpos];
-					if(p != p_cur)
-						ast_mutex_lock(&p_cur->lock);
+/*!
+ * \brief Whether new IAMs on \a linkset should be turned away, with the linkset lock held
+ *
+ * Looks at the depth of the ISUP dispatch queue and at how long that queue is
+ * expected to take at the current cost of an event.  Overload ends once both
+ * are back under half their threshold, so we do not flap at the limit.
+ */
+static int ss7_overloaded(struct dahdi_ss7 *linkset)
+{
+	int backlog, delay;
 
-					if (p_cur->locallyblocked & SS7_BLOCKED_MAINTENANCE) {
-						mb_state[i] = 1;
-					} else
-						mb_state[i] = 0;
+	if (!ss7_overload_queue && !ss7_overload_delay)
+		return 0;
 
-					p_cur->remotelyblocked = p_cur->remotelyblocked & ~SS7_BLOCKED_MAINTENANCE;
+	ast_mutex_lock(&linkset->evlock);
+	backlog = linkset->evcount;
+	ast_mutex_unlock(&linkset->evlock);
+	delay = backlog * linkset->ev_avg / 1000;
 
-					if(p_cur->owner) {
-						p_cur->owner->_softhangup |= AST_SOFTHANGUP_DEV;
-						if(p_cur->owner->_state == AST_STATE_DIALING && !linkset->pvts[i]->proceeding)
-							p_cur->owner->hangupcause = SS7_CAUSE_TRY_AGAIN;
-						else
-							p_cur->owner->hangupcause = AST_CAUSE_NORMAL_CLEARING;
-						p_cur->do_hangup = SS7_HANGUP_FREE_CALL;
-					} else if (p->ss7call && p != p_cur) { /* clear any session */
-						isup_free_call(ss7, p_cur->ss7call);
-						p_cur->ss7call = NULL;
-					}
+	if (!linkset->overload) {
+		if ((ss7_overload_queue && (backlog >= ss7_overload_queue)) || (ss7_overload_delay && (delay >= ss7_overload_delay))) {
+			linkset->overload = 1;
+			linkset->overloads++;
+			ast_log(LOG_WARNING, "Linkset %d overloaded, %d events queued, about %d ms behind: rejecting new IAMs\n",
+				(int) (linkset - linksets) + 1, backlog, delay);
+		}
+	} else if ((!ss7_overload_queue || (backlog < ss7_overload_queue / 2)) && (!ss7_overload_delay || (delay < ss7_overload_delay / 2))) {
+		linkset->overload = 0;
+		ast_log(LOG_NOTICE, "Linkset %d no longer overloaded, %u IAMs rejected so far\n", (int) (linkset - linksets) + 1, linkset->shed);
+	}
+	return linkset->overload;
+}
 
-					p_cur->inservice = 1;
+/*! \brief ISUP dispatch stage: act on one event of \a linkset, with the linkset lock held */
+static void __ss7_handle_event(struct dahdi_ss7 *linkset, ss7_event *e)
+{
+	int res, i, first, exists, matchmore;
+	struct ss7 *ss7 = linkset->ss7;
+	struct dahdi_pvt *p_cur, *p = NULL; /* just shut up gcc 4.1 */
+	int cic;
+	unsigned int dpc;
+	unsigned char mb_state[255];
 
-					if(p != p_cur)
-						ast_mutex_unlock(&p_cur->lock);
-				}
+	switch (e->e) {
+	case SS7_EVENT_UP:
+		if (linkset->state != LINKSET_STATE_UP) {
+			ast_verbose("--- SS7 Up ---\n");
+			ss7_reset_linkset(linkset);
+		}
+		linkset->state = LINKSET_STATE_UP;
+		break;
+	case SS7_EVENT_DOWN:
+		ast_verbose("--- SS7 Down ---\n");
+		linkset->state = LINKSET_STATE_DOWN;
+		linkset->grs_active = 0;
+		for (i = 0; i < linkset->numchans; i++) {
+			struct dahdi_pvt *p = linkset->pvts[i];
+			if (p) {
+				circuit_clear(p, CIRCUIT_INSERVICE);
+				if (linkset->flags & LINKSET_FLAG_INITIALHWBLO)
+					circuit_set(p, CIRCUIT_REMOTE(SS7_BLOCKED_HARDWARE));
+			}
+		}
+		break;
+	case MTP2_LINK_UP:
+		ast_verbose("MTP2 link up (SLC %d)\n", e->gen.data);
+		break;
+	case MTP2_LINK_DOWN:
+		ast_log(LOG_WARNING, "MTP2 link down (SLC %d)\n", e->gen.data);
+		break;
+	case ISUP_EVENT_CPG:
+		p = ss7_find_cic(linkset, e->cpg.cic, e->cpg.opc);
+		if (!p) { /* Never will be true */
+			ast_log(LOG_WARNING, "CPG on unconfigured CIC %d PC %d\n", e->cpg.cic, e->cpg.opc);
+			isup_free_call(ss7, e->cpg.call);
+			break;
+		}
+		ast_mutex_lock(&p->lock);
 
-				isup_gra(ss7, p->ss7call, e->grs.endcic, mb_state);
-				if(!p->owner)
-					p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
-				ast_mutex_unlock(&p->lock);
-				break;
-			case ISUP_EVENT_CQM:
-				ast_debug(1, "Got Circuit group query message from CICs %d to %d\n", e->cqm.startcic, e->cqm.endcic);
-				ss7_handle_cqm(linkset, e->cqm.startcic, e->cqm.endcic, e->cqm.opc);
-				chanpos = ss7_find_cic(linkset, e->iam.cic, e->iam.opc);
-				if (chanpos > -1) {
-					p = linkset->pvts[chanpos];
-					ast_mutex_lock(&p->lock);
-					if (!p->owner)
-						p->ss7call = isup_free_call_if_clear(ss7, e->cqm.call);
-					ast_mutex_unlock(&p->lock);
+		switch (e->cpg.event) {
+		case CPG_EVENT_ALERTING:
+			p->alerting = 1;
+			p->subs[SUB_REAL].needringing = 1;
+			break;
+		case CPG_EVENT_PROGRESS:
+		case CPG_EVENT_INBANDINFO:
+			{
+				struct ast_frame f = { AST_FRAME_CONTROL, AST_CONTROL_PROGRESS, };
+				ast_debug(1, "Queuing frame PROGRESS on CIC %d\n", p->cic);
+				ss7_queue_control(p, f.subclass, linkset);
+				p->progress = 1;
+				p->dialing = 0;
+				if (p->dsp && p->dsp_features) {
+					ast_dsp_set_features(p->dsp, p->dsp_features);
+					p->dsp_features = 0;
 				}
-				break;
+			}
+			break;
+		default:
+			ast_debug(1, "Do not handle CPG with event type 0x%x\n", e->cpg.event);
+		}
+		p->echocontrol_ind = e->cpg.echocontrol_ind;
+		ast_mutex_unlock(&p->lock);
+		break;
+	case ISUP_EVENT_RSC:
+		ast_verbose("Resetting CIC %d\n", e->rsc.cic);
+		p = ss7_find_cic(linkset, e->rsc.cic, e->rsc.opc);
+		if (!p) {
+			ast_log(LOG_WARNING, "RSC on unconfigured CIC %d PC %d\n", e->rsc.cic, e->rsc.opc);
+			isup_free_call(ss7, e->rsc.call);
+			break;
+		}
+		ast_mutex_lock(&p->lock);
+		p->ss7call = e->rsc.call;
+		circuit_update(p, CIRCUIT_REMOTE_MASK, CIRCUIT_INSERVICE);
+		dpc = p->dpc;
+		if (circuit_locally_blocked(p) == SS7_BLOCKED_MAINTENANCE)
+			isup_blo(ss7, e->rsc.call);
+		else if (circuit_locally_blocked(p) == SS7_BLOCKED_HARDWARE)
+			circuit_clear(p, CIRCUIT_LOCAL_MASK);
 
-			case ISUP_EVENT_GRA:
-				if(!ss7_find_cic_range(linkset, e->gra.startcic, e->gra.endcic, e->gra.opc)) { /* Never will be true */
-					ast_log(LOG_WARNING, "GRA on unconfigured range CIC %d - %d PC %d\n", e->gra.startcic, e->gra.endcic, e->gra.opc);
-					isup_free_call(ss7, e->gra.call);
-					break;
-				}
-				chanpos = ss7_find_cic(linkset, e->gra.startcic, e->gra.opc);
-				p = linkset->pvts[chanpos];
+		isup_set_call_dpc(e->rsc.call, dpc);
+
+		if (p->owner) {
+			p->owner->_softhangup |= AST_SOFTHANGUP_DEV;
+			p->do_hangup = SS7_HANGUP_SEND_RLC;
+			if (e->rsc.got_sent_msg != ISUP_SENT_IAM) {
+				/* Q.784 6.2.3 */
+				p->owner->hangupcause = AST_CAUSE_NORMAL_CLEARING;
+			} else {
+				p->owner->hangupcause = SS7_CAUSE_TRY_AGAIN;
+			}
+		} else {
+			isup_rlc(ss7, e->rsc.call);
+			p->ss7call = isup_free_call_if_clear(ss7, e->rsc.call);
+		}
+		/* End the loopback if we have one */
+		dahdi_loopback(p, 0);
+		ast_mutex_unlock(&p->lock);
+		break;
+	case ISUP_EVENT_GRS:
+		if(!ss7_find_cic_range(linkset, e->grs.startcic, e->grs.endcic, e->grs.opc)) {
+			ast_log(LOG_WARNING, "GRS on unconfigured range CIC %d - %d PC %d\n", e->grs.startcic, e->grs.endcic, e->grs.opc);
+			p = ss7_find_cic(linkset, e->gra.startcic, e->gra.opc);
+			if(p) {
 				ast_mutex_lock(&p->lock);
-				p->ss7call = e->gra.call;
+				p->ss7call = isup_free_call_if_clear(ss7, e->grs.call);
+				ast_mutex_unlock(&p->lock);
+			} else
+				isup_free_call(ss7, e->grs.call);
+			break;
+		}
 
-				ast_verbose("Got reset acknowledgement from CIC %d to %d DPC: %d\n", e->gra.startcic, e->gra.endcic, e->gra.opc);
-				ss7_inservice(linkset, e->gra.startcic, e->gra.endcic, e->gra.opc);
-				ss7_block_cics(linkset, e->gra.startcic, e->gra.endcic, e->gra.opc, e->gra.status,
-					1, 1, SS7_BLOCKED_MAINTENANCE);
+		ss7_cic_range(linkset, e->grs.startcic, e->grs.endcic, e->grs.opc, &first);
+		p = linkset->pvts[first];
+		ast_mutex_lock(&p->lock);
+		p->ss7call = e->gra.call;
 
-				p->ss7call = isup_free_call_if_clear(ss7, p->ss7call); /* we may sent a CDB with GRS! */
-				ast_mutex_unlock(&p->lock);
-				break;
-			case ISUP_EVENT_SAM:
-				chanpos = ss7_find_cic(linkset, e->sam.cic, e->sam.opc);
-				if(chanpos < 0) {
-					ast_log(LOG_WARNING, "SAM on unconfigured CIC %d PC %d\n", e->sam.cic, e->sam.opc);
-					isup_free_call(ss7, e->sam.call);
-					break;
-				}
-				p = linkset->pvts[chanpos];
-				ast_mutex_lock(&p->lock);
-				if(p->owner) {
-					ast_log(LOG_WARNING, "SAM on CIC %d PC %d already have call\n", e->sam.cic, e->sam.opc);
-					ast_mutex_unlock(&p->lock);
-					break;
-				}
-				p->called_complete = 0;
-				if (!ast_strlen_zero(e->sam.called_party_num)) {
-					char *st;
-					strncat(p->exten, e->sam.called_party_num, sizeof(p->exten) - strlen(p->exten));
-					st = strchr(p->exten, '#');
-					if (st) {
-						*st = '\0';
-						p->called_complete = 1;
-					}
-				} else
-					p->exten[0] = '\0';
-				goto ss7_start_switch;
-			case ISUP_EVENT_IAM:
- 				ast_debug(1, "Got IAM for CIC %d and called number %s, calling number %s\n", e->iam.cic, e->iam.called_party_num, e->iam.calling_party_num);
-				chanpos = ss7_find_cic(linkset, e->iam.cic, e->iam.opc);
-				if (chanpos < 0) {
-					ast_log(LOG_WARNING, "IAM on unconfigured CIC %d PC %d\n", e->iam.cic, e->iam.opc);
-					isup_free_call(ss7, e->iam.call);
-					break;
-				}
-				p = linkset->pvts[chanpos];
-				ast_mutex_lock(&p->lock);
-				p->ss7call = e->iam.call;
-				if (p->locallyblocked) {
-					isup_clear_callflags(ss7, p->ss7call, ISUP_GOT_IAM);
-					p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
-					ast_mutex_unlock(&p->lock);
-					ast_log(LOG_WARNING, "Got IAM on locally blocked CIC %d DPC %d, ignore\n", e->iam.cic, e->iam.opc);
-					break;
-				}
-				if (p->remotelyblocked) {
-					ast_log(LOG_NOTICE, "Got IAM on remotely blocked CIC %d DPC %d remove blocking\n", e->iam.cic, e->iam.opc);
-					p->remotelyblocked = 0;
-					p->inservice = 1;
-				}
-				if (p->owner) {
-					ast_mutex_unlock(&p->lock);
-					ast_log(LOG_WARNING, "Ring requested on CIC %d already in use!\n", e->iam.cic);
-					break;
-				}
+		ss7_block_cics(linkset, e->grs.startcic, e->grs.endcic, e->grs.opc, NULL, 0, 1,  SS7_BLOCKED_HARDWARE);
 
-				dpc = p->dpc;
-				p->ss7call = e->iam.call;
-				isup_set_call_dpc(p->ss7call, dpc);
+		for (i = 0; i <= e->grs.endcic - p->cic; i++)	{
+			p_cur = linkset->pvts[first + i];
+			if(p != p_cur)
+				ast_mutex_lock(&p_cur->lock);
 
-				if ((p->use_callerid) && (!ast_strlen_zero(e->iam.calling_party_num))) {
-					ss7_apply_plan_to_number(p->cid_num, sizeof(p->cid_num), linkset, e->iam.calling_party_num, e->iam.calling_nai);
-					p->callingpres = ss7_pres_scr2cid_pres(e->iam.presentation_ind, e->iam.screening_ind);
-				} else {
-					p->cid_num[0] = 0;
-					if (e->iam.presentation_ind)
-						p->callingpres = ss7_pres_scr2cid_pres(e->iam.presentation_ind, e->iam.screening_ind);
-				}
+			if (circuit_locally_blocked(p_cur) & SS7_BLOCKED_MAINTENANCE) {
+				mb_state[i] = 1;
+			} else
+				mb_state[i] = 0;
 
-				p->called_complete = 0;
-				if (p->immediate) {
-					p->exten[0] = 's';
-					p->exten[1] = '\0';
-				} else if (!ast_strlen_zero(e->iam.called_party_num)) {
-					char *st;
-					ss7_apply_plan_to_number(p->exten, sizeof(p->exten), linkset, e->iam.called_party_num, e->iam.called_nai);
-					st = strchr(p->exten, '#');
-					if (st) {
-						*st = '\0';
-						p->called_complete = 1;
-					}
-				} else
-					p->exten[0] = '\0';
+			circuit_clear(p_cur, CIRCUIT_REMOTE(SS7_BLOCKED_MAINTENANCE));
 
-				p->cid_ani[0] = '\0';
-				if ((p->use_callerid) && (!ast_strlen_zero(e->iam.generic_name)))
-					ast_copy_string(p->cid_name, e->iam.generic_name, sizeof(p->cid_name));
+			if(p_cur->owner) {
+				p_cur->owner->_softhangup |= AST_SOFTHANGUP_DEV;
+				if(p_cur->owner->_state == AST_STATE_DIALING && !p_cur->proceeding)
+					p_cur->owner->hangupcause = SS7_CAUSE_TRY_AGAIN;
 				else
-					p->cid_name[0] = '\0';
-
-				p->cid_ani2 = e->iam.oli_ani2;
-				p->cid_ton = 0;
-				ast_copy_string(p->charge_number, e->iam.charge_number, sizeof(p->charge_number));
-				ast_copy_string(p->gen_add_number, e->iam.gen_add_number, sizeof(p->gen_add_number));
-				p->gen_add_type = e->iam.gen_add_type;
-				p->gen_add_nai = e->iam.gen_add_nai;
-				p->gen_add_pres_ind = e->iam.gen_add_pres_ind;
-				p->gen_add_num_plan = e->iam.gen_add_num_plan;
-				ast_copy_string(p->gen_dig_number, e->iam.gen_dig_number, sizeof(p->gen_dig_number));
-				p->gen_dig_type = e->iam.gen_dig_type;
-				p->gen_dig_scheme = e->iam.gen_dig_scheme;
-				ast_copy_string(p->jip_number, e->iam.jip_number, sizeof(p->jip_number));
-				if (!ast_strlen_zero(e->iam.orig_called_num))
-					ss7_apply_plan_to_number(p->orig_called_num, sizeof(p->orig_called_num), linkset, e->iam.orig_called_num, e->iam.orig_called_nai);
-				if(!ast_strlen_zero(e->iam.redirecting_num))
-					ss7_apply_plan_to_number(p->redirecting_num, sizeof(p->redirecting_num), linkset, e->iam.redirecting_num, e->iam.redirecting_num_nai);
-				ast_copy_string(p->generic_name, e->iam.generic_name, sizeof(p->generic_name));
-				p->calling_party_cat = e->iam.calling_party_cat;
-				p->redirect_counter = e->iam.redirect_counter;
-				p->redirect_info = e->iam.redirect_info;
-				p->redirect_info_ind = e->iam.redirect_info_ind;
-				p->redirect_info_orig_reas = e->iam.redirect_info_orig_reas;
-				p->redirect_info_counter = e->iam.redirect_info_counter;
-				p->redirect_info_reas = e->iam.redirect_info_reas;
-				p->cug_indicator = e->iam.cug_indicator;
-				p->cug_interlock_code = e->iam.cug_interlock_code;
-				ast_copy_string(p->cug_interlock_ni, e->iam.cug_interlock_ni, sizeof(p->cug_interlock_ni));
-
-				if (e->iam.cot_check_required)
-						dahdi_loopback(p, 1);
-
-				p->echocontrol_ind = e->iam.echocontrol_ind;
-ss7_start_switch:
-				if (option_verbose > 2)
-					ast_verbose("SS7 exten: %s complete: %i\n", p->exten, p->called_complete);
-				if (ast_exists_extension(NULL, p->context, p->exten, 1, p->cid_num) && (!ast_matchmore_extension(NULL, p->context, p->exten, 1, p->cid_num) || p->called_complete)) {
-					p->called_complete = 1; /* If COT succesful start call! */
-					/* Set DNID */
-					strncpy(p->dnid, p->exten, sizeof(p->dnid));
-					if ((e->e == ISUP_EVENT_IAM) ? !(e->iam.cot_check_required || e->iam.cot_performed_on_previous_cic) : (!(e->sam.cot_check_required || e->sam.cot_performed_on_previous_cic) || e->sam.cot_check_passed))
-						ss7_start_call(p, linkset);
-				} else if (ast_canmatch_extension(NULL, p->context, p->exten, 1, p->cid_num) && !p->called_complete) {
-					isup_start_digittimeout(ss7, p->ss7call);
-				} else if (!ast_matchmore_extension(NULL, p->context, p->exten, 1, p->cid_num) || p->called_complete) {
-					ast_debug(1, "Call on CIC for unconfigured extension %s\n", p->exten);
-					isup_rel(ss7, (e->e == ISUP_EVENT_IAM) ? e->iam.call : e->sam.call, AST_CAUSE_UNALLOCATED);
-				}
-				ast_mutex_unlock(&p->lock);
-
-				if (e->e == ISUP_EVENT_IAM && e->iam.cot_performed_on_previous_cic) {
-					chanpos = ss7_find_cic(linkset, (e->iam.cic - 1), e->iam.opc);
-					if (chanpos < 0) {
-						/* some stupid switch do this */
-						ast_verbose("COT request on previous non exists CIC %d in IAM PC %d\n", (e->iam.cic - 1), e->iam.opc);
-						break;
-					}
-					ast_verbose("COT request on previous CIC %d in IAM PC %d\n", (e->iam.cic - 1), e->iam.opc);
-					p = linkset->pvts[chanpos];
-					ast_mutex_lock(&p->lock);
-					if (!p->ss7call && !p->owner) {
-						p->inservice = 0; /* to prevent to use this circuit */
-						dahdi_loopback(p, 1);
-					} /* If already have a call don't loop */
-					ast_mutex_unlock(&p->lock);
-				}
-				break;
-			case ISUP_EVENT_DIGITTIMEOUT:
-				chanpos = ss7_find_cic(linkset, e->digittimeout.cic, e->digittimeout.opc);
-				if (chanpos < 0) {
-					ast_log(LOG_WARNING, "DIGITTIMEOUT on unconfigured CIC %d PC %d\n", e->digittimeout.cic, e->digittimeout.opc);
-					isup_free_call(ss7, e->digittimeout.call);
-					break;
-				}
-				p = linkset->pvts[chanpos];
-				ast_debug(1, "Digittimeout on CIC: %d PC: %d\n", e->digittimeout.cic, e->digittimeout.opc);
-				ast_mutex_lock(&p->lock);
-				p->called_complete = 1; /* If COT succesful start call! */
-				strncpy(p->dnid, p->exten, sizeof(p->dnid));
-				if (!(e->digittimeout.cot_check_required || e->digittimeout.cot_performed_on_previous_cic) || e->digittimeout.cot_check_passed)
-					ss7_start_call(p, linkset);
-				ast_mutex_unlock(&p->lock);
-				break;
-			case ISUP_EVENT_COT:
-				if (e->cot.cot_performed_on_previous_cic) {
-					chanpos = ss7_find_cic(linkset, (e->cot.cic - 1), e->cot.opc);
-					/* some stupid switches do this!!! */
-					if (chanpos > 0) {
-						p = linkset->pvts[chanpos];
-						ast_mutex_lock(&p->lock);
-						p->inservice = 1;
-						dahdi_loopback(p, 0);
-						ast_mutex_unlock(&p->lock);
-						ast_verbose("Loop turned off on CIC: %d PC: %d\n",  (e->cot.cic - 1), e->cot.opc);
-					}
-				}
+					p_cur->owner->hangupcause = AST_CAUSE_NORMAL_CLEARING;
+				p_cur->do_hangup = SS7_HANGUP_FREE_CALL;
+			} else if (p->ss7call && p != p_cur) { /* clear any session */
+				isup_free_call(ss7, p_cur->ss7call);
+				p_cur->ss7call = NULL;
+			}
 
-				chanpos = ss7_find_cic(linkset, e->cot.cic, e->cot.opc);
-				if (chanpos < 0) { /* Never will be true */
-					ast_log(LOG_WARNING, "COT on unconfigured CIC %d PC %d\n", e->cot.cic, e->cot.opc);
-					isup_free_call(ss7, e->cot.call);
-					break;
-				}
-				p = linkset->pvts[chanpos];
+			circuit_set(p_cur, CIRCUIT_INSERVICE);
+			ss7_queue_bearer(p_cur, SS7_BEARER_PREPARE);
 
-				ast_mutex_lock(&p->lock);
-				p->ss7call = e->cot.call;
+			if(p != p_cur)
+				ast_mutex_unlock(&p_cur->lock);
+		}
 
-				if (p->loopedback) {
-					dahdi_loopback(p, 0);
-					ast_verbose("Loop turned off on CIC: %d PC: %d\n",  e->cot.cic, e->cot.opc);
-				}
+		isup_gra(ss7, p->ss7call, e->grs.endcic, mb_state);
+		if(!p->owner)
+			p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
+		ast_mutex_unlock(&p->lock);
+		break;
+	case ISUP_EVENT_CQM:
+		ast_debug(1, "Got Circuit group query message from CICs %d to %d\n", e->cqm.startcic, e->cqm.endcic);
+		ss7_handle_cqm(linkset, e->cqm.startcic, e->cqm.endcic, e->cqm.opc);
+		p = ss7_find_cic(linkset, e->iam.cic, e->iam.opc);
+		if (p) {
+			ast_mutex_lock(&p->lock);
+			if (!p->owner)
+				p->ss7call = isup_free_call_if_clear(ss7, e->cqm.call);
+			ast_mutex_unlock(&p->lock);
+		}
+		break;
 
-				/* Don't start call if we didn't get IAM or COT failed! */
-				if ((e->cot.got_sent_msg & ISUP_GOT_IAM) && e->cot.passed && p->called_complete)
-					ss7_start_call(p, linkset);
+	case ISUP_EVENT_GRA:
+		if(!ss7_find_cic_range(linkset, e->gra.startcic, e->gra.endcic, e->gra.opc)) { /* Never will be true */
+			ast_log(LOG_WARNING, "GRA on unconfigured range CIC %d - %d PC %d\n", e->gra.startcic, e->gra.endcic, e->gra.opc);
+			isup_free_call(ss7, e->gra.call);
+			break;
+		}
+		p = ss7_find_cic(linkset, e->gra.startcic, e->gra.opc);
+		ast_mutex_lock(&p->lock);
+		p->ss7call = e->gra.call;
+		ss7_stat_phase(p, SS7_PHASE_GRA);
 
-				p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
-				ast_mutex_unlock(&p->lock);
-				break;
-			case ISUP_EVENT_CCR:
-				ast_debug(1, "Got CCR request on CIC %d\n", e->ccr.cic);
-				chanpos = ss7_find_cic(linkset, e->ccr.cic, e->ccr.opc);
-				if (chanpos < 0) {
-					ast_log(LOG_WARNING, "CCR on unconfigured CIC %d PC %d\n", e->ccr.cic, e->ccr.opc);
-					isup_free_call(ss7, e->ccr.call);
-					break;
-				}
+		ast_verbose("Got reset acknowledgement from CIC %d to %d DPC: %d\n", e->gra.startcic, e->gra.endcic, e->gra.opc);
+		ss7_inservice(linkset, e->gra.startcic, e->gra.endcic, e->gra.opc);
+		ss7_block_cics(linkset, e->gra.startcic, e->gra.endcic, e->gra.opc, e->gra.status,
+			1, 1, SS7_BLOCKED_MAINTENANCE);
 
-				p = linkset->pvts[chanpos];
+		p->ss7call = isup_free_call_if_clear(ss7, p->ss7call); /* we may sent a CDB with GRS! */
+		ast_mutex_unlock(&p->lock);
+		ss7_grs_ack(linkset, p);
+		break;
+	case ISUP_EVENT_SAM:
+		p = ss7_find_cic(linkset, e->sam.cic, e->sam.opc);
+		if(!p) {
+			ast_log(LOG_WARNING, "SAM on unconfigured CIC %d PC %d\n", e->sam.cic, e->sam.opc);
+			isup_free_call(ss7, e->sam.call);
+			break;
+		}
+		ast_mutex_lock(&p->lock);
+		if(p->owner) {
+			ast_log(LOG_WARNING, "SAM on CIC %d PC %d already have call\n", e->sam.cic, e->sam.opc);
+			ast_mutex_unlock(&p->lock);
+			break;
+		}
+		p->called_complete = 0;
+		if (!ast_strlen_zero(e->sam.called_party_num)) {
+			ast_copy_string(p->exten + p->overlap_checked, e->sam.called_party_num, sizeof(p->exten) - p->overlap_checked);
+			ss7_overlap_digits(linkset, p);
+		} else {
+			p->exten[0] = '\0';
+			p->overlap_checked = 0;
+		}
+		goto ss7_start_switch;
+	case ISUP_EVENT_IAM:
+ 				ast_debug(1, "Got IAM for CIC %d and called number %s, calling number %s\n", e->iam.cic, e->iam.called_party_num, e->iam.calling_party_num);
+		p = ss7_find_cic(linkset, e->iam.cic, e->iam.opc);
+		if (!p) {
+			ast_log(LOG_WARNING, "IAM on unconfigured CIC %d PC %d\n", e->iam.cic, e->iam.opc);
+			isup_free_call(ss7, e->iam.call);
+			break;
+		}
+		ast_mutex_lock(&p->lock);
+		p->ss7call = e->iam.call;
+		if (circuit_locally_blocked(p)) {
+			isup_clear_callflags(ss7, p->ss7call, ISUP_GOT_IAM);
+			p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
+			ast_mutex_unlock(&p->lock);
+			ast_log(LOG_WARNING, "Got IAM on locally blocked CIC %d DPC %d, ignore\n", e->iam.cic, e->iam.opc);
+			break;
+		}
+		if (circuit_remotely_blocked(p)) {
+			ast_log(LOG_NOTICE, "Got IAM on remotely blocked CIC %d DPC %d remove blocking\n", e->iam.cic, e->iam.opc);
+			circuit_update(p, CIRCUIT_REMOTE_MASK, CIRCUIT_INSERVICE);
+		}
+		if (p->owner) {
+			ast_mutex_unlock(&p->lock);
+			ast_log(LOG_WARNING, "Ring requested on CIC %d already in use!\n", e->iam.cic);
+			break;
+		}
+		ss7_stat_phase(p, SS7_PHASE_IAM);
 
-				ast_mutex_lock(&p->lock);
-				p->ss7call = e->ccr.call;
-				dahdi_loopback(p, 1);
-				ast_mutex_unlock(&p->lock);
+		if (ss7_overloaded(linkset)) {
+			/* Turn the call away before any work is spent on it, the RLC frees the call */
+			isup_rel(ss7, e->iam.call, AST_CAUSE_SWITCH_CONGESTION);
+			ss7_stat_phase(p, SS7_PHASE_REL);
+			linkset->shed++;
+			ast_mutex_unlock(&p->lock);
+			ast_debug(1, "Rejected IAM on CIC %d DPC %d, linkset overloaded\n", e->iam.cic, e->iam.opc);
+			break;
+		}
 
-				if (linkset->type == SS7_ANSI)
-				    isup_lpa(linkset->ss7, e->ccr.cic, p->dpc);
-				break;
-			case ISUP_EVENT_CVT:
-				ast_debug(1, "Got CVT request on CIC %d\n", e->cvt.cic);
-				chanpos = ss7_find_cic(linkset, e->cvt.cic, e->cvt.opc);
-				if (chanpos < 0) {
-					ast_log(LOG_WARNING, "CVT on unconfigured CIC %d PC %d\n", e->cvt.cic, e->cvt.opc);
-					isup_free_call(ss7, e->cvt.call);
-					break;
-				}
+		dpc = p->dpc;
+		p->ss7call = e->iam.call;
+		isup_set_call_dpc(p->ss7call, dpc);
 
-				p = linkset->pvts[chanpos];
+		if ((p->use_callerid) && (!ast_strlen_zero(e->iam.calling_party_num))) {
+			ss7_apply_plan_to_number(p->cid_num, sizeof(p->cid_num), linkset, e->iam.calling_party_num, e->iam.calling_nai);
+			p->callingpres = ss7_pres_scr2cid_pres(e->iam.presentation_ind, e->iam.screening_ind);
+		} else {
+			p->cid_num[0] = 0;
+			if (e->iam.presentation_ind)
+				p->callingpres = ss7_pres_scr2cid_pres(e->iam.presentation_ind, e->iam.screening_ind);
+		}
+
+		p->called_complete = 0;
+		p->overlap_checked = 0;
+		if (p->immediate) {
+			p->exten[0] = 's';
+			p->exten[1] = '\0';
+		} else if (!ast_strlen_zero(e->iam.called_party_num)) {
+			ss7_apply_plan_to_number(p->exten, sizeof(p->exten), linkset, e->iam.called_party_num, e->iam.called_nai);
+			ss7_overlap_digits(linkset, p);
+		} else
+			p->exten[0] = '\0';
 
-				ast_mutex_lock(&p->lock);
-				p->ss7call = e->cvt.call;
+		p->cid_ani[0] = '\0';
+		if ((p->use_callerid) && (!ast_strlen_zero(e->iam.generic_name)))
+			ast_copy_string(p->cid_name, e->iam.generic_name, sizeof(p->cid_name));
+		else
+			p->cid_name[0] = '\0';
+
+		p->cid_ani2 = e->iam.oli_ani2;
+		p->cid_ton = 0;
+		ast_copy_string(p->charge_number, e->iam.charge_number, sizeof(p->charge_number));
+		ast_copy_string(p->gen_add_number, e->iam.gen_add_number, sizeof(p->gen_add_number));
+		p->gen_add_type = e->iam.gen_add_type;
+		p->gen_add_nai = e->iam.gen_add_nai;
+		p->gen_add_pres_ind = e->iam.gen_add_pres_ind;
+		p->gen_add_num_plan = e->iam.gen_add_num_plan;
+		ast_copy_string(p->gen_dig_number, e->iam.gen_dig_number, sizeof(p->gen_dig_number));
+		p->gen_dig_type = e->iam.gen_dig_type;
+		p->gen_dig_scheme = e->iam.gen_dig_scheme;
+		ast_copy_string(p->jip_number, e->iam.jip_number, sizeof(p->jip_number));
+		if (!ast_strlen_zero(e->iam.orig_called_num))
+			ss7_apply_plan_to_number(p->orig_called_num, sizeof(p->orig_called_num), linkset, e->iam.orig_called_num, e->iam.orig_called_nai);
+		if(!ast_strlen_zero(e->iam.redirecting_num))
+			ss7_apply_plan_to_number(p->redirecting_num, sizeof(p->redirecting_num), linkset, e->iam.redirecting_num, e->iam.redirecting_num_nai);
+		ast_copy_string(p->generic_name, e->iam.generic_name, sizeof(p->generic_name));
+		p->calling_party_cat = e->iam.calling_party_cat;
+		p->redirect_counter = e->iam.redirect_counter;
+		p->redirect_info = e->iam.redirect_info;
+		p->redirect_info_ind = e->iam.redirect_info_ind;
+		p->redirect_info_orig_reas = e->iam.redirect_info_orig_reas;
+		p->redirect_info_counter = e->iam.redirect_info_counter;
+		p->redirect_info_reas = e->iam.redirect_info_reas;
+		p->cug_indicator = e->iam.cug_indicator;
+		p->cug_interlock_code = e->iam.cug_interlock_code;
+		ast_copy_string(p->cug_interlock_ni, e->iam.cug_interlock_ni, sizeof(p->cug_interlock_ni));
+
+		if (e->iam.cot_check_required)
 				dahdi_loopback(p, 1);
-				if (!p->owner)
-					p->ss7call = isup_free_call_if_clear(ss7, e->cvt.call);
-				ast_mutex_unlock(&p->lock);
 
-				isup_cvr(linkset->ss7, e->cvt.cic, p->dpc);
+		p->echocontrol_ind = e->iam.echocontrol_ind;
+ss7_start_switch:
+		if (option_verbose > 2)
+			ast_verbose("SS7 exten: %s complete: %i\n", p->exten, p->called_complete);
+		/* Can match is exists or match more, so two dialplan lookups at most, one once the number is complete */
+		exists = ast_exists_extension(NULL, p->context, p->exten, 1, p->cid_num);
+		matchmore = (exists && p->called_complete) ? 0 : ast_matchmore_extension(NULL, p->context, p->exten, 1, p->cid_num);
+		if (exists && (!matchmore || p->called_complete)) {
+			p->called_complete = 1; /* If COT succesful start call! */
+			/* Set DNID */
+			strncpy(p->dnid, p->exten, sizeof(p->dnid));
+			if ((e->e == ISUP_EVENT_IAM) ? !(e->iam.cot_check_required || e->iam.cot_performed_on_previous_cic) : (!(e->sam.cot_check_required || e->sam.cot_performed_on_previous_cic) || e->sam.cot_check_passed))
+				ss7_start_call(p, linkset);
+		} else if ((exists || matchmore) && !p->called_complete) {
+			isup_start_digittimeout(ss7, p->ss7call);
+		} else {
+			ast_debug(1, "Call on CIC for unconfigured extension %s\n", p->exten);
+			isup_rel(ss7, (e->e == ISUP_EVENT_IAM) ? e->iam.call : e->sam.call, AST_CAUSE_UNALLOCATED);
+			ss7_stat_phase(p, SS7_PHASE_REL);
+		}
+		ast_mutex_unlock(&p->lock);
 
+		if (e->e == ISUP_EVENT_IAM && e->iam.cot_performed_on_previous_cic) {
+			p = ss7_find_cic(linkset, (e->iam.cic - 1), e->iam.opc);
+			if (!p) {
+				/* some stupid switch do this */
+				ast_verbose("COT request on previous non exists CIC %d in IAM PC %d\n", (e->iam.cic - 1), e->iam.opc);
 				break;
-			case ISUP_EVENT_REL:
-				chanpos = ss7_find_cic(linkset, e->rel.cic, e->rel.opc);
-				if (chanpos < 0) {
-					ast_log(LOG_WARNING, "REL on unconfigured CIC %d PC %d\n", e->rel.cic, e->rel.opc);
-					isup_free_call(ss7, e->rel.call);
-					break;
-				}
-				p = linkset->pvts[chanpos];
+			}
+			ast_verbose("COT request on previous CIC %d in IAM PC %d\n", (e->iam.cic - 1), e->iam.opc);
+			ast_mutex_lock(&p->lock);
+			if (!p->ss7call && !p->owner) {
+				circuit_clear(p, CIRCUIT_INSERVICE); /* to prevent to use this circuit */
+				dahdi_loopback(p, 1);
+			} /* If already have a call don't loop */
+			ast_mutex_unlock(&p->lock);
+		}
+		break;
+	case ISUP_EVENT_DIGITTIMEOUT:
+		p = ss7_find_cic(linkset, e->digittimeout.cic, e->digittimeout.opc);
+		if (!p) {
+			ast_log(LOG_WARNING, "DIGITTIMEOUT on unconfigured CIC %d PC %d\n", e->digittimeout.cic, e->digittimeout.opc);
+			isup_free_call(ss7, e->digittimeout.call);
+			break;
+		}
+		ast_debug(1, "Digittimeout on CIC: %d PC: %d\n", e->digittimeout.cic, e->digittimeout.opc);
+		ast_mutex_lock(&p->lock);
+		p->called_complete = 1; /* If COT succesful start call! */
+		strncpy(p->dnid, p->exten, sizeof(p->dnid));
+		if (!(e->digittimeout.cot_check_required || e->digittimeout.cot_performed_on_previous_cic) || e->digittimeout.cot_check_passed)
+			ss7_start_call(p, linkset);
+		ast_mutex_unlock(&p->lock);
+		break;
+	case ISUP_EVENT_COT:
+		if (e->cot.cot_performed_on_previous_cic) {
+			p = ss7_find_cic(linkset, (e->cot.cic - 1), e->cot.opc);
+			/* some stupid switches do this!!! */
+			if (p) {
 				ast_mutex_lock(&p->lock);
-				p->ss7call = e->rel.call;
-				if (p->owner) {
-					p->owner->hangupcause = e->rel.cause;
-					p->owner->_softhangup |= AST_SOFTHANGUP_DEV;
-					p->do_hangup = SS7_HANGUP_SEND_RLC;
-					/* End the loopback if we have one */
-					dahdi_loopback(p, 0);
-				} else {
-					ast_verbose("REL on CIC %d DPC %d without owner!\n", p->cic, p->dpc);
-					isup_rlc(ss7, p->ss7call);
-					p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
-				}
-				/* End the loopback if we have one */
+				circuit_set(p, CIRCUIT_INSERVICE);
 				dahdi_loopback(p, 0);
-
-				/* the rel is not complete here!!! */
 				ast_mutex_unlock(&p->lock);
-				break;
-			case ISUP_EVENT_ACM:
-				chanpos = ss7_find_cic(linkset, e->acm.cic, e->acm.opc);
-				if (chanpos < 0) { /* Never will be true */
-					ast_log(LOG_WARNING, "ACM on unconfigured CIC %d PC: %d\n", e->acm.cic, e->acm.opc);
-					isup_free_call(ss7, e->acm.call);
-					break;
-				} else {
-					p = linkset->pvts[chanpos];
-					ast_mutex_lock(&p->lock);
-					p->ss7call = e->acm.call;
+				ast_verbose("Loop turned off on CIC: %d PC: %d\n",  (e->cot.cic - 1), e->cot.opc);
+			}
+		}
 
-					struct ast_frame f = { AST_FRAME_CONTROL, AST_CONTROL_PROCEEDING, };
-					ast_debug(1, "Queueing frame from SS7_EVENT_ACM on CIC %d\n", p->cic);
+		p = ss7_find_cic(linkset, e->cot.cic, e->cot.opc);
+		if (!p) { /* Never will be true */
+			ast_log(LOG_WARNING, "COT on unconfigured CIC %d PC %d\n", e->cot.cic, e->cot.opc);
+			isup_free_call(ss7, e->cot.call);
+			break;
+		}
 
-					if (e->acm.call_ref_ident > 0) {
-						p->rlt = 1; /* Setting it but not using it here*/
-					}
-					dahdi_queue_frame(p, &f, linkset);
-					p->proceeding = 1;
-					p->dialing = 0;
-					/* Send alerting if subscriber is free */
-					if (e->acm.called_party_status_ind == 1) {
-						p->alerting = 1;
-						p->subs[SUB_REAL].needringing = 1;
-					}
-					p->echocontrol_ind = e->acm.echocontrol_ind;
-					ast_mutex_unlock(&p->lock);
-				}
-				break;
-			case ISUP_EVENT_CGB:
- 				chanpos = ss7_find_cic(linkset, e->cgb.startcic, e->cgb.opc);
- 				if (chanpos < 0) {
-					isup_free_call(ss7, e->cgb.call);
- 					ast_log(LOG_WARNING, "CGB on unconfigured CIC %d PC %d\n", e->cgb.startcic, e->cgb.opc);
- 					break;
- 				}
- 				p = linkset->pvts[chanpos];
-				ast_mutex_lock(&p->lock);
-				p->ss7call = e->cgb.call;
+		ast_mutex_lock(&p->lock);
+		p->ss7call = e->cot.call;
 
-				ss7_check_range(linkset, e->cgb.startcic, e->cgb.endcic, e->cgb.opc, e->cgb.status);
+		if (p->loopedback) {
+			dahdi_loopback(p, 0);
+			ast_verbose("Loop turned off on CIC: %d PC: %d\n",  e->cot.cic, e->cot.opc);
+		}
 
-				ss7_block_cics(linkset, e->cgb.startcic, e->cgb.endcic, e->cgb.opc, e->cgb.status, 1, 1,
-					(e->cgb.type) ? SS7_BLOCKED_HARDWARE : SS7_BLOCKED_MAINTENANCE);
- 				isup_cgba(linkset->ss7, p->ss7call, e->cgb.endcic, e->cgb.status);
-				if(!p->owner)
-					p->ss7call = isup_free_call_if_clear(ss7, e->cgb.call);
-				ast_mutex_unlock(&p->lock);
-				break;
-			case ISUP_EVENT_CGU:
- 				chanpos = ss7_find_cic(linkset, e->cgu.startcic, e->cgu.opc);
- 				if (chanpos < 0) {
-					isup_free_call(ss7, e->cgu.call);
- 					ast_log(LOG_WARNING, "CGU on unconfigured CIC %d PC %d\n", e->cgu.startcic, e->cgu.opc);
- 					break;
- 				}
- 				p = linkset->pvts[chanpos];
-				ast_mutex_lock(&p->lock);
-				p->ss7call = e->cgu.call;
+		/* Don't start call if we didn't get IAM or COT failed! */
+		if ((e->cot.got_sent_msg & ISUP_GOT_IAM) && e->cot.passed && p->called_complete)
+			ss7_start_call(p, linkset);
+
+		p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
+		ast_mutex_unlock(&p->lock);
+		break;
+	case ISUP_EVENT_CCR:
+		ast_debug(1, "Got CCR request on CIC %d\n", e->ccr.cic);
+		p = ss7_find_cic(linkset, e->ccr.cic, e->ccr.opc);
+		if (!p) {
+			ast_log(LOG_WARNING, "CCR on unconfigured CIC %d PC %d\n", e->ccr.cic, e->ccr.opc);
+			isup_free_call(ss7, e->ccr.call);
+			break;
+		}
+
+		ast_mutex_lock(&p->lock);
+		p->ss7call = e->ccr.call;
+		dahdi_loopback(p, 1);
+		ast_mutex_unlock(&p->lock);
+
+		if (linkset->type == SS7_ANSI)
+		    isup_lpa(linkset->ss7, e->ccr.cic, p->dpc);
+		break;
+	case ISUP_EVENT_CVT:
+		ast_debug(1, "Got CVT request on CIC %d\n", e->cvt.cic);
+		p = ss7_find_cic(linkset, e->cvt.cic, e->cvt.opc);
+		if (!p) {
+			ast_log(LOG_WARNING, "CVT on unconfigured CIC %d PC %d\n", e->cvt.cic, e->cvt.opc);
+			isup_free_call(ss7, e->cvt.call);
+			break;
+		}
+
+		ast_mutex_lock(&p->lock);
+		p->ss7call = e->cvt.call;
+		dahdi_loopback(p, 1);
+		if (!p->owner)
+			p->ss7call = isup_free_call_if_clear(ss7, e->cvt.call);
+		ast_mutex_unlock(&p->lock);
 
-				ss7_check_range(linkset, e->cgu.startcic, e->cgu.endcic, e->cgu.opc, e->cgu.status);
+		isup_cvr(linkset->ss7, e->cvt.cic, p->dpc);
+
+		break;
+	case ISUP_EVENT_REL:
+		p = ss7_find_cic(linkset, e->rel.cic, e->rel.opc);
+		if (!p) {
+			ast_log(LOG_WARNING, "REL on unconfigured CIC %d PC %d\n", e->rel.cic, e->rel.opc);
+			isup_free_call(ss7, e->rel.call);
+			break;
+		}
+		ast_mutex_lock(&p->lock);
+		p->ss7call = e->rel.call;
+		ss7_stat_phase(p, SS7_PHASE_REL);
+		if (p->owner) {
+			p->owner->hangupcause = e->rel.cause;
+			p->owner->_softhangup |= AST_SOFTHANGUP_DEV;
+			p->do_hangup = SS7_HANGUP_SEND_RLC;
+			/* End the loopback if we have one */
+			dahdi_loopback(p, 0);
+		} else {
+			ast_verbose("REL on CIC %d DPC %d without owner!\n", p->cic, p->dpc);
+			isup_rlc(ss7, p->ss7call);
+			ss7_stat_phase(p, SS7_PHASE_RLC);
+			p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
+		}
+		/* End the loopback if we have one */
+		dahdi_loopback(p, 0);
+
+		/* the rel is not complete here!!! */
+		ast_mutex_unlock(&p->lock);
+		break;
+	case ISUP_EVENT_ACM:
+		p = ss7_find_cic(linkset, e->acm.cic, e->acm.opc);
+		if (!p) { /* Never will be true */
+			ast_log(LOG_WARNING, "ACM on unconfigured CIC %d PC: %d\n", e->acm.cic, e->acm.opc);
+			isup_free_call(ss7, e->acm.call);
+			break;
+		} else {
+			ast_mutex_lock(&p->lock);
+			p->ss7call = e->acm.call;
+			ss7_stat_phase(p, SS7_PHASE_ACM);
+
+			struct ast_frame f = { AST_FRAME_CONTROL, AST_CONTROL_PROCEEDING, };
+			ast_debug(1, "Queueing frame from SS7_EVENT_ACM on CIC %d\n", p->cic);
+
+			if (e->acm.call_ref_ident > 0) {
+				p->rlt = 1; /* Setting it but not using it here*/
+			}
+			ss7_queue_control(p, f.subclass, linkset);
+			p->proceeding = 1;
+			p->dialing = 0;
+			/* Send alerting if subscriber is free */
+			if (e->acm.called_party_status_ind == 1) {
+				p->alerting = 1;
+				p->subs[SUB_REAL].needringing = 1;
+			}
+			p->echocontrol_ind = e->acm.echocontrol_ind;
+			ast_mutex_unlock(&p->lock);
+		}
+		break;
+	case ISUP_EVENT_CGB:
+		p = ss7_find_cic(linkset, e->cgb.startcic, e->cgb.opc);
+		if (!p) {
+			isup_free_call(ss7, e->cgb.call);
+			ast_log(LOG_WARNING, "CGB on unconfigured CIC %d PC %d\n", e->cgb.startcic, e->cgb.opc);
+			break;
+		}
+		ast_mutex_lock(&p->lock);
+		p->ss7call = e->cgb.call;
+
+		ss7_check_range(linkset, e->cgb.startcic, e->cgb.endcic, e->cgb.opc, e->cgb.status);
+
+		ss7_block_cics(linkset, e->cgb.startcic, e->cgb.endcic, e->cgb.opc, e->cgb.status, 1, 1,
+			(e->cgb.type) ? SS7_BLOCKED_HARDWARE : SS7_BLOCKED_MAINTENANCE);
+		isup_cgba(linkset->ss7, p->ss7call, e->cgb.endcic, e->cgb.status);
+		if(!p->owner)
+			p->ss7call = isup_free_call_if_clear(ss7, e->cgb.call);
+		ast_mutex_unlock(&p->lock);
+		break;
+	case ISUP_EVENT_CGU:
+		p = ss7_find_cic(linkset, e->cgu.startcic, e->cgu.opc);
+		if (!p) {
+			isup_free_call(ss7, e->cgu.call);
+			ast_log(LOG_WARNING, "CGU on unconfigured CIC %d PC %d\n", e->cgu.startcic, e->cgu.opc);
+			break;
+		}
+		ast_mutex_lock(&p->lock);
+		p->ss7call = e->cgu.call;
+
+		ss7_check_range(linkset, e->cgu.startcic, e->cgu.endcic, e->cgu.opc, e->cgu.status);
+
+		ss7_block_cics(linkset, e->cgu.startcic, e->cgu.endcic, e->cgu.opc, e->cgu.status, 0, 1,
+			e->cgu.type ? SS7_BLOCKED_HARDWARE : SS7_BLOCKED_MAINTENANCE);
+		isup_cgua(linkset->ss7, p->ss7call, e->cgu.endcic, e->cgu.status);
+		if(!p->owner)
+			p->ss7call = isup_free_call_if_clear(ss7, e->cgu.call);
+		ast_mutex_unlock(&p->lock);
+		break;
+	case ISUP_EVENT_UCIC:
+		p = ss7_find_cic(linkset, e->ucic.cic, e->ucic.opc);
+		if (!p) {
+			ast_log(LOG_WARNING, "UCIC on unconfigured CIC %d PC %d\n", e->ucic.cic, e->ucic.opc);
+			isup_free_call(ss7, e->ucic.call);
+			break;
+		}
+		ast_debug(1, "Unequiped Circuit Id Code on CIC %d\n", e->ucic.cic);
+		ast_mutex_lock(&p->lock);
+		p->ss7call = e->ucic.call;
+		circuit_update(p, CIRCUIT_REMOTE_MASK | CIRCUIT_INSERVICE, CIRCUIT_REMOTE(SS7_BLOCKED_MAINTENANCE));
+		p->ss7call = NULL;
+		isup_free_call(ss7, e->ucic.call);
+		if (p->owner)
+			p->owner->_softhangup |= AST_SOFTHANGUP_DEV;
+		ast_mutex_unlock(&p->lock);			/* doesn't require a SS7 acknowledgement */
+		break;
+	case ISUP_EVENT_BLO:
+		p = ss7_find_cic(linkset, e->blo.cic, e->blo.opc);
+		if (!p) {
+			ast_log(LOG_WARNING, "BLO on unconfigured CIC %d PC %d\n", e->blo.cic, e->blo.opc);
+			isup_free_call(ss7, e->blo.call);
+			break;
+		}
+		p->ss7call = e->blo.call;
+		ast_debug(1, "Blocking CIC %d\n", e->blo.cic);
+		ast_mutex_lock(&p->lock);
+		circuit_set(p, CIRCUIT_REMOTE(SS7_BLOCKED_MAINTENANCE));
+		isup_bla(linkset->ss7, e->blo.call);
+		if (!p->owner)
+			p->ss7call = isup_free_call_if_clear(ss7, e->blo.call);
+		else if (e->blo.got_sent_msg == ISUP_SENT_IAM) {
+			/* Q.784 6.2.2 */
+			p->owner->hangupcause = SS7_CAUSE_TRY_AGAIN;
+			p->owner->_softhangup |= AST_SOFTHANGUP_DEV;
+		}
+		ast_mutex_unlock(&p->lock);
+		break;
+	case ISUP_EVENT_BLA:
+		p = ss7_find_cic(linkset, e->bla.cic, e->bla.opc);
+		if (!p) { /* Never will be true */
+			ast_log(LOG_WARNING, "BLA on unconfigured CIC %d PC %d\n", e->bla.cic, e->bla.opc);
+			isup_free_call(ss7, e->bla.call);
+			break;
+		}
+		p->ss7call = e->bla.call;
+		ast_mutex_lock(&p->lock);
+		ast_debug(1, "Locally blocking CIC %d\n", e->bla.cic);
+		circuit_set(p, CIRCUIT_LOCAL(SS7_BLOCKED_MAINTENANCE));
+		if (!p->owner)
+			p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
+		ast_mutex_unlock(&p->lock);
+		break;
+	case ISUP_EVENT_UBL:
+		p = ss7_find_cic(linkset, e->ubl.cic, e->ubl.opc);
+		if (!p) {
+			ast_log(LOG_WARNING, "UBL on unconfigured CIC %d PC %d\n", e->ubl.cic, e->ubl.opc);
+			isup_free_call(ss7, e->ubl.call);
+			break;
+		}
+		ast_debug(1, "Remotely unblocking CIC %d PC %d\n", e->ubl.cic, e->ubl.opc);
+		ast_mutex_lock(&p->lock);
+		p->ss7call = e->ubl.call;
+		circuit_clear(p, CIRCUIT_REMOTE(SS7_BLOCKED_MAINTENANCE));
+		isup_uba(linkset->ss7, e->ubl.call);
+		if (!p->owner)
+			p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
+		ast_mutex_unlock(&p->lock);
+		break;
+	case ISUP_EVENT_UBA:
+		p = ss7_find_cic(linkset, e->uba.cic, e->uba.opc);
+		if (!p) {
+			ast_log(LOG_WARNING, "UBA on unconfigured CIC %d PC %d\n", e->uba.cic, e->uba.opc);
+			isup_free_call(ss7, e->uba.call);
+			break;
+		}
+		ast_mutex_lock(&p->lock);
+		p->ss7call = e->uba.call;
+		ast_debug(1, "Locally unblocking CIC %d PC %d\n", e->uba.cic, e->uba.opc);
+		circuit_clear(p, CIRCUIT_LOCAL(SS7_BLOCKED_MAINTENANCE));
+		if (!p->owner)
+			p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
+		ast_mutex_unlock(&p->lock);
+		break;
+	case ISUP_EVENT_CON:
+	case ISUP_EVENT_ANM:
+		if (e->e == ISUP_EVENT_CON) {
+			cic = e->con.cic;
+			/* if (e->con.connected_num)
+				ss7_process_connected(p, e->con.connected_num, e->con.connected_nai,
+						e->con.connected_presentation_ind, e->con.connected_screening_ind); */
+		} else {
+			cic = e->anm.cic;
+			/* if (e->anm.connected_num)
+				ss7_process_connected(p, e->anm.connected_num, e->anm.connected_nai,
+						e->anm.connected_presentation_ind, e->anm.connected_screening_ind); */
+		}
+
+		p = ss7_find_cic(linkset, cic, (e->e == ISUP_EVENT_ANM) ? e->anm.opc : e->con.opc);
+		if (!p) { /* Never will be true */
+			ast_log(LOG_WARNING, "ANM/CON on unconfigured CIC %d PC %d\n", cic, (e->e == ISUP_EVENT_ANM) ? e->anm.opc : e->con.opc);
+			isup_free_call(ss7, (e->e == ISUP_EVENT_ANM) ? e->anm.call : e->con.call);
+			break;
+		} else {
+			ast_mutex_lock(&p->lock);
+			p->proceeding = 1;
+			p->dialing = 0;
+			p->ss7call = (e->e == ISUP_EVENT_ANM) ?  e->anm.call : e->con.call;
+			ss7_stat_phase(p, SS7_PHASE_ANM);
+			p->subs[SUB_REAL].needanswer = 1;
+			if (p->dsp && p->dsp_features) {
+				ast_dsp_set_features(p->dsp, p->dsp_features);
+				p->dsp_features = 0;
+			}
+			if ((e->e == ISUP_EVENT_ANM) ? !e->anm.echocontrol_ind  : !e->con.echocontrol_ind || !(linkset->flags & LINKSET_FLAG_USEECHOCONTROL))
+				ss7_queue_bearer(p, SS7_BEARER_EC);
+			ast_mutex_unlock(&p->lock);
+		}
+		break;
+	case ISUP_EVENT_RLC:
+		p = ss7_find_cic(linkset, e->rlc.cic, e->rlc.opc);
+		if (!p) { /* Never will be true */
+			ast_log(LOG_WARNING, "RLC on unconfigured CIC %d PC %d\n", e->rlc.cic, e->rlc.opc);
+			isup_free_call(ss7, e->rlc.call);
+			break;
+		} else {
+			ast_mutex_lock(&p->lock);
+			p->ss7call = e->rlc.call;
+			ss7_stat_phase(p, SS7_PHASE_RLC);
+			if (e->rlc.got_sent_msg & (ISUP_SENT_RSC | ISUP_SENT_REL)) {
+				dahdi_loopback(p, 0);
+				if (e->rlc.got_sent_msg & ISUP_SENT_RSC) {
+					circuit_set(p, CIRCUIT_INSERVICE);
+					ss7_queue_bearer(p, SS7_BEARER_PREPARE);
+				}
+			}
+			if (!p->owner)
+				p->ss7call = isup_free_call_if_clear(ss7, e->rlc.call);
+			else {
+				p->owner->_softhangup |= AST_SOFTHANGUP_DEV;
+				p->do_hangup = SS7_HANGUP_DO_NOTHING;
+			}
+			ast_mutex_unlock(&p->lock);
+		}
+		break;
+	case ISUP_EVENT_FAA:
+		p = ss7_find_cic(linkset, e->faa.cic, e->faa.opc);
+		if (!p) {
+			ast_log(LOG_WARNING, "FAA on unconfigured CIC %d PC %d\n", e->faa.cic, e->faa.opc);
+			isup_free_call(ss7, e->faa.call);
+			break;
+		} else {
+			p->ss7call = e->faa.call;
+			ast_debug(1, "FAA received on CIC %d\n", e->faa.cic);
+			ast_mutex_lock(&p->lock);
+			/*if (p->alreadyhungup)
+				ast_log(LOG_NOTICE, "Received FAA and we haven't sent FAR.  Ignoring.\n");
+			FIX IT !!! */
+			p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
+			ast_mutex_unlock(&p->lock);
+		}
+		break;
+	case ISUP_EVENT_CGBA:
+		p = ss7_find_cic(linkset, e->cgba.startcic, e->cgba.opc);
+		if (!p) { /* Never will be true */
+			ast_log(LOG_WARNING, "CGBA on unconfigured CIC %d PC %d\n", e->cgba.startcic, e->cgba.opc);
+			isup_free_call(ss7, e->cgba.call);
+			break;
+		}
+		ast_mutex_lock(&p->lock);
+		p->ss7call = e->cgba.call;
+
+		ss7_block_cics(linkset, e->cgba.startcic, e->cgba.endcic, e->cgba.opc, e->cgba.status, 1, 0,
+				e->cgba.type ? SS7_BLOCKED_HARDWARE : SS7_BLOCKED_MAINTENANCE);
+
+		if(!p->owner)
+			p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
+		ast_mutex_unlock(&p->lock);
+		break;
+	case ISUP_EVENT_CGUA:
+		p = ss7_find_cic(linkset, e->cgua.startcic, e->cgua.opc);
+		if (!p) { /* Never will be true */
+			ast_log(LOG_WARNING, "CGUA on unconfigured CIC %d PC %d\n", e->cgua.startcic, e->cgua.opc);
+			isup_free_call(ss7, e->cgua.call);
+			break;
+		}
+		ast_mutex_lock(&p->lock);
+		p->ss7call = e->cgua.call;
+
+		ss7_block_cics(linkset, e->cgua.startcic, e->cgua.endcic, e->cgua.opc, e->cgua.status, 0, 0,
+			e->cgba.type ? SS7_BLOCKED_HARDWARE : SS7_BLOCKED_MAINTENANCE);
+		if(!p->owner)
+			p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
+		ast_mutex_unlock(&p->lock);
+		break;
+	case ISUP_EVENT_SUS:
+	case ISUP_EVENT_RES:
+		p = ss7_find_cic(linkset, e->susres.cic, e->susres.opc);
+		if (!p) {
+			ast_log(LOG_WARNING, "SUS/RES on unconfigured CIC %d PC %d\n", e->susres.cic, e->susres.opc);
+			isup_free_call(ss7, e->susres.call);
+			break;
+		}
+		ast_mutex_lock(&p->lock);
+		p->ss7call = e->susres.call;
+		if(!p->owner)
+			p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
+		ast_mutex_unlock(&p->lock);
+		break;
+	default:
+		ast_debug(1, "Unknown event %s\n", ss7_event2str(e->e));
+		break;
+	}
+}
+
+/*! \brief Find the CICs and OPC \a e is about, -1 if it is about the whole linkset
+ *
+ * \a data gets the end of a CIC range, a release cause, or whatever else is
+ * worth tracing about the event.
+ */
+static int ss7_event_cics(const ss7_event *e, int *cic, int *endcic, unsigned int *pc, int *data)
+{
+	*cic = *endcic = *data = 0;
+	*pc = 0;
+	switch (e->e) {
+	case ISUP_EVENT_IAM:
+		*cic = *endcic = e->iam.cic;
+		*pc = e->iam.opc;
+		break;
+	case ISUP_EVENT_SAM:
+		*cic = *endcic = e->sam.cic;
+		*pc = e->sam.opc;
+		break;
+	case ISUP_EVENT_ACM:
+		*cic = *endcic = e->acm.cic;
+		*pc = e->acm.opc;
+		break;
+	case ISUP_EVENT_CPG:
+		*cic = *endcic = e->cpg.cic;
+		*pc = e->cpg.opc;
+		break;
+	case ISUP_EVENT_ANM:
+		*cic = *endcic = e->anm.cic;
+		*pc = e->anm.opc;
+		break;
+	case ISUP_EVENT_CON:
+		*cic = *endcic = e->con.cic;
+		*pc = e->con.opc;
+		break;
+	case ISUP_EVENT_REL:
+		*cic = *endcic = e->rel.cic;
+		*pc = e->rel.opc;
+		*data = e->rel.cause;
+		break;
+	case ISUP_EVENT_RLC:
+		*cic = *endcic = e->rlc.cic;
+		*pc = e->rlc.opc;
+		break;
+	case ISUP_EVENT_SUS:
+	case ISUP_EVENT_RES:
+		*cic = *endcic = e->susres.cic;
+		*pc = e->susres.opc;
+		break;
+	case ISUP_EVENT_COT:
+		*cic = *endcic = e->cot.cic;
+		*pc = e->cot.opc;
+		break;
+	case ISUP_EVENT_CCR:
+		*cic = *endcic = e->ccr.cic;
+		*pc = e->ccr.opc;
+		break;
+	case ISUP_EVENT_CVT:
+		*cic = *endcic = e->cvt.cic;
+		*pc = e->cvt.opc;
+		break;
+	case ISUP_EVENT_RSC:
+		*cic = *endcic = e->rsc.cic;
+		*pc = e->rsc.opc;
+		break;
+	case ISUP_EVENT_GRS:
+		*cic = *endcic = e->grs.startcic;
+		*pc = e->grs.opc;
+		*endcic = *data = e->grs.endcic;
+		break;
+	case ISUP_EVENT_GRA:
+		*cic = *endcic = e->gra.startcic;
+		*pc = e->gra.opc;
+		*endcic = *data = e->gra.endcic;
+		break;
+	case ISUP_EVENT_CQM:
+		*cic = *endcic = e->cqm.startcic;
+		*pc = e->cqm.opc;
+		*endcic = *data = e->cqm.endcic;
+		break;
+	case ISUP_EVENT_BLO:
+		*cic = *endcic = e->blo.cic;
+		*pc = e->blo.opc;
+		break;
+	case ISUP_EVENT_BLA:
+		*cic = *endcic = e->bla.cic;
+		*pc = e->bla.opc;
+		break;
+	case ISUP_EVENT_UBL:
+		*cic = *endcic = e->ubl.cic;
+		*pc = e->ubl.opc;
+		break;
+	case ISUP_EVENT_UBA:
+		*cic = *endcic = e->uba.cic;
+		*pc = e->uba.opc;
+		break;
+	case ISUP_EVENT_CGB:
+		*cic = *endcic = e->cgb.startcic;
+		*pc = e->cgb.opc;
+		*endcic = *data = e->cgb.endcic;
+		break;
+	case ISUP_EVENT_CGBA:
+		*cic = *endcic = e->cgba.startcic;
+		*pc = e->cgba.opc;
+		*endcic = *data = e->cgba.endcic;
+		break;
+	case ISUP_EVENT_CGU:
+		*cic = *endcic = e->cgu.startcic;
+		*pc = e->cgu.opc;
+		*endcic = *data = e->cgu.endcic;
+		break;
+	case ISUP_EVENT_CGUA:
+		*cic = *endcic = e->cgua.startcic;
+		*pc = e->cgua.opc;
+		*endcic = *data = e->cgua.endcic;
+		break;
+	case ISUP_EVENT_UCIC:
+		*cic = *endcic = e->ucic.cic;
+		*pc = e->ucic.opc;
+		break;
+	case ISUP_EVENT_FAA:
+		*cic = *endcic = e->faa.cic;
+		*pc = e->faa.opc;
+		break;
+	case ISUP_EVENT_DIGITTIMEOUT:
+		*cic = *endcic = e->digittimeout.cic;
+		*pc = e->digittimeout.opc;
+		break;
+	case MTP2_LINK_UP:
+	case MTP2_LINK_DOWN:
+		*data = e->gen.data;
+		return -1;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+/*! \brief Which CICs ss7_setup_barrier() must finish the setups of before \a e is handled */
+static void ss7_event_range(const ss7_event *e, struct ss7_cic_range *range)
+{
+	int data;
+
+	range->all = ss7_event_cics(e, &range->lo, &range->hi, &range->pc, &data) ? 1 : 0;
+}
+
+/*! \brief Trace the CIC range and OPC of a libss7 event */
+static void ss7_trace_event(struct dahdi_ss7 *linkset, ss7_event *e)
+{
+	int cic, endcic, data;
+	unsigned int pc;
+
+	ss7_event_cics(e, &cic, &endcic, &pc, &data);
+	ss7_trace(linkset, e->e, -1, cic, pc, data);
+}
+
+/*! \brief Count and time \a e while __ss7_handle_event() acts on it, with the linkset lock held */
+static void ss7_handle_event(struct dahdi_ss7 *linkset, ss7_event *e)
+{
+	struct timeval start = ast_tvnow();
+
+	ss7_trace_event(linkset, e);
+
+	linkset->msgcount[(e->e >= 0 && e->e < SS7_STATS_EVENTS) ? e->e : SS7_STATS_EVENTS]++;
+	__ss7_handle_event(linkset, e);
+	ss7_hist_add(&linkset->latency[SS7_LAT_EVENT], start, ast_tvnow());
+	linkset->ev_avg += ((int) lock_prof_since(start) - linkset->ev_avg) / 8;
+}
+
+/*!
+ * \brief Handle the event at the head of the queue of \a linkset, with the linkset lock held
+ *
+ * The setups it depends on are finished while it is still queued, so nothing
+ * queued behind it can be handled first while ss7_setup_barrier() has the
+ * linkset lock dropped.  Only the dispatcher, or ss7_dispatcher_stop() once
+ * that is gone, takes events off the queue.
+ *
+ * \retval 0 on success.
+ * \retval -1 if the queue was empty.
+ */
+static int ss7_dispatch_one(struct dahdi_ss7 *linkset)
+{
+	ss7_event e;
+
+	ast_mutex_lock(&linkset->evlock);
+	if (!linkset->evcount) {
+		ast_mutex_unlock(&linkset->evlock);
+		return -1;
+	}
+	e = linkset->evq[linkset->evhead];
+	ast_mutex_unlock(&linkset->evlock);
+
+	ss7_setup_barrier(linkset, &e);
+
+	ast_mutex_lock(&linkset->evlock);
+	linkset->evhead = (linkset->evhead + 1) % linkset->evsize;
+	linkset->evcount--;
+	ast_mutex_unlock(&linkset->evlock);
+	ss7_handle_event(linkset, &e);
+	return 0;
+}
+
+/*! \brief Double the event queue of \a linkset, with evlock held */
+static int ss7_grow_events(struct dahdi_ss7 *linkset)
+{
+	ss7_event *evq;
+	int i;
+
+	if (!(evq = ast_calloc(linkset->evsize * 2, sizeof(*evq))))
+		return -1;
+	for (i = 0; i < linkset->evcount; i++)
+		evq[i] = linkset->evq[(linkset->evhead + i) % linkset->evsize];
+	ast_free(linkset->evq);
+	linkset->evq = evq;
+	linkset->evhead = 0;
+	linkset->evsize *= 2;
+	return 0;
+}
+
+/*!
+ * \brief Link I/O stage: hand every event libss7 has queued for \a linkset to the dispatch stage
+ *
+ * Called with the linkset lock held, right after the HDLC reads, writes and
+ * MTP timers.  The dispatcher of the linkset handles the events one at a time,
+ * so the link is serviced again between two slow call setups.  A full queue
+ * grows rather than being drained here: the dispatcher may have the event at
+ * its head in flight, and this thread must not drop the linkset lock while
+ * \a e still points into libss7.  Only without a running dispatcher are the
+ * events handled here, and then no setup is ever queued to wait for.
+ */
+static void ss7_linkset_dispatch(struct dahdi_ss7 *linkset)
+{
+	ss7_event *e;
+	unsigned int n = 0;
+
+	while ((e = ss7_check_event(linkset->ss7))) {
+		n++;
+		if (!linkset->evq) {
+			ss7_handle_event(linkset, e);
+			continue;
+		}
+		ast_mutex_lock(&linkset->evlock);
+		if (linkset->evcount == linkset->evsize) {
+			linkset->evoverflow++;
+			if (ss7_grow_events(linkset)) {
+				ast_mutex_unlock(&linkset->evlock);
+				ast_log(LOG_ERROR, "Linkset %d: ISUP event queue full, dropping %s\n",
+					(int) (linkset - linksets) + 1, ss7_event2str(e->e));
+				continue;
+			}
+		}
+		linkset->evq[(linkset->evhead + linkset->evcount) % linkset->evsize] = *e;
+		if (++linkset->evcount > linkset->evpeak)
+			linkset->evpeak = linkset->evcount;
+		ast_cond_signal(&linkset->evcond);
+		ast_mutex_unlock(&linkset->evlock);
+	}
+	ss7_grs_pump(linkset);
+	linkset->passes++;
+	linkset->passevents += n;
+	if (n > linkset->passmax)
+		linkset->passmax = n;
+}
+
+/*! \brief Move the calling thread of \a linkset to its placement, if that changed since \a gen */
+static void ss7_thread_place(struct dahdi_ss7 *linkset, const char *what, int *gen)
+{
+	struct dahdi_placement place;
+	char name[48];
+
+	if (*gen == linkset->place_gen)
+		return;
+	ast_mutex_lock(&linkset->lock);
+	*gen = linkset->place_gen;
+	place = linkset->placement;
+	ast_mutex_unlock(&linkset->lock);
+	snprintf(name, sizeof(name), "%s of linkset %d", what, (int) (linkset - linksets) + 1);
+	dahdi_thread_place(name, &place);
+}
+
+/*! \brief ISUP dispatch thread of one linkset */
+static void *ss7_dispatch_thread(void *data)
+{
+	struct dahdi_ss7 *linkset = data;
+	struct dahdi_pvt *p;
+	int gen = -1;
+
+	for (;;) {
+		ast_mutex_lock(&linkset->evlock);
+		while (!linkset->evcount && !linkset->evstop)
+			ast_cond_wait(&linkset->evcond, &linkset->evlock);
+		if (linkset->evstop) {
+			ast_mutex_unlock(&linkset->evlock);
+			break;
+		}
+		ast_mutex_unlock(&linkset->evlock);
+		ss7_thread_place(linkset, "SS7 dispatcher", &gen);
+
+		ast_mutex_lock(&linkset->lock);
+		if (ss7_dispatch_one(linkset)) {
+			ast_mutex_unlock(&linkset->lock);
+			continue;
+		}
+		if (!linkset->numsetup_threads) {
+			while ((p = ss7_setup_take(linkset, NULL)))
+				ss7_setup_run(linkset, p);
+		}
+		ast_mutex_unlock(&linkset->lock);
+	}
+
+	return NULL;
+}
+
+static int ss7_dispatcher_start(struct dahdi_ss7 *linkset)
+{
+	if (!(linkset->evq = ast_calloc(SS7_EVENT_QUEUE, sizeof(*linkset->evq))))
+		return -1;
+	linkset->evsize = SS7_EVENT_QUEUE;
+	linkset->evhead = linkset->evcount = 0;
+	linkset->evstop = 0;
+	if (ast_pthread_create(&linkset->dispatcher, NULL, ss7_dispatch_thread, linkset)) {
+		ast_free(linkset->evq);
+		linkset->evq = NULL;
+		return -1;
+	}
+	for (linkset->numsetup_threads = 0; linkset->numsetup_threads < ss7_setup_threads; linkset->numsetup_threads++) {
+		if (ast_pthread_create(&linkset->setup_threads[linkset->numsetup_threads], NULL, ss7_setup_thread, linkset)) {
+			ast_log(LOG_WARNING, "Unable to start more than %d call setup threads on linkset %d\n",
+				linkset->numsetup_threads, (int) (linkset - linksets) + 1);
+			break;
+		}
+	}
+	return 0;
+}
+
+/*! \brief Stop the dispatcher of \a linkset, once its link I/O thread is gone */
+static void ss7_dispatcher_stop(struct dahdi_ss7 *linkset)
+{
+	struct dahdi_pvt *p;
+	int i;
+
+	if (!linkset->evq)
+		return;
+
+	ast_mutex_lock(&linkset->evlock);
+	linkset->evstop = 1;
+	ast_cond_signal(&linkset->evcond);
+	ast_cond_broadcast(&linkset->setupcond);
+	ast_mutex_unlock(&linkset->evlock);
+	pthread_join(linkset->dispatcher, NULL);
+	for (i = 0; i < linkset->numsetup_threads; i++)
+		pthread_join(linkset->setup_threads[i], NULL);
+	linkset->numsetup_threads = 0;
+
+	/* Whatever was left over still gets handled, in order */
+	ast_mutex_lock(&linkset->lock);
+	while (!ss7_dispatch_one(linkset))
+		;
+	while ((p = ss7_setup_take(linkset, NULL)))
+		ss7_setup_run(linkset, p);
+	ast_free(linkset->evq);
+	linkset->evq = NULL;
+	ast_mutex_unlock(&linkset->lock);
+}
+
+static void *ss7_linkset(void *data)
+{
+	int res, i;
+	struct timeval next;
+	struct dahdi_ss7 *linkset = (struct dahdi_ss7 *) data;
+	struct ss7 *ss7 = linkset->ss7;
+	struct pollfd pollers[NUM_DCHANS];
+	int nextms = 0;
+	int gen = -1;
+
+	ss7_start(ss7);
+
+	while(1) {
+		ss7_thread_place(linkset, "SS7 linkset thread", &gen);
+		nextms = ss7_linkset_deadline(linkset, &next) ? -1 : ss7_ms_until(next);
+
+		for (i = 0; i < linkset->numsigchans; i++) {
+			pollers[i].fd = linkset->fds[i];
+			pollers[i].events = ss7_pollflags(ss7, linkset->fds[i]);
+			pollers[i].revents = 0;
+		}
+
+		res = poll(pollers, linkset->numsigchans, nextms);
+		if ((res < 0) && (errno != EINTR)) {
+			ast_log(LOG_ERROR, "poll(%s)\n", strerror(errno));
+		} else if (!res) {
+			ast_mutex_lock(&linkset->lock);
+			ss7_schedule_run(ss7);
+			ast_mutex_unlock(&linkset->lock);
+			/* continue; */
+		}
+
+		ast_mutex_lock(&linkset->lock);
+		for (i = 0; i < linkset->numsigchans; i++)
+			ss7_linkset_fd_event(linkset, i, pollers[i].revents);
+		ss7_linkset_dispatch(linkset);
+		ast_mutex_unlock(&linkset->lock);
+	}
+
+	return 0;
+}
+
+static inline int ss7_timer_before(struct timeval a, struct timeval b)
+{
+	return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_usec < b.tv_usec);
+}
+
+static void ss7_heap_swap(struct ss7_worker *w, int a, int b)
+{
+	struct dahdi_ss7 *tmp = w->heap[a];
+
+	w->heap[a] = w->heap[b];
+	w->heap[b] = tmp;
+	w->heap[a]->heap_pos = a;
+	w->heap[b]->heap_pos = b;
+}
+
+/*! \brief Restore heap order around \a pos after its deadline changed */
+static void ss7_heap_fix(struct ss7_worker *w, int pos)
+{
+	int child;
+
+	while (pos > 0 && ss7_timer_before(w->heap[pos]->deadline, w->heap[(pos - 1) / 2]->deadline)) {
+		ss7_heap_swap(w, pos, (pos - 1) / 2);
+		pos = (pos - 1) / 2;
+	}
+	for (;;) {
+		child = 2 * pos + 1;
+		if (child >= w->heapsize)
+			break;
+		if (child + 1 < w->heapsize && ss7_timer_before(w->heap[child + 1]->deadline, w->heap[child]->deadline))
+			child++;
+		if (!ss7_timer_before(w->heap[child]->deadline, w->heap[pos]->deadline))
+			break;
+		ss7_heap_swap(w, pos, child);
+		pos = child;
+	}
+}
+
+/*! \brief Re-read the next libss7 timer of \a linkset and move it in, around or out of the worker's heap */
+static void ss7_heap_update(struct ss7_worker *w, struct dahdi_ss7 *linkset)
+{
+	int pos = linkset->heap_pos;
+
+	if (ss7_linkset_deadline(linkset, &linkset->deadline)) {
+		if (pos < 0)
+			return;
+		linkset->heap_pos = -1;
+		if (pos != --w->heapsize) {
+			w->heap[pos] = w->heap[w->heapsize];
+			w->heap[pos]->heap_pos = pos;
+			ss7_heap_fix(w, pos);
+		}
+		return;
+	}
+	if (pos < 0) {
+		pos = w->heapsize++;
+		w->heap[pos] = linkset;
+		linkset->heap_pos = pos;
+	}
+	ss7_heap_fix(w, pos);
+}
+
+static inline unsigned int ss7_poll2epoll(short events)
+{
+	return ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLPRI) ? EPOLLPRI : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+}
+
+static inline short ss7_epoll2poll(unsigned int events)
+{
+	return ((events & EPOLLIN) ? POLLIN : 0) | ((events & EPOLLPRI) ? POLLPRI : 0) | ((events & EPOLLOUT) ? POLLOUT : 0);
+}
+
+/*! \brief Bring the worker's epoll registrations for \a linkset in line with what libss7 wants to poll for */
+static void ss7_worker_sync(struct ss7_worker *w, struct dahdi_ss7 *linkset)
+{
+	struct epoll_event ev;
+	unsigned int mask;
+	int i;
+
+	ast_mutex_lock(&linkset->lock);
+	for (i = 0; i < linkset->numsigchans; i++) {
+		mask = ss7_poll2epoll(ss7_pollflags(linkset->ss7, linkset->fds[i]));
+		if (mask == linkset->epmask[i])
+			continue;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = mask;
+		ev.data.u64 = ((uint64_t) (linkset - linksets) << 8) | i;
+		if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, linkset->fds[i], &ev))
+			ast_log(LOG_WARNING, "Unable to update signalling channel %d of linkset %d: %s\n", i, (int) (linkset - linksets) + 1, strerror(errno));
+		else
+			linkset->epmask[i] = mask;
+	}
+	ast_mutex_unlock(&linkset->lock);
+}
+
+/*! \brief Signalling thread for the linksets of one worker, see ss7workers in chan_dahdi.conf */
+static void *ss7_worker_thread(void *data)
+{
+	struct ss7_worker *w = data;
+	struct epoll_event events[NUM_SPANS * NUM_DCHANS];
+	struct dahdi_ss7 *linkset;
+	struct timeval now;
+	int i, res, nextms, timers;
+	int gen = -1;
+
+	for (i = 0; i < w->numlinksets; i++) {
+		ss7_start(w->linksets[i]->ss7);
+		w->linksets[i]->dirty = 1;
+	}
+
+	for (;;) {
+		/* Linksets sharing a worker are expected to share their placement too */
+		ss7_thread_place(w->linksets[0], "SS7 linkset worker", &gen);
+		w->kicked = 0;
+		for (i = 0; i < w->numlinksets; i++) {
+			linkset = w->linksets[i];
+			if (!linkset->dirty)
+				continue;
+			ast_mutex_lock(&linkset->lock);
+			linkset->dirty = 0;
+			ss7_linkset_dispatch(linkset);
+			ast_mutex_unlock(&linkset->lock);
+			ss7_worker_sync(w, linkset);
+			ss7_heap_update(w, linkset);
+		}
+		if (w->kicked)
+			continue;
+
+		nextms = w->heapsize ? ss7_ms_until(w->heap[0]->deadline) : -1;
+		res = epoll_wait(w->epfd, events, ARRAY_LEN(events), nextms);
+		if (res < 0) {
+			if (errno != EINTR)
+				ast_log(LOG_ERROR, "epoll_wait(%s)\n", strerror(errno));
+			continue;
+		}
 
-				ss7_block_cics(linkset, e->cgu.startcic, e->cgu.endcic, e->cgu.opc, e->cgu.status, 0, 1,
-					e->cgu.type ? SS7_BLOCKED_HARDWARE : SS7_BLOCKED_MAINTENANCE);
- 				isup_cgua(linkset->ss7, p->ss7call, e->cgu.endcic, e->cgu.status);
-				if(!p->owner)
-					p->ss7call = isup_free_call_if_clear(ss7, e->cgu.call);
-				ast_mutex_unlock(&p->lock);
-				break;
-			case ISUP_EVENT_UCIC:
-				chanpos = ss7_find_cic(linkset, e->ucic.cic, e->ucic.opc);
-				if (chanpos < 0) {
-					ast_log(LOG_WARNING, "UCIC on unconfigured CIC %d PC %d\n", e->ucic.cic, e->ucic.opc);
-					isup_free_call(ss7, e->ucic.call);
-					break;
-				}
-				p = linkset->pvts[chanpos];
-				ast_debug(1, "Unequiped Circuit Id Code on CIC %d\n", e->ucic.cic);
-				ast_mutex_lock(&p->lock);
-				p->ss7call = e->ucic.call;
-				p->remotelyblocked = SS7_BLOCKED_MAINTENANCE;
-				p->inservice = 0;
-				p->ss7call = NULL;
-				isup_free_call(ss7, e->ucic.call);
-				if (p->owner)
-					p->owner->_softhangup |= AST_SOFTHANGUP_DEV;
-				ast_mutex_unlock(&p->lock);			/* doesn't require a SS7 acknowledgement */
-				break;
-			case ISUP_EVENT_BLO:
-				chanpos = ss7_find_cic(linkset, e->blo.cic, e->blo.opc);
-				if (chanpos < 0) {
-					ast_log(LOG_WARNING, "BLO on unconfigured CIC %d PC %d\n", e->blo.cic, e->blo.opc);
-					isup_free_call(ss7, e->blo.call);
-					break;
-				}
-				p = linkset->pvts[chanpos];
-				p->ss7call = e->blo.call;
-				ast_debug(1, "Blocking CIC %d\n", e->blo.cic);
-				ast_mutex_lock(&p->lock);
-				p->remotelyblocked |= SS7_BLOCKED_MAINTENANCE;
-				isup_bla(linkset->ss7, e->blo.call);
-				if (!p->owner)
-					p->ss7call = isup_free_call_if_clear(ss7, e->blo.call);
-				else if (e->blo.got_sent_msg == ISUP_SENT_IAM) {
-					/* Q.784 6.2.2 */
-					p->owner->hangupcause = SS7_CAUSE_TRY_AGAIN;
-					p->owner->_softhangup |= AST_SOFTHANGUP_DEV;
-				}
-				ast_mutex_unlock(&p->lock);
-				break;
-			case ISUP_EVENT_BLA:
-				chanpos = ss7_find_cic(linkset, e->bla.cic, e->bla.opc);
-				if (chanpos < 0) { /* Never will be true */
-					ast_log(LOG_WARNING, "BLA on unconfigured CIC %d PC %d\n", e->bla.cic, e->bla.opc);
-					isup_free_call(ss7, e->bla.call);
-					break;
-				}
-				p = linkset->pvts[chanpos];
-				p->ss7call = e->bla.call;
-				ast_mutex_lock(&p->lock);
-				ast_debug(1, "Locally blocking CIC %d\n", e->bla.cic);
-				p->locallyblocked |= SS7_BLOCKED_MAINTENANCE;
-				if (!p->owner)
-					p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
-				ast_mutex_unlock(&p->lock);
-				break;
-			case ISUP_EVENT_UBL:
-				chanpos = ss7_find_cic(linkset, e->ubl.cic, e->ubl.opc);
-				if (chanpos < 0) {
-					ast_log(LOG_WARNING, "UBL on unconfigured CIC %d PC %d\n", e->ubl.cic, e->ubl.opc);
-					isup_free_call(ss7, e->ubl.call);
-					break;
-				}
-				p = linkset->pvts[chanpos];
-				ast_debug(1, "Remotely unblocking CIC %d PC %d\n", e->ubl.cic, e->ubl.opc);
-				ast_mutex_lock(&p->lock);
-				p->ss7call = e->ubl.call;
-				p->remotelyblocked &= ~SS7_BLOCKED_MAINTENANCE;
-				isup_uba(linkset->ss7, e->ubl.call);
-				if (!p->owner)
-					p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
-				ast_mutex_unlock(&p->lock);
-				break;
-			case ISUP_EVENT_UBA:
-				chanpos = ss7_find_cic(linkset, e->uba.cic, e->uba.opc);
-				if (chanpos < 0) {
-					ast_log(LOG_WARNING, "UBA on unconfigured CIC %d PC %d\n", e->uba.cic, e->uba.opc);
-					isup_free_call(ss7, e->uba.call);
-					break;
-				}
-				p = linkset->pvts[chanpos];
-				ast_mutex_lock(&p->lock);
-				p->ss7call = e->uba.call;
-				ast_debug(1, "Locally unblocking CIC %d PC %d\n", e->uba.cic, e->uba.opc);
-				p->locallyblocked &= ~SS7_BLOCKED_MAINTENANCE;
-				if (!p->owner)
-					p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
-				ast_mutex_unlock(&p->lock);
-				break;
-			case ISUP_EVENT_CON:
-			case ISUP_EVENT_ANM:
-				if (e->e == ISUP_EVENT_CON) {
-					cic = e->con.cic;
-					/* if (e->con.connected_num)
-						ss7_process_connected(p, e->con.connected_num, e->con.connected_nai,
-								e->con.connected_presentation_ind, e->con.connected_screening_ind); */
-				} else {
-					cic = e->anm.cic;
-					/* if (e->anm.connected_num)
-						ss7_process_connected(p, e->anm.connected_num, e->anm.connected_nai,
-								e->anm.connected_presentation_ind, e->anm.connected_screening_ind); */
-				}
+		for (i = 0; i < res; i++) {
+			linkset = &linksets[events[i].data.u64 >> 8];
+			ast_mutex_lock(&linkset->lock);
+			ss7_linkset_fd_event(linkset, events[i].data.u64 & 0xff, ss7_epoll2poll(events[i].events));
+			linkset->dirty = 1;
+			ast_mutex_unlock(&linkset->lock);
+		}
 
-				chanpos = ss7_find_cic(linkset, cic, (e->e == ISUP_EVENT_ANM) ? e->anm.opc : e->con.opc);
-				if (chanpos < 0) { /* Never will be true */
-					ast_log(LOG_WARNING, "ANM/CON on unconfigured CIC %d PC %d\n", cic, (e->e == ISUP_EVENT_ANM) ? e->anm.opc : e->con.opc);
-					isup_free_call(ss7, (e->e == ISUP_EVENT_ANM) ? e->anm.call : e->con.call);
-					break;
-				} else {
-					p = linkset->pvts[chanpos];
-					ast_mutex_lock(&p->lock);
-					p->proceeding = 1;
-					p->dialing = 0;
-					p->ss7call = (e->e == ISUP_EVENT_ANM) ?  e->anm.call : e->con.call;
-					p->subs[SUB_REAL].needanswer = 1;
-					if (p->dsp && p->dsp_features) {
-						ast_dsp_set_features(p->dsp, p->dsp_features);
-						p->dsp_features = 0;
-					}
-					if ((e->e == ISUP_EVENT_ANM) ? !e->anm.echocontrol_ind  : !e->con.echocontrol_ind || !(linkset->flags & LINKSET_FLAG_USEECHOCONTROL)) {
-						dahdi_enable_ec(p);
-						dahdi_train_ec(p);
-					}
-					ast_mutex_unlock(&p->lock);
-				}
-				break;
-			case ISUP_EVENT_RLC:
-				chanpos = ss7_find_cic(linkset, e->rlc.cic, e->rlc.opc);
-				if (chanpos < 0) { /* Never will be true */
-					ast_log(LOG_WARNING, "RLC on unconfigured CIC %d PC %d\n", e->rlc.cic, e->rlc.opc);
-					isup_free_call(ss7, e->rlc.call);
-					break;
-				} else {
-					p = linkset->pvts[chanpos];
-					ast_mutex_lock(&p->lock);
-					p->ss7call = e->rlc.call;
-					if (e->rlc.got_sent_msg & (ISUP_SENT_RSC | ISUP_SENT_REL)) {
-						dahdi_loopback(p, 0);
-						if (e->rlc.got_sent_msg & ISUP_SENT_RSC)
-							p->inservice = 1;
-					}
-					if (!p->owner)
-						p->ss7call = isup_free_call_if_clear(ss7, e->rlc.call);
-					else {
-						p->owner->_softhangup |= AST_SOFTHANGUP_DEV;
-						p->do_hangup = SS7_HANGUP_DO_NOTHING;
-					}
-					ast_mutex_unlock(&p->lock);
-				}
-				break;
-			case ISUP_EVENT_FAA:
-				chanpos = ss7_find_cic(linkset, e->faa.cic, e->faa.opc);
-				if (chanpos < 0) {
-					ast_log(LOG_WARNING, "FAA on unconfigured CIC %d PC %d\n", e->faa.cic, e->faa.opc);
-					isup_free_call(ss7, e->faa.call);
-					break;
-				} else {
-					p = linkset->pvts[chanpos];
-					p->ss7call = e->faa.call;
-					ast_debug(1, "FAA received on CIC %d\n", e->faa.cic);
-					ast_mutex_lock(&p->lock);
-					/*if (p->alreadyhungup)
-						ast_log(LOG_NOTICE, "Received FAA and we haven't sent FAR.  Ignoring.\n");
-					FIX IT !!! */
-					p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
-					ast_mutex_unlock(&p->lock);
-				}
-				break;
-			case ISUP_EVENT_CGBA:
-				chanpos = ss7_find_cic(linkset, e->cgba.startcic, e->cgba.opc);
-				if (chanpos < 0) { /* Never will be true */
-					ast_log(LOG_WARNING, "CGBA on unconfigured CIC %d PC %d\n", e->cgba.startcic, e->cgba.opc);
-					isup_free_call(ss7, e->cgba.call);
-					break;
-				}
-				p = linkset->pvts[chanpos];
-				ast_mutex_lock(&p->lock);
-				p->ss7call = e->cgba.call;
+		/* Run every libss7 schedule that is due, at most once per linkset and pass */
+		now = ast_tvnow();
+		for (timers = w->heapsize; timers > 0 && w->heapsize && !ss7_timer_before(now, w->heap[0]->deadline); timers--) {
+			linkset = w->heap[0];
+			ast_mutex_lock(&linkset->lock);
+			ss7_schedule_run(linkset->ss7);
+			linkset->dirty = 1;
+			ast_mutex_unlock(&linkset->lock);
+			ss7_heap_update(w, linkset);
+		}
+	}
 
-				ss7_block_cics(linkset, e->cgba.startcic, e->cgba.endcic, e->cgba.opc, e->cgba.status, 1, 0,
-						e->cgba.type ? SS7_BLOCKED_HARDWARE : SS7_BLOCKED_MAINTENANCE);
+	return NULL;
+}
 
-				if(!p->owner)
-					p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
-				ast_mutex_unlock(&p->lock);
-				break;
-			case ISUP_EVENT_CGUA:
-				chanpos = ss7_find_cic(linkset, e->cgua.startcic, e->cgua.opc);
-				if (chanpos < 0) { /* Never will be true */
-					ast_log(LOG_WARNING, "CGUA on unconfigured CIC %d PC %d\n", e->cgua.startcic, e->cgua.opc);
-					isup_free_call(ss7, e->cgua.call);
-					break;
-				}
-				p = linkset->pvts[chanpos];
-				ast_mutex_lock(&p->lock);
-				p->ss7call = e->cgua.call;
+/*! \brief Spread the configured linksets over ss7_numworkers worker threads and start them */
+static int ss7_workers_start(void)
+{
+	struct epoll_event ev;
+	struct dahdi_ss7 *linkset;
+	struct ss7_worker *w;
+	int x, i, n = 0;
 
-				ss7_block_cics(linkset, e->cgua.startcic, e->cgua.endcic, e->cgua.opc, e->cgua.status, 0, 0,
-					e->cgba.type ? SS7_BLOCKED_HARDWARE : SS7_BLOCKED_MAINTENANCE);
-				if(!p->owner)
-					p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
-				ast_mutex_unlock(&p->lock);
-				break;
-			case ISUP_EVENT_SUS:
-			case ISUP_EVENT_RES:
-				chanpos = ss7_find_cic(linkset, e->susres.cic, e->susres.opc);
-				if (chanpos < 0) {
-					ast_log(LOG_WARNING, "SUS/RES on unconfigured CIC %d PC %d\n", e->susres.cic, e->susres.opc);
-					isup_free_call(ss7, e->susres.call);
-					break;
-				}
-				p = linkset->pvts[chanpos];
-				ast_mutex_lock(&p->lock);
-				p->ss7call = e->susres.call;
-				if(!p->owner)
-					p->ss7call = isup_free_call_if_clear(ss7, p->ss7call);
-				ast_mutex_unlock(&p->lock);
-				break;
-			default:
-				ast_debug(1, "Unknown event %s\n", ss7_event2str(e->e));
-				break;
+	memset(ss7_workers, 0, sizeof(ss7_workers));
+	for (x = 0; x < NUM_SPANS; x++) {
+		linkset = &linksets[x];
+		if (!linkset->ss7)
+			continue;
+		w = &ss7_workers[n++ % ss7_numworkers];
+		if (!w->numlinksets && (w->epfd = epoll_create(NUM_SPANS * NUM_DCHANS)) < 0) {
+			ast_log(LOG_ERROR, "Unable to create epoll set for SS7 linkset workers: %s\n", strerror(errno));
+			return -1;
+		}
+		linkset->worker = w;
+		linkset->heap_pos = -1;
+		for (i = 0; i < linkset->numsigchans; i++) {
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN | EPOLLPRI;
+			ev.data.u64 = ((uint64_t) x << 8) | i;
+			if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, linkset->fds[i], &ev)) {
+				ast_log(LOG_ERROR, "Unable to watch signalling channel %d of linkset %d: %s\n", i, x + 1, strerror(errno));
+				return -1;
 			}
+			linkset->epmask[i] = ev.events;
 		}
-		ast_mutex_unlock(&linkset->lock);
+		w->linksets[w->numlinksets++] = linkset;
 	}
 
+	for (ss7_workers_running = 0; ss7_workers_running < ss7_numworkers && ss7_workers[ss7_workers_running].numlinksets; ss7_workers_running++) {
+		w = &ss7_workers[ss7_workers_running];
+		if (ast_pthread_create(&w->thread, NULL, ss7_worker_thread, w)) {
+			ast_log(LOG_ERROR, "Unable to start SS7 linkset worker %d\n", ss7_workers_running + 1);
+			close(w->epfd);
+			return -1;
+		}
+		ast_verb(2, "Starting SS7 linkset worker %d for %d linkset(s)\n", ss7_workers_running + 1, w->numlinksets);
+	}
 	return 0;
 }
 
-static struct dahdi_pvt * ss7_find_pvt(struct ss7 *ss7, int cic, unsigned int dpc)
+/*! \brief Cancel and join every running linkset worker */
+static void ss7_workers_stop(void)
 {
-	int i, chanpos;
-	struct dahdi_ss7 *winner = NULL;
+	int i, j;
 
-	for (i = 0; i < NUM_SPANS; i++)
-		if(linksets[i].ss7 == ss7) {
-			winner = &linksets[i];
-			break;
+	for (i = 0; i < SS7_MAX_WORKERS && ss7_workers[i].numlinksets; i++) {
+		if (i < ss7_workers_running) {
+			pthread_cancel(ss7_workers[i].thread);
+			pthread_kill(ss7_workers[i].thread, SIGURG);
+			pthread_join(ss7_workers[i].thread, NULL);
 		}
+		close(ss7_workers[i].epfd);
+		for (j = 0; j < ss7_workers[i].numlinksets; j++)
+			ss7_workers[i].linksets[j]->worker = NULL;
+	}
+	ss7_workers_running = 0;
+	memset(ss7_workers, 0, sizeof(ss7_workers));
+}
 
-	if (winner && (chanpos = ss7_find_cic(winner, cic, dpc)) > -1) {
-		return winner->pvts[chanpos];
-	} else
+static inline unsigned int ss7_linkset_slot(struct ss7 *ss7)
+{
+	return (unsigned int) (((unsigned long) ss7 >> 4) % SS7_LINKSET_MAP_SIZE);
+}
+
+/*! \brief Remember which linkset owns a libss7 instance, so callbacks need not search linksets[] */
+static void ss7_register_linkset(struct ss7 *ss7, struct dahdi_ss7 *linkset)
+{
+	unsigned int slot = ss7_linkset_slot(ss7);
+
+	while (linkset_map[slot].ss7 && linkset_map[slot].ss7 != ss7)
+		slot = (slot + 1) % SS7_LINKSET_MAP_SIZE;
+	linkset_map[slot].ss7 = ss7;
+	linkset_map[slot].linkset = linkset;
+}
+
+static struct dahdi_ss7 *ss7_find_linkset(struct ss7 *ss7)
+{
+	unsigned int slot = ss7_linkset_slot(ss7);
+
+	for (; linkset_map[slot].ss7; slot = (slot + 1) % SS7_LINKSET_MAP_SIZE) {
+		if (linkset_map[slot].ss7 == ss7)
+			return linkset_map[slot].linkset;
+	}
+	return NULL;
+}
+
+static struct dahdi_pvt * ss7_find_pvt(struct ss7 *ss7, int cic, unsigned int dpc)
+{
+	struct dahdi_ss7 *winner = ss7_find_linkset(ss7);
+
+	if (winner)
+		return ss7_find_cic(winner, cic, dpc);
+	else
 		return NULL;
 }
 
@@ -10871,13 +14143,7 @@ static int dahdi_ss7_hangup(struct ss7 *ss7, int cic, unsigned int dpc, int caus
 static void dahdi_ss7_call_null(struct ss7 *ss7, struct isup_call *c, int lock)
 {
 	int i;
-	struct dahdi_ss7 *winner = NULL;
-
-	for (i = 0; i < NUM_SPANS; i++)
-		if(linksets[i].ss7 == ss7) {
-			winner = &linksets[i];
-			break;
-		}
+	struct dahdi_ss7 *winner = ss7_find_linkset(ss7);
 
 	if (winner)
 		for (i = 0; i < winner->numchans; i++)
@@ -10902,7 +14168,7 @@ static void dahdi_ss7_notinservice(struct ss7 *ss7, int cic, unsigned int dpc)
 		return;
 
 	ast_mutex_lock(&p->lock);
-	p->inservice = 0;
+	circuit_clear(p, CIRCUIT_INSERVICE);
 	ast_mutex_unlock(&p->lock);
 }
 
@@ -11013,6 +14279,10 @@ static int pri_fixup_principle(struct dahdi_pri *pri, int principle, q931_call *
 				/* Fix it all up now */
 				new->owner = old->owner;
 				old->owner = NULL;
+				hunt_groups_mark(old, 1);
+				hunt_groups_mark(new, 0);
+				monitor_touch(old);
+				monitor_touch(new);
 				if (new->owner) {
 					ast_string_field_build(new->owner, name,
 							       "DAHDI/%d:%d-%d", pri->trunkgroup,
@@ -11298,14 +14568,17 @@ static void *pri_dchannel(void *vpri)
 	int numdchans;
 	int cause=0;
 	struct dahdi_pvt *crv;
-	pthread_t threadid;
 	char ani2str[6];
 	char plancallingnum[256];
 	char plancallingani[256];
 	char calledtonstr[10];
+	char name[40];
 
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
+	snprintf(name, sizeof(name), "D-channel thread of span %d", pri->span);
+	dahdi_thread_place(name, &pri->placement);
+
 	gettimeofday(&lastidle, NULL);
 	if (!ast_strlen_zero(pri->idledial) && !ast_strlen_zero(pri->idleext)) {
 		/* Need to do idle dialing, check to be sure though */
@@ -11822,7 +15095,7 @@ static void *pri_dchannel(void *vpri)
 
 							ast_mutex_lock(&pri->pvts[chanpos]->lock);
 							ast_mutex_lock(&pri->lock);
-							if (c && !ast_pthread_create_detached(&threadid, NULL, ss_thread, c)) {
+							if (c && !dahdi_ss_thread_start(c)) {
 								ast_verb(3, "Accepting overlap call from '%s' to '%s' on channel %d/%d, span %d\n",
 										plancallingnum, S_OR(pri->pvts[chanpos]->exten, "<unspecified>"),
 										pri->pvts[chanpos]->logicalspan, pri->pvts[chanpos]->prioffset, pri->span);
@@ -12311,7 +15584,7 @@ static void *pri_dchannel(void *vpri)
 							pri->pvts[chanpos]->owner->_softhangup |= AST_SOFTHANGUP_DEV;
 						}
 						pri->pvts[chanpos]->resetting = 0;
-						pri->pvts[chanpos]->inservice = 1;
+						circuit_set(pri->pvts[chanpos], CIRCUIT_INSERVICE);
 						ast_verb(3, "B-channel %d/%d successfully restarted on span %d\n", pri->pvts[chanpos]->logicalspan,
 									pri->pvts[chanpos]->prioffset, pri->span);
 						ast_mutex_unlock(&pri->pvts[chanpos]->lock);
@@ -12849,7 +16122,7 @@ static void dahdi_softhangup_all(void)
 {
 	struct dahdi_pvt *p;
 retry:
-	ast_mutex_lock(&iflock);
+	iflock_rdlock();
     for (p = iflist; p; p = p->next) {
 		ast_mutex_lock(&p->lock);
         if (p->owner && !p->restartpending) {
@@ -12858,7 +16131,7 @@ retry:
 					ast_verbose("Avoiding deadlock\n");
 				/* Avoid deadlock since you're not supposed to lock iflock or pvt before a channel */
 				ast_mutex_unlock(&p->lock);
-				ast_mutex_unlock(&iflock);
+				ast_rwlock_unlock(&iflock);
 				goto retry;
 			}
 			if (option_debug > 2)
@@ -12870,7 +16143,7 @@ retry:
 		}
 		ast_mutex_unlock(&p->lock);
     }
-	ast_mutex_unlock(&iflock);
+	ast_rwlock_unlock(&iflock);
 }
 
 static int setup_dahdi(int reload);
@@ -12910,6 +16183,10 @@ static int dahdi_restart(void)
 			ast_debug(4, "Joined thread of span %d\n", i);
 		}
     }
+	ss7_workers_stop();
+	for (i = 0; i < NUM_SPANS; i++)
+		ss7_dispatcher_stop(&linksets[i]);
+	ss7_bearer_stop();
 #endif
 
 	ast_mutex_lock(&monlock);
@@ -12963,11 +16240,16 @@ static int dahdi_restart(void)
 	for (i = 0; i < NUM_SPANS; i++) {
 		for (j = 0; j < NUM_DCHANS; j++)
 			dahdi_close(linksets[i].fds[j]);
+		ss7_free_pvts(&linksets[i]);
 	}
 
 	memset(linksets, 0, sizeof(linksets));
+	memset(linkset_map, 0, sizeof(linkset_map));
 	for (i = 0; i < NUM_SPANS; i++) {
 		ast_mutex_init(&linksets[i].lock);
+		ast_mutex_init(&linksets[i].evlock);
+		ast_cond_init(&linksets[i].evcond, NULL);
+		ast_cond_init(&linksets[i].setupcond, NULL);
 		linksets[i].master = AST_PTHREADT_NULL;
 		for (j = 0; j < NUM_DCHANS; j++)
 			linksets[i].fds[j] = -1;
@@ -13051,7 +16333,7 @@ static char *dahdi_show_channels(struct ast_cli_entry *e, int cmd, struct ast_cl
 		return NULL;
 	}
 
-	lock = &iflock;
+	lock = NULL;
 	start = iflist;
 
 	/* syntax: dahdi show channels [ group <group> | context <context> | trunkgroup <trunkgroup> ] */
@@ -13091,7 +16373,7 @@ static char *dahdi_show_channels(struct ast_cli_entry *e, int cmd, struct ast_cl
 		}
 	}
 
-	ast_mutex_lock(lock);
+	iflist_lock(lock, 0);
 #ifdef HAVE_PRI
 	ast_cli(a->fd, FORMAT2, pri ? "CRV" : "Chan", "Extension", "Context", "Language", "MOH Interpret", "Blocked", "State");
 #else
@@ -13123,24 +16405,24 @@ static char *dahdi_show_channels(struct ast_cli_entry *e, int cmd, struct ast_cl
 		} else
 			ast_copy_string(tmps, "pseudo", sizeof(tmps));
 
-		if (tmp->locallyblocked)
+		if (circuit_locally_blocked(tmp))
 			blockstr[0] = 'L';
 		else
 			blockstr[0] = ' ';
 
-		if (tmp->remotelyblocked)
+		if (circuit_remotely_blocked(tmp))
 			blockstr[1] = 'R';
 		else
 			blockstr[1] = ' ';
 
 		blockstr[2] = '\0';
 
-		snprintf(statestr, sizeof(statestr), "%s", tmp->inservice ? "In Service" : "Not In Service");
+		snprintf(statestr, sizeof(statestr), "%s", circuit_inservice(tmp) ? "In Service" : "Not In Service");
 
 		ast_cli(a->fd, FORMAT, tmps, tmp->exten, tmp->context, tmp->language, tmp->mohinterpret, blockstr, statestr);
 		tmp = tmp->next;
 	}
-	ast_mutex_unlock(lock);
+	iflist_unlock(lock);
 	return CLI_SUCCESS;
 #undef FORMAT
 #undef FORMAT2
@@ -13171,7 +16453,7 @@ static char *dahdi_show_channel(struct ast_cli_entry *e, int cmd, struct ast_cli
 		return NULL;
 	}
 
-	lock = &iflock;
+	lock = NULL;
 	start = iflist;
 
 	if (a->argc != 4)
@@ -13199,7 +16481,7 @@ static char *dahdi_show_channel(struct ast_cli_entry *e, int cmd, struct ast_cli
 #endif
 		channel = atoi(a->argv[3]);
 
-	ast_mutex_lock(lock);
+	iflist_lock(lock, 0);
 	tmp = start;
 	while (tmp) {
 		if (tmp->channel == channel) {
@@ -13253,6 +16535,7 @@ static char *dahdi_show_channel(struct ast_cli_entry *e, int cmd, struct ast_cli
 			ast_cli(a->fd, "Relax DTMF: %s\n", tmp->dtmfrelax ? "yes" : "no");
 			ast_cli(a->fd, "Dialing/CallwaitCAS: %d/%d\n", tmp->dialing, tmp->callwaitcas);
 			ast_cli(a->fd, "Default law: %s\n", tmp->law == DAHDI_LAW_MULAW ? "ulaw" : tmp->law == DAHDI_LAW_ALAW ? "alaw" : "unknown");
+			ast_cli(a->fd, "Frame size: %d samples (%d ms)\n", tmp->readsize, tmp->readsize / 8);
 			ast_cli(a->fd, "Fax Handled: %s\n", tmp->faxhandled ? "yes" : "no");
 			ast_cli(a->fd, "Pulse phone: %s\n", tmp->pulsedial ? "yes" : "no");
 			ast_cli(a->fd, "DND: %s\n", tmp->dnd ? "yes" : "no");
@@ -13311,14 +16594,14 @@ static char *dahdi_show_channel(struct ast_cli_entry *e, int cmd, struct ast_cli
 					ast_cli(a->fd, "Hookstate (FXS only): %s\n", ps.rxisoffhook ? "Offhook" : "Onhook");
 				}
 			}
-			ast_mutex_unlock(lock);
+			iflist_unlock(lock);
 			return CLI_SUCCESS;
 		}
 		tmp = tmp->next;
 	}
 
 	ast_cli(a->fd, "Unable to find given channel %d\n", channel);
-	ast_mutex_unlock(lock);
+	iflist_unlock(lock);
 	return CLI_FAILURE;
 }
 
@@ -13436,6 +16719,16 @@ static char *dahdi_show_status(struct ast_cli_entry *e, int cmd, struct ast_cli_
 	}
 	close(ctl);
 
+	ast_mutex_lock(&ss_pool.lock);
+	if (ss_pool.size) {
+		ast_cli(a->fd, "\nSimple switch pool: %d/%d workers (%d idle), %d/%d queued (peak %d)\n",
+			ss_pool.workers, ss_pool.size, ss_pool.idle, ss_pool.queued, ss_pool.depth, ss_pool.peak_queued);
+		ast_cli(a->fd, "  %u call setups dispatched, %u threads spawned, %u rejected, %u expired in the queue\n",
+			ss_pool.dispatched, ss_pool.spawned, ss_pool.rejected, ss_pool.expired);
+	} else
+		ast_cli(a->fd, "\nSimple switch pool: disabled (one thread per call)\n");
+	ast_mutex_unlock(&ss_pool.lock);
+
 	return CLI_SUCCESS;
 #undef FORMAT
 #undef FORMAT2
@@ -13474,6 +16767,110 @@ static char *dahdi_show_version(struct ast_cli_entry *e, int cmd, struct ast_cli
 	return CLI_SUCCESS;
 }
 
+static int lock_prof_cmp(const void *a, const void *b)
+{
+	const struct lock_prof *pa = a, *pb = b;
+
+	return (pa->wait < pb->wait) ? 1 : (pa->wait > pb->wait) ? -1 : 0;
+}
+
+static char *dahdi_show_locks(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct lock_prof *site, *sites;
+	int count = 0, i;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "dahdi show locks";
+		e->usage =
+			"Usage: dahdi show locks\n"
+			"       Shows the contention recorded on the linkset, PRI, interface list\n"
+			"       and pvt locks by every place they were taken, worst waits first.\n"
+			"       Recording is switched on with lockprofile=yes or 'dahdi set lockprofile'.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	/* Copy the counters out, so printing doesn't stall the locks being profiled */
+	ast_mutex_lock(&lock_prof_lock);
+	for (site = lock_profs; site; site = site->next)
+		count++;
+	if (!(sites = ast_calloc(count ? count : 1, sizeof(*sites)))) {
+		ast_mutex_unlock(&lock_prof_lock);
+		return CLI_FAILURE;
+	}
+	for (site = lock_profs, i = 0; site; site = site->next, i++)
+		sites[i] = *site;
+	ast_mutex_unlock(&lock_prof_lock);
+	qsort(sites, count, sizeof(*sites), lock_prof_cmp);
+
+	ast_cli(a->fd, "Lock profiling is %s\n", lock_profiling ? "on" : "off");
+	ast_cli(a->fd, "%-15s %-28s %10s %7s %9s %10s %10s %10s %10s\n",
+		"Lock", "Site", "Acquired", "Failed", "Retries", "AvgWait", "MaxWait", "AvgHold", "MaxHold");
+	for (i = 0; i < count; i++) {
+		char where[64];
+
+		site = &sites[i];
+		snprintf(where, sizeof(where), "%s:%d", site->func, site->line);
+		ast_cli(a->fd, "%-15s %-28.28s %10u %7u %9u %8lluus %8uus %8lluus %8uus\n",
+			site->lock, where, site->acquired, site->failed, site->retries,
+			(site->acquired + site->failed) ? site->wait / (site->acquired + site->failed) : 0ULL, site->maxwait,
+			site->holds ? site->hold / site->holds : 0ULL, site->maxhold);
+	}
+	ast_free(sites);
+
+	return CLI_SUCCESS;
+}
+
+static char *dahdi_reset_locks(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct lock_prof *site;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "dahdi reset locks";
+		e->usage =
+			"Usage: dahdi reset locks\n"
+			"       Clears the counters shown by 'dahdi show locks'.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	/* The sites stay, a linkset may be holding on to one to time its release */
+	ast_mutex_lock(&lock_prof_lock);
+	for (site = lock_profs; site; site = site->next) {
+		site->acquired = site->failed = site->retries = 0;
+		site->wait = site->hold = 0;
+		site->maxwait = site->holds = site->maxhold = 0;
+	}
+	ast_mutex_unlock(&lock_prof_lock);
+
+	return CLI_SUCCESS;
+}
+
+static char *dahdi_set_lockprofile(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "dahdi set lockprofile {on|off}";
+		e->usage =
+			"Usage: dahdi set lockprofile {on|off}\n"
+			"       Starts or stops recording lock contention, see 'dahdi show locks'.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4)
+		return CLI_SHOWUSAGE;
+	lock_profiling = ast_true(a->argv[3]);
+	ast_cli(a->fd, "Lock profiling %s\n", lock_profiling ? "on" : "off");
+
+	return CLI_SUCCESS;
+}
+
 static char *dahdi_set_hwgain(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
 	int channel;
@@ -13511,7 +16908,7 @@ static char *dahdi_set_hwgain(struct ast_cli_entry *e, int cmd, struct ast_cli_a
 	channel = atoi(a->argv[4]);
 	gain = atof(a->argv[5])*10.0;
 
-	ast_mutex_lock(&iflock);
+	iflock_wrlock();
 
 	for (tmp = iflist; tmp; tmp = tmp->next) {
 
@@ -13525,7 +16922,7 @@ static char *dahdi_set_hwgain(struct ast_cli_entry *e, int cmd, struct ast_cli_a
 		hwgain.tx = tx;
 		if (ioctl(tmp->subs[SUB_REAL].dfd, DAHDI_SET_HWGAIN, &hwgain) < 0) {
 			ast_cli(a->fd, "Unable to set the hardware gain for channel %d: %s\n", channel, strerror(errno));
-			ast_mutex_unlock(&iflock);
+			ast_rwlock_unlock(&iflock);
 			return CLI_FAILURE;
 		}
 		ast_cli(a->fd, "hardware %s gain set to %d (%.1f dB) on channel %d\n",
@@ -13533,7 +16930,7 @@ static char *dahdi_set_hwgain(struct ast_cli_entry *e, int cmd, struct ast_cli_a
 		break;
 	}
 
-	ast_mutex_unlock(&iflock);
+	ast_rwlock_unlock(&iflock);
 
 	if (tmp)
 		return CLI_SUCCESS;
@@ -13549,7 +16946,6 @@ static char *dahdi_set_swgain(struct ast_cli_entry *e, int cmd, struct ast_cli_a
 	float gain;
 	int tx;
 	int res;
-	ast_mutex_t *lock;
 	struct dahdi_pvt *tmp = NULL;
 
 	switch (cmd) {
@@ -13568,8 +16964,6 @@ static char *dahdi_set_swgain(struct ast_cli_entry *e, int cmd, struct ast_cli_a
 		return NULL;
 	}
 
-	lock = &iflock;
-
 	if (a->argc != 6)
 		return CLI_SHOWUSAGE;
 
@@ -13583,7 +16977,7 @@ static char *dahdi_set_swgain(struct ast_cli_entry *e, int cmd, struct ast_cli_a
 	channel = atoi(a->argv[4]);
 	gain = atof(a->argv[5]);
 
-	ast_mutex_lock(lock);
+	iflock_wrlock();
 	for (tmp = iflist; tmp; tmp = tmp->next) {
 
 		if (tmp->channel != channel)
@@ -13599,7 +16993,7 @@ static char *dahdi_set_swgain(struct ast_cli_entry *e, int cmd, struct ast_cli_a
 
 		if (res) {
 			ast_cli(a->fd, "Unable to set the software gain for channel %d\n", channel);
-			ast_mutex_unlock(lock);
+			ast_rwlock_unlock(&iflock);
 			return CLI_FAILURE;
 		}
 
@@ -13607,7 +17001,7 @@ static char *dahdi_set_swgain(struct ast_cli_entry *e, int cmd, struct ast_cli_a
 			tx ? "tx" : "rx", gain, channel);
 		break;
 	}
-	ast_mutex_unlock(lock);
+	ast_rwlock_unlock(&iflock);
 
 	if (tmp)
 		return CLI_SUCCESS;
@@ -13655,7 +17049,8 @@ static char *dahdi_set_dnd(struct ast_cli_entry *e, int cmd, struct ast_cli_args
 		return CLI_SHOWUSAGE;
 	}
 
-	ast_mutex_lock(&iflock);
+	/* Exclusive, do_monitor() updates the bitfields next to dnd under the read lock */
+	iflock_wrlock();
 	for (dahdi_chan = iflist; dahdi_chan; dahdi_chan = dahdi_chan->next) {
 		if (dahdi_chan->channel != channel)
 			continue;
@@ -13664,7 +17059,7 @@ static char *dahdi_set_dnd(struct ast_cli_entry *e, int cmd, struct ast_cli_args
 		dahdi_dnd(dahdi_chan, on);
 		break;
 	}
-	ast_mutex_unlock(&iflock);
+	ast_rwlock_unlock(&iflock);
 
 	if (!dahdi_chan) {
 		ast_cli(a->fd, "Unable to find given channel %d\n", channel);
@@ -13685,6 +17080,9 @@ static struct ast_cli_entry dahdi_cli[] = {
 	AST_CLI_DEFINE(dahdi_set_hwgain, "Set hardware gain on a channel"),
 	AST_CLI_DEFINE(dahdi_set_swgain, "Set software gain on a channel"),
 	AST_CLI_DEFINE(dahdi_set_dnd, "Set software gain on a channel"),
+	AST_CLI_DEFINE(dahdi_show_locks, "Show lock contention"),
+	AST_CLI_DEFINE(dahdi_reset_locks, "Clear lock contention counters"),
+	AST_CLI_DEFINE(dahdi_set_lockprofile, "Record lock contention"),
 };
 
 #define TRANSFER	0
@@ -13842,7 +17240,7 @@ static int action_dahdishowchannels(struct mansession *s, const struct message *
 	if (!ast_strlen_zero(id))
 		snprintf(idText, sizeof(idText), "ActionID: %s\r\n", id);
 
-	ast_mutex_lock(&iflock);
+	iflock_rdlock();
 
 	tmp = iflist;
 	while (tmp) {
@@ -13899,7 +17297,7 @@ static int action_dahdishowchannels(struct mansession *s, const struct message *
 		tmp = tmp->next;
 	}
 
-	ast_mutex_unlock(&iflock);
+	ast_rwlock_unlock(&iflock);
 
 	astman_append(s,
 		"Event: DAHDIShowChannelsComplete\r\n"
@@ -13933,8 +17331,11 @@ static int linkset_addsigchan(int sigchan)
 		return -1;
 	}
 
-	if (!link->ss7)
+	if (!link->ss7) {
 		link->ss7 = ss7_new(cur_ss7type);
+		if (link->ss7)
+			ss7_register_linkset(link->ss7, link);
+	}
 
 	if (!link->ss7) {
 		ast_log(LOG_ERROR, "Can't create new SS7!\n");
@@ -14016,33 +17417,181 @@ static int linkset_addsigchan(int sigchan)
 		}
 	}
 
-	if (cur_adjpointcode < 0) {
-		ast_log(LOG_ERROR, "Unspecified adjpointcode!\n");
-		return -1;
-	} else {
-		ss7_set_adjpc(link->ss7, link->fds[curfd], cur_adjpointcode);
-	}
+	if (cur_adjpointcode < 0) {
+		ast_log(LOG_ERROR, "Unspecified adjpointcode!\n");
+		return -1;
+	} else {
+		ss7_set_adjpc(link->ss7, link->fds[curfd], cur_adjpointcode);
+	}
+
+	if (cur_defaultdpc < 0) {
+		ast_log(LOG_ERROR, "Unspecified defaultdpc!\n");
+		return -1;
+	}
+
+	if (cur_networkindicator < 0) {
+		ast_log(LOG_ERROR, "Invalid networkindicator!\n");
+		return -1;
+	} else
+		ss7_set_network_ind(link->ss7, cur_networkindicator);
+
+	return 0;
+}
+
+/*! \brief Mark what a reload has to see again to keep it, call with iflock held */
+static void ss7_reload_begin(void)
+{
+	struct dahdi_pvt *p;
+	int i;
+
+	for (i = 0; i < NUM_SPANS; i++) {
+		linksets[i].reload_flags = 0;
+		linksets[i].reload_seen = 0;
+	}
+	for (p = iflist; p; p = p->next) {
+		if (p->ss7) {
+			p->ss7_stale = 1;
+			p->ss7_pending = 0;
+		}
+	}
+	cur_linkset = -1;
+	cur_cicbeginswith = -1;
+}
+
+/*! \brief Apply the CIC and linkset changes of a reload to the running linksets
+ *
+ * Channels no longer configured are destroyed and channels whose CIC or DPC
+ * changed are taken out of their linkset before anyone is put back in, so
+ * CICs can be swapped around.  Circuits with a call, or a reset or blocking
+ * exchange, in progress are left alone and picked up again by the next
+ * reload.  New and moved CICs are reset.  When the configuration could not be
+ * read to its end nothing is removed or moved, and the channels the reload
+ * created are destroyed again.
+ */
+static void ss7_reload_end(int complete)
+{
+	struct dahdi_pvt *p, *prev, *next, *cur;
+	struct dahdi_ss7 *ss7;
+	int i, res;
+	int added = 0, removed = 0, busy = 0;
+
+	iflock_wrlock();
+	for (i = 0; complete && (i < NUM_SPANS); i++) {
+		ss7 = &linksets[i];
+		if (!ss7->ss7 || !ss7->reload_seen || (ss7->flags == ss7->reload_flags))
+			continue;
+		ast_mutex_lock(&ss7->lock);
+		ast_verb(3, "Linkset %d flags changed from 0x%x to 0x%x\n", i + 1, ss7->flags, ss7->reload_flags);
+		ss7->flags = ss7->reload_flags;
+		ast_mutex_unlock(&ss7->lock);
+	}
+
+	prev = NULL;
+	for (p = iflist; p; p = next) {
+		next = p->next;
+		if (!p->ss7 || !p->ss7->ss7 || !(p->ss7_stale || p->ss7_pending)) {
+			prev = p;
+			continue;
+		}
+		ss7 = p->ss7;
+		ast_mutex_lock(&ss7->lock);
+		ast_mutex_lock(&p->lock);
+		if (ss7_find_cic(ss7, p->cic, p->dpc) != p) {
+			/* Added by this reload, not in the linkset yet */
+			ast_mutex_unlock(&p->lock);
+			if (!complete) {
+				ast_verb(3, "Dropping new channel %d, the configuration did not load\n", p->channel);
+				destroy_channel(prev, p, 1);
+				ast_mutex_unlock(&ss7->lock);
+				continue;
+			}
+			ast_mutex_unlock(&ss7->lock);
+			prev = p;
+			continue;
+		}
+		if (!complete) {
+			p->ss7_stale = 0;
+			p->ss7_pending = 0;
+			ast_mutex_unlock(&p->lock);
+			ast_mutex_unlock(&ss7->lock);
+			prev = p;
+			continue;
+		}
+		/* A call that is done with has nothing to tell the far end any more */
+		if (p->ss7call)
+			p->ss7call = isup_free_call_if_clear(ss7->ss7, p->ss7call);
+		if (p->owner || p->ss7call) {
+			ast_log(LOG_WARNING, "CIC %d DPC %d on channel %d is busy, its %s left to the next reload\n",
+				p->cic, p->dpc, p->channel, p->ss7_stale ? "removal is" : "new CIC is");
+			p->ss7_stale = 0;
+			p->ss7_pending = 0;
+			busy++;
+			ast_mutex_unlock(&p->lock);
+			ast_mutex_unlock(&ss7->lock);
+			prev = p;
+			continue;
+		}
+		if (p->ss7_stale) {
+			ast_verb(3, "Removing CIC %d DPC %d from linkset %d\n", p->cic, p->dpc, (int) (ss7 - linksets) + 1);
+			ast_mutex_unlock(&p->lock);
+			destroy_channel(prev, p, 1);
+			ast_mutex_unlock(&ss7->lock);
+			removed++;
+			continue;
+		}
+		ss7_remove_pvt(ss7, p);
+		ast_mutex_unlock(&p->lock);
+		ast_mutex_unlock(&ss7->lock);
+		prev = p;
+	}
+
+	prev = NULL;
+	for (p = iflist; complete && p; p = next) {
+		next = p->next;
+		if (!p->ss7 || !p->ss7_pending) {
+			prev = p;
+			continue;
+		}
+		ss7 = p->ss7;
+		ast_mutex_lock(&ss7->lock);
+		p->ss7_pending = 0;
+		if ((cur = ss7_find_cic(ss7, p->reload_cic, p->reload_dpc))) {
+			ast_log(LOG_ERROR, "CIC %d DPC %d of channel %d is still used by channel %d, destroying channel %d\n",
+				p->reload_cic, p->reload_dpc, p->channel, cur->channel, p->channel);
+			destroy_channel(prev, p, 1);
+			ast_mutex_unlock(&ss7->lock);
+			continue;
+		}
+		p->cic = p->reload_cic;
+		p->dpc = p->reload_dpc;
+		if (ss7_add_pvt(ss7, p)) {
+			destroy_channel(prev, p, 1);
+			ast_mutex_unlock(&ss7->lock);
+			continue;
+		}
+		ast_mutex_unlock(&ss7->lock);
 
-	if (cur_defaultdpc < 0) {
-		ast_log(LOG_ERROR, "Unspecified defaultdpc!\n");
-		return -1;
+		ast_mutex_lock(&p->lock);
+		ss7_grab(p, ss7);
+		res = ss7_start_rsc(p);
+		ss7_rel(ss7);
+		ast_mutex_unlock(&p->lock);
+		ast_verb(3, "%s CIC %d DPC %d on channel %d to linkset %d\n", res ? "Reset" : "Added, unable to reset,",
+			p->cic, p->dpc, p->channel, (int) (ss7 - linksets) + 1);
+		added++;
+		prev = p;
 	}
+	ast_rwlock_unlock(&iflock);
 
-	if (cur_networkindicator < 0) {
-		ast_log(LOG_ERROR, "Invalid networkindicator!\n");
-		return -1;
-	} else
-		ss7_set_network_ind(link->ss7, cur_networkindicator);
-
-	return 0;
+	if (added || removed || busy)
+		ast_verb(2, "SS7 reload: %d CICs added or moved, %d removed, %d busy\n", added, removed, busy);
 }
 
 static int ss7_find_alloc_call(struct dahdi_pvt *p) {
 	if(!p)
 		return 0;
 	if(!p->ss7call) {
-		p->ss7call = isup_new_call(p->ss7->ss7);
-		if(!p->ss7call)
+		if(!ss7_new_call(p))
 			return 0;
 		else
 			isup_init_call(p->ss7->ss7, p->ss7call, p->cic, p->dpc);
@@ -14153,10 +17702,11 @@ static char *handle_ss7_block_cic(struct ast_cli_entry *e, int cmd, struct ast_c
 
 	dpc = atoi(a->argv[4]);
 
+	ast_mutex_lock(&linksets[linkset-1].lock);
 	for (i = 0; i < linksets[linkset-1].numchans; i++) {
 		p = linksets[linkset-1].pvts[i];
 		if (p->cic == cic && p->dpc == dpc) {
-			blocked = p->locallyblocked;
+			blocked = circuit_locally_blocked(p);
 			if (!(blocked & SS7_BLOCKED_MAINTENANCE)) {
 				ast_mutex_lock(&p->lock);
 				ss7_grab(p, p->ss7);
@@ -14164,6 +17714,7 @@ static char *handle_ss7_block_cic(struct ast_cli_entry *e, int cmd, struct ast_c
 					ss7_rel(p->ss7);
 					ast_mutex_unlock(&p->lock);
 					ast_cli(a->fd, "Unable allocate new ss7call\n");
+					ast_mutex_unlock(&linksets[linkset-1].lock);
 					return CLI_SUCCESS;
 				}
 				isup_blo(linksets[linkset-1].ss7, p->ss7call);
@@ -14172,6 +17723,7 @@ static char *handle_ss7_block_cic(struct ast_cli_entry *e, int cmd, struct ast_c
 			}
 		}
 	}
+	ast_mutex_unlock(&linksets[linkset-1].lock);
 
 	if (blocked < 0) {
 		ast_cli(a->fd, "Invalid CIC specified!\n");
@@ -14184,7 +17736,7 @@ static char *handle_ss7_block_cic(struct ast_cli_entry *e, int cmd, struct ast_c
 		ast_cli(a->fd, "CIC %d already locally blocked\n", cic);
 
 	/* Break poll on the linkset so it sends our messages */
-	pthread_kill(linksets[linkset-1].master, SIGURG);
+	ss7_linkset_kick(&linksets[linkset-1]);
 
 	return CLI_SUCCESS;
 }
@@ -14266,11 +17818,12 @@ static char *handle_ss7_reset_cic(struct ast_cli_entry *e, int cmd, struct ast_c
 
 	dpc = atoi(a->argv[4]);
 
+	ast_mutex_lock(&linksets[linkset-1].lock);
 	for (i = 0; i < linksets[linkset-1].numchans; i++) {
 		p = linksets[linkset-1].pvts[i];
 		if (p->cic == cic && p->dpc == dpc) {
 			ast_mutex_lock(&p->lock);
-			p->locallyblocked = 0;
+			circuit_clear(p, CIRCUIT_LOCAL_MASK);
 			ss7_grab(p, p->ss7);
 			res = ss7_start_rsc(p);
 			ss7_rel(p->ss7);
@@ -14278,6 +17831,7 @@ static char *handle_ss7_reset_cic(struct ast_cli_entry *e, int cmd, struct ast_c
 			ast_cli(a->fd, "%s RSC for linkset %d on CIC %d DPC %d\n", res ? "Sent" : "Failed", linkset, cic, dpc);
 		}
 	}
+	ast_mutex_unlock(&linksets[linkset-1].lock);
 
 	return CLI_SUCCESS;
 }
@@ -14329,8 +17883,10 @@ static char *handle_ss7_group_reset(struct ast_cli_entry *e, int cmd, struct ast
 
 	dpc = atoi(a->argv[4]);
 
+	ast_mutex_lock(&linksets[linkset-1].lock);
 	if(!ss7_find_cic_range(&linksets[linkset-1], cic, cic + range, dpc)) {
 		ast_cli(a->fd, "Invalid CIC/RANGE\n");
+		ast_mutex_unlock(&linksets[linkset-1].lock);
 		return CLI_SHOWUSAGE;
 	}
 
@@ -14343,6 +17899,7 @@ static char *handle_ss7_group_reset(struct ast_cli_entry *e, int cmd, struct ast
 				ss7_rel(p->ss7);
 				ast_mutex_unlock(&p->lock);
 				ast_cli(a->fd, "Unable allocate new ss7call\n");
+				ast_mutex_unlock(&linksets[linkset-1].lock);
 				return CLI_SUCCESS;
 			}
 			ss7_clear_channels(p, p->cic + range, SS7_HANGUP_FREE_CALL);
@@ -14351,11 +17908,13 @@ static char *handle_ss7_group_reset(struct ast_cli_entry *e, int cmd, struct ast
 			ss7_block_cics(&linksets[linkset-1], p->cic, p->cic + range, dpc, NULL, 0, 0,
 				SS7_BLOCKED_MAINTENANCE | SS7_BLOCKED_HARDWARE);
 			isup_grs(linksets[linkset-1].ss7, p->ss7call, p->cic + range);
+			ss7_stat_phase(p, SS7_PHASE_GRS);
 			ss7_rel(p->ss7);
 			ast_mutex_unlock(&p->lock);
 			ast_cli(a->fd, "GRS sent ... \n");
 		}
 	}
+	ast_mutex_unlock(&linksets[linkset-1].lock);
 
 	return CLI_SUCCESS;
 }
@@ -14415,8 +17974,10 @@ static char *handle_ss7_group_block(struct ast_cli_entry *e, int cmd, struct ast
 
 	dpc = atoi(a->argv[4]);
 
+	ast_mutex_lock(&linksets[linkset-1].lock);
 	if(!ss7_find_cic_range(&linksets[linkset-1], cic, cic + range, dpc)) {
 		ast_cli(a->fd, "Invalid CIC/RANGE\n");
+		ast_mutex_unlock(&linksets[linkset-1].lock);
 		return CLI_SHOWUSAGE;
 	}
 
@@ -14441,6 +18002,7 @@ static char *handle_ss7_group_block(struct ast_cli_entry *e, int cmd, struct ast
 			ss7_rel(p->ss7);
 			ast_mutex_unlock(&p->lock);
 			ast_cli(a->fd, "Unable allocate new ss7call\n");
+			ast_mutex_unlock(&linksets[linkset-1].lock);
 			return CLI_SUCCESS;
 		}
 
@@ -14450,6 +18012,7 @@ static char *handle_ss7_group_block(struct ast_cli_entry *e, int cmd, struct ast
 		ast_cli(a->fd, "Sending remote blocking request linkset %d on CIC %d range %d\n", linkset, cic, range);
 
 	}
+	ast_mutex_unlock(&linksets[linkset-1].lock);
 
 	return CLI_SUCCESS;
 }
@@ -14509,8 +18072,10 @@ static char *handle_ss7_group_unblock(struct ast_cli_entry *e, int cmd, struct a
 
 	dpc = atoi(a->argv[4]);
 
+	ast_mutex_lock(&linksets[linkset-1].lock);
 	if(!ss7_find_cic_range(&linksets[linkset-1], cic, cic + range, dpc)) {
 		ast_cli(a->fd, "Invalid CIC/RANGE\n");
+		ast_mutex_unlock(&linksets[linkset-1].lock);
 		return CLI_SHOWUSAGE;
 	}
 
@@ -14535,6 +18100,7 @@ static char *handle_ss7_group_unblock(struct ast_cli_entry *e, int cmd, struct a
 			ss7_rel(p->ss7);
 			ast_mutex_unlock(&p->lock);
 			ast_cli(a->fd, "Unable allocate new ss7call\n");
+			ast_mutex_unlock(&linksets[linkset-1].lock);
 			return CLI_SUCCESS;
 		}
 
@@ -14544,6 +18110,7 @@ static char *handle_ss7_group_unblock(struct ast_cli_entry *e, int cmd, struct a
 		ast_cli(a->fd, "Sending remote unblocking request linkset %d on CIC %d range %d\n", linkset, cic, range);
 
 	}
+	ast_mutex_unlock(&linksets[linkset-1].lock);
 
 	return CLI_SUCCESS;
 }
@@ -14580,6 +18147,7 @@ static char *handle_ss7_block_linkset(struct ast_cli_entry *e, int cmd, struct a
 		return CLI_SUCCESS;
 	}
 
+	ast_mutex_lock(&linksets[linkset-1].lock);
 	for (i = 0; i < linksets[linkset-1].numchans; i++) {
 		p = linksets[linkset-1].pvts[i];
 		ast_mutex_lock(&p->lock);
@@ -14593,6 +18161,7 @@ static char *handle_ss7_block_linkset(struct ast_cli_entry *e, int cmd, struct a
 		}
 		ast_mutex_unlock(&p->lock);
 	}
+	ast_mutex_unlock(&linksets[linkset-1].lock);
 
 	return CLI_SUCCESS;
 }
@@ -14639,10 +18208,11 @@ static char *handle_ss7_unblock_cic(struct ast_cli_entry *e, int cmd, struct ast
 
 	dpc = atoi(a->argv[4]);
 
+	ast_mutex_lock(&linksets[linkset-1].lock);
 	for (i = 0; i < linksets[linkset-1].numchans; i++) {
 		p = linksets[linkset-1].pvts[i];
 		if (p->cic == cic && p->dpc == dpc) {
-			blocked = p->locallyblocked;
+			blocked = circuit_locally_blocked(p);
 			if (blocked) {
 				ast_mutex_lock(&p->lock);
 				ss7_grab(p, p->ss7);
@@ -14650,6 +18220,7 @@ static char *handle_ss7_unblock_cic(struct ast_cli_entry *e, int cmd, struct ast
 					ss7_rel(p->ss7);
 					ast_mutex_unlock(&p->lock);
 					ast_cli(a->fd, "Unable allocate new ss7call\n");
+					ast_mutex_unlock(&linksets[linkset-1].lock);
 					return CLI_SUCCESS;
 				}
 				isup_ubl(linksets[linkset-1].ss7, p->ss7call);
@@ -14658,6 +18229,7 @@ static char *handle_ss7_unblock_cic(struct ast_cli_entry *e, int cmd, struct ast
 			}
 		}
 	}
+	ast_mutex_unlock(&linksets[linkset-1].lock);
 
 	if (blocked > 0)
 		ast_cli(a->fd, "Sent unblocking request for linkset %d on CIC %d\n", linkset, cic);
@@ -14697,6 +18269,7 @@ static char *handle_ss7_unblock_linkset(struct ast_cli_entry *e, int cmd, struct
 		return CLI_SUCCESS;
 	}
 
+	ast_mutex_lock(&linksets[linkset-1].lock);
 	for (i = 0; i < linksets[linkset-1].numchans; i++) {
 		p = linksets[linkset-1].pvts[i];
 		ast_mutex_lock(&p->lock);
@@ -14708,6 +18281,7 @@ static char *handle_ss7_unblock_linkset(struct ast_cli_entry *e, int cmd, struct
 		ss7_rel(p->ss7);
 		ast_mutex_unlock(&p->lock);
 	}
+	ast_mutex_unlock(&linksets[linkset-1].lock);
 
 	return CLI_SUCCESS;
 }
@@ -14754,6 +18328,7 @@ static char *handle_ss7_show_cics(struct ast_cli_entry *e, int cmd, struct ast_c
 
 	ast_cli(a->fd, format, "CIC", "DPC", "DAHDI", "STATE", "BLOCKING");
 
+	ast_mutex_lock(&ss7->lock);
 	for (i = 0; i < ss7->numchans; i++) {
 		if(!dpc || ss7->pvts[i]->dpc == dpc) {
 
@@ -14761,19 +18336,19 @@ static char *handle_ss7_show_cics(struct ast_cli_entry *e, int cmd, struct ast_c
 				state = "Used";
 			else if (ss7->pvts[i]->ss7call)
 				state = "Pending";
-			else if (!ss7->pvts[i]->inservice)
+			else if (!circuit_inservice(ss7->pvts[i]))
 				state = "NotInServ";
 			else
 				state = "Idle";
 
-			if (ss7->pvts[i]->locallyblocked) {
+			if (circuit_locally_blocked(ss7->pvts[i])) {
 				strcpy(blocking, "L:");
-				if(ss7->pvts[i]->locallyblocked & SS7_BLOCKED_MAINTENANCE)
+				if(circuit_locally_blocked(ss7->pvts[i]) & SS7_BLOCKED_MAINTENANCE)
 					strcat(blocking, "M");
 				else
 					strcat(blocking, " ");
 
-				if(ss7->pvts[i]->locallyblocked & SS7_BLOCKED_HARDWARE)
+				if(circuit_locally_blocked(ss7->pvts[i]) & SS7_BLOCKED_HARDWARE)
 					strcat(blocking, "H");
 				else
 					strcat(blocking, " ");
@@ -14782,14 +18357,14 @@ static char *handle_ss7_show_cics(struct ast_cli_entry *e, int cmd, struct ast_c
 				strcpy(blocking, "    ");
 			}
 
-			if (ss7->pvts[i]->remotelyblocked) {
+			if (circuit_remotely_blocked(ss7->pvts[i])) {
 				strcat(blocking, " R:");
-				if(ss7->pvts[i]->remotelyblocked & SS7_BLOCKED_MAINTENANCE)
+				if(circuit_remotely_blocked(ss7->pvts[i]) & SS7_BLOCKED_MAINTENANCE)
 					strcat(blocking, "M");
 				else
 					strcat(blocking, " ");
 
-				if(ss7->pvts[i]->remotelyblocked & SS7_BLOCKED_HARDWARE)
+				if(circuit_remotely_blocked(ss7->pvts[i]) & SS7_BLOCKED_HARDWARE)
 					strcat(blocking, "H");
 				else
 					strcat(blocking, " ");
@@ -14800,13 +18375,14 @@ static char *handle_ss7_show_cics(struct ast_cli_entry *e, int cmd, struct ast_c
 			ast_cli(a->fd, formatd, ss7->pvts[i]->cic, ss7->pvts[i]->dpc, ss7->pvts[i]->channel, state, blocking);
 		}
 	}
+	ast_mutex_unlock(&ss7->lock);
 
 	return CLI_SUCCESS;
 }
 
 static char *handle_ss7_show_linkset(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
-	int linkset;
+	int linkset, i, cic;
 	struct dahdi_ss7 *ss7;
 	switch (cmd) {
 	case CLI_INIT:
@@ -14842,10 +18418,285 @@ static char *handle_ss7_show_linkset(struct ast_cli_entry *e, int cmd, struct as
 	ast_cli(a->fd, "SS7 unknownprefix: %s\n", ss7->unknownprefix);
 	ast_cli(a->fd, "SS7 networkroutedprefix: %s\n", ss7->networkroutedprefix);
 	ast_cli(a->fd, "SS7 subscriberprefix: %s\n", ss7->subscriberprefix);
+	if (ss7->worker)
+		ast_cli(a->fd, "SS7 serviced by worker %d of %d\n", (int) (ss7->worker - ss7_workers) + 1, ss7_workers_running);
+	for (i = 0; i < ss7->numsigchans; i++) {
+		ast_cli(a->fd, "SS7 link %d rx: %u frames in %u wakeups (avg %.1f, max %u)\n", i,
+			ss7->rxstats[i].frames, ss7->rxstats[i].wakeups,
+			ss7->rxstats[i].wakeups ? (double) ss7->rxstats[i].frames / ss7->rxstats[i].wakeups : 0.0, ss7->rxstats[i].maxbatch);
+		ast_cli(a->fd, "SS7 link %d tx: %u frames in %u wakeups (avg %.1f, max %u)\n", i,
+			ss7->txstats[i].frames, ss7->txstats[i].wakeups,
+			ss7->txstats[i].wakeups ? (double) ss7->txstats[i].frames / ss7->txstats[i].wakeups : 0.0, ss7->txstats[i].maxbatch);
+	}
+	ast_mutex_lock(&ss7->lock);
+	for (i = 0, cic = 0; i < ss7->numchans; i++) {
+		if (ss7->pvts[i] && ss7->pvts[i]->ss7call)
+			cic++;
+	}
+	ast_cli(a->fd, "SS7 calls: %d CICs holding one, %u allocated, %u allocations failed\n", cic, ss7->calls_allocated, ss7->calls_failed);
+	for (i = 0, cic = 0; i < ss7->numchans; i++) {
+		if (ss7->pvts[i] && circuit_inservice(ss7->pvts[i]))
+			cic++;
+	}
+	ast_mutex_unlock(&ss7->lock);
+	if (ss7->grs_active)
+		ast_cli(a->fd, "SS7 startup reset: %d/%d GRS acknowledged, %d outstanding, %d/%d CICs in service after %d ms\n",
+			ss7->grs_acked, ss7->grs_ranges, ss7->grs_outstanding, cic, ss7->numchans, (int) ast_tvdiff_ms(ast_tvnow(), ss7->grs_start));
+	else if (!ast_tvzero(ss7->grs_finish))
+		ast_cli(a->fd, "SS7 startup reset: done, %d GRS in %d ms, %d/%d CICs in service\n",
+			ss7->grs_acked, (int) ast_tvdiff_ms(ss7->grs_finish, ss7->grs_start), cic, ss7->numchans);
+	ast_cli(a->fd, "SS7 bearers prepared while idle: %d, at IAM: %d%s\n", ss7->bearers_prepared, ss7->bearers_inline,
+		ss7_bearer.running ? "" : " (no bearer thread)");
+	ast_mutex_lock(&ss7->evlock);
+	if (ss7->evq)
+		ast_cli(a->fd, "SS7 ISUP dispatch queue: %d/%d (peak %d, grown %u times)\n", ss7->evcount, ss7->evsize, ss7->evpeak, ss7->evoverflow);
+	else
+		ast_cli(a->fd, "SS7 ISUP dispatch queue: none, events handled by the link thread\n");
+	ast_mutex_unlock(&ss7->evlock);
 	ss7_show_linkset(ss7->ss7, &ast_cli, a->fd);
 	return CLI_SUCCESS;
 }
 
+/*! \brief Counters and histograms of a linkset, copied out so they can be printed without its lock */
+struct ss7_stats_snapshot {
+	unsigned int msgcount[SS7_STATS_EVENTS + 1];
+	unsigned int passes;
+	unsigned int passevents;
+	unsigned int passmax;
+	struct ss7_hist latency[SS7_LAT_NUM];
+	int overload;
+	unsigned int overloads;
+	unsigned int shed;
+	int backlog;
+	int ev_avg;
+};
+
+static void ss7_stats_snapshot(struct dahdi_ss7 *linkset, struct ss7_stats_snapshot *snap)
+{
+	ast_mutex_lock(&linkset->lock);
+	memcpy(snap->msgcount, linkset->msgcount, sizeof(snap->msgcount));
+	snap->passes = linkset->passes;
+	snap->passevents = linkset->passevents;
+	snap->passmax = linkset->passmax;
+	memcpy(snap->latency, linkset->latency, sizeof(snap->latency));
+	snap->overload = linkset->overload;
+	snap->overloads = linkset->overloads;
+	snap->shed = linkset->shed;
+	snap->ev_avg = linkset->ev_avg;
+	ast_mutex_lock(&linkset->evlock);
+	snap->backlog = linkset->evcount;
+	ast_mutex_unlock(&linkset->evlock);
+	ast_mutex_unlock(&linkset->lock);
+}
+
+static char *handle_ss7_show_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	int linkset, i, j;
+	struct ss7_stats_snapshot snap;
+	struct ss7_hist *h;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "ss7 show stats";
+		e->usage =
+			"Usage: ss7 show stats <linkset>\n"
+			"       Shows the ISUP message counters and latency histograms of an SS7 linkset.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc < 4)
+		return CLI_SHOWUSAGE;
+	linkset = atoi(a->argv[3]);
+	if ((linkset < 1) || (linkset > NUM_SPANS)) {
+		ast_cli(a->fd, "Invalid linkset %s.  Should be a number %d to %d\n", a->argv[3], 1, NUM_SPANS);
+		return CLI_SUCCESS;
+	}
+	if (!linksets[linkset-1].ss7) {
+		ast_cli(a->fd, "No SS7 running on linkset %d\n", linkset);
+		return CLI_SUCCESS;
+	}
+
+	ss7_stats_snapshot(&linksets[linkset-1], &snap);
+
+	ast_cli(a->fd, "SS7 linkset %d messages handled:\n", linkset);
+	for (i = 0; i < SS7_STATS_EVENTS; i++) {
+		if (snap.msgcount[i])
+			ast_cli(a->fd, "  %-24s %10u\n", ss7_event2str(i), snap.msgcount[i]);
+	}
+	if (snap.msgcount[SS7_STATS_EVENTS])
+		ast_cli(a->fd, "  %-24s %10u\n", "Other", snap.msgcount[SS7_STATS_EVENTS]);
+	ast_cli(a->fd, "SS7 dispatch passes: %u, %u events (avg %.2f, max %u)\n", snap.passes, snap.passevents,
+		snap.passes ? (double) snap.passevents / snap.passes : 0.0, snap.passmax);
+	ast_cli(a->fd, "SS7 overload: %s, %d events queued, %d us per event, entered %u times, %u IAMs rejected\n",
+		snap.overload ? "yes" : "no", snap.backlog, snap.ev_avg, snap.overloads, snap.shed);
+
+	ast_cli(a->fd, "\n%-9s %8s %9s %9s", "Latency", "Count", "Avg(ms)", "Max(ms)");
+	for (j = 0; j < SS7_HIST_BUCKETS; j++)
+		ast_cli(a->fd, " %6s", ss7_hist_labels[j]);
+	ast_cli(a->fd, "\n");
+	for (i = 0; i < SS7_LAT_NUM; i++) {
+		h = &snap.latency[i];
+		ast_cli(a->fd, "%-9s %8u %9.3f %9.3f", ss7_latency_names[i], h->count,
+			h->count ? (double) h->total / h->count / 1000.0 : 0.0, h->max / 1000.0);
+		for (j = 0; j < SS7_HIST_BUCKETS; j++)
+			ast_cli(a->fd, " %6u", h->buckets[j]);
+		ast_cli(a->fd, "\n");
+	}
+	return CLI_SUCCESS;
+}
+
+/*! \brief Copy out the last \a max intact records of the trace ring of \a linkset, oldest first */
+static int ss7_trace_copy(struct dahdi_ss7 *linkset, struct ss7_trace_rec *out, int max)
+{
+	volatile struct ss7_trace_rec *r;
+	unsigned int end = linkset->trace_pos, pos, seq;
+	int n = 0;
+
+	if (max > SS7_TRACE_SIZE)
+		max = SS7_TRACE_SIZE;
+	for (pos = (end > (unsigned int) max) ? end - max : 0; pos != end; pos++) {
+		r = &linkset->trace[pos & (SS7_TRACE_SIZE - 1)];
+		seq = r->seq;
+		__sync_synchronize();
+		out[n].tv = r->tv;
+		out[n].type = r->type;
+		out[n].link = r->link;
+		out[n].cic = r->cic;
+		out[n].pc = r->pc;
+		out[n].data = r->data;
+		out[n].seq = seq;
+		__sync_synchronize();
+		/* Skip what was being written, or got overwritten, while we copied it */
+		if (seq == pos + 1 && r->seq == seq)
+			n++;
+	}
+	return n;
+}
+
+static char *handle_ss7_show_trace(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	int linkset, max = 50, n, i;
+	struct ss7_trace_rec *recs;
+	struct timeval now;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "ss7 show trace";
+		e->usage =
+			"Usage: ss7 show trace <linkset> [count]\n"
+			"       Shows the last events, 50 by default, kept in the trace ring of\n"
+			"       an SS7 linkset: ISUP messages received, MTP link changes and\n"
+			"       DAHDI events on the signalling channels.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if ((a->argc < 4) || (a->argc > 5))
+		return CLI_SHOWUSAGE;
+	linkset = atoi(a->argv[3]);
+	if ((linkset < 1) || (linkset > NUM_SPANS) || !linksets[linkset-1].ss7) {
+		ast_cli(a->fd, "No SS7 running on linkset %s\n", a->argv[3]);
+		return CLI_SUCCESS;
+	}
+	if ((a->argc == 5) && ((max = atoi(a->argv[4])) < 1))
+		return CLI_SHOWUSAGE;
+	if (!linksets[linkset-1].trace) {
+		ast_cli(a->fd, "No trace kept on linkset %d\n", linkset);
+		return CLI_SUCCESS;
+	}
+	if (!(recs = ast_malloc(SS7_TRACE_SIZE * sizeof(*recs))))
+		return CLI_FAILURE;
+
+	n = ss7_trace_copy(&linksets[linkset-1], recs, max);
+	now = ast_tvnow();
+	ast_cli(a->fd, "%-17s %12s %-4s %-24s %6s %6s %6s\n", "Time", "Age(s)", "Link", "Event", "CIC", "OPC", "Data");
+	for (i = 0; i < n; i++) {
+		ast_cli(a->fd, "%10ld.%06ld %12.6f ", (long) recs[i].tv.tv_sec, (long) recs[i].tv.tv_usec,
+			ast_tvdiff_ms(now, recs[i].tv) / 1000.0);
+		if (recs[i].type == SS7_TRACE_DAHDI)
+			ast_cli(a->fd, "%-4d %-24s %6s %6s %6d\n", recs[i].link, event2str(recs[i].data), "", "", recs[i].data);
+		else
+			ast_cli(a->fd, "%-4s %-24s %6d %6u %6d\n", "", ss7_event2str(recs[i].type), recs[i].cic, recs[i].pc, recs[i].data);
+	}
+	ast_cli(a->fd, "%d records shown, %d traced since the linkset started\n", n, linksets[linkset-1].trace_pos);
+	ast_free(recs);
+	return CLI_SUCCESS;
+}
+
+static int action_ss7showstats(struct mansession *s, const struct message *m)
+{
+	const char *id = astman_get_header(m, "ActionID");
+	const char *ls = astman_get_header(m, "Linkset");
+	char idText[256] = "";
+	char buckets[SS7_HIST_BUCKETS * 12];
+	struct ss7_stats_snapshot snap;
+	struct ss7_hist *h;
+	int linkset, i, j, len;
+
+	if (ast_strlen_zero(ls)) {
+		astman_send_error(s, m, "No linkset specified");
+		return 0;
+	}
+	linkset = atoi(ls);
+	if ((linkset < 1) || (linkset > NUM_SPANS) || !linksets[linkset-1].ss7) {
+		astman_send_error(s, m, "No SS7 running on that linkset");
+		return 0;
+	}
+	if (!ast_strlen_zero(id))
+		snprintf(idText, sizeof(idText), "ActionID: %s\r\n", id);
+
+	ss7_stats_snapshot(&linksets[linkset-1], &snap);
+	astman_send_ack(s, m, "SS7 linkset statistics will follow");
+
+	for (i = 0; i < SS7_STATS_EVENTS + 1; i++) {
+		if (!snap.msgcount[i])
+			continue;
+		astman_append(s,
+			"Event: SS7StatsMessage\r\n"
+			"Linkset: %d\r\n"
+			"Message: %s\r\n"
+			"Count: %u\r\n"
+			"%s"
+			"\r\n",
+			linkset, (i < SS7_STATS_EVENTS) ? ss7_event2str(i) : "Other", snap.msgcount[i], idText);
+	}
+	for (i = 0; i < SS7_LAT_NUM; i++) {
+		h = &snap.latency[i];
+		for (j = 0, len = 0; j < SS7_HIST_BUCKETS; j++)
+			len += snprintf(buckets + len, sizeof(buckets) - len, "%s%u", j ? "," : "", h->buckets[j]);
+		astman_append(s,
+			"Event: SS7StatsLatency\r\n"
+			"Linkset: %d\r\n"
+			"Latency: %s\r\n"
+			"Count: %u\r\n"
+			"TotalUs: %llu\r\n"
+			"MaxUs: %u\r\n"
+			"Buckets: %s\r\n"
+			"%s"
+			"\r\n",
+			linkset, ss7_latency_names[i], h->count, h->total, h->max, buckets, idText);
+	}
+	astman_append(s,
+		"Event: SS7StatsComplete\r\n"
+		"Linkset: %d\r\n"
+		"Passes: %u\r\n"
+		"PassEvents: %u\r\n"
+		"PassMax: %u\r\n"
+		"Overload: %s\r\n"
+		"Backlog: %d\r\n"
+		"EventUs: %d\r\n"
+		"Overloads: %u\r\n"
+		"Shed: %u\r\n"
+		"%s"
+		"\r\n",
+		linkset, snap.passes, snap.passevents, snap.passmax, snap.overload ? "Yes" : "No", snap.backlog,
+		snap.ev_avg, snap.overloads, snap.shed, idText);
+	return 0;
+}
+
 static char *handle_ss7_mtp3_restart(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
 	int linkset;
@@ -14881,7 +18732,7 @@ static char *handle_ss7_mtp3_restart(struct ast_cli_entry *e, int cmd, struct as
 
 	ast_mutex_lock(&ss7->lock);
 	mtp3_init_restart(ss7->ss7, slc);
-	pthread_kill(ss7->master, SIGURG);
+	ss7_linkset_kick(ss7);
 	ast_mutex_unlock(&ss7->lock);
 
 	return CLI_SUCCESS;
@@ -14928,7 +18779,7 @@ static char *handle_ss7_net_mnt(struct ast_cli_entry *e, int cmd, struct ast_cli
 
 	ast_mutex_lock(&ss7->lock);
 	res = mtp3_net_mng(ss7->ss7, slc, a->argv[4], arg);
-	pthread_kill(ss7->master, SIGURG);
+	ss7_linkset_kick(ss7);
 	ast_mutex_unlock(&ss7->lock);
 
 	ast_cli(a->fd, "%s", res);
@@ -14938,9 +18789,10 @@ static char *handle_ss7_net_mnt(struct ast_cli_entry *e, int cmd, struct ast_cli
 
 static char *handle_ss7_destroy_cics(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
-	int linkset, cicbegin, cicend, cur_cic, cur_chan, channel, res;
+	int linkset, cicbegin, cicend, cur_cic, channel, res;
 	unsigned short dpc;
 	struct dahdi_ss7 *ss7;
+	struct dahdi_pvt *p;
 
 	switch (cmd) {
 	case CLI_INIT:
@@ -14978,28 +18830,28 @@ static char *handle_ss7_destroy_cics(struct ast_cli_entry *e, int cmd, struct as
 		return CLI_SUCCESS;
 	}
 
+	ast_mutex_lock(&ss7->lock);
 	for (cur_cic = cicbegin; cur_cic <= cicend; cur_cic++) {
-		if (ss7_find_cic(ss7, cur_cic, dpc) == -1) {
+		if (!ss7_find_cic(ss7, cur_cic, dpc)) {
 			ast_cli(a->fd, "CIC: %i DPC: %i doesn't exist\n", cur_cic, dpc);
+			ast_mutex_unlock(&ss7->lock);
 			return CLI_SUCCESS;
 		}
 	}
 
-	ast_mutex_lock(&ss7->lock);
 	for (cur_cic = cicbegin; cur_cic <= cicend; cur_cic++) {
-		channel = ss7_find_cic(ss7, cur_cic, dpc);
-		ast_mutex_lock(&ss7->pvts[channel]->lock);
-		if(ss7->pvts[channel]->ss7call) {
-			isup_free_call(ss7->ss7, ss7->pvts[channel]->ss7call);
-			ss7->pvts[channel]->ss7call = NULL;
-		}
-		ast_mutex_unlock(&ss7->pvts[channel]->lock);
-		res = dahdi_destroy_channel_bynum(ss7->pvts[channel]->channel);
+		if (!(p = ss7_find_cic(ss7, cur_cic, dpc)))
+			continue;
+		channel = p->channel;
+		ast_mutex_lock(&p->lock);
+		if(p->ss7call) {
+			isup_free_call(ss7->ss7, p->ss7call);
+			p->ss7call = NULL;
+		}
+		ast_mutex_unlock(&p->lock);
+		res = dahdi_destroy_channel_bynum(channel);
 		if (res == RESULT_SUCCESS) {
 			ast_cli(a->fd, "CIC destroyed: CIC: %i DPC: %i dahdi chan: %i\n", cur_cic, dpc, channel);
-			ss7->numchans--;
-			for (cur_chan = channel; cur_chan < ss7->numchans; cur_chan++)
-				ss7->pvts[cur_chan] = ss7->pvts[cur_chan + 1];
 		}
 	}
 	ast_mutex_unlock(&ss7->lock);
@@ -15052,25 +18904,29 @@ static char *handle_ss7_add_cics(struct ast_cli_entry *e, int cmd, struct ast_cl
 	dpc = atoi(a->argv[6]);
 	cur_dahdi = atoi(a->argv[7]);
 
-	if (!ss7->numchans) {
-		ast_cli(a->fd, "Need at least 1 existing cic!\n");
+	if(!cicbegin || !cicend || !dpc || cicend < cicbegin || !cur_dahdi) {
+		ast_cli(a->fd, "Invalid cicbegin/cicend/dpc/dahdi_chan\n");
 		return CLI_SUCCESS;
 	}
 
-	if(!cicbegin || !cicend || !dpc || cicend < cicbegin || !cur_dahdi) {
-		ast_cli(a->fd, "Invalid cicbegin/cicend/dpc/dahdi_chan\n");
+	iflock_wrlock();
+	ast_mutex_lock(&ss7->lock);
+	if (!ss7->numchans) {
+		ast_cli(a->fd, "Need at least 1 existing cic!\n");
+		ast_mutex_unlock(&ss7->lock);
+		ast_rwlock_unlock(&iflock);
 		return CLI_SUCCESS;
 	}
 
 	for (cur_cic = cicbegin; cur_cic <= cicend; cur_cic++) {
-		if (ss7_find_cic(ss7, cur_cic, dpc) != -1) {
+		if (ss7_find_cic(ss7, cur_cic, dpc)) {
 			ast_cli(a->fd, "CIC: %i DPC: %i already exists\n", cur_cic, dpc);
+			ast_mutex_unlock(&ss7->lock);
+			ast_rwlock_unlock(&iflock);
 			return CLI_SUCCESS;
 		}
 	}
 
-	ast_mutex_lock(&iflock);
-	ast_mutex_lock(&ss7->lock);
 	for(cur_cic = cicbegin; cur_cic <= cicend; cur_cic++) {
 		chanpos = ss7->pvts[ss7->numchans - 1]->channel;
 
@@ -15087,9 +18943,15 @@ static char *handle_ss7_add_cics(struct ast_cli_entry *e, int cmd, struct ast_cl
 		p->channel = cur_dahdi;
 		p->owner = NULL;
 		p->ss7call = NULL;
-		p->inservice = 0;
+		circuit_clear(p, CIRCUIT_INSERVICE);
 		p->dpc = dpc;
 		p->cic = cur_cic;
+		p->cic_next = NULL;
+		p->monitor_events = 0;
+		p->monitor_radio = 0;
+		p->monitor_queued = 0;
+		p->monitor_next = NULL;
+		p->io_placed = 0;
 
 		snprintf(fn, sizeof(fn), "%d", p->channel);
 		p->subs[SUB_REAL].dfd = dahdi_open(fn);
@@ -15147,18 +19009,28 @@ static char *handle_ss7_add_cics(struct ast_cli_entry *e, int cmd, struct ast_cl
 				}
 			}
 
-			ss7->pvts[ss7->numchans] = p;
-			ss7->numchans++;
+			if (ss7_add_pvt(ss7, p)) {
+				ast_cli(a->fd, "Unable to add CIC: %i DPC: %i to linkset %d\n", p->cic, p->dpc, linkset);
+				/* Whatever it shares with the CIC it was copied from is not its own to free */
+				p->use_smdi = 0;
+				p->mwi_event_sub = NULL;
+				p->vars = NULL;
+				destroy_channel(p->prev, p, 1);
+				ifcount--;
+				break;
+			}
+			hunt_groups_invalidate();
+			monitor_touch(p);
 			cur_dahdi++;
 			ast_cli(a->fd, "Added new CIC: %i DPC: %i\n", p->cic, p->dpc);
 		} else {
 			ast_mutex_unlock(&ss7->lock);
-			ast_mutex_unlock(&iflock);
+			ast_rwlock_unlock(&iflock);
 			return CLI_SUCCESS;
 		}
 	}
 	ast_mutex_unlock(&ss7->lock);
-	ast_mutex_unlock(&iflock);
+	ast_rwlock_unlock(&iflock);
 
 	return CLI_SUCCESS;
 }
@@ -15176,6 +19048,8 @@ static struct ast_cli_entry dahdi_ss7_cli[] = {
 	AST_CLI_DEFINE(handle_ss7_block_linkset, "Blocks all CICs on a linkset"),
 	AST_CLI_DEFINE(handle_ss7_unblock_linkset, "Unblocks all CICs on a linkset"),
 	AST_CLI_DEFINE(handle_ss7_show_linkset, "Shows the status of a linkset"),
+	AST_CLI_DEFINE(handle_ss7_show_stats, "Shows ISUP counters and latencies of a linkset"),
+	AST_CLI_DEFINE(handle_ss7_show_trace, "Shows the last events traced on a linkset"),
 	AST_CLI_DEFINE(handle_ss7_show_calls, "Show ss7 calls"),
 	AST_CLI_DEFINE(handle_ss7_show_cics, "Show cics on a linkset"),
 	AST_CLI_DEFINE(handle_ss7_net_mnt, "Send an NET MNT message"),
@@ -15206,6 +19080,16 @@ static int __unload_module(void)
 		if (linksets[i].master != AST_PTHREADT_NULL)
 			pthread_cancel(linksets[i].master);
 		}
+	ss7_workers_stop();
+	/* The dispatchers and the bearer thread touch pvts, stop them before those go away */
+	for (i = 0; i < NUM_SPANS; i++) {
+		if (linksets[i].master && (linksets[i].master != AST_PTHREADT_NULL)) {
+			pthread_join(linksets[i].master, NULL);
+			linksets[i].master = AST_PTHREADT_NULL;
+		}
+		ss7_dispatcher_stop(&linksets[i]);
+	}
+	ss7_bearer_stop();
 	ast_cli_unregister_multiple(dahdi_ss7_cli, sizeof(dahdi_ss7_cli) / sizeof(struct ast_cli_entry));
 #endif
 
@@ -15217,8 +19101,11 @@ static int __unload_module(void)
 	ast_manager_unregister( "DAHDIDNDon" );
 	ast_manager_unregister("DAHDIShowChannels");
 	ast_manager_unregister("DAHDIRestart");
+#ifdef HAVE_SS7
+	ast_manager_unregister("SS7ShowStats");
+#endif
 	ast_channel_unregister(&dahdi_tech);
-	ast_mutex_lock(&iflock);
+	iflock_rdlock();
 	/* Hangup all interfaces if they have an owner */
 	p = iflist;
 	while (p) {
@@ -15226,7 +19113,7 @@ static int __unload_module(void)
 			ast_softhangup(p->owner, AST_SOFTHANGUP_APPUNLOAD);
 		p = p->next;
 	}
-	ast_mutex_unlock(&iflock);
+	ast_rwlock_unlock(&iflock);
 	ast_mutex_lock(&monlock);
 	if (monitor_thread && (monitor_thread != AST_PTHREADT_STOP) && (monitor_thread != AST_PTHREADT_NULL)) {
 		pthread_cancel(monitor_thread);
@@ -15236,7 +19123,7 @@ static int __unload_module(void)
 	monitor_thread = AST_PTHREADT_STOP;
 	ast_mutex_unlock(&monlock);
 
-	ast_mutex_lock(&iflock);
+	iflock_wrlock();
 	/* Destroy all the interfaces and free their memory */
 	p = iflist;
 	while (p) {
@@ -15256,7 +19143,10 @@ static int __unload_module(void)
 	}
 	iflist = NULL;
 	ifcount = 0;
-	ast_mutex_unlock(&iflock);
+	ast_mutex_lock(&huntlock);
+	hunt_groups_free();
+	ast_mutex_unlock(&huntlock);
+	ast_rwlock_unlock(&iflock);
 
 #if defined(HAVE_PRI)
 	for (i = 0; i < NUM_SPANS; i++) {
@@ -15277,10 +19167,22 @@ static int __unload_module(void)
 		}
 		if (linksets[i].ss7)
 			ss7_destroy(linksets[i].ss7);
+		ss7_free_pvts(&linksets[i]);
 	}
 #endif
 
+	ss_pool_shutdown();
+	ast_cond_destroy(&ss_pool.cond);
 	ast_cond_destroy(&ss_thread_complete);
+
+	lock_profiling = 0;
+	ast_mutex_lock(&lock_prof_lock);
+	while (lock_profs) {
+		struct lock_prof *site = lock_profs;
+		lock_profs = site->next;
+		ast_free(site);
+	}
+	ast_mutex_unlock(&lock_prof_lock);
 	return 0;
 }
 
@@ -15450,6 +19352,10 @@ static int process_dahdi(struct dahdi_chan_conf *confp, struct ast_variable *v,
 	int y;
 	int found_pseudo = 0;
         char dahdichan[MAX_CHANLIST_LEN] = {};
+#ifdef HAVE_SS7
+	struct dahdi_ss7 *cfglink;
+	int flag;
+#endif
 
 	for (; v; v = v->next) {
 		if (!ast_jb_read_conf(&global_jbconf, v->name, v->value))
@@ -15642,6 +19548,15 @@ static int process_dahdi(struct dahdi_chan_conf *confp, struct ast_variable *v,
 					confp->chan.vars = tmpvar;
 				}
 			}
+		} else if (!strcasecmp(v->name, "iocpus")) {
+			dahdi_parse_cpus_option(v, confp->chan.iocpus, sizeof(confp->chan.iocpus));
+		} else if (!strcasecmp(v->name, "ionumanode")) {
+			char cpus[DAHDI_CPUS_LEN];
+			int node;
+			if ((sscanf(v->value, "%d", &node) != 1) || dahdi_numa_cpus(node, cpus, sizeof(cpus)) || !dahdi_valid_cpus(cpus))
+				ast_log(LOG_WARNING, "No NUMA node '%s' on this host at line %d, ignoring ionumanode.\n", v->value, v->lineno);
+			else
+				ast_copy_string(confp->chan.iocpus, cpus, sizeof(confp->chan.iocpus));
 		} else if (!strcasecmp(v->name, "immediate")) {
 			confp->chan.immediate = ast_true(v->value);
 		} else if (!strcasecmp(v->name, "transfertobusy")) {
@@ -15708,6 +19623,85 @@ static int process_dahdi(struct dahdi_chan_conf *confp, struct ast_variable *v,
 			confp->chan.sendcalleridafter = atoi(v->value);
 		} else if (!strcasecmp(v->name, "mwimonitornotify")) {
 			ast_copy_string(mwimonitornotify, v->value, sizeof(mwimonitornotify));
+		} else if (!strcasecmp(v->name, "lockprofile")) {
+			lock_profiling = ast_true(v->value);
+#ifdef HAVE_SS7
+		} else if ((reload == 1) && !skipchannels && (!strcasecmp(v->name, "signalling") || !strcasecmp(v->name, "signaling"))) {
+			/* Only SS7 channels are added by a reload, see mkintf() */
+			confp->chan.sig = !strcasecmp(v->value, "ss7") ? SIG_SS7 : -1;
+			confp->is_sig_auto = 0;
+		} else if (!strcasecmp(v->name, "linkset")) {
+			cur_linkset = atoi(v->value);
+			if ((reload == 1) && (cfglink = ss7_resolve_linkset(cur_linkset)))
+				cfglink->reload_seen = 1;
+		} else if (!strcasecmp(v->name, "ss7framesize")) {
+			int ms = atoi(v->value);
+			if ((ms < 10) || (ms * 8 > MAX_READ_SIZE) || (ms % 10)) {
+				ast_log(LOG_WARNING, "Invalid ss7framesize '%s' at line %d, must be 10-%d and a multiple of 10.\n", v->value, v->lineno, MAX_READ_SIZE / 8);
+				confp->chan.readsize = READ_SIZE;
+			} else
+				confp->chan.readsize = ms * 8;
+		} else if (!strcasecmp(v->name, "defaultdpc")) {
+			cur_defaultdpc = parse_pointcode(v->value);
+		} else if (!strcasecmp(v->name, "cicbeginswith")) {
+			cur_cicbeginswith = atoi(v->value);
+		} else if (!strcasecmp(v->name, "ss7_internationalprefix")) {
+			ast_copy_string(confp->ss7.internationalprefix, v->value, sizeof(confp->ss7.internationalprefix));
+		} else if (!strcasecmp(v->name, "ss7_nationalprefix")) {
+			ast_copy_string(confp->ss7.nationalprefix, v->value, sizeof(confp->ss7.nationalprefix));
+		} else if (!strcasecmp(v->name, "ss7_subscriberprefix")) {
+			ast_copy_string(confp->ss7.subscriberprefix, v->value, sizeof(confp->ss7.subscriberprefix));
+		} else if (!strcasecmp(v->name, "ss7_unknownprefix")) {
+			ast_copy_string(confp->ss7.unknownprefix, v->value, sizeof(confp->ss7.unknownprefix));
+		} else if (!strcasecmp(v->name, "ss7_networkroutedprefix")) {
+			ast_copy_string(confp->ss7.networkroutedprefix, v->value, sizeof(confp->ss7.networkroutedprefix));
+		} else if (!strcasecmp(v->name, "ss7cpus")) {
+			dahdi_parse_cpus_option(v, confp->ss7.placement.cpus, sizeof(confp->ss7.placement.cpus));
+		} else if (!strcasecmp(v->name, "ss7rtprio")) {
+			dahdi_parse_rtprio_option(v, &confp->ss7.placement.rtprio);
+		} else if (!strcasecmp(v->name, "ss7_called_lengths")) {
+			ast_copy_string(confp->ss7.called_lengths, v->value, sizeof(confp->ss7.called_lengths));
+		} else if (!strcasecmp(v->name, "ss7_stdigit")) {
+			if (strlen(v->value) == 1)
+				confp->ss7.stdigit = v->value[0];
+			else
+				ast_log(LOG_WARNING, "Invalid ss7_stdigit '%s' at line %d, must be a single character.\n", v->value, v->lineno);
+		} else if (!strcasecmp(v->name, "ss7_called_nai")) {
+			if (!strcasecmp(v->value, "national")) {
+				confp->ss7.called_nai = SS7_NAI_NATIONAL;
+			} else if (!strcasecmp(v->value, "international")) {
+				confp->ss7.called_nai = SS7_NAI_INTERNATIONAL;
+			} else if (!strcasecmp(v->value, "subscriber")) {
+				confp->ss7.called_nai = SS7_NAI_SUBSCRIBER;
+ 			} else if (!strcasecmp(v->value, "dynamic")) {
+ 					confp->ss7.called_nai = SS7_NAI_DYNAMIC;
+			} else {
+				ast_log(LOG_WARNING, "Unknown SS7 called_nai '%s' at line %d.\n", v->value, v->lineno);
+			}
+		} else if (!strcasecmp(v->name, "ss7_calling_nai")) {
+			if (!strcasecmp(v->value, "national")) {
+				confp->ss7.calling_nai = SS7_NAI_NATIONAL;
+			} else if (!strcasecmp(v->value, "international")) {
+				confp->ss7.calling_nai = SS7_NAI_INTERNATIONAL;
+			} else if (!strcasecmp(v->value, "subscriber")) {
+				confp->ss7.calling_nai = SS7_NAI_SUBSCRIBER;
+			} else if (!strcasecmp(v->value, "dynamic")) {
+				confp->ss7.calling_nai = SS7_NAI_DYNAMIC;
+			} else {
+				ast_log(LOG_WARNING, "Unknown SS7 calling_nai '%s' at line %d.\n", v->value, v->lineno);
+			}
+		} else if ((flag = ss7_linkset_flag(v->name))) {
+			cfglink = ss7_resolve_linkset(cur_linkset);
+			if (!cfglink) {
+				ast_log(LOG_ERROR, "Invalid linkset number.  Must be between 1 and %d\n", NUM_SPANS + 1);
+				return -1;
+			}
+			if (reload == 1) {
+				if (ast_true(v->value))
+					cfglink->reload_flags |= flag;
+			} else if (ast_true(v->value))
+				cfglink->flags |= flag;
+#endif
 		} else if (reload != 1) {
 			 if (!strcasecmp(v->name, "signalling") || !strcasecmp(v->name, "signaling")) {
 				int orig_radio = confp->chan.radio;
@@ -15961,6 +19955,10 @@ static int process_dahdi(struct dahdi_chan_conf *confp, struct ast_variable *v,
 				ast_copy_string(confp->pri.privateprefix, v->value, sizeof(confp->pri.privateprefix));
 			} else if (!strcasecmp(v->name, "unknownprefix")) {
 				ast_copy_string(confp->pri.unknownprefix, v->value, sizeof(confp->pri.unknownprefix));
+			} else if (!strcasecmp(v->name, "pricpus")) {
+				dahdi_parse_cpus_option(v, confp->pri.placement.cpus, sizeof(confp->pri.placement.cpus));
+			} else if (!strcasecmp(v->name, "prirtprio")) {
+				dahdi_parse_rtprio_option(v, &confp->pri.placement.rtprio);
 			} else if (!strcasecmp(v->name, "resetinterval")) {
 				if (!strcasecmp(v->value, "never"))
 					confp->pri.resetinterval = -1;
@@ -16024,16 +20022,10 @@ static int process_dahdi(struct dahdi_chan_conf *confp, struct ast_variable *v,
 					cur_ss7type = SS7_ANSI;
 				} else
 					ast_log(LOG_WARNING, "'%s' is an unknown ss7 switch type at line %d.!\n", v->value, v->lineno);
-			} else if (!strcasecmp(v->name, "linkset")) {
-				cur_linkset = atoi(v->value);
 			} else if (!strcasecmp(v->name, "pointcode")) {
 				cur_pointcode = parse_pointcode(v->value);
 			} else if (!strcasecmp(v->name, "adjpointcode")) {
 				cur_adjpointcode = parse_pointcode(v->value);
-			} else if (!strcasecmp(v->name, "defaultdpc")) {
-				cur_defaultdpc = parse_pointcode(v->value);
-			} else if (!strcasecmp(v->name, "cicbeginswith")) {
-				cur_cicbeginswith = atoi(v->value);
 			} else if (!strcasecmp(v->name, "networkindicator")) {
 				if (!strcasecmp(v->value, "national"))
 					cur_networkindicator = SS7_NI_NAT;
@@ -16045,40 +20037,6 @@ static int process_dahdi(struct dahdi_chan_conf *confp, struct ast_variable *v,
 					cur_networkindicator = SS7_NI_INT_SPARE;
 				else
 					cur_networkindicator = -1;
-			} else if (!strcasecmp(v->name, "ss7_internationalprefix")) {
-				ast_copy_string(confp->ss7.internationalprefix, v->value, sizeof(confp->ss7.internationalprefix));
-			} else if (!strcasecmp(v->name, "ss7_nationalprefix")) {
-				ast_copy_string(confp->ss7.nationalprefix, v->value, sizeof(confp->ss7.nationalprefix));
-			} else if (!strcasecmp(v->name, "ss7_subscriberprefix")) {
-				ast_copy_string(confp->ss7.subscriberprefix, v->value, sizeof(confp->ss7.subscriberprefix));
-			} else if (!strcasecmp(v->name, "ss7_unknownprefix")) {
-				ast_copy_string(confp->ss7.unknownprefix, v->value, sizeof(confp->ss7.unknownprefix));
-			} else if (!strcasecmp(v->name, "ss7_networkroutedprefix")) {
-				ast_copy_string(confp->ss7.networkroutedprefix, v->value, sizeof(confp->ss7.networkroutedprefix));
-			} else if (!strcasecmp(v->name, "ss7_called_nai")) {
-				if (!strcasecmp(v->value, "national")) {
-					confp->ss7.called_nai = SS7_NAI_NATIONAL;
-				} else if (!strcasecmp(v->value, "international")) {
-					confp->ss7.called_nai = SS7_NAI_INTERNATIONAL;
-				} else if (!strcasecmp(v->value, "subscriber")) {
-					confp->ss7.called_nai = SS7_NAI_SUBSCRIBER;
-	 			} else if (!strcasecmp(v->value, "dynamic")) {
- 					confp->ss7.called_nai = SS7_NAI_DYNAMIC;
-				} else {
-					ast_log(LOG_WARNING, "Unknown SS7 called_nai '%s' at line %d.\n", v->value, v->lineno);
-				}
-			} else if (!strcasecmp(v->name, "ss7_calling_nai")) {
-				if (!strcasecmp(v->value, "national")) {
-					confp->ss7.calling_nai = SS7_NAI_NATIONAL;
-				} else if (!strcasecmp(v->value, "international")) {
-					confp->ss7.calling_nai = SS7_NAI_INTERNATIONAL;
-				} else if (!strcasecmp(v->value, "subscriber")) {
-					confp->ss7.calling_nai = SS7_NAI_SUBSCRIBER;
-				} else if (!strcasecmp(v->value, "dynamic")) {
-					confp->ss7.calling_nai = SS7_NAI_DYNAMIC;
-				} else {
-					ast_log(LOG_WARNING, "Unknown SS7 calling_nai '%s' at line %d.\n", v->value, v->lineno);
-				}
 			} else if (!strcasecmp(v->name, "sigchan")) {
 				int sigchan, res;
 				sigchan = atoi(v->value);
@@ -16086,51 +20044,6 @@ static int process_dahdi(struct dahdi_chan_conf *confp, struct ast_variable *v,
 				if (res < 0)
 					return -1;
 
-			} else if (!strcasecmp(v->name, "ss7_explicitacm")) {
-				struct dahdi_ss7 *link;
-				link = ss7_resolve_linkset(cur_linkset);
-				if (!link) {
-					ast_log(LOG_ERROR, "Invalid linkset number.  Must be between 1 and %d\n", NUM_SPANS + 1);
-					return -1;
-				}
-				if (ast_true(v->value))
-					link->flags |= LINKSET_FLAG_EXPLICITACM;
-			} else if (!strcasecmp(v->name, "ss7_autoacm")) {
-				struct dahdi_ss7 *link;
-				link = ss7_resolve_linkset(cur_linkset);
-				if (!link) {
-					ast_log(LOG_ERROR, "Invalid linkset number.  Must be between 1 and %d\n", NUM_SPANS + 1);
-					return -1;
-				}
-				if (ast_true(v->value))
-					link->flags |= LINKSET_FLAG_AUTOACM;
-			} else if (!strcasecmp(v->name, "ss7_initialhwblo")) {
-				struct dahdi_ss7 *link;
-				link = ss7_resolve_linkset(cur_linkset);
-				if (!link) {
-					ast_log(LOG_ERROR, "Invalid linkset number.  Must be between 1 and %d\n", NUM_SPANS + 1);
-					return -1;
-				}
-				if (ast_true(v->value))
-					link->flags |= LINKSET_FLAG_INITIALHWBLO;
-			} else if (!strcasecmp(v->name, "ss7_use_echocontrol")) {
-				struct dahdi_ss7 *link;
-				link = ss7_resolve_linkset(cur_linkset);
-				if (!link) {
-					ast_log(LOG_ERROR, "Invalid linkset number.  Must be between 1 and %d\n", NUM_SPANS + 1);
-					return -1;
-				}
-				if (ast_true(v->value))
-					link->flags |= LINKSET_FLAG_USEECHOCONTROL;
-			} else if (!strcasecmp(v->name, "ss7_default_echocontrol")) {
-				struct dahdi_ss7 *link;
-				link = ss7_resolve_linkset(cur_linkset);
-				if (!link) {
-					ast_log(LOG_ERROR, "Invalid linkset number.  Must be between 1 and %d\n", NUM_SPANS + 1);
-					return -1;
-				}
-				if (ast_true(v->value))
-					link->flags |= LINKSET_FLAG_DEFAULTECHOCONTROL;
 			} else if (!strncasecmp(v->name, "isup_timer", 10)) {
 				struct dahdi_ss7 *link;
 				link = ss7_resolve_linkset(cur_linkset);
@@ -16326,6 +20239,94 @@ static int process_dahdi(struct dahdi_chan_conf *confp, struct ast_variable *v,
 				ast_copy_string(defaultozz, v->value, sizeof(defaultozz));
 			} else if (!strcasecmp(v->name, "mwilevel")) {
 				mwilevel = atoi(v->value);
+#ifdef HAVE_SS7
+			} else if (!strcasecmp(v->name, "ss7workers")) {
+				ss7_numworkers = atoi(v->value);
+				if (ss7_numworkers < 0 || ss7_numworkers > SS7_MAX_WORKERS) {
+					ast_log(LOG_WARNING, "Invalid ss7workers '%s' at line %d, must be 0-%d.\n", v->value, v->lineno, SS7_MAX_WORKERS);
+					ss7_numworkers = ss7_numworkers < 0 ? 0 : SS7_MAX_WORKERS;
+				}
+			} else if (!strcasecmp(v->name, "ss7setupthreads")) {
+				ss7_setup_threads = atoi(v->value);
+				if (ss7_setup_threads < 0 || ss7_setup_threads > SS7_MAX_SETUP_THREADS) {
+					ast_log(LOG_WARNING, "Invalid ss7setupthreads '%s' at line %d, must be 0-%d.\n", v->value, v->lineno, SS7_MAX_SETUP_THREADS);
+					ss7_setup_threads = ss7_setup_threads < 0 ? 0 : SS7_MAX_SETUP_THREADS;
+				}
+			} else if (!strcasecmp(v->name, "ss7tandembridge")) {
+				ss7_tandem = ast_true(v->value);
+			} else if (!strcasecmp(v->name, "ss7dspshed")) {
+				if (ast_false(v->value))
+					ss7_dsp_shed = -1;
+				else if (!strcasecmp(v->value, "answer"))
+					ss7_dsp_shed = 0;
+				else if (sscanf(v->value, "%d", &ss7_dsp_shed) != 1 || ss7_dsp_shed < 0) {
+					ast_log(LOG_WARNING, "Invalid ss7dspshed '%s' at line %d, must be no, answer or seconds.\n", v->value, v->lineno);
+					ss7_dsp_shed = -1;
+				}
+			} else if (!strcasecmp(v->name, "ss7grswindow")) {
+				ss7_grs_window = atoi(v->value);
+				if (ss7_grs_window < 0) {
+					ast_log(LOG_WARNING, "Invalid ss7grswindow '%s' at line %d, must be 0 or more.\n", v->value, v->lineno);
+					ss7_grs_window = 0;
+				}
+			} else if (!strcasecmp(v->name, "ss7grsrate")) {
+				ss7_grs_rate = atoi(v->value);
+				if (ss7_grs_rate < 0) {
+					ast_log(LOG_WARNING, "Invalid ss7grsrate '%s' at line %d, must be 0 or more.\n", v->value, v->lineno);
+					ss7_grs_rate = 0;
+				}
+			} else if (!strcasecmp(v->name, "ss7overloadqueue")) {
+				ss7_overload_queue = atoi(v->value);
+				if ((ss7_overload_queue < 0) || (ss7_overload_queue > SS7_EVENT_QUEUE)) {
+					ast_log(LOG_WARNING, "Invalid ss7overloadqueue '%s' at line %d, must be 0-%d.\n", v->value, v->lineno, SS7_EVENT_QUEUE);
+					ss7_overload_queue = 0;
+				}
+			} else if (!strcasecmp(v->name, "ss7overloaddelay")) {
+				ss7_overload_delay = atoi(v->value);
+				if (ss7_overload_delay < 0) {
+					ast_log(LOG_WARNING, "Invalid ss7overloaddelay '%s' at line %d, must be 0 or more ms.\n", v->value, v->lineno);
+					ss7_overload_delay = 0;
+				}
+			} else if (!strcasecmp(v->name, "ss7batch")) {
+				ss7_batch = atoi(v->value);
+				if (ss7_batch < 1) {
+					ast_log(LOG_WARNING, "Invalid ss7batch '%s' at line %d, must be at least 1.\n", v->value, v->lineno);
+					ss7_batch = 1;
+				}
+#endif
+			} else if (!strcasecmp(v->name, "monitorcpus")) {
+				dahdi_parse_cpus_option(v, monitor_placement.cpus, sizeof(monitor_placement.cpus));
+			} else if (!strcasecmp(v->name, "monitorrtprio")) {
+				dahdi_parse_rtprio_option(v, &monitor_placement.rtprio);
+			} else if (!strcasecmp(v->name, "ssthreadpool")) {
+				int size = atoi(v->value);
+				if (size < 0) {
+					ast_log(LOG_WARNING, "Invalid ssthreadpool '%s' at line %d, disabling the pool.\n", v->value, v->lineno);
+					size = 0;
+				}
+				ast_mutex_lock(&ss_pool.lock);
+				ss_pool.size = size;
+				/* Let idle workers above the new size go */
+				ast_cond_broadcast(&ss_pool.cond);
+				ast_mutex_unlock(&ss_pool.lock);
+			} else if (!strcasecmp(v->name, "ssthreadqueue")) {
+				int depth = atoi(v->value);
+				if (depth < 0 || depth > SS_POOL_MAX_QUEUE) {
+					ast_log(LOG_WARNING, "Invalid ssthreadqueue '%s' at line %d, must be 0-%d.\n", v->value, v->lineno, SS_POOL_MAX_QUEUE);
+					depth = depth < 0 ? 0 : SS_POOL_MAX_QUEUE;
+				}
+				ast_mutex_lock(&ss_pool.lock);
+				ss_pool.depth = depth;
+				ast_mutex_unlock(&ss_pool.lock);
+			} else if (!strcasecmp(v->name, "ssthreadwait")) {
+				int timeout = atoi(v->value);
+				if (timeout < 0) {
+					ast_log(LOG_WARNING, "Invalid ssthreadwait '%s' at line %d, queued call setups wait for ever.\n", v->value, v->lineno);
+					timeout = 0;
+				}
+				ast_mutex_lock(&ss_pool.lock);
+				ss_pool.timeout = timeout;
+				ast_mutex_unlock(&ss_pool.lock);
 			}
 		} else if (!skipchannels)
 			ast_log(LOG_WARNING, "Ignoring any changes to '%s' (on reload) at line %d.\n", v->name, v->lineno);
@@ -16394,7 +20395,7 @@ static int setup_dahdi(int reload)
 	}
 
 	/* It's a little silly to lock it, but we mind as well just to be sure */
-	ast_mutex_lock(&iflock);
+	iflock_wrlock();
 #ifdef HAVE_PRI
 	if (reload != 1) {
 		/* Process trunkgroups first */
@@ -16461,12 +20462,22 @@ static int setup_dahdi(int reload)
 
 	mwimonitornotify[0] = '\0';
 
+#ifdef HAVE_SS7
+	if (reload == 1)
+		ss7_reload_begin();
+#endif
+
 	v = ast_variable_browse(cfg, "channels");
 	res = process_dahdi(&base_conf, v, reload, 0);
-	ast_mutex_unlock(&iflock);
+	ast_rwlock_unlock(&iflock);
 	ast_config_destroy(cfg);
-	if (res)
+	if (res) {
+#ifdef HAVE_SS7
+		if (reload == 1)
+			ss7_reload_end(0);
+#endif
 		return res;
+	}
 	if (ucfg) {
 		char *cat;
 		const char *chans;
@@ -16501,7 +20512,24 @@ static int setup_dahdi(int reload)
 	}
 #endif
 #ifdef HAVE_SS7
+	if (reload == 1)
+		ss7_reload_end(1);
 	if (reload != 1) {
+		int x;
+		ss7_bearer_start();
+		for (x = 0; x < NUM_SPANS; x++) {
+			if (linksets[x].ss7 && !linksets[x].trace && !(linksets[x].trace = ast_calloc(SS7_TRACE_SIZE, sizeof(*linksets[x].trace))))
+				ast_log(LOG_WARNING, "Unable to allocate the trace ring of linkset %d\n", x + 1);
+			if (linksets[x].ss7 && ss7_dispatcher_start(&linksets[x]))
+				ast_log(LOG_WARNING, "Unable to start ISUP dispatcher on linkset %d, events will be handled by its link thread\n", x + 1);
+		}
+	}
+	if (reload != 1 && ss7_numworkers) {
+		if (ss7_workers_start()) {
+			ss7_workers_stop();
+			return -1;
+		}
+	} else if (reload != 1) {
 		int x;
 		for (x = 0; x < NUM_SPANS; x++) {
 			if (linksets[x].ss7) {
@@ -16542,8 +20570,12 @@ static int load_module(void)
 #endif
 #ifdef HAVE_SS7
 	memset(linksets, 0, sizeof(linksets));
+	memset(linkset_map, 0, sizeof(linkset_map));
 	for (y = 0; y < NUM_SPANS; y++) {
 		ast_mutex_init(&linksets[y].lock);
+		ast_mutex_init(&linksets[y].evlock);
+		ast_cond_init(&linksets[y].evcond, NULL);
+		ast_cond_init(&linksets[y].setupcond, NULL);
 		linksets[y].master = AST_PTHREADT_NULL;
 		for (i = 0; i < NUM_DCHANS; i++)
 			linksets[y].fds[i] = -1;
@@ -16554,6 +20586,9 @@ static int load_module(void)
 	ss7_set_notinservice(dahdi_ss7_notinservice);
 	ss7_set_call_null(dahdi_ss7_call_null);
 #endif /* HAVE_SS7 */
+	energy_tables_init();
+	ast_cond_init(&ss_pool.cond, NULL);
+	ss_pool.stop = 0;
 	res = setup_dahdi(0);
 	/* Make sure we can register our DAHDI channel type */
 	if (res)
@@ -16582,6 +20617,9 @@ static int load_module(void)
 	ast_manager_register("DAHDIDNDoff", 0, action_dahdidndoff, "Toggle DAHDI channel Do Not Disturb status OFF" );
 	ast_manager_register("DAHDIShowChannels", 0, action_dahdishowchannels, "Show status dahdi channels");
 	ast_manager_register("DAHDIRestart", 0, action_dahdirestart, "Fully Restart DAHDI channels (terminates calls)");
+#ifdef HAVE_SS7
+	ast_manager_register("SS7ShowStats", 0, action_ss7showstats, "Show ISUP counters and latencies of an SS7 linkset");
+#endif
 
 	ast_cond_init(&ss_thread_complete, NULL);
 
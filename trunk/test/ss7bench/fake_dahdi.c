@@ -0,0 +1,279 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Fake DAHDI file descriptors for the ss7bench preload library
+ *
+ * Every open() of a /dev/dahdi/ path gets one end of a socketpair instead,
+ * so poll() works on it as usual.  The DAHDI ioctls chan_dahdi issues are
+ * answered from here: the channels listed in SS7BENCH_SIGCHANS are HDLC
+ * signalling channels, every other one is a clear channel bearer, all spans
+ * are E1 without alarms.  Audio written to a bearer is thrown away, reading
+ * one gives silence.  Nothing but the descriptors opened here is touched.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <dahdi/user.h>
+
+#include "ss7bench.h"
+
+#define BENCH_SPAN_CHANS 31		/*!< Channels per span, as on an E1 */
+#define BENCH_MAX_SIGCHANS 32
+
+struct bench_fd {
+	unsigned int used:1;
+	unsigned int sigchan:1;
+	int channel;			/*!< From DAHDI_SPECIFY, or made up for pseudo channels */
+	int peer;			/*!< Our end of the socketpair */
+};
+
+static struct bench_fd fds[SS7BENCH_MAX_FDS];
+static pthread_mutex_t fdlock = PTHREAD_MUTEX_INITIALIZER;
+static int sigchans[BENCH_MAX_SIGCHANS];
+static int numsigchans;
+static int next_pseudo = 10000;
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_close)(int);
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_write)(int, const void *, size_t);
+static int (*real_ioctl)(int, unsigned long, ...);
+
+static void __attribute__((constructor)) fake_dahdi_init(void)
+{
+	char *list, *cur, *next;
+
+	real_open = dlsym(RTLD_NEXT, "open");
+	real_close = dlsym(RTLD_NEXT, "close");
+	real_read = dlsym(RTLD_NEXT, "read");
+	real_write = dlsym(RTLD_NEXT, "write");
+	real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+
+	if (!(cur = getenv("SS7BENCH_SIGCHANS")) || !(list = strdup(cur)))
+		return;
+	for (cur = list; cur && (numsigchans < BENCH_MAX_SIGCHANS); cur = next) {
+		if ((next = strchr(cur, ',')))
+			*next++ = '\0';
+		if (atoi(cur) > 0)
+			sigchans[numsigchans++] = atoi(cur);
+	}
+	free(list);
+}
+
+static int is_sigchan(int channel)
+{
+	int i;
+
+	for (i = 0; i < numsigchans; i++) {
+		if (sigchans[i] == channel)
+			return 1;
+	}
+	return 0;
+}
+
+int bench_fd_is_fake(int fd)
+{
+	return (fd >= 0) && (fd < SS7BENCH_MAX_FDS) && fds[fd].used;
+}
+
+int bench_fd_channel(int fd)
+{
+	return bench_fd_is_fake(fd) ? fds[fd].channel : 0;
+}
+
+void bench_fd_wake(int fd)
+{
+	char c = 0;
+
+	if (bench_fd_is_fake(fd))
+		send(fds[fd].peer, &c, 1, MSG_DONTWAIT);
+}
+
+void bench_fd_drain(int fd)
+{
+	char buf[256];
+
+	if (!bench_fd_is_fake(fd))
+		return;
+	while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+}
+
+static int fake_open(const char *path, int flags)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return -1;
+	if ((sv[0] >= SS7BENCH_MAX_FDS) || (sv[1] >= SS7BENCH_MAX_FDS)) {
+		real_close(sv[0]);
+		real_close(sv[1]);
+		errno = EMFILE;
+		return -1;
+	}
+	if (flags & O_NONBLOCK)
+		fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+
+	pthread_mutex_lock(&fdlock);
+	memset(&fds[sv[0]], 0, sizeof(fds[sv[0]]));
+	fds[sv[0]].used = 1;
+	fds[sv[0]].peer = sv[1];
+	if (!strcmp(path, "/dev/dahdi/pseudo"))
+		fds[sv[0]].channel = next_pseudo++;
+	pthread_mutex_unlock(&fdlock);
+	return sv[0];
+}
+
+int open(const char *path, int flags, ...)
+{
+	va_list ap;
+	mode_t mode = 0;
+
+	if (flags & O_CREAT) {
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+	if (!strncmp(path, "/dev/dahdi/", 11))
+		return fake_open(path, flags);
+	return real_open(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+{
+	va_list ap;
+	mode_t mode = 0;
+
+	if (flags & O_CREAT) {
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+	return open(path, flags | O_LARGEFILE, mode);
+}
+
+int close(int fd)
+{
+	if (bench_fd_is_fake(fd)) {
+		pthread_mutex_lock(&fdlock);
+		real_close(fds[fd].peer);
+		fds[fd].used = 0;
+		pthread_mutex_unlock(&fdlock);
+	}
+	return real_close(fd);
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	ssize_t res;
+
+	if (!bench_fd_is_fake(fd) || fds[fd].sigchan)
+		return real_read(fd, buf, count);
+	/* A bearer always has a block of A-law silence for the channel thread */
+	if ((res = recv(fd, buf, count, MSG_DONTWAIT)) > 0)
+		return res;
+	memset(buf, 0xd5, count);
+	return count;
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	if (bench_fd_is_fake(fd))
+		return count;
+	return real_write(fd, buf, count);
+}
+
+static void fake_params(struct bench_fd *f, struct dahdi_params *p)
+{
+	int channel = f->channel ? f->channel : p->channo;
+
+	memset(p, 0, sizeof(*p));
+	p->channo = channel;
+	p->spanno = (channel - 1) / BENCH_SPAN_CHANS + 1;
+	p->chanpos = (channel - 1) % BENCH_SPAN_CHANS + 1;
+	p->sigtype = f->sigchan ? DAHDI_SIG_HDLCFCS : DAHDI_SIG_CLEAR;
+	p->sigcap = p->sigtype;
+	p->curlaw = DAHDI_LAW_ALAW;
+	snprintf(p->name, sizeof(p->name), "SS7BENCH/%d/%d", p->spanno, p->chanpos);
+}
+
+static void fake_spanstat(struct bench_fd *f, struct dahdi_spaninfo *si)
+{
+	int spanno = si->spanno ? si->spanno : (f->channel ? (f->channel - 1) / BENCH_SPAN_CHANS + 1 : 1);
+
+	memset(si, 0, sizeof(*si));
+	si->spanno = spanno;
+	si->alarms = 0;
+	si->numchans = BENCH_SPAN_CHANS;
+	si->totalchans = BENCH_SPAN_CHANS;
+	si->lineconfig = DAHDI_CONFIG_CCS | DAHDI_CONFIG_HDB3 | DAHDI_CONFIG_CRC4;
+	snprintf(si->name, sizeof(si->name), "SS7BENCH/%d", spanno);
+	snprintf(si->desc, sizeof(si->desc), "ss7bench fake E1 span %d", spanno);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	struct bench_fd *f;
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (!bench_fd_is_fake(fd))
+		return real_ioctl(fd, request, arg);
+	f = &fds[fd];
+
+	switch (request) {
+	case DAHDI_SPECIFY:
+		f->channel = *(int *) arg;
+		f->sigchan = is_sigchan(f->channel);
+		break;
+	case DAHDI_CHANNO:
+		*(int *) arg = f->channel;
+		break;
+	case DAHDI_GET_PARAMS:
+		fake_params(f, arg);
+		break;
+	case DAHDI_SPANSTAT:
+		fake_spanstat(f, arg);
+		break;
+	case DAHDI_GETVERSION:
+		memset(arg, 0, sizeof(struct dahdi_versioninfo));
+		snprintf(((struct dahdi_versioninfo *) arg)->version, sizeof(((struct dahdi_versioninfo *) arg)->version), "ss7bench");
+		break;
+	case DAHDI_GETEVENT:
+		*(int *) arg = DAHDI_EVENT_NONE;
+		break;
+	case DAHDI_DIALING:
+		*(int *) arg = 0;
+		break;
+	case DAHDI_IOMUX:
+		*(int *) arg &= DAHDI_IOMUX_READ | DAHDI_IOMUX_WRITE | DAHDI_IOMUX_WRITEEMPTY;
+		break;
+	default:
+		/* Gains, conferences, buffering, echo cancellers, tones: accepted as is */
+		break;
+	}
+	return 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief ISUP messages chan_dahdi sends, for the ss7bench preload library
+ *
+ * Each libss7 call below is reported to bench_sent() and then passed on to
+ * libss7 itself, which encodes the message as usual; it never leaves, as
+ * ss7_write() belongs to ss7_script.c.  libss7.h is deliberately not
+ * included: only the symbol names matter to the dynamic linker, and the
+ * prototypes below are the ones chan_dahdi calls them with.  All of them
+ * are taken to return int, chan_dahdi never looks at the result of those
+ * that do not.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <dlfcn.h>
+
+#include "ss7bench.h"
+
+struct ss7;
+
+#define BENCH_REAL(name, ret, args) \
+	static ret (*real) args; \
+	if (!real) \
+		real = (ret (*) args) dlsym(RTLD_NEXT, #name)
+
+/*! \brief A message about one call */
+#define BENCH_TAP_CALL(name, msg) \
+int name(struct ss7 *ss7, struct isup_call *c) \
+{ \
+	BENCH_REAL(name, int, (struct ss7 *, struct isup_call *)); \
+	bench_sent(msg, c, -1, 0); \
+	return real ? real(ss7, c) : -1; \
+}
+
+/*! \brief A message about one call, with a cause or event */
+#define BENCH_TAP_ARG(name, msg) \
+int name(struct ss7 *ss7, struct isup_call *c, int arg) \
+{ \
+	BENCH_REAL(name, int, (struct ss7 *, struct isup_call *, int)); \
+	bench_sent(msg, c, -1, arg); \
+	return real ? real(ss7, c, arg) : -1; \
+}
+
+/*! \brief A circuit group supervision acknowledgement, up to \a endcic */
+#define BENCH_TAP_ACK(name, msg) \
+int name(struct ss7 *ss7, struct isup_call *c, int endcic, unsigned char state[]) \
+{ \
+	BENCH_REAL(name, int, (struct ss7 *, struct isup_call *, int, unsigned char *)); \
+	bench_sent(msg, c, endcic, 0); \
+	return real ? real(ss7, c, endcic, state) : -1; \
+}
+
+/*! \brief A circuit group (un)blocking, up to \a endcic */
+#define BENCH_TAP_GROUP(name, msg) \
+int name(struct ss7 *ss7, struct isup_call *c, int endcic, unsigned char state[], int type) \
+{ \
+	BENCH_REAL(name, int, (struct ss7 *, struct isup_call *, int, unsigned char *, int)); \
+	bench_sent(msg, c, endcic, type); \
+	return real ? real(ss7, c, endcic, state, type) : -1; \
+}
+
+BENCH_TAP_CALL(isup_iam, BENCH_MSG_IAM)
+BENCH_TAP_CALL(isup_acm, BENCH_MSG_ACM)
+BENCH_TAP_CALL(isup_anm, BENCH_MSG_ANM)
+BENCH_TAP_CALL(isup_rlc, BENCH_MSG_RLC)
+BENCH_TAP_CALL(isup_rsc, BENCH_MSG_RSC)
+BENCH_TAP_CALL(isup_blo, BENCH_MSG_BLO)
+BENCH_TAP_CALL(isup_bla, BENCH_MSG_BLA)
+BENCH_TAP_CALL(isup_ubl, BENCH_MSG_UBL)
+BENCH_TAP_CALL(isup_uba, BENCH_MSG_UBA)
+BENCH_TAP_ARG(isup_rel, BENCH_MSG_REL)
+BENCH_TAP_ARG(isup_cpg, BENCH_MSG_CPG)
+BENCH_TAP_ACK(isup_gra, BENCH_MSG_GRA)
+BENCH_TAP_ACK(isup_cgba, BENCH_MSG_CGBA)
+BENCH_TAP_ACK(isup_cgua, BENCH_MSG_CGUA)
+BENCH_TAP_GROUP(isup_cgb, BENCH_MSG_CGB)
+BENCH_TAP_GROUP(isup_cgu, BENCH_MSG_CGU)
+
+int isup_grs(struct ss7 *ss7, struct isup_call *c, int endcic)
+{
+	BENCH_REAL(isup_grs, int, (struct ss7 *, struct isup_call *, int));
+	bench_sent(BENCH_MSG_GRS, c, endcic, 0);
+	return real ? real(ss7, c, endcic) : -1;
+}
+
+void isup_init_call(struct ss7 *ss7, struct isup_call *c, int cic, unsigned int dpc)
+{
+	BENCH_REAL(isup_init_call, void, (struct ss7 *, struct isup_call *, int, unsigned int));
+	if (real)
+		real(ss7, c, cic, dpc);
+	bench_call_init(c, cic, dpc);
+}
+
+void isup_free_call(struct ss7 *ss7, struct isup_call *c)
+{
+	BENCH_REAL(isup_free_call, void, (struct ss7 *, struct isup_call *));
+	bench_call_free(c);
+	if (real)
+		real(ss7, c);
+}
+
+struct isup_call *isup_free_call_if_clear(struct ss7 *ss7, struct isup_call *c)
+{
+	struct isup_call *res;
+
+	BENCH_REAL(isup_free_call_if_clear, struct isup_call *, (struct ss7 *, struct isup_call *));
+	if (!real)
+		return c;
+	if (!(res = real(ss7, c)))
+		bench_call_free(c);
+	return res;
+}
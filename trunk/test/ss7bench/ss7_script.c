@@ -0,0 +1,876 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Scripted far end for the ss7bench preload library
+ *
+ * Takes the place of the libss7 link layer of a linkset: ss7_read(),
+ * ss7_write(), the MTP timers and ss7_check_event() are answered from here,
+ * so no HDLC frame is ever sent or expected.  ISUP events come from a script
+ * (SS7BENCH_SCRIPT) and/or a synthetic call generator (SS7BENCH_CALLS), and
+ * are handed to chan_dahdi as libss7 would, with real libss7 call objects.
+ * What chan_dahdi answers is reported to bench_sent(), which times it and
+ * plays the far end's part: RLC for a REL, GRA for a GRS and so on.
+ *
+ * Only the first linkset chan_dahdi starts is driven.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <libss7.h>
+
+#include "ss7bench.h"
+
+#define BENCH_MAX_STEPS 65536		/*!< Lines an SS7BENCH_SCRIPT can have */
+#define BENCH_CALL_BUCKETS 4096
+#define BENCH_LAT_BUCKETS 32		/*!< log2 of microseconds */
+
+/*! \brief What the far end can send, the script keywords */
+enum bench_ev {
+	BENCH_EV_UP,
+	BENCH_EV_DOWN,
+	BENCH_EV_IAM,
+	BENCH_EV_SAM,
+	BENCH_EV_ACM,
+	BENCH_EV_CPG,
+	BENCH_EV_ANM,
+	BENCH_EV_CON,
+	BENCH_EV_REL,
+	BENCH_EV_RLC,
+	BENCH_EV_RSC,
+	BENCH_EV_GRS,
+	BENCH_EV_GRA,
+	BENCH_EV_CGB,
+	BENCH_EV_CGBA,
+	BENCH_EV_CGU,
+	BENCH_EV_CGUA,
+	BENCH_EV_BLO,
+	BENCH_EV_BLA,
+	BENCH_EV_UBL,
+	BENCH_EV_UBA,
+	BENCH_EV_DIGITTIMEOUT,
+	BENCH_EV_COUNT,
+};
+
+static const char * const bench_ev_names[BENCH_EV_COUNT] = {
+	"UP", "DOWN", "IAM", "SAM", "ACM", "CPG", "ANM", "CON", "REL", "RLC", "RSC",
+	"GRS", "GRA", "CGB", "CGBA", "CGU", "CGUA", "BLO", "BLA", "UBL", "UBA", "DIGITTIMEOUT",
+};
+
+/*! \brief One message of the far end, a line of the script */
+struct bench_step {
+	long ms;			/*!< Offset from the start of the script, or delay of a reply */
+	enum bench_ev ev;
+	int cic;
+	int endcic;
+	int arg;			/*!< REL cause, CPG event, CGB/CGU type */
+	char called[32];
+	char calling[32];
+};
+
+struct bench_inject {
+	struct timeval when;
+	struct bench_step step;
+	struct bench_inject *next;
+};
+
+/*! \brief Far end state of one CIC */
+struct bench_cic {
+	struct isup_call *call;
+	unsigned int busy:1;		/*!< A call of the generator is on it */
+	int waiting;			/*!< Event whose answer is being timed, -1 if none */
+	struct timeval sent;		/*!< When that event was due */
+};
+
+struct bench_callmap {
+	struct isup_call *call;
+	int cic;
+	struct bench_callmap *next;
+};
+
+struct bench_lat {
+	unsigned int count;
+	double total;			/*!< Microseconds */
+	unsigned int max;
+	unsigned int hist[BENCH_LAT_BUCKETS];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct ss7 *bench_ss7;
+static int bench_fd = -1;			/*!< First signalling channel of the linkset */
+static pthread_t pump;
+static int pump_running;
+
+static struct bench_inject *sched;		/*!< Sorted by due time */
+static struct bench_inject *ready_head, *ready_tail;
+
+static struct bench_step *steps;
+static int numsteps;
+static int loops = 1;
+static double speed = 1.0;
+static unsigned int dpc = 1;
+static long reply_ms;
+static long answer_ms;
+static int interval = 10;
+static FILE *report;
+
+static double calls_per_sec;
+static int calls_first, calls_last, calls_next;
+static long hold_ms;
+static char calls_called[32] = "1000";
+static char calls_calling[32] = "2000";
+
+static struct bench_cic cics[SS7BENCH_MAX_CICS];
+static struct bench_callmap *callmap[BENCH_CALL_BUCKETS];
+
+static struct timeval start;
+static struct rusage start_ru;
+static unsigned long long injected, injected_last;
+static unsigned long long sent[BENCH_MSG_COUNT];
+static unsigned long long blocked;		/*!< Generator calls that found no idle CIC */
+static struct bench_lat lat[BENCH_EV_COUNT];
+
+static const char * const bench_msg_names[BENCH_MSG_COUNT] = {
+	"IAM", "ACM", "ANM", "CPG", "REL", "RLC", "RSC", "GRS", "GRA",
+	"CGB", "CGBA", "CGU", "CGUA", "BLO", "BLA", "UBL", "UBA",
+};
+
+static long tv_us(struct timeval a, struct timeval b)
+{
+	return (a.tv_sec - b.tv_sec) * 1000000L + (a.tv_usec - b.tv_usec);
+}
+
+static struct timeval tv_add_us(struct timeval tv, long us)
+{
+	tv.tv_sec += us / 1000000;
+	tv.tv_usec += us % 1000000;
+	if (tv.tv_usec >= 1000000) {
+		tv.tv_sec++;
+		tv.tv_usec -= 1000000;
+	}
+	return tv;
+}
+
+static struct timeval tv_add_ms(struct timeval tv, long ms)
+{
+	return tv_add_us(tv, ms * 1000);
+}
+
+static int cic_ok(int cic)
+{
+	return (cic > 0) && (cic < SS7BENCH_MAX_CICS);
+}
+
+/*! \brief Queue \a step to be sent at \a when, with lock held */
+static void bench_schedule(struct timeval when, const struct bench_step *step)
+{
+	struct bench_inject *inj, **cur;
+
+	if (!(inj = calloc(1, sizeof(*inj))))
+		return;
+	inj->when = when;
+	inj->step = *step;
+	for (cur = &sched; *cur && (tv_us((*cur)->when, when) <= 0); cur = &(*cur)->next)
+		;
+	inj->next = *cur;
+	*cur = inj;
+	pthread_cond_signal(&cond);
+}
+
+/*! \brief Send a reply of the far end on \a cic, \a ms from now, with lock held */
+static void bench_reply(enum bench_ev ev, int cic, int endcic, long ms)
+{
+	struct bench_step step;
+	struct timeval now;
+
+	memset(&step, 0, sizeof(step));
+	step.ev = ev;
+	step.cic = cic;
+	step.endcic = endcic;
+	gettimeofday(&now, NULL);
+	bench_schedule(tv_add_ms(now, ms), &step);
+}
+
+static int bench_ev_lookup(const char *name)
+{
+	int i;
+
+	for (i = 0; i < BENCH_EV_COUNT; i++) {
+		if (!strcasecmp(name, bench_ev_names[i]))
+			return i;
+	}
+	return -1;
+}
+
+/*!
+ * \brief Read SS7BENCH_SCRIPT
+ *
+ * One message per line: "<ms> <message> <cic>[-<endcic>] [args]", where
+ * args are the called and calling numbers of an IAM, the digits of a SAM,
+ * the cause of a REL, the event of a CPG or the type of a CGB/CGU.
+ * '#' starts a comment.
+ */
+static int bench_load_script(const char *path)
+{
+	FILE *f;
+	char line[256], name[16], a[32], b[32];
+	struct bench_step *step;
+	int lineno = 0, ev;
+	long ms;
+	char range[32];
+
+	if (!(f = fopen(path, "r"))) {
+		fprintf(stderr, "ss7bench: unable to open script %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (!(steps = calloc(BENCH_MAX_STEPS, sizeof(*steps)))) {
+		fclose(f);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) && (numsteps < BENCH_MAX_STEPS)) {
+		lineno++;
+		if (strchr(line, '#'))
+			*strchr(line, '#') = '\0';
+		a[0] = b[0] = range[0] = '\0';
+		if (sscanf(line, "%ld %15s %31s %31s %31s", &ms, name, range, a, b) < 2)
+			continue;
+		if ((ev = bench_ev_lookup(name)) < 0) {
+			fprintf(stderr, "ss7bench: %s:%d: unknown message %s\n", path, lineno, name);
+			continue;
+		}
+		step = &steps[numsteps];
+		step->ev = ev;
+		step->ms = ms;
+		step->cic = atoi(range);
+		step->endcic = strchr(range, '-') ? atoi(strchr(range, '-') + 1) : step->cic;
+		if ((step->ev != BENCH_EV_UP) && (step->ev != BENCH_EV_DOWN) && !cic_ok(step->cic)) {
+			fprintf(stderr, "ss7bench: %s:%d: bad CIC %s\n", path, lineno, range);
+			continue;
+		}
+		switch (step->ev) {
+		case BENCH_EV_IAM:
+			snprintf(step->called, sizeof(step->called), "%s", a);
+			snprintf(step->calling, sizeof(step->calling), "%s", b);
+			break;
+		case BENCH_EV_SAM:
+			snprintf(step->called, sizeof(step->called), "%s", a);
+			break;
+		case BENCH_EV_REL:
+			step->arg = a[0] ? atoi(a) : 16;
+			break;
+		case BENCH_EV_CPG:
+			step->arg = a[0] ? atoi(a) : CPG_EVENT_ALERTING;
+			break;
+		case BENCH_EV_CGB:
+		case BENCH_EV_CGU:
+			step->arg = atoi(a);
+			break;
+		default:
+			break;
+		}
+		numsteps++;
+	}
+	fclose(f);
+	return 0;
+}
+
+/*! \brief Queue every loop of the script, with lock held */
+static void bench_schedule_script(struct timeval base)
+{
+	long period;
+	int l, i;
+
+	if (!numsteps)
+		return;
+	period = steps[numsteps - 1].ms + 1;
+	for (l = 0; l < loops; l++) {
+		for (i = 0; i < numsteps; i++)
+			bench_schedule(tv_add_ms(base, (long) ((l * period + steps[i].ms) / speed)), &steps[i]);
+	}
+}
+
+/*! \brief Start a call of the generator on the next idle CIC, with lock held */
+static void bench_generate_call(struct timeval now)
+{
+	struct bench_step step;
+	int i, cic = 0;
+
+	for (i = 0; i <= calls_last - calls_first; i++) {
+		cic = calls_first + (calls_next++ % (calls_last - calls_first + 1));
+		if (!cics[cic].busy)
+			break;
+		cic = 0;
+	}
+	if (!cic) {
+		blocked++;
+		return;
+	}
+	cics[cic].busy = 1;
+
+	memset(&step, 0, sizeof(step));
+	step.ev = BENCH_EV_IAM;
+	step.cic = step.endcic = cic;
+	snprintf(step.called, sizeof(step.called), "%s", calls_called);
+	snprintf(step.calling, sizeof(step.calling), "%s", calls_calling);
+	bench_schedule(now, &step);
+
+	step.ev = BENCH_EV_REL;
+	step.arg = 16;
+	bench_schedule(tv_add_ms(now, hold_ms), &step);
+}
+
+static void bench_lat_add(struct bench_lat *l, long us)
+{
+	int b;
+
+	if (us < 0)
+		us = 0;
+	for (b = 0; (b < BENCH_LAT_BUCKETS - 1) && ((1L << b) <= us); b++)
+		;
+	l->hist[b]++;
+	l->count++;
+	l->total += us;
+	if (us > l->max)
+		l->max = us;
+}
+
+/*! \brief Upper bound of the bucket the \a pct percentile falls into, in microseconds */
+static unsigned long bench_lat_pct(const struct bench_lat *l, int pct)
+{
+	unsigned int want = (l->count * pct + 99) / 100, seen = 0;
+	int b;
+
+	for (b = 0; b < BENCH_LAT_BUCKETS; b++) {
+		if ((seen += l->hist[b]) >= want)
+			return 1UL << b;
+	}
+	return l->max;
+}
+
+/*! \brief Print throughput, answer latency and CPU use since the start, with lock held */
+static void bench_report(void)
+{
+	struct timeval now;
+	struct rusage ru;
+	double secs, usr, sys;
+	int i;
+
+	gettimeofday(&now, NULL);
+	getrusage(RUSAGE_SELF, &ru);
+	secs = tv_us(now, start) / 1e6;
+	if (secs <= 0)
+		return;
+	usr = tv_us(ru.ru_utime, start_ru.ru_utime) / 1e4 / secs;
+	sys = tv_us(ru.ru_stime, start_ru.ru_stime) / 1e4 / secs;
+
+	fprintf(report, "ss7bench: %.1f s, %llu events in (%.1f/s, %llu since last), CPU %.1f%% user %.1f%% system\n",
+		secs, injected, injected / secs, injected - injected_last, usr, sys);
+	injected_last = injected;
+	if (blocked)
+		fprintf(report, "  %llu generated calls found no idle CIC\n", blocked);
+	fprintf(report, "  %-14s %10s %10s %10s %10s %10s\n", "Answer to", "Count", "avg us", "p50 us", "p99 us", "max us");
+	for (i = 0; i < BENCH_EV_COUNT; i++) {
+		if (!lat[i].count)
+			continue;
+		fprintf(report, "  %-14s %10u %10.0f %10lu %10lu %10u\n", bench_ev_names[i], lat[i].count,
+			lat[i].total / lat[i].count, bench_lat_pct(&lat[i], 50), bench_lat_pct(&lat[i], 99), lat[i].max);
+	}
+	fprintf(report, "  Sent by chan_dahdi:");
+	for (i = 0; i < BENCH_MSG_COUNT; i++) {
+		if (sent[i])
+			fprintf(report, " %s %llu", bench_msg_names[i], sent[i]);
+	}
+	fprintf(report, "\n");
+	fflush(report);
+}
+
+/*! \brief Moves due messages of the far end to chan_dahdi and runs the generator */
+static void *bench_pump(void *data)
+{
+	struct timeval now, next_call, next_report;
+	struct timespec ts;
+	struct bench_inject *inj;
+	struct timeval wake;
+	int due;
+
+	pthread_mutex_lock(&lock);
+	gettimeofday(&now, NULL);
+	next_call = now;
+	next_report = tv_add_ms(now, interval * 1000L);
+	while (pump_running) {
+		gettimeofday(&now, NULL);
+		while (calls_per_sec > 0 && tv_us(now, next_call) >= 0) {
+			bench_generate_call(now);
+			next_call = tv_add_us(next_call, (long) (1000000.0 / calls_per_sec));
+		}
+		for (due = 0; sched && (tv_us(now, sched->when) >= 0); due++) {
+			inj = sched;
+			sched = inj->next;
+			inj->next = NULL;
+			if (ready_tail)
+				ready_tail->next = inj;
+			else
+				ready_head = inj;
+			ready_tail = inj;
+		}
+		if (due)
+			bench_fd_wake(bench_fd);
+		if (interval && tv_us(now, next_report) >= 0) {
+			bench_report();
+			next_report = tv_add_ms(now, interval * 1000L);
+		}
+
+		wake = next_report;
+		if (sched && tv_us(wake, sched->when) > 0)
+			wake = sched->when;
+		if (calls_per_sec > 0 && tv_us(wake, next_call) > 0)
+			wake = next_call;
+		ts.tv_sec = wake.tv_sec;
+		ts.tv_nsec = wake.tv_usec * 1000;
+		pthread_cond_timedwait(&cond, &lock, &ts);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+static void __attribute__((constructor)) bench_init(void)
+{
+	const char *v;
+
+	report = stderr;
+	if ((v = getenv("SS7BENCH_REPORT")) && !(report = fopen(v, "a")))
+		report = stderr;
+	if ((v = getenv("SS7BENCH_SCRIPT")))
+		bench_load_script(v);
+	if ((v = getenv("SS7BENCH_LOOPS")) && (atoi(v) > 0))
+		loops = atoi(v);
+	if ((v = getenv("SS7BENCH_SPEED")) && (atof(v) > 0))
+		speed = atof(v);
+	if ((v = getenv("SS7BENCH_DPC")))
+		dpc = strtoul(v, NULL, 0);
+	if ((v = getenv("SS7BENCH_REPLY_MS")))
+		reply_ms = atol(v);
+	if ((v = getenv("SS7BENCH_ANSWER_MS")))
+		answer_ms = atol(v);
+	if ((v = getenv("SS7BENCH_INTERVAL")))
+		interval = atoi(v);
+	/* <calls per second>,<first cic>-<last cic>,<hold ms>[,<called>[,<calling>]] */
+	if ((v = getenv("SS7BENCH_CALLS"))) {
+		if ((sscanf(v, "%lf,%d-%d,%ld,%31[^,],%31s", &calls_per_sec, &calls_first, &calls_last, &hold_ms,
+			calls_called, calls_calling) < 4) || !cic_ok(calls_first) || !cic_ok(calls_last) || (calls_last < calls_first)) {
+			fprintf(stderr, "ss7bench: bad SS7BENCH_CALLS '%s'\n", v);
+			calls_per_sec = 0;
+		}
+	}
+}
+
+static void __attribute__((destructor)) bench_fini(void)
+{
+	pthread_mutex_lock(&lock);
+	if (!pump_running) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	pump_running = 0;
+	pthread_cond_signal(&cond);
+	bench_report();
+	pthread_mutex_unlock(&lock);
+	pthread_join(pump, NULL);
+}
+
+/* The call map, everything below with lock held */
+
+static unsigned int bench_call_hash(struct isup_call *call)
+{
+	return ((unsigned long) call >> 4) % BENCH_CALL_BUCKETS;
+}
+
+static int bench_call_cic(struct isup_call *call)
+{
+	struct bench_callmap *m;
+
+	for (m = callmap[bench_call_hash(call)]; m; m = m->next) {
+		if (m->call == call)
+			return m->cic;
+	}
+	return 0;
+}
+
+void bench_call_init(struct isup_call *call, int cic, unsigned int pc)
+{
+	struct bench_callmap *m, **head;
+
+	if (!call || !cic_ok(cic))
+		return;
+	pthread_mutex_lock(&lock);
+	head = &callmap[bench_call_hash(call)];
+	for (m = *head; m && m->call != call; m = m->next)
+		;
+	if (!m && (m = calloc(1, sizeof(*m)))) {
+		m->call = call;
+		m->next = *head;
+		*head = m;
+	}
+	if (m)
+		m->cic = cic;
+	cics[cic].call = call;
+	pthread_mutex_unlock(&lock);
+}
+
+void bench_call_free(struct isup_call *call)
+{
+	struct bench_callmap *m, **cur;
+
+	pthread_mutex_lock(&lock);
+	for (cur = &callmap[bench_call_hash(call)]; *cur; cur = &(*cur)->next) {
+		if ((*cur)->call == call) {
+			m = *cur;
+			*cur = m->next;
+			if (cics[m->cic].call == call)
+				cics[m->cic].call = NULL;
+			free(m);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void bench_sent(enum bench_msg msg, struct isup_call *call, int endcic, int arg)
+{
+	struct timeval now;
+	int cic;
+
+	gettimeofday(&now, NULL);
+	pthread_mutex_lock(&lock);
+	sent[msg]++;
+	if (!(cic = bench_call_cic(call))) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	if (cics[cic].waiting >= 0) {
+		bench_lat_add(&lat[cics[cic].waiting], tv_us(now, cics[cic].sent));
+		cics[cic].waiting = -1;
+	}
+
+	switch (msg) {
+	case BENCH_MSG_IAM:
+		bench_reply(BENCH_EV_ACM, cic, cic, reply_ms);
+		bench_reply(BENCH_EV_ANM, cic, cic, reply_ms + answer_ms);
+		break;
+	case BENCH_MSG_REL:
+		bench_reply(BENCH_EV_RLC, cic, cic, reply_ms);
+		cics[cic].busy = 0;
+		break;
+	case BENCH_MSG_RLC:
+		cics[cic].busy = 0;
+		break;
+	case BENCH_MSG_RSC:
+		bench_reply(BENCH_EV_RLC, cic, cic, reply_ms);
+		break;
+	case BENCH_MSG_GRS:
+		bench_reply(BENCH_EV_GRA, cic, endcic, reply_ms);
+		break;
+	case BENCH_MSG_CGB:
+		bench_reply(BENCH_EV_CGBA, cic, endcic, reply_ms);
+		break;
+	case BENCH_MSG_CGU:
+		bench_reply(BENCH_EV_CGUA, cic, endcic, reply_ms);
+		break;
+	case BENCH_MSG_BLO:
+		bench_reply(BENCH_EV_BLA, cic, cic, reply_ms);
+		break;
+	case BENCH_MSG_UBL:
+		bench_reply(BENCH_EV_UBA, cic, cic, reply_ms);
+		break;
+	default:
+		break;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* libss7, as chan_dahdi sees it */
+
+int ss7_add_link(struct ss7 *ss7, int transport, int fd)
+{
+	static int (*real_add_link)(struct ss7 *, int, int);
+
+	if (!real_add_link)
+		real_add_link = dlsym(RTLD_NEXT, "ss7_add_link");
+	pthread_mutex_lock(&lock);
+	if (!bench_ss7) {
+		bench_ss7 = ss7;
+		bench_fd = fd;
+	}
+	pthread_mutex_unlock(&lock);
+	/* libss7 still knows the link by its fd, for the alarm and CLI calls */
+	return real_add_link ? real_add_link(ss7, transport, fd) : 0;
+}
+
+int ss7_start(struct ss7 *ss7)
+{
+	struct bench_step up;
+	int i;
+
+	if (ss7 != bench_ss7)
+		return 0;
+	pthread_mutex_lock(&lock);
+	gettimeofday(&start, NULL);
+	getrusage(RUSAGE_SELF, &start_ru);
+	memset(cics, 0, sizeof(cics));
+	for (i = 0; i < SS7BENCH_MAX_CICS; i++)
+		cics[i].waiting = -1;
+	memset(&up, 0, sizeof(up));
+	up.ev = BENCH_EV_UP;
+	bench_schedule(start, &up);
+	bench_schedule_script(tv_add_ms(start, 1));
+	pump_running = !pthread_create(&pump, NULL, bench_pump, NULL);
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+int ss7_read(struct ss7 *ss7, int fd)
+{
+	bench_fd_drain(fd);
+	return 0;
+}
+
+int ss7_write(struct ss7 *ss7, int fd)
+{
+	return 0;
+}
+
+int ss7_pollflags(struct ss7 *ss7, int fd)
+{
+	return POLLIN | POLLPRI;
+}
+
+struct timeval *ss7_schedule_next(struct ss7 *ss7)
+{
+	return NULL;
+}
+
+void ss7_schedule_run(struct ss7 *ss7)
+{
+}
+
+/*! \brief Call of \a cic for an event, a new one if the far end has none there yet */
+static struct isup_call *bench_event_call(int cic)
+{
+	struct isup_call *call;
+
+	if ((call = cics[cic].call))
+		return call;
+	pthread_mutex_unlock(&lock);
+	if ((call = isup_new_call(bench_ss7)))
+		isup_init_call(bench_ss7, call, cic, dpc);
+	pthread_mutex_lock(&lock);
+	return call;
+}
+
+/*! \brief Turn \a step into the libss7 event \a e, with lock held */
+static void bench_build_event(ss7_event *e, const struct bench_step *step)
+{
+	int cic = step->cic, i;
+
+	memset(e, 0, sizeof(*e));
+	switch (step->ev) {
+	case BENCH_EV_UP:
+		e->e = SS7_EVENT_UP;
+		return;
+	case BENCH_EV_DOWN:
+		e->e = SS7_EVENT_DOWN;
+		return;
+	case BENCH_EV_IAM:
+		/* A new call, whatever the far end had on the CIC before */
+		cics[cic].call = NULL;
+		e->e = ISUP_EVENT_IAM;
+		e->iam.cic = cic;
+		e->iam.opc = dpc;
+		e->iam.call = bench_event_call(cic);
+		e->iam.called_nai = SS7_NAI_NATIONAL;
+		e->iam.calling_nai = SS7_NAI_NATIONAL;
+		snprintf(e->iam.called_party_num, sizeof(e->iam.called_party_num), "%s", step->called);
+		snprintf(e->iam.calling_party_num, sizeof(e->iam.calling_party_num), "%s", step->calling);
+		break;
+	case BENCH_EV_SAM:
+		e->e = ISUP_EVENT_SAM;
+		e->sam.cic = cic;
+		e->sam.opc = dpc;
+		e->sam.call = bench_event_call(cic);
+		snprintf(e->sam.called_party_num, sizeof(e->sam.called_party_num), "%s", step->called);
+		break;
+	case BENCH_EV_ACM:
+		e->e = ISUP_EVENT_ACM;
+		e->acm.cic = cic;
+		e->acm.opc = dpc;
+		e->acm.call = bench_event_call(cic);
+		break;
+	case BENCH_EV_CPG:
+		e->e = ISUP_EVENT_CPG;
+		e->cpg.cic = cic;
+		e->cpg.opc = dpc;
+		e->cpg.call = bench_event_call(cic);
+		e->cpg.event = step->arg;
+		break;
+	case BENCH_EV_ANM:
+		e->e = ISUP_EVENT_ANM;
+		e->anm.cic = cic;
+		e->anm.opc = dpc;
+		e->anm.call = bench_event_call(cic);
+		break;
+	case BENCH_EV_CON:
+		e->e = ISUP_EVENT_CON;
+		e->con.cic = cic;
+		e->con.opc = dpc;
+		e->con.call = bench_event_call(cic);
+		break;
+	case BENCH_EV_REL:
+		e->e = ISUP_EVENT_REL;
+		e->rel.cic = cic;
+		e->rel.opc = dpc;
+		e->rel.call = bench_event_call(cic);
+		e->rel.cause = step->arg;
+		break;
+	case BENCH_EV_RLC:
+		e->e = ISUP_EVENT_RLC;
+		e->rlc.cic = cic;
+		e->rlc.opc = dpc;
+		e->rlc.call = bench_event_call(cic);
+		break;
+	case BENCH_EV_RSC:
+		e->e = ISUP_EVENT_RSC;
+		e->rsc.cic = cic;
+		e->rsc.opc = dpc;
+		e->rsc.call = bench_event_call(cic);
+		break;
+	case BENCH_EV_GRS:
+		e->e = ISUP_EVENT_GRS;
+		e->grs.startcic = cic;
+		e->grs.endcic = step->endcic;
+		e->grs.opc = dpc;
+		e->grs.call = bench_event_call(cic);
+		break;
+	case BENCH_EV_GRA:
+		e->e = ISUP_EVENT_GRA;
+		e->gra.startcic = cic;
+		e->gra.endcic = step->endcic;
+		e->gra.opc = dpc;
+		e->gra.call = bench_event_call(cic);
+		break;
+	case BENCH_EV_CGB:
+		e->e = ISUP_EVENT_CGB;
+		e->cgb.startcic = cic;
+		e->cgb.endcic = step->endcic;
+		e->cgb.opc = dpc;
+		e->cgb.type = step->arg;
+		e->cgb.call = bench_event_call(cic);
+		for (i = 0; (i <= step->endcic - cic) && (i < (int) sizeof(e->cgb.status)); i++)
+			e->cgb.status[i] = 1;
+		break;
+	case BENCH_EV_CGBA:
+		e->e = ISUP_EVENT_CGBA;
+		e->cgba.startcic = cic;
+		e->cgba.endcic = step->endcic;
+		e->cgba.opc = dpc;
+		e->cgba.call = bench_event_call(cic);
+		for (i = 0; (i <= step->endcic - cic) && (i < (int) sizeof(e->cgba.status)); i++)
+			e->cgba.status[i] = 1;
+		break;
+	case BENCH_EV_CGU:
+		e->e = ISUP_EVENT_CGU;
+		e->cgu.startcic = cic;
+		e->cgu.endcic = step->endcic;
+		e->cgu.opc = dpc;
+		e->cgu.type = step->arg;
+		e->cgu.call = bench_event_call(cic);
+		for (i = 0; (i <= step->endcic - cic) && (i < (int) sizeof(e->cgu.status)); i++)
+			e->cgu.status[i] = 1;
+		break;
+	case BENCH_EV_CGUA:
+		e->e = ISUP_EVENT_CGUA;
+		e->cgua.startcic = cic;
+		e->cgua.endcic = step->endcic;
+		e->cgua.opc = dpc;
+		e->cgua.call = bench_event_call(cic);
+		break;
+	case BENCH_EV_BLO:
+		e->e = ISUP_EVENT_BLO;
+		e->blo.cic = cic;
+		e->blo.opc = dpc;
+		e->blo.call = bench_event_call(cic);
+		break;
+	case BENCH_EV_BLA:
+		e->e = ISUP_EVENT_BLA;
+		e->bla.cic = cic;
+		e->bla.opc = dpc;
+		e->bla.call = bench_event_call(cic);
+		break;
+	case BENCH_EV_UBL:
+		e->e = ISUP_EVENT_UBL;
+		e->ubl.cic = cic;
+		e->ubl.opc = dpc;
+		e->ubl.call = bench_event_call(cic);
+		break;
+	case BENCH_EV_UBA:
+		e->e = ISUP_EVENT_UBA;
+		e->uba.cic = cic;
+		e->uba.opc = dpc;
+		e->uba.call = bench_event_call(cic);
+		break;
+	case BENCH_EV_DIGITTIMEOUT:
+		e->e = ISUP_EVENT_DIGITTIMEOUT;
+		e->digittimeout.cic = cic;
+		e->digittimeout.opc = dpc;
+		e->digittimeout.call = bench_event_call(cic);
+		break;
+	default:
+		break;
+	}
+}
+
+/*!
+ * \brief Hand the next due message of the far end to chan_dahdi
+ *
+ * Like the one of libss7, the event returned is only good until the next call.
+ */
+ss7_event *ss7_check_event(struct ss7 *ss7)
+{
+	static ss7_event ev;
+	struct bench_inject *inj;
+
+	if (ss7 != bench_ss7)
+		return NULL;
+	pthread_mutex_lock(&lock);
+	if (!(inj = ready_head)) {
+		pthread_mutex_unlock(&lock);
+		return NULL;
+	}
+	if (!(ready_head = inj->next))
+		ready_tail = NULL;
+	bench_build_event(&ev, &inj->step);
+	if (cic_ok(inj->step.cic) && (inj->step.ev != BENCH_EV_UP) && (inj->step.ev != BENCH_EV_DOWN)) {
+		cics[inj->step.cic].waiting = inj->step.ev;
+		cics[inj->step.cic].sent = inj->when;
+	}
+	injected++;
+	pthread_mutex_unlock(&lock);
+	free(inj);
+	return &ev;
+}
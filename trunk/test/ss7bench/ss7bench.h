@@ -0,0 +1,75 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Hardware-free ISUP replay and load harness for chan_dahdi
+ *
+ * Shared by the three parts of the ss7bench preload library, see README:
+ * - fake_dahdi.c: /dev/dahdi/ file descriptors that need no DAHDI driver;
+ * - ss7_script.c: the far end, a scripted libss7 event source;
+ * - isup_tap.c: the ISUP messages chan_dahdi sends back, timed and answered.
+ */
+
+#ifndef SS7BENCH_H
+#define SS7BENCH_H
+
+#include <sys/types.h>
+
+struct isup_call;
+
+#define SS7BENCH_MAX_FDS 4096		/*!< Highest file descriptor that can be a fake DAHDI channel */
+#define SS7BENCH_MAX_CICS 65536		/*!< CICs the far end keeps state for */
+
+/*! \brief What chan_dahdi sent to the far end, for isup_tap.c to hand to bench_sent() */
+enum bench_msg {
+	BENCH_MSG_IAM,
+	BENCH_MSG_ACM,
+	BENCH_MSG_ANM,
+	BENCH_MSG_CPG,
+	BENCH_MSG_REL,
+	BENCH_MSG_RLC,
+	BENCH_MSG_RSC,
+	BENCH_MSG_GRS,
+	BENCH_MSG_GRA,
+	BENCH_MSG_CGB,
+	BENCH_MSG_CGBA,
+	BENCH_MSG_CGU,
+	BENCH_MSG_CGUA,
+	BENCH_MSG_BLO,
+	BENCH_MSG_BLA,
+	BENCH_MSG_UBL,
+	BENCH_MSG_UBA,
+	BENCH_MSG_COUNT,
+};
+
+/* fake_dahdi.c */
+
+/*! \brief Whether \a fd is a DAHDI channel opened through the fake layer */
+int bench_fd_is_fake(int fd);
+/*! \brief DAHDI channel number \a fd was specified to, 0 if none */
+int bench_fd_channel(int fd);
+/*! \brief Make the signalling channel behind \a fd readable, to wake the link I/O thread */
+void bench_fd_wake(int fd);
+/*! \brief Eat whatever bench_fd_wake() left on \a fd */
+void bench_fd_drain(int fd);
+
+/* ss7_script.c */
+
+/*! \brief Note that libss7 call \a call is now on \a cic */
+void bench_call_init(struct isup_call *call, int cic, unsigned int dpc);
+/*! \brief Forget libss7 call \a call, it is freed */
+void bench_call_free(struct isup_call *call);
+/*!
+ * \brief chan_dahdi sent \a msg on the CIC of \a call
+ * \param endcic last CIC for range messages, else -1
+ * \param arg cause of a REL, event of a CPG, type of a CGB/CGU
+ */
+void bench_sent(enum bench_msg msg, struct isup_call *call, int endcic, int arg);
+
+#endif /* SS7BENCH_H */